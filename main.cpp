@@ -14,1076 +14,14600 @@
 #include <algorithm>
 #include <optional>
 #include <set>
+#include <tuple>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <cstring>
+#include <functional>
+#include <filesystem>
 
 #include <SDL/SDL.h>
 #include <SDL/SDL_syswm.h>
 
+#ifdef _WIN32
 #define VK_USE_PLATFORM_WIN32_KHR
+#endif
 #include <vulkan/vulkan.h>
 
+#ifndef _WIN32
+#include <SDL/SDL_vulkan.h>
+#endif
+
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
 
+enum class SurfaceMode
+{
+	// SDL window surface
+	Window,
+	// VK_EXT_headless_surface, a real swapchain without a display
+	Headless,
+	// Ring of plain images standing in for the swapchain
+	Offscreen
+};
+
+enum class PresentPolicy
+{
+	// IMMEDIATE, then MAILBOX; may tear
+	LowLatency,
+	// FIFO, the display paces the frames
+	LowPower,
+	// MAILBOX, then FIFO; never tears
+	TearFree
+};
+
 std::string caption = "Vulkan";
-uint32_t width = 800;
-uint32_t height = 600;
-bool running = true;
+// Written by the event loop, read by the render thread in --threaded mode
+std::atomic<uint32_t> width = { 800 };
+std::atomic<uint32_t> height = { 600 };
+std::atomic<bool> running = { true };
 SDL_Window* window = nullptr;
+uint32_t framesInFlight = 2;
+SurfaceMode surfaceMode = SurfaceMode::Window;
+uint32_t offscreenImageCount = 3;
+uint64_t maxFrames = 0;
+bool profiling = false;
+std::atomic<bool> windowResized = { false };
+PresentPolicy presentPolicy = PresentPolicy::LowLatency;
+uint32_t swapImageCount = 0;
+double frameRateCap = 0.0;
+// F8-F10 from the event loop, applied by the thread that owns the swapchain
+std::atomic<bool> frameCapCycle = { false };
+std::atomic<bool> swapImagesCycle = { false };
+std::atomic<bool> presentPolicyCycle = { false };
+std::string pipelineCachePath = "pipeline_cache.bin";
+uint32_t stagingRingSize = 16;
+uint32_t jobThreads = 0;
+bool benchJobs = false;
+uint32_t spriteCount = 0;
+bool bindlessDescriptors = true;
+std::string deviceCachePath;
+bool threadedMode = false;
+bool latencyTracking = false;
+
+// Steady clock nanoseconds of the newest input no frame has consumed, 0 if none
+std::atomic<int64_t> pendingInput = { 0 };
+double simulationRate = 60.0;
+#ifdef NDEBUG
+bool validationLayer = false;
+#else
+bool validationLayer = true;
+#endif
+std::string shaderDir = "shaders";
+std::string shaderCachePath = "shader_cache";
+std::string shaderCompiler = "glslangValidator";
+
+// Frames are streamed to captureDir every captureInterval frames, 0 is off
+std::string captureDir;
+uint32_t captureInterval = 0;
+bool capturePng = true;
+uint64_t screenshotFrame = 0;
+std::atomic<bool> screenshotRequested = { false };
+
+// Comma separated scenario names or "all", empty outside of --bench
+std::string benchScenarios;
+std::string benchJsonPath = "bench.json";
+std::string goldenDir;
+bool updateGolden = false;
+
+// GPU frame time dynamic resolution aims for, 0 renders at the swapchain size
+double dynamicResolutionTarget = 0.0;
+float minResolutionScale = 0.5f;
+float maxResolutionScale = 1.0f;
+
+// Procedural textures streamed onto the sprites, and a cap on their
+// memory in MiB on top of what VK_EXT_memory_budget allows, 0 is no cap
+uint32_t streamTextureCount = 0;
+uint32_t textureBudget = 0;
+
+// Cubes culled and drawn on the GPU, 0 is off
+uint32_t objectCount = 0;
+
+enum TimingPhase
+{
+	PhaseUpdate,
+	PhaseAcquire,
+	PhaseRecord,
+	PhaseSubmit,
+	PhasePresent,
+	PhaseFrame,
+	PhaseCount
+};
 
+const char* timingPhaseNames[PhaseCount] = {
+	"update",
+	"acquire",
+	"record",
+	"submit",
+	"present",
+	"frame"
+};
 
-void app_init();
-void app_release();
-void app_update(float delta);
-void app_render();
+const uint32_t maxGpuTimers = 32;
 
-int main(int argc, char** argv)
+struct FrameTiming
 {
-	SDL_Init(SDL_INIT_EVERYTHING);
-	window = SDL_CreateWindow(
-		caption.c_str(),
-		SDL_WINDOWPOS_UNDEFINED,
-		SDL_WINDOWPOS_UNDEFINED,
-		width,
-		height,
-		SDL_WINDOW_SHOWN
-	);
-	SDL_Event e;
-	uint32_t pre = SDL_GetTicks();
-	uint32_t curr = 0;
-	float delta = 0.0f;
-	app_init();
+	uint64_t frame = 0;
 
-	while (running)
-	{
+	// Milliseconds
+	double cpu[PhaseCount] = {};
 
-		curr = SDL_GetTicks();
-		delta = (curr - pre) / 1000.0f;
-		pre = curr;
+	uint32_t gpuCount = 0;
+	const char* gpuNames[maxGpuTimers] = {};
+	double gpu[maxGpuTimers] = {};
+	double gpuTotal = 0.0;
 
-		while (SDL_PollEvent(&e))
-		{
-			if (e.type == SDL_QUIT)
-			{
-				running = false;
-			}
-		}
+	// GPU results arrive frames-in-flight later
+	bool gpuPending = false;
+};
 
+struct FrameProfiler
+{
+	typedef std::chrono::steady_clock Clock;
 
-		app_update(delta);
-		app_render();
-	}
+	// Single producer ring filled by the render loop, drained by the writer thread
+	std::vector<FrameTiming> ring;
+	std::atomic<uint64_t> head = { 0 };
+	std::atomic<uint64_t> tail = { 0 };
+	std::atomic<uint64_t> dropped = { 0 };
 
-	app_release();
-	SDL_DestroyWindow(window);
-	SDL_Quit();
-	
-	std::getchar();
+	std::thread writer;
+	std::atomic<bool> writerRunning = { false };
+	std::vector<FrameTiming> history;
 
-	return 0;
-}
+	// Render loop side
+	FrameTiming current;
+	Clock::time_point phaseStart[PhaseCount];
+	std::deque<FrameTiming> pending;
 
-struct QueueFamilyIndices
-{
-	//int32_t graphicsFamily = -1;
-	std::optional<uint32_t> graphicsFamily;
-	std::optional<uint32_t> presentFamily;
+	std::string csvPath;
+	std::string jsonPath;
 
-	bool isCompete()
-	{
-		return 
-			this->graphicsFamily.has_value() && 
-			this->presentFamily.has_value();
-	}
-};
+	// Timer names built at runtime, history keeps pointers into it
+	std::set<std::string> names;
 
-struct SwapChainSupportDetails
-{
-	VkSurfaceCapabilitiesKHR caps;
-	std::vector<VkSurfaceFormatKHR> formats;
-	std::vector<VkPresentModeKHR> presentModes;
-};
+	void init(uint32_t capacity);
 
-struct VulkanTest
-{
-	bool useLayer = true;
+	void release();
 
-	// Instance
-	VkInstance instance;
+	void begin(TimingPhase phase);
 
-	// Debug Callback
-	VkDebugReportCallbackEXT debugCallback;
+	void end(TimingPhase phase);
 
-	// Surface
-	VkSurfaceKHR surface;
+	void endFrame();
 
-	// Physical Device
-	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+	void resolveGpu(uint64_t frame, uint32_t count, const char* const* names, const double* times);
 
-	// Devices
-	VkDevice device;
-	VkQueue graphicsQueue;
-	VkQueue presentQueue;
+	const char* intern(const std::string& name);
 
-	// Swap Chain
-	VkSwapchainKHR swapChain;
-	std::vector<VkImage> swapChainImages;
-	VkFormat swapChainImageFormat;
-	VkExtent2D swapChainExtent;
-	std::vector<VkImageView> swapChainImageViews;
-	uint32_t swapChainIndex = 0;
+	void flushPending(bool force);
 
-	// Command Pool
-	VkCommandPool commandPool;
+	bool push(const FrameTiming& timing);
 
-	// Command Buffer List
-	std::vector<VkCommandBuffer> commandBufferList;
+	void drain();
 
-	// Render Pass
-	VkRenderPass clearRenderPass;
-	VkRenderPass drawRenderPass;
+	void writeCsv();
 
-	// Framebuffers
-	std::vector<VkFramebuffer> clearFramebuffers;
-	std::vector<VkFramebuffer> drawFramebuffers;
+	void writeJson();
 
-	// Semaphores
-	VkSemaphore imageAvailable;
-	VkSemaphore renderFinish;
+	void printSummary();
+};
 
-	// Fence
-	VkFence inFlight;
+FrameProfiler profiler;
 
-	void init();
-	
-	void clear(const glm::vec3& color);
+struct FrameLimiter
+{
+	typedef std::chrono::steady_clock Clock;
 
-	void present();
+	std::chrono::nanoseconds period = std::chrono::nanoseconds(0);
+	Clock::time_point deadline;
 
-	void release();
+	// Sleep until this close to the deadline, then spin; grows with the
+	// oversleep the OS scheduler actually shows
+	std::chrono::nanoseconds spinMargin = std::chrono::microseconds(500);
+	std::chrono::nanoseconds sleepError = std::chrono::nanoseconds(0);
 
-	void createInstance();
-	void createDebugReportCallback();
+	uint64_t frames = 0;
+	uint64_t missed = 0;
+	std::chrono::nanoseconds worstMiss = std::chrono::nanoseconds(0);
 
-	void createSurface();
+	void setRate(double fps);
 
-	void createPhysicalDevice();
-	bool isDeviceSuitable(VkPhysicalDevice device);
-	QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device);
+	void wait();
+};
 
-	void createLogicalDevice();
+FrameLimiter limiter;
 
-	void createSwapChain();
+// Wall time of each init step. Independent steps run on their own thread
+// through spawn and are joined before anything that depends on them.
+struct StartupProfiler
+{
+	typedef std::chrono::steady_clock Clock;
 
-	SwapChainSupportDetails querySwapChainSupport(VkPhysicalDevice device);
-	VkSurfaceFormatKHR chooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR>& formats);
-	VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& presentModes);
-	VkExtent2D chooseSwapExtent(const VkSurfaceCapabilitiesKHR& caps);
+	struct Step
+	{
+		std::string name;
+		double start;
+		double ms;
+		bool async;
+	};
 
-	void createSwapChainImageViews();
+	Clock::time_point origin;
 
-	void createCommandPool();
+	std::mutex mutex;
+	std::vector<Step> steps;
+	std::vector<std::thread> tasks;
+	std::exception_ptr error;
 
-	void createRenderPass();
+	void begin();
 
-	void createFramebuffers();
+	void run(const char* name, const std::function<void()>& func);
 
-	void createSemaphore();
+	void spawn(const char* name, std::function<void()> func);
 
-	void createFence();
+	// Rethrows the first exception of a spawned step
+	void join();
 
-	VkCommandBuffer allocCommandBuffer();
+	void record(const char* name, Clock::time_point start, bool async);
 
-	VkCommandBuffer clearCommand(glm::vec3 color);
+	void print();
 };
 
-VulkanTest test;
+StartupProfiler startup;
 
-void app_init()
+enum class LogSeverity
 {
-	test.init();
-}
+	Verbose,
+	Info,
+	Warning,
+	Error
+};
 
-void app_release()
-{
-	test.release();
-}
+const char* logSeverityNames[] = {
+	"verbose",
+	"info",
+	"warning",
+	"error"
+};
 
-void app_update(float delta)
+LogSeverity logSeverityFromName(const std::string& name);
+
+// Fixed size so a slot never allocates, longer text is cut
+struct LogMessage
 {
-}
+	std::atomic<uint64_t> sequence = { 0 };
+	LogSeverity severity;
+	uint64_t key;
+	char source[32];
+	char text[472];
+};
 
-void app_render()
+// Validation layer and renderer messages. Producers may be driver threads
+// and never lock or touch stdout: a message is deduplicated by its ID,
+// rate limited and pushed into a bounded multi-producer ring that a
+// background thread drains and writes.
+struct MessageLogger
 {
-	test.clear(glm::vec3(1.0f, 0.0f, 0.0f));
+	typedef std::chrono::steady_clock Clock;
 
+	std::unique_ptr<LogMessage[]> ring;
+	uint64_t mask = 0;
+	std::atomic<uint64_t> head = { 0 };
+	uint64_t tail = 0;
 
-	test.present();
-}
+	// Runtime filter, anything below is dropped in the producer
+	std::atomic<int> minSeverity = { (int)LogSeverity::Warning };
 
-void VulkanTest::init()
-{
-	this->createInstance();
-	
-	if (this->useLayer)
-	{
-		this->createDebugReportCallback();
-	}
+	// Seen IDs, open addressing; key 0 is an empty slot
+	static const uint32_t dedupSize = 4096;
+	std::unique_ptr<std::atomic<uint64_t>[]> dedupKeys;
+	std::unique_ptr<std::atomic<uint32_t>[]> dedupCounts;
 
-	this->createSurface();
+	// Messages of one ID written before it is only counted
+	uint32_t repeatLimit = 3;
 
-	this->createPhysicalDevice();
-	this->createLogicalDevice();
-	this->createSwapChain();
+	// Messages per second that reach the ring
+	uint32_t rateLimit = 200;
+	std::atomic<int64_t> rateWindow = { 0 };
+	std::atomic<uint32_t> rateCount = { 0 };
 
-	this->createSwapChainImageViews();
+	std::thread writer;
+	std::atomic<bool> running = { false };
 
-	this->createCommandPool();
+	// Stats
+	std::atomic<uint64_t> accepted = { 0 };
+	std::atomic<uint64_t> repeated = { 0 };
+	std::atomic<uint64_t> limited = { 0 };
+	std::atomic<uint64_t> overflowed = { 0 };
 
-	this->createRenderPass();
+	void init(uint32_t capacity);
 
-	this->createFramebuffers();
+	void release();
 
-	this->createSemaphore();
+	void setSeverity(LogSeverity severity);
 
-	this->createFence();
-}
+	// Next severity, wraps from error back to verbose
+	void cycleSeverity();
 
-void VulkanTest::clear(const glm::vec3& color)
+	// ID 0 dedups by text
+	void log(LogSeverity severity, const char* source, int64_t id, const char* text);
+
+	bool dedup(uint64_t key);
+
+	bool rateAllowed();
+
+	bool push(LogSeverity severity, const char* source, uint64_t key, const char* text);
+
+	void drain();
+
+	void printRepeats();
+};
+
+MessageLogger logger;
+
+struct Job;
+
+// Counts unfinished jobs. Continuations queued on it are started by the
+// job that brings it to zero.
+struct JobCounter
 {
-	vkAcquireNextImageKHR(
-		device,
-		swapChain,
-		std::numeric_limits<uint64_t>::max(),
-		imageAvailable,
-		VK_NULL_HANDLE,
-		&swapChainIndex
-	);
+	std::atomic<uint32_t> pending = { 0 };
 
-	this->commandBufferList.push_back(
-		this->clearCommand(color)
-	);
-}
+	std::mutex mutex;
+	std::vector<Job*> continuations;
+};
 
-void VulkanTest::present()
+struct Job
 {
-	VkResult r;
+	std::function<void()> func;
+	JobCounter* counter = nullptr;
+};
 
-	vkWaitForFences(device, 1, &this->inFlight, VK_TRUE, std::numeric_limits<uint64_t>::max());
-	vkResetFences(device, 1, &this->inFlight);
+// Chase-Lev deque. The owning thread pushes and pops at the bottom,
+// thieves take from the top; fixed capacity, a full deque runs inline.
+struct JobDeque
+{
+	static const int64_t capacity = 4096;
 
-	// Submit
-	VkSubmitInfo submitInfo = {};
-	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	std::atomic<int64_t> top = { 0 };
+	std::atomic<int64_t> bottom = { 0 };
+	std::unique_ptr<std::atomic<Job*>[]> buffer;
 
-	VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
+	JobDeque() : buffer(new std::atomic<Job*>[capacity]) {}
 
-	submitInfo.waitSemaphoreCount = 1;
-	submitInfo.pWaitSemaphores = &this->imageAvailable;
-	submitInfo.pWaitDstStageMask = waitStages;
+	bool push(Job* job);
 
-	submitInfo.commandBufferCount = this->commandBufferList.size();
-	submitInfo.pCommandBuffers = commandBufferList.data();
+	Job* pop();
 
-	submitInfo.signalSemaphoreCount = 1;
-	submitInfo.pSignalSemaphores = &renderFinish;
+	Job* steal();
+};
 
-	r = vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlight);
+typedef std::function<void(uint32_t first, uint32_t count)> ParallelForFunc;
 
-	if (r != VK_SUCCESS)
-	{
-		throw std::runtime_error("Failed to submit to graphics queue...");
-	}
+// Fixed pool of workers with one deque each. The main thread and up to
+// maxExternal other threads register for a slot of their own and help
+// run jobs while they wait; unregistered threads submit through a locked
+// queue and only block in wait.
+struct JobSystem
+{
+	static const uint32_t maxExternal = 2;
 
-	// Present
-	VkPresentInfoKHR presentInfo = {};
-	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-	
-	presentInfo.waitSemaphoreCount = 1;
-	presentInfo.pWaitSemaphores = &this->renderFinish;
+	std::vector<std::unique_ptr<JobDeque>> deques;
+	std::vector<std::thread> workers;
+	uint32_t workerCount = 0;
+	std::atomic<uint32_t> registered = { 0 };
 
-	presentInfo.swapchainCount = 1;
-	presentInfo.pSwapchains = &this->swapChain;
-	presentInfo.pImageIndices = &this->swapChainIndex;
+	std::mutex injectMutex;
+	std::deque<Job*> injected;
 
-	r = vkQueuePresentKHR(this->presentQueue, &presentInfo);
+	// Sleeping, see run() for the wakeup order
+	std::mutex sleepMutex;
+	std::condition_variable sleepCond;
+	std::atomic<int64_t> queued = { 0 };
+	std::atomic<uint32_t> sleepers = { 0 };
+	std::atomic<bool> stopping = { false };
 
-	vkQueueWaitIdle(this->presentQueue);
+	// Stats
+	std::atomic<uint64_t> executed = { 0 };
+	std::atomic<uint64_t> stolen = { 0 };
+	bool printStats = true;
 
-	// Release Command Buffer List
-	vkFreeCommandBuffers(
-		device,
-		this->commandPool,
-		this->commandBufferList.size(),
-		this->commandBufferList.data()
-	);
+	// Counts the calling thread, so threadCount 1 means no workers
+	void init(uint32_t threadCount);
 
-	this->commandBufferList.clear();
-}
+	void release();
 
-void VulkanTest::release()
-{
-	vkDestroyFence(device, inFlight, nullptr);
+	// Gives the calling thread a deque, once per thread
+	void registerThread();
 
-	vkDestroySemaphore(device, renderFinish, nullptr);
-	vkDestroySemaphore(device, this->imageAvailable, nullptr);
+	// Worker or registered slot of the calling thread, UINT32_MAX otherwise
+	uint32_t threadIndex();
 
-	for (uint32_t i = 0; i < this->drawFramebuffers.size(); i++)
-	{
-		vkDestroyFramebuffer(this->device, this->drawFramebuffers[i], nullptr);
-	}
+	// Slots that threadIndex can return, for per-thread resources
+	uint32_t slotCount();
 
-	for (uint32_t i = 0; i < this->clearFramebuffers.size(); i++)
-	{
-		vkDestroyFramebuffer(this->device, this->clearFramebuffers[i], nullptr);
-	}
+	void run(std::function<void()> func, JobCounter* counter = nullptr);
 
-	vkDestroyRenderPass(this->device, this->drawRenderPass, nullptr);
-	vkDestroyRenderPass(this->device, this->clearRenderPass, nullptr);
+	// Starts func once `after` reaches zero
+	void then(JobCounter& after, std::function<void()> func, JobCounter* counter = nullptr);
 
-	vkDestroyCommandPool(this->device, this->commandPool, nullptr);
+	// Runs other jobs until counter reaches zero
+	void wait(JobCounter& counter);
 
-	for (auto imageView : this->swapChainImageViews)
-	{
-		vkDestroyImageView(device, imageView, nullptr);
-	}
+	// Splits [0, count) into chunks of at least grain and returns when all ran
+	void parallelFor(uint32_t count, uint32_t grain, const ParallelForFunc& func);
 
-	vkDestroySwapchainKHR(device, swapChain, nullptr);
+	void submit(Job* job);
 
-	vkDestroyDevice(device, nullptr);
+	Job* find(uint32_t slot);
 
-	vkDestroySurfaceKHR(instance, surface, nullptr);
+	void execute(Job* job);
 
-	if (this->useLayer)
-	{
-		auto debugDestroy = (PFN_vkDestroyDebugReportCallbackEXT)vkGetInstanceProcAddr(this->instance, "vkDestroyDebugReportCallbackEXT");
-		debugDestroy(instance, this->debugCallback, nullptr);
-	}
+	void workerLoop(uint32_t slot);
+};
 
-	vkDestroyInstance(instance, nullptr);
-}
+JobSystem jobs;
 
-void VulkanTest::createInstance()
+// Lock-free single producer / single consumer triple buffer. The writer
+// fills its back slot and swaps it into the middle, the reader swaps the
+// middle out when it holds something newer; neither side ever waits and
+// the reader always sees the latest complete value.
+template<typename T>
+struct TripleBuffer
 {
-	VkApplicationInfo appInfo = {};
-	appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
-	appInfo.pApplicationName = caption.c_str();
-	appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
-	appInfo.pEngineName = caption.c_str();
-	appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-	appInfo.apiVersion = VK_API_VERSION_1_1;
+	T slots[3];
 
-	VkInstanceCreateInfo createInfo = {};
-	createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
-	createInfo.pApplicationInfo = &appInfo;
+	// Middle slot index, bit 2 set when it holds an unread value
+	std::atomic<uint8_t> middle = { 1 };
 
-	std::vector<const char*> layers;
-	std::vector<const char*> extensions;
+	uint8_t back = 0;
+	uint8_t front = 2;
 
-	// Layers
-	if (this->useLayer)
+	T& writeBuffer()
 	{
-		layers.push_back("VK_LAYER_LUNARG_standard_validation");
-		extensions.push_back(VK_EXT_DEBUG_REPORT_EXTENSION_NAME);
+		return this->slots[this->back];
 	}
 
-	extensions.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
-	extensions.push_back(VK_KHR_WIN32_SURFACE_EXTENSION_NAME);
-
-
-	if (layers.size() > 0)
+	void publish()
 	{
-		createInfo.enabledLayerCount = layers.size();
-		createInfo.ppEnabledLayerNames = layers.data();
+		uint8_t previous = this->middle.exchange(this->back | 4, std::memory_order_acq_rel);
+		this->back = previous & 3;
 	}
 
-	if (extensions.size() > 0)
+	// True when front changed
+	bool update()
 	{
-		createInfo.enabledExtensionCount = extensions.size();
-		createInfo.ppEnabledExtensionNames = extensions.data();
-	}
+		if ((this->middle.load(std::memory_order_relaxed) & 4) == 0)
+		{
+			return false;
+		}
 
-	VkResult result = vkCreateInstance(&createInfo, nullptr, &instance);
+		uint8_t previous = this->middle.exchange(this->front, std::memory_order_acq_rel);
+		this->front = previous & 3;
 
-	if (result != VK_SUCCESS)
-	{
-		throw std::runtime_error("failed to create instance!");
+		return true;
 	}
-}
 
-static VkBool32 VKAPI_CALL _debugCallback(
-	VkDebugReportFlagsEXT			flags,
-	VkDebugReportObjectTypeEXT		objType,
-	uint64_t						obj,
-	size_t							location,
-	int32_t							msgCode,
-	const char*						layerPrefix,
-	const char*						msg,
-	void*							useData);
+	const T& readBuffer() const
+	{
+		return this->slots[this->front];
+	}
+};
 
-void VulkanTest::createDebugReportCallback()
-{
-	VkDebugReportCallbackCreateInfoEXT debugInfo = {};
-	debugInfo.sType = VK_STRUCTURE_TYPE_DEBUG_REPORT_CREATE_INFO_EXT;
-	debugInfo.pfnCallback = _debugCallback;
-	debugInfo.flags = VK_DEBUG_REPORT_WARNING_BIT_EXT | VK_DEBUG_REPORT_ERROR_BIT_EXT;
 
-	auto func = (PFN_vkCreateDebugReportCallbackEXT)vkGetInstanceProcAddr(instance, "vkCreateDebugReportCallbackEXT");
+void app_init();
+void app_release();
+void app_update(float delta);
+void app_render();
+void handleEvents();
+uint64_t runThreaded();
+int runJobBenchmark();
+int runRenderBenchmark();
 
-	if (func != nullptr)
+int main(int argc, char** argv)
+{
+	for (int i = 1; i < argc; i++)
 	{
-		VkResult r = func(instance, &debugInfo, nullptr, &this->debugCallback);
+		std::string arg = argv[i];
 
-		if (r != VK_SUCCESS)
+		if (arg == "--frames-in-flight" && i + 1 < argc)
 		{
-			throw std::runtime_error("Didn't create debug report callback.");
+			framesInFlight = std::max(1, std::min(3, std::atoi(argv[++i])));
 		}
-	}
-}
-
-static VkBool32 VKAPI_CALL _debugCallback(
-	VkDebugReportFlagsEXT			flags,
-	VkDebugReportObjectTypeEXT		objType,
-	uint64_t						obj,
-	size_t							location,
-	int32_t							msgCode,
-	const char*						layerPrefix,
-	const char*						msg,
-	void*							useData)
-{
-	std::cout << location << std::endl;
-	std::cout << layerPrefix << ": " << msg << std::endl;
-	return VK_FALSE;
+		else if (arg == "--headless")
+		{
+			surfaceMode = SurfaceMode::Headless;
+		}
+		else if (arg == "--offscreen")
+		{
+			surfaceMode = SurfaceMode::Offscreen;
+		}
+		else if (arg == "--frames" && i + 1 < argc)
+		{
+			maxFrames = std::strtoull(argv[++i], nullptr, 10);
+		}
+		else if (arg == "--profile")
+		{
+			profiling = true;
+		}
+		else if (arg == "--timing-csv" && i + 1 < argc)
+		{
+			profiling = true;
+			profiler.csvPath = argv[++i];
+		}
+		else if (arg == "--timing-json" && i + 1 < argc)
+		{
+			profiling = true;
+			profiler.jsonPath = argv[++i];
+		}
+		else if (arg == "--present" && i + 1 < argc)
+		{
+			std::string mode = argv[++i];
+
+			if (mode == "low-latency")
+			{
+				presentPolicy = PresentPolicy::LowLatency;
+			}
+			else if (mode == "low-power")
+			{
+				presentPolicy = PresentPolicy::LowPower;
+			}
+			else if (mode == "tear-free")
+			{
+				presentPolicy = PresentPolicy::TearFree;
+			}
+		}
+		else if (arg == "--swap-images" && i + 1 < argc)
+		{
+			swapImageCount = std::atoi(argv[++i]);
+		}
+		else if (arg == "--fps" && i + 1 < argc)
+		{
+			frameRateCap = std::atof(argv[++i]);
+		}
+		else if (arg == "--pipeline-cache" && i + 1 < argc)
+		{
+			pipelineCachePath = argv[++i];
+		}
+		else if (arg == "--staging-ring" && i + 1 < argc)
+		{
+			stagingRingSize = std::max(1, std::atoi(argv[++i]));
+		}
+		else if ((arg == "--job-threads" || arg == "--record-threads") && i + 1 < argc)
+		{
+			jobThreads = std::atoi(argv[++i]);
+		}
+		else if (arg == "--bench-jobs")
+		{
+			benchJobs = true;
+		}
+		else if (arg == "--bench" && i + 1 < argc)
+		{
+			benchScenarios = argv[++i];
+			profiling = true;
+		}
+		else if (arg == "--bench-json" && i + 1 < argc)
+		{
+			benchJsonPath = argv[++i];
+		}
+		else if (arg == "--golden" && i + 1 < argc)
+		{
+			goldenDir = argv[++i];
+		}
+		else if (arg == "--update-golden")
+		{
+			updateGolden = true;
+		}
+		else if (arg == "--dynamic-res" && i + 1 < argc)
+		{
+			dynamicResolutionTarget = std::atof(argv[++i]);
+		}
+		else if (arg == "--res-scale" && i + 2 < argc)
+		{
+			minResolutionScale = std::max(0.1f, (float)std::atof(argv[++i]));
+			maxResolutionScale = std::max(minResolutionScale, std::min(2.0f, (float)std::atof(argv[++i])));
+		}
+		else if (arg == "--stream-textures" && i + 1 < argc)
+		{
+			streamTextureCount = std::atoi(argv[++i]);
+		}
+		else if (arg == "--texture-budget" && i + 1 < argc)
+		{
+			textureBudget = std::atoi(argv[++i]);
+		}
+		else if (arg == "--objects" && i + 1 < argc)
+		{
+			objectCount = std::atoi(argv[++i]);
+		}
+		else if (arg == "--latency")
+		{
+			latencyTracking = true;
+		}
+		else if (arg == "--threaded")
+		{
+			threadedMode = true;
+		}
+		else if (arg == "--sim-rate" && i + 1 < argc)
+		{
+			simulationRate = std::max(1.0, std::atof(argv[++i]));
+		}
+		else if (arg == "--validation")
+		{
+			validationLayer = true;
+		}
+		else if (arg == "--no-validation")
+		{
+			validationLayer = false;
+		}
+		else if (arg == "--log-level" && i + 1 < argc)
+		{
+			logger.setSeverity(logSeverityFromName(argv[++i]));
+		}
+		else if (arg == "--device-cache" && i + 1 < argc)
+		{
+			deviceCachePath = argv[++i];
+		}
+		else if (arg == "--no-bindless")
+		{
+			bindlessDescriptors = false;
+		}
+		else if (arg == "--sprites" && i + 1 < argc)
+		{
+			spriteCount = std::atoi(argv[++i]);
+		}
+		else if (arg == "--shaders" && i + 1 < argc)
+		{
+			shaderDir = argv[++i];
+		}
+		else if (arg == "--shader-cache" && i + 1 < argc)
+		{
+			shaderCachePath = argv[++i];
+		}
+		else if (arg == "--shader-compiler" && i + 1 < argc)
+		{
+			shaderCompiler = argv[++i];
+		}
+		else if (arg == "--capture" && i + 1 < argc)
+		{
+			captureDir = argv[++i];
+			captureInterval = std::max(captureInterval, 1u);
+		}
+		else if (arg == "--capture-every" && i + 1 < argc)
+		{
+			captureInterval = std::max(1, std::atoi(argv[++i]));
+		}
+		else if (arg == "--capture-format" && i + 1 < argc)
+		{
+			capturePng = std::string(argv[++i]) != "raw";
+		}
+		else if (arg == "--screenshot" && i + 1 < argc)
+		{
+			screenshotFrame = std::strtoull(argv[++i], nullptr, 10);
+		}
+		else if (arg == "--size" && i + 2 < argc)
+		{
+			width = std::atoi(argv[++i]);
+			height = std::atoi(argv[++i]);
+		}
+	}
+
+	// Benchmarks never open a window, unless asked for the headless surface
+	if (!benchScenarios.empty() && surfaceMode == SurfaceMode::Window)
+	{
+		surfaceMode = SurfaceMode::Offscreen;
+	}
+
+	if (surfaceMode == SurfaceMode::Window)
+	{
+		SDL_Init(SDL_INIT_EVERYTHING);
+
+		Uint32 flags = SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE;
+#ifndef _WIN32
+		flags |= SDL_WINDOW_VULKAN;
+#endif
+
+		window = SDL_CreateWindow(
+			caption.c_str(),
+			SDL_WINDOWPOS_UNDEFINED,
+			SDL_WINDOWPOS_UNDEFINED,
+			width,
+			height,
+			flags
+		);
+	}
+	else
+	{
+		// No display on the build boxes, only timers and events
+		SDL_Init(SDL_INIT_TIMER | SDL_INIT_EVENTS);
+	}
+
+	if (benchJobs)
+	{
+		return runJobBenchmark();
+	}
+
+	profiler.init(1024);
+
+	jobs.init(jobThreads);
+
+	if (!benchScenarios.empty())
+	{
+		int result = runRenderBenchmark();
+
+		jobs.release();
+		SDL_Quit();
+
+		return result;
+	}
+
+	auto pre = std::chrono::steady_clock::now();
+	auto curr = pre;
+	float delta = 0.0f;
+	uint64_t frames = 0;
+	app_init();
+
+	limiter.setRate(frameRateCap);
+
+	auto start = std::chrono::steady_clock::now();
+
+	if (threadedMode)
+	{
+		frames = runThreaded();
+	}
+
+	while (running && !threadedMode)
+	{
+
+		profiler.begin(PhaseFrame);
+
+		curr = std::chrono::steady_clock::now();
+		delta = std::chrono::duration<float>(curr - pre).count();
+		pre = curr;
+
+		handleEvents();
+
+		profiler.begin(PhaseUpdate);
+		app_update(delta);
+		profiler.end(PhaseUpdate);
+
+		app_render();
+
+		profiler.end(PhaseFrame);
+		profiler.endFrame();
+
+		limiter.wait();
+
+		frames++;
+
+		if (maxFrames > 0 && frames >= maxFrames)
+		{
+			running = false;
+		}
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << frames << " frames in " << seconds << "s (" << (frames / seconds) << " fps)" << std::endl;
+
+	if (limiter.frames > 0)
+	{
+		std::cout << "Frame limiter missed " << limiter.missed << " of " << limiter.frames << " deadlines, worst by "
+			<< std::chrono::duration<double, std::milli>(limiter.worstMiss).count() << "ms" << std::endl;
+	}
+
+	app_release();
+
+	jobs.release();
+
+	profiler.release();
+
+	if (window != nullptr)
+	{
+		SDL_DestroyWindow(window);
+	}
+
+	SDL_Quit();
+	
+	if (surfaceMode == SurfaceMode::Window)
+	{
+		std::getchar();
+	}
+
+	return 0;
+}
+
+struct QueueFamilyIndices
+{
+	//int32_t graphicsFamily = -1;
+	std::optional<uint32_t> graphicsFamily;
+	std::optional<uint32_t> presentFamily;
+
+	// Transfer only family if the device has one, graphics otherwise
+	std::optional<uint32_t> transferFamily;
+
+	// Compute family without graphics if the device has one, graphics otherwise
+	std::optional<uint32_t> computeFamily;
+
+	bool isCompete()
+	{
+		return 
+			this->graphicsFamily.has_value() && 
+			this->presentFamily.has_value();
+	}
+};
+
+struct SwapChainSupportDetails
+{
+	VkSurfaceCapabilitiesKHR caps;
+	std::vector<VkSurfaceFormatKHR> formats;
+	std::vector<VkPresentModeKHR> presentModes;
+};
+
+// Everything device selection learned about the chosen GPU, queried once
+struct DeviceCapabilities
+{
+	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+	VkPhysicalDeviceProperties props;
+	VkPhysicalDeviceFeatures features;
+	VkPhysicalDeviceMemoryProperties memProps;
+	std::vector<VkQueueFamilyProperties> queueFamilies;
+	std::set<std::string> extensions;
+	QueueFamilyIndices queues;
+
+	uint64_t score = 0;
+
+	// Queue layout came from the device cache
+	bool cached = false;
+
+	bool hasExtension(const char* name) const;
+};
+
+// Device cache file, one entry naming the chosen GPU and its queue layout.
+// A different driver version or GPU set invalidates it.
+struct DeviceCacheEntry
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t vendorID;
+	uint32_t deviceID;
+	uint32_t driverVersion;
+	uint8_t uuid[VK_UUID_SIZE];
+	uint32_t deviceCount;
+	uint32_t surfaceMode;
+	uint32_t graphicsFamily;
+	uint32_t presentFamily;
+	uint32_t transferFamily;
+	uint32_t computeFamily;
+};
+
+struct FrameData
+{
+	// Command Pool
+	VkCommandPool commandPool;
+
+	// Command Buffers owned by the pool, reused after each reset
+	std::vector<VkCommandBuffer> commandBuffers;
+	uint32_t commandBufferUsed = 0;
+
+	// Command Buffer List
+	std::vector<VkCommandBuffer> commandBufferList;
+
+	// Semaphores
+	VkSemaphore imageAvailable;
+	VkSemaphore renderFinish;
+
+	// Fence
+	VkFence inFlight;
+
+	// GPU Timers
+	VkQueryPool queryPool = VK_NULL_HANDLE;
+	uint32_t timerCount = 0;
+	const char* timerNames[maxGpuTimers];
+	uint64_t timedFrame = 0;
+
+	// Latency, when the frame started and the input it consumed (0 if none)
+	std::chrono::steady_clock::time_point startTime;
+	int64_t inputTime = 0;
+};
+
+struct ClearCommandKey
+{
+	uint32_t image;
+	glm::vec3 color;
+
+	bool operator<(const ClearCommandKey& other) const
+	{
+		return
+			std::tie(this->image, this->color.r, this->color.g, this->color.b) <
+			std::tie(other.image, other.color.r, other.color.g, other.color.b);
+	}
+};
+
+struct ClearCommandEntry
+{
+	VkCommandBuffer commandBuffer;
+	uint64_t lastUsed;
+};
+
+struct GpuMemoryBlock
+{
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize size = 0;
+	uint32_t memoryType = 0;
+
+	// Buffers and linear images never share a block with optimal images,
+	// which keeps bufferImageGranularity out of the offset math
+	bool linear = false;
+
+	void* mapped = nullptr;
+	VkDeviceSize used = 0;
+	uint32_t allocations = 0;
+
+	// Buddy free lists, order n holds free ranges of minAllocation << n bytes
+	std::vector<std::set<VkDeviceSize>> freeLists;
+};
+
+struct GpuAllocation
+{
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0;
+	void* mapped = nullptr;
+
+	// nullptr for dedicated allocations
+	GpuMemoryBlock* block = nullptr;
+	uint32_t order = 0;
+};
+
+struct GpuAllocatorStats
+{
+	uint32_t blocks = 0;
+	uint32_t dedicated = 0;
+	uint32_t allocations = 0;
+	uint64_t deviceAllocationCalls = 0;
+	VkDeviceSize reserved = 0;
+	VkDeviceSize used = 0;
+	VkDeviceSize largestFree = 0;
+
+	// 1 - largest free range / total free, 0 when all free space is contiguous
+	float fragmentation = 0.0f;
+};
+
+struct GpuAllocator
+{
+	VkDevice device = VK_NULL_HANDLE;
+	VkPhysicalDeviceMemoryProperties memProps;
+	uint32_t maxDeviceAllocations = 0;
+
+	VkDeviceSize minAllocation = 256;
+	VkDeviceSize blockSize = 64ull * 1024 * 1024;
+
+	std::mutex mutex;
+	std::vector<std::unique_ptr<GpuMemoryBlock>> blocks;
+
+	uint32_t deviceAllocations = 0;
+	uint64_t deviceAllocationCalls = 0;
+	uint32_t dedicatedCount = 0;
+	VkDeviceSize dedicatedBytes = 0;
+	uint32_t liveAllocations = 0;
+
+	void init(VkDevice device, VkPhysicalDevice physicalDevice);
+
+	void release();
+
+	uint32_t findMemoryType(uint32_t typeBits, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred);
+
+	void allocate(
+		const VkMemoryRequirements& reqs,
+		VkMemoryPropertyFlags required,
+		VkMemoryPropertyFlags preferred,
+		bool linear,
+		bool dedicated,
+		VkBuffer dedicatedBuffer,
+		VkImage dedicatedImage,
+		GpuAllocation& allocation);
+
+	void free(GpuAllocation& allocation);
+
+	// Concurrent between families when more than one distinct family is
+	// listed, otherwise owned by one queue family at a time
+	void createBuffer(
+		VkDeviceSize size,
+		VkBufferUsageFlags usage,
+		VkMemoryPropertyFlags required,
+		VkMemoryPropertyFlags preferred,
+		VkBuffer& buffer,
+		GpuAllocation& allocation,
+		const std::vector<uint32_t>& families = {});
+
+	void createImage(
+		const VkImageCreateInfo& createInfo,
+		VkMemoryPropertyFlags required,
+		VkImage& image,
+		GpuAllocation& allocation);
+
+	void destroyBuffer(VkBuffer buffer, GpuAllocation& allocation);
+
+	void destroyImage(VkImage image, GpuAllocation& allocation);
+
+	GpuAllocatorStats stats();
+
+	void printStats();
+
+	VkDeviceMemory allocateDeviceMemory(VkDeviceSize size, uint32_t memoryType, VkBuffer dedicatedBuffer, VkImage dedicatedImage, void** mapped);
+
+	VkDeviceSize blockSizeFor(uint32_t memoryType);
+
+	GpuMemoryBlock* createBlock(uint32_t memoryType, bool linear);
+
+	bool allocateFromBlock(GpuMemoryBlock* block, VkDeviceSize size, GpuAllocation& allocation);
+
+	void freeToBlock(GpuMemoryBlock* block, VkDeviceSize offset, uint32_t order);
+};
+
+// Host visible buffer split into one linear region per frame in flight,
+// for data that is written once and read by the GPU in the same frame
+struct GpuRingBuffer
+{
+	VkBuffer buffer = VK_NULL_HANDLE;
+	GpuAllocation allocation;
+
+	VkDeviceSize frameSize = 0;
+	VkDeviceSize frameBase = 0;
+	VkDeviceSize head = 0;
+
+	uint64_t overflows = 0;
+
+	void init(GpuAllocator& allocator, VkDeviceSize frameSize, uint32_t frames, VkBufferUsageFlags usage);
+
+	void release(GpuAllocator& allocator);
+
+	void beginFrame(uint32_t frame);
+
+	bool allocate(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset, void*& data);
+};
+
+// One transfer submission; its ring range is reusable once the fence
+// signals, its semaphore once the graphics frame that waited on it is done
+struct UploadBatch
+{
+	VkCommandBuffer cmd = VK_NULL_HANDLE;
+	VkFence fence = VK_NULL_HANDLE;
+	VkSemaphore semaphore = VK_NULL_HANDLE;
+
+	VkDeviceSize ringEnd = 0;
+	VkDeviceSize ringBytes = 0;
+	VkDeviceSize uploadBytes = 0;
+
+	bool ringFreed = false;
+	uint64_t consumedFrame = 0;
+
+	// Queue family acquire half, recorded on the graphics queue
+	std::vector<VkBufferMemoryBarrier> bufferAcquires;
+	std::vector<VkImageMemoryBarrier> imageAcquires;
+};
+
+// Persistently mapped staging ring feeding the transfer queue. Uploads are
+// recorded into the open batch, flush() submits it without waiting and
+// consume() makes the graphics submission wait on every submitted batch.
+// Render thread only, like the rest of VulkanTest.
+struct StagingUploader
+{
+	VkDevice device = VK_NULL_HANDLE;
+	GpuAllocator* allocator = nullptr;
+
+	VkQueue queue = VK_NULL_HANDLE;
+	uint32_t queueFamily = 0;
+	uint32_t graphicsFamily = 0;
+
+	VkCommandPool commandPool = VK_NULL_HANDLE;
+
+	VkBuffer ring = VK_NULL_HANDLE;
+	GpuAllocation ringMemory;
+	VkDeviceSize ringSize = 0;
+	VkDeviceSize head = 0;
+	VkDeviceSize tail = 0;
+	VkDeviceSize used = 0;
+
+	UploadBatch* open = nullptr;
+	std::deque<UploadBatch*> submitted;
+	std::deque<UploadBatch*> consumed;
+	std::vector<UploadBatch*> freeBatches;
+	std::vector<std::unique_ptr<UploadBatch>> batches;
+
+	// Stats
+	uint64_t uploadCount = 0;
+	uint64_t uploadBytes = 0;
+	uint64_t batchCount = 0;
+	uint64_t ringStalls = 0;
+
+	void init(VkDevice device, GpuAllocator* allocator, VkQueue queue, uint32_t queueFamily, uint32_t graphicsFamily, VkDeviceSize ringSize);
+
+	void release();
+
+	void uploadBuffer(VkBuffer dst, VkDeviceSize dstOffset, const void* data, VkDeviceSize size);
+
+	// Leaves the level in SHADER_READ_ONLY_OPTIMAL, owned by graphics. Rows
+	// go through the ring in bands, a level may be larger than the ring.
+	void uploadImage(VkImage dst, VkExtent3D extent, const void* data, VkDeviceSize size, uint32_t mipLevel = 0);
+
+	void flush();
+
+	bool hasSubmitted();
+
+	void consume(VkCommandBuffer cmd, std::vector<VkSemaphore>& waits, std::vector<VkPipelineStageFlags>& stages, uint64_t frame);
+
+	void collect(uint64_t frame, uint32_t framesInFlight);
+
+	VkDeviceSize reserve(VkDeviceSize size, VkDeviceSize alignment);
+
+	UploadBatch* openBatch();
+};
+
+struct ComputeFrame
+{
+	VkCommandPool commandPool = VK_NULL_HANDLE;
+	VkCommandBuffer cmd = VK_NULL_HANDLE;
+	VkFence fence = VK_NULL_HANDLE;
+	VkSemaphore semaphore = VK_NULL_HANDLE;
+
+	bool recording = false;
+	bool submitted = false;
+	bool consumed = false;
+
+	// Two timestamps per queue, separate pools so each queue resets its own
+	VkQueryPool computeQueries = VK_NULL_HANDLE;
+	VkQueryPool graphicsQueries = VK_NULL_HANDLE;
+	bool graphicsTimed = false;
+
+	// Queue family acquire half, recorded on the graphics queue
+	std::vector<VkBufferMemoryBarrier> bufferAcquires;
+	std::vector<VkImageMemoryBarrier> imageAcquires;
+};
+
+// Compute submissions on their own queue, one slot per frame in flight.
+// Results are handed to the graphics submission of the same frame through
+// a semaphore plus queue family ownership transfers. With timestamps on,
+// both queues are stamped so the overlap can be measured.
+struct AsyncCompute
+{
+	VkDevice device = VK_NULL_HANDLE;
+	VkQueue queue = VK_NULL_HANDLE;
+	uint32_t queueFamily = 0;
+	uint32_t graphicsFamily = 0;
+
+	std::vector<ComputeFrame> frames;
+	uint32_t current = 0;
+
+	bool timestamps = false;
+	float timestampPeriod = 1.0f;
+	uint64_t timestampMask = ~0ull;
+
+	// Stats
+	uint64_t submits = 0;
+	uint64_t timedFrames = 0;
+	double computeMs = 0.0;
+	double graphicsMs = 0.0;
+	double overlapMs = 0.0;
+
+	void init(VkDevice device, VkPhysicalDevice physicalDevice, VkQueue queue, uint32_t queueFamily, uint32_t graphicsFamily, uint32_t frameCount, float timestampPeriod);
+
+	void release();
+
+	// After the graphics fence of this slot has been waited on
+	void beginFrame(uint32_t frame);
+
+	VkCommandBuffer begin();
+
+	// Release halves for resources written by compute and read by graphics
+	void releaseBuffer(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size, VkAccessFlags srcAccess, VkAccessFlags dstAccess);
+
+	void releaseImage(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, VkAccessFlags srcAccess, VkAccessFlags dstAccess);
+
+	void submit();
+
+	bool pending();
+
+	void consume(VkCommandBuffer cmd, std::vector<VkSemaphore>& waits, std::vector<VkPipelineStageFlags>& stages);
+
+	void endGraphicsTimer(VkCommandBuffer cmd);
+
+	void readTimestamps(ComputeFrame& frame);
+};
+
+// Records items [first, first + count) into a secondary command buffer
+typedef std::function<void(VkCommandBuffer cmd, uint32_t first, uint32_t count)> RecordFunc;
+
+// Secondary buffers of one thread for one frame in flight, reset as a whole
+struct RecordPool
+{
+	VkCommandPool commandPool = VK_NULL_HANDLE;
+	std::vector<VkCommandBuffer> commandBuffers;
+	uint32_t commandBufferUsed = 0;
+};
+
+// Records chunks of a pass into secondary buffers as jobs. Each job slot
+// has its own pools, a slot only ever runs one job at a time. Chunks are
+// executed in item order whichever thread recorded them.
+struct ParallelRecorder
+{
+	VkDevice device = VK_NULL_HANDLE;
+	JobSystem* jobs = nullptr;
+	uint32_t frame = 0;
+
+	// [slot][frame], the extra slot is for callers outside the job system
+	std::vector<std::vector<RecordPool>> pools;
+	std::mutex externalMutex;
+
+	// Stats
+	uint64_t passes = 0;
+	uint64_t chunks = 0;
+
+	void init(VkDevice device, uint32_t queueFamily, uint32_t frameCount, JobSystem* jobs);
+
+	void release();
+
+	void beginFrame(uint32_t frame);
+
+	void record(const VkCommandBufferInheritanceInfo& inheritance, uint32_t itemCount, const RecordFunc& func, std::vector<VkCommandBuffer>& commandBuffers);
+
+	void recordChunk(const VkCommandBufferInheritanceInfo& inheritance, const RecordFunc& func, uint32_t first, uint32_t count, VkCommandBuffer& output);
+
+	VkCommandBuffer allocSecondary(uint32_t slot);
+};
+
+enum class RenderGraphAccess
+{
+	ColorWrite,
+	InputRead,
+	SampledRead,
+	StorageRead,
+	StorageWrite
+};
+
+struct RenderGraphContext
+{
+	VkCommandBuffer cmd;
+
+	// VK_NULL_HANDLE for compute passes
+	VkRenderPass renderPass;
+	uint32_t subpass;
+	VkFramebuffer framebuffer;
+	VkExtent2D extent;
+
+	// Compatible with renderPass and kept until the graph is released,
+	// pipelines used in the pass are built against it and subpass
+	VkRenderPass compatiblePass;
+};
+
+typedef std::function<void(const RenderGraphContext& ctx)> RenderGraphFunc;
+
+struct RenderGraphResource
+{
+	VkFormat format;
+	VkExtent2D extent;
+
+	// Imported images belong to someone else, their contents are kept
+	// unless initialLayout is UNDEFINED
+	bool imported = false;
+	VkImage image = VK_NULL_HANDLE;
+	VkImageView view = VK_NULL_HANDLE;
+	VkImageLayout initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	VkImageLayout finalLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+};
+
+struct RenderGraphUse
+{
+	uint32_t resource;
+	RenderGraphAccess access;
+
+	// Clears replace the resource's history, the clear color itself is
+	// not part of the graph structure and may change every frame
+	bool clear = false;
+	VkClearColorValue clearValue = {};
+};
+
+struct RenderGraphPass
+{
+	const char* name;
+	bool compute = false;
+
+	// The subpass is begun with SECONDARY_COMMAND_BUFFERS contents
+	bool secondary = false;
+
+	std::vector<RenderGraphUse> uses;
+
+	// Empty for passes that only clear
+	RenderGraphFunc execute;
+
+	void write(uint32_t resource);
+
+	void clear(uint32_t resource, const glm::vec4& color);
+
+	void readInput(uint32_t resource);
+
+	void sample(uint32_t resource);
+
+	void readStorage(uint32_t resource);
+
+	void writeStorage(uint32_t resource);
+};
+
+struct RenderGraphBarrier
+{
+	uint32_t resource;
+	VkImageLayout oldLayout;
+	VkImageLayout newLayout;
+	VkAccessFlags srcAccess;
+	VkAccessFlags dstAccess;
+};
+
+// Recorded as one vkCmdPipelineBarrier
+struct RenderGraphBarrierBatch
+{
+	std::vector<RenderGraphBarrier> barriers;
+	VkPipelineStageFlags srcStages = 0;
+	VkPipelineStageFlags dstStages = 0;
+};
+
+struct RenderGraphFramebuffer
+{
+	VkFramebuffer framebuffer;
+	uint64_t lastUsed;
+};
+
+// Consecutive graphics passes merged into the subpasses of one render
+// pass, or a single compute pass
+struct RenderGraphGroup
+{
+	bool compute = false;
+	VkExtent2D extent = {};
+
+	// Its passes joined by '+', names the group's GPU timer
+	const char* name = "";
+
+	// One subpass each, passes folded into a load op aren't listed
+	std::vector<uint32_t> passes;
+
+	RenderGraphBarrierBatch before;
+
+	VkRenderPass renderPass = VK_NULL_HANDLE;
+	VkRenderPass compatiblePass = VK_NULL_HANDLE;
+	std::vector<uint32_t> attachments;
+
+	// Declared pass whose use clears the attachment, UINT32_MAX if loaded
+	std::vector<uint32_t> clearPasses;
+
+	// Keyed by attachment views, imported views change every frame
+	std::map<std::vector<VkImageView>, RenderGraphFramebuffer> framebuffers;
+};
+
+struct CompiledRenderGraph
+{
+	uint64_t lastUsed = 0;
+
+	// What it was compiled from, hash matches are compared against it
+	std::vector<uint64_t> key;
+
+	std::vector<RenderGraphGroup> groups;
+
+	// Imported images to their final layout
+	RenderGraphBarrierBatch after;
+
+	// Per resource, VK_NULL_HANDLE for imported and unused ones
+	std::vector<VkImage> images;
+	std::vector<VkImageView> views;
+
+	// Transient memory, shared by images whose lifetimes don't overlap
+	std::vector<GpuAllocation> memory;
+
+	// Stats
+	uint32_t culled = 0;
+	uint32_t subpasses = 0;
+	uint32_t folded = 0;
+	VkDeviceSize aliasedBytes = 0;
+};
+
+// Frame graph declared every frame. Passes state what they read and write;
+// the compiled form culls passes nothing depends on, merges passes into
+// subpasses, picks load/store ops and batches layout transitions. It is
+// cached by structure, so a steady frame only looks it up.
+struct RenderGraph
+{
+	VkDevice device = VK_NULL_HANDLE;
+	GpuAllocator* allocator = nullptr;
+	uint32_t framesInFlight = 2;
+	uint64_t frame = 0;
+
+	// Unused compiled graphs and framebuffers live this many frames, so
+	// alternating frame shapes and swapchain images don't rebuild them
+	uint32_t keepFrames = 60;
+
+	// Declared this frame
+	std::vector<RenderGraphResource> resources;
+	std::vector<RenderGraphPass> passes;
+
+	std::multimap<uint64_t, std::unique_ptr<CompiledRenderGraph>> compiled;
+
+	// One render pass per compatibility class, by everything but load/store
+	// ops and layouts; compiled graphs come and go, these stay
+	std::map<std::vector<uint64_t>, VkRenderPass> compatiblePasses;
+
+	// Structure of this frame's graph, reused to avoid allocating
+	std::vector<uint64_t> key;
+
+	// Every resource's view while execute runs, for passes that sample them
+	std::vector<VkImageView> views;
+
+	// Optional, every group is recorded between the two
+	std::function<uint32_t(VkCommandBuffer cmd, const char* name)> beginTimer;
+	std::function<void(VkCommandBuffer cmd, uint32_t timer)> endTimer;
+
+	// Stats
+	uint64_t compiles = 0;
+
+	void init(VkDevice device, GpuAllocator* allocator, uint32_t framesInFlight);
+
+	void release();
+
+	// After the frame's fence has been waited on
+	void reset(uint64_t frame);
+
+	uint32_t importImage(VkImage image, VkImageView view, VkFormat format, VkExtent2D extent, VkImageLayout initialLayout, VkImageLayout finalLayout);
+
+	uint32_t createImage(VkFormat format, VkExtent2D extent);
+
+	RenderGraphPass& addPass(const char* name, bool compute = false);
+
+	void execute(VkCommandBuffer cmd);
+
+	// Fills key from the declared graph and hashes it
+	uint64_t hash();
+
+	// Before an imported view is destroyed; framebuffers using it are moved
+	// to retired, their owner destroys them once frames in flight are done
+	void forgetView(VkImageView view, std::vector<VkFramebuffer>& retired);
+
+	CompiledRenderGraph* compile();
+
+	void createRenderPass(CompiledRenderGraph& graph, RenderGraphGroup& group, std::vector<VkImageLayout>& layouts, std::vector<bool>& defined, uint32_t groupIndex);
+
+	VkRenderPass compatiblePass(const VkRenderPassCreateInfo& createInfo);
+
+	// What a group of draws into one color attachment is compatible with,
+	// for building pipelines ahead of the first frame
+	VkRenderPass colorPass(VkFormat format);
+
+	void createImages(CompiledRenderGraph& graph);
+
+	void destroy(CompiledRenderGraph& graph);
+
+	VkFramebuffer framebuffer(CompiledRenderGraph& graph, RenderGraphGroup& group);
+
+	void recordBarriers(VkCommandBuffer cmd, CompiledRenderGraph& graph, const RenderGraphBarrierBatch& batch);
+};
+
+struct LatencyFrame
+{
+	std::chrono::steady_clock::time_point start;
+	int64_t input;
+	std::chrono::steady_clock::time_point submit;
+
+	// Present wait when presentId is set, otherwise the fence
+	uint64_t presentId;
+	VkSwapchainKHR swapChain;
+	VkFence fence;
+
+	bool dropped;
+};
+
+// Watches submitted frames on its own thread until they reach the screen,
+// through VK_KHR_present_wait when the device has it, otherwise by the
+// frame's fence, which is when the GPU finished and not when the image
+// was shown. Input and frame start times are tied to that moment.
+struct LatencyTracker
+{
+	typedef std::chrono::steady_clock Clock;
+
+	VkDevice device = VK_NULL_HANDLE;
+	PFN_vkWaitForPresentKHR waitForPresent = nullptr;
+
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque<LatencyFrame> queue;
+	bool stopping = false;
+
+	// What the worker is blocked on right now
+	VkSwapchainKHR busySwapChain = VK_NULL_HANDLE;
+
+	// Milliseconds
+	std::vector<double> inputToPresent;
+	std::vector<double> startToPresent;
+	std::vector<double> submitToPresent;
+	uint64_t dropped = 0;
+
+	void init(VkDevice device, bool presentWait);
+
+	void release();
+
+	bool usesPresentWait();
+
+	void submitted(const LatencyFrame& frame);
+
+	// Before the fence is reset, waits until the worker is done with it
+	void releaseFence(VkFence fence);
+
+	// Before the swapchain is destroyed, its pending frames are dropped
+	void forgetSwapChain(VkSwapchainKHR swapChain);
+
+	void run();
+
+	void printHistogram(const char* name, const std::vector<double>& values);
+};
+
+// Host visible copy of a finished frame, filled by the GPU and written out
+// by the capture thread once the frame's fence has signalled
+struct CaptureSlot
+{
+	VkBuffer buffer = VK_NULL_HANDLE;
+	GpuAllocation memory;
+	VkDeviceSize capacity = 0;
+
+	// Guarded by FrameCapture::mutex once handed to the writer
+	bool busy = false;
+	bool writing = false;
+
+	uint64_t submitted = 0;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	VkFormat format = VK_FORMAT_UNDEFINED;
+	std::string path;
+};
+
+// Render scale from measured GPU frame times. Steps are quantized and held
+// while results from the old scale drain, so the graph cache sees a
+// handful of extents rather than a new one every frame.
+struct DynamicResolution
+{
+	double targetMs = 0.0;
+	float minScale = 0.5f;
+	float maxScale = 1.0f;
+	float scale = 1.0f;
+
+	// Smoothed GPU time at the current scale
+	double averageMs = 0.0;
+	uint32_t holdFrames = 0;
+
+	// Stats
+	uint64_t frames = 0;
+	uint64_t changes = 0;
+	double scaleSum = 0.0;
+
+	void init(double targetMs, float minScale, float maxScale);
+
+	// GPU time of a finished frame
+	void update(double gpuMs);
+
+	VkExtent2D extent(VkExtent2D full);
+
+	void printStats();
+};
+
+// Capture handed back to the caller instead of written, RGBA
+struct CapturedFrame
+{
+	uint64_t frame = 0;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	std::vector<uint8_t> pixels;
+};
+
+// Screenshots and capture streaming without stalling the queue. A small ring
+// of readback buffers trails the render loop by frames in flight; when every
+// slot is still copying or writing, the frame is skipped rather than waited on.
+struct FrameCapture
+{
+	typedef std::chrono::steady_clock Clock;
+
+	VkDevice device = VK_NULL_HANDLE;
+	GpuAllocator* allocator = nullptr;
+
+	std::vector<CaptureSlot> slots;
+	uint32_t next = 0;
+
+	std::thread writer;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque<uint32_t> queue;
+	bool stopping = false;
+
+	// Captures recorded with an empty path
+	std::vector<CapturedFrame> kept;
+
+	uint64_t written = 0;
+	uint64_t skipped = 0;
+	uint64_t failed = 0;
+	uint64_t bytes = 0;
+	double writeMs = 0.0;
+
+	void init(VkDevice device, GpuAllocator* allocator, uint32_t slotCount);
+
+	void release();
+
+	static bool supports(VkFormat format);
+
+	// Records the copy of an image the frame has finished with, false when no
+	// slot is free. The image is left in the layout it came in; an empty path
+	// keeps the pixels for take().
+	bool record(
+		VkCommandBuffer cmd,
+		VkImage image,
+		VkImageLayout layout,
+		VkFormat format,
+		VkExtent2D extent,
+		uint64_t frame,
+		const std::string& path);
+
+	// After the fence wait, hands the copies of retired frames to the writer
+	void collect(uint64_t frame, uint32_t framesInFlight);
+
+	// Never blocks, false until the writer has got to the frame
+	bool take(uint64_t frame, CapturedFrame& captured);
+
+	void run();
+};
+
+// Extent dependent objects replaced by a swapchain recreation, destroyed
+// once every frame that could still reference them has retired
+struct RetiredSwapChain
+{
+	uint64_t frame;
+	VkSwapchainKHR swapChain = VK_NULL_HANDLE;
+	std::vector<VkImage> images;
+	std::vector<GpuAllocation> memory;
+	std::vector<VkImageView> imageViews;
+	std::vector<VkFramebuffer> framebuffers;
+	std::vector<VkCommandBuffer> commandBuffers;
+};
+
+// Fixed function state and shaders of a graphics pipeline. Shader modules,
+// layout and render pass must stay alive until the pipeline is ready.
+struct GraphicsPipelineDesc
+{
+	VkShaderModule vertexShader = VK_NULL_HANDLE;
+	VkShaderModule fragmentShader = VK_NULL_HANDLE;
+
+	std::vector<VkVertexInputBindingDescription> bindings;
+	std::vector<VkVertexInputAttributeDescription> attributes;
+
+	VkPrimitiveTopology topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	VkPolygonMode polygonMode = VK_POLYGON_MODE_FILL;
+	VkCullModeFlags cullMode = VK_CULL_MODE_NONE;
+	VkFrontFace frontFace = VK_FRONT_FACE_CLOCKWISE;
+
+	bool blend = false;
+	bool depthTest = false;
+	bool depthWrite = false;
+
+	VkPipelineLayout layout = VK_NULL_HANDLE;
+	VkRenderPass renderPass = VK_NULL_HANDLE;
+	uint32_t subpass = 0;
+
+	uint64_t hash() const;
+
+	bool operator==(const GraphicsPipelineDesc& other) const;
+};
+
+struct PipelineEntry
+{
+	uint64_t hash;
+	GraphicsPipelineDesc desc;
+
+	// Written once by a worker, VK_NULL_HANDLE until then
+	std::atomic<VkPipeline> pipeline = { VK_NULL_HANDLE };
+	std::atomic<bool> ready = { false };
+	bool failed = false;
+};
+
+typedef PipelineEntry* PipelineHandle;
+
+// Header in front of the driver's cache blob, a cache from another
+// device or driver version is thrown away instead of handed to the driver
+struct PipelineCacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t vendorID;
+	uint32_t deviceID;
+	uint32_t driverVersion;
+	uint8_t uuid[VK_UUID_SIZE];
+	uint64_t dataSize;
+};
+
+struct PipelineManager
+{
+	VkDevice device = VK_NULL_HANDLE;
+	VkPhysicalDeviceProperties props;
+	std::string cachePath;
+
+	VkPipelineCache cache = VK_NULL_HANDLE;
+
+	std::mutex mutex;
+	std::condition_variable queueCond;
+	std::condition_variable readyCond;
+	// Keyed by hash, request() compares the descs of colliding entries
+	std::multimap<uint64_t, std::unique_ptr<PipelineEntry>> entries;
+	std::deque<PipelineEntry*> queue;
+
+	std::vector<std::thread> workers;
+	bool stopping = false;
+
+	// Stats
+	std::atomic<uint32_t> compiled = { 0 };
+	std::atomic<uint64_t> compileMicros = { 0 };
+	size_t loadedCacheSize = 0;
+
+	void init(VkDevice device, VkPhysicalDevice physicalDevice, const std::string& cachePath);
+
+	void release();
+
+	PipelineHandle request(const GraphicsPipelineDesc& desc);
+
+	VkPipeline get(PipelineHandle handle);
+
+	void wait(PipelineHandle handle);
+
+	void waitAll();
+
+	void compile(PipelineEntry* entry);
+
+	void loadCache();
+
+	void saveCache();
+};
+
+// Shader source and the defines it's compiled with, NAME or NAME=VALUE.
+// GLSL unless the path ends in .hlsl; path + ".spv" is loaded instead when
+// the source isn't there or doesn't compile.
+struct ShaderDesc
+{
+	std::string path;
+	VkShaderStageFlagBits stage = VK_SHADER_STAGE_VERTEX_BIT;
+	std::vector<std::string> defines;
+};
+
+struct ShaderBinding
+{
+	uint32_t set;
+	uint32_t binding;
+	VkDescriptorType type;
+
+	// 0 for runtime sized arrays
+	uint32_t count;
+};
+
+// What pipeline layouts need from a module, cached next to its SPIR-V
+struct ShaderReflection
+{
+	VkShaderStageFlagBits stage = VK_SHADER_STAGE_VERTEX_BIT;
+	std::vector<ShaderBinding> bindings;
+	uint32_t pushConstantSize = 0;
+	uint32_t localSize[3] = { 1, 1, 1 };
+};
+
+struct ShaderEntry
+{
+	ShaderDesc desc;
+
+	// Source and includes, defines, stage and compiler version; names the cache files
+	uint64_t hash = 0;
+
+	// Written once by a worker, VK_NULL_HANDLE until then
+	std::atomic<VkShaderModule> module = { VK_NULL_HANDLE };
+	std::atomic<bool> ready = { false };
+	bool failed = false;
+	ShaderReflection reflection;
+};
+
+typedef ShaderEntry* ShaderHandle;
+
+// Runtime GLSL/HLSL compilation through an external glslangValidator. The
+// SPIR-V and its reflection are cached on disk by content hash, so a warm
+// start only reads files; compiles run on dedicated threads like pipelines,
+// and identical SPIR-V shares one VkShaderModule.
+struct ShaderManager
+{
+	VkDevice device = VK_NULL_HANDLE;
+	std::string cacheDir;
+	std::string compiler;
+
+	// --target-env for the Vulkan version in use, the SPIR-V version follows it
+	std::string targetEnv;
+
+	// Queried once by the first worker that needs it
+	std::once_flag versionOnce;
+	std::string compilerVersion;
+
+	std::mutex mutex;
+	std::condition_variable queueCond;
+	std::condition_variable readyCond;
+
+	// Keyed by path, stage and defines
+	std::map<uint64_t, std::unique_ptr<ShaderEntry>> entries;
+	std::deque<ShaderEntry*> queue;
+
+	// Keyed by SPIR-V hash, the code is compared on a match
+	std::multimap<uint64_t, std::pair<std::vector<uint32_t>, VkShaderModule>> modules;
+
+	std::vector<std::thread> workers;
+	bool stopping = false;
+
+	// Stats
+	std::atomic<uint32_t> cacheHits = { 0 };
+	std::atomic<uint32_t> compiled = { 0 };
+	std::atomic<uint32_t> failures = { 0 };
+	std::atomic<uint32_t> deduplicated = { 0 };
+	std::atomic<uint64_t> compileMicros = { 0 };
+
+	// apiVersion is what instance and device both support
+	void init(VkDevice device, uint32_t apiVersion, const std::string& cacheDir, const std::string& compiler);
+
+	void release();
+
+	ShaderHandle request(const ShaderDesc& desc);
+
+	VkShaderModule get(ShaderHandle handle);
+
+	void wait(ShaderHandle handle);
+
+	void waitAll();
+
+	// Only once the handle is ready
+	const ShaderReflection& reflection(ShaderHandle handle);
+
+	// Merged over the stages, for descriptor set and pipeline layouts
+	std::vector<VkDescriptorSetLayoutBinding> layoutBindings(const std::vector<ShaderHandle>& handles, uint32_t set);
+
+	VkPushConstantRange pushConstantRange(const std::vector<ShaderHandle>& handles);
+
+	void build(ShaderEntry* entry);
+
+	bool compile(ShaderEntry* entry, const std::string& output);
+
+	void queryVersion();
+
+	VkShaderModule createModule(const std::vector<uint32_t>& code);
+
+	static bool reflect(const std::vector<uint32_t>& code, ShaderReflection& reflection);
+
+	bool loadReflection(const std::string& path, ShaderReflection& reflection);
+
+	void saveReflection(const std::string& path, const ShaderReflection& reflection);
+};
+
+// Global descriptor table, textures and storage buffers are addressed by
+// index instead of a set per draw. With descriptor indexing there is one
+// update-after-bind set with partially bound arrays; without it every
+// frame in flight gets its own set, every slot holds a valid default
+// descriptor and changes reach a frame's set when it comes around again.
+struct BindlessTable
+{
+	VkDevice device = VK_NULL_HANDLE;
+	GpuAllocator* allocator = nullptr;
+
+	bool indexing = false;
+	uint32_t framesInFlight = 0;
+	uint32_t maxTextures = 0;
+	uint32_t maxBuffers = 0;
+
+	VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
+	VkDescriptorPool pool = VK_NULL_HANDLE;
+
+	// One set with indexing, one per frame in flight without
+	std::vector<VkDescriptorSet> sets;
+	std::vector<bool> dirty;
+	uint32_t frame = 0;
+	uint64_t frameCount = 0;
+
+	// set() was called this frame, on the fallback path its set can't be
+	// written any more until the frame comes around again
+	bool handedOut = false;
+
+	// Current contents, mirrored for the fallback rewrite
+	std::vector<VkDescriptorImageInfo> textures;
+	std::vector<VkDescriptorBufferInfo> buffers;
+
+	// Free slots, a released slot waits until no frame can still read it
+	std::vector<uint32_t> freeTextures;
+	std::vector<uint32_t> freeBuffers;
+	std::vector<std::pair<uint64_t, uint32_t>> retiredTextures;
+	std::vector<std::pair<uint64_t, uint32_t>> retiredBuffers;
+
+	// Fills unused slots on the fallback path
+	VkImage defaultImage = VK_NULL_HANDLE;
+	GpuAllocation defaultImageMemory;
+	VkImageView defaultView = VK_NULL_HANDLE;
+	VkSampler defaultSampler = VK_NULL_HANDLE;
+	VkBuffer defaultBuffer = VK_NULL_HANDLE;
+	GpuAllocation defaultBufferMemory;
+
+	// Stats
+	uint64_t writes = 0;
+	uint64_t rewrites = 0;
+
+	void init(VkDevice device, VkPhysicalDevice physicalDevice, GpuAllocator* allocator, StagingUploader* uploader, bool indexing, uint32_t frameCount);
+
+	void release();
+
+	// Applies retirements and, on the fallback path, pending writes
+	void beginFrame(uint32_t frame, uint64_t frameCount);
+
+	// Set to bind this frame, set = 0 of layouts built from setLayout
+	VkDescriptorSet set();
+
+	// Binding 0, image must be SHADER_READ_ONLY_OPTIMAL when sampled
+	uint32_t addTexture(VkImageView view, VkSampler sampler);
+
+	// Binding 1
+	uint32_t addBuffer(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range);
+
+	void removeTexture(uint32_t index);
+
+	void removeBuffer(uint32_t index);
+
+	void write(uint32_t binding, uint32_t index);
+};
+
+// Descriptor pools for sets that live one frame. Each frame in flight owns
+// a growing list of pools, all reset with one call per pool once its
+// fence signalled, instead of freeing sets one by one.
+struct FrameDescriptorPools
+{
+	VkDevice device = VK_NULL_HANDLE;
+
+	std::vector<std::vector<VkDescriptorPool>> pools;
+	std::vector<uint32_t> used;
+	uint32_t frame = 0;
+
+	uint32_t setsPerPool = 256;
+
+	// Stats
+	uint64_t allocations = 0;
+	uint32_t poolsCreated = 0;
+
+	void init(VkDevice device, uint32_t frameCount);
+
+	void release();
+
+	void beginFrame(uint32_t frame);
+
+	VkDescriptorSet allocate(VkDescriptorSetLayout layout);
+
+	VkDescriptorPool createPool();
+};
+
+// Writes one mip level as tightly packed RGBA8, on a streaming worker;
+// false when the level can't be decoded
+typedef std::function<bool(uint32_t level, uint32_t width, uint32_t height, std::vector<uint8_t>& rgba)> TextureDecodeFunc;
+
+// A texture whose finest levels come and go. The GPU image only holds
+// levels [resident, levels), level resident is its mip 0.
+struct StreamedTexture
+{
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t levels = 0;
+	TextureDecodeFunc decode;
+
+	// Always resident once loaded, at most 64 texels on a side
+	uint32_t tail = 0;
+
+	// Finest level that fits the staging ring in one upload frame
+	uint32_t finest = 0;
+
+	// levels while nothing is on the GPU
+	uint32_t resident = 0;
+
+	// Level of the queued or decoding load, UINT32_MAX when idle
+	uint32_t pending = UINT32_MAX;
+
+	// Finest level draws asked for, and the frame of the last draw
+	uint32_t wanted = 0;
+	uint64_t lastUsed = 0;
+	bool used = false;
+
+	VkImage image = VK_NULL_HANDLE;
+	GpuAllocation memory;
+	VkImageView view = VK_NULL_HANDLE;
+
+	// Bumped every time view changes
+	uint32_t version = 0;
+};
+
+// Levels [first, levels) of one texture, decoded on a worker
+struct TextureLoad
+{
+	StreamedTexture* texture = nullptr;
+	uint32_t first = 0;
+	std::vector<std::vector<uint8_t>> levels;
+	bool failed = false;
+
+	std::chrono::steady_clock::time_point queued;
+	double decodeMs = 0.0;
+};
+
+struct RetiredTexture
+{
+	uint64_t frame;
+	VkImage image;
+	GpuAllocation memory;
+	VkImageView view;
+};
+
+struct TextureStreamerStats
+{
+	uint32_t textures = 0;
+	uint32_t fullyResident = 0;
+	uint32_t pendingLoads = 0;
+	VkDeviceSize residentBytes = 0;
+	VkDeviceSize peakBytes = 0;
+	VkDeviceSize budget = 0;
+
+	uint64_t loads = 0;
+	uint64_t evictions = 0;
+	uint64_t failures = 0;
+
+	// Finer levels that waited because nothing could be evicted
+	uint64_t deferred = 0;
+
+	uint64_t uploadedBytes = 0;
+	double uploadMBps = 0.0;
+	double decodeMs = 0.0;
+	double latencyMs = 0.0;
+};
+
+// Streams mip levels in on demand: draws report how large a texture is on
+// screen, update() schedules one level finer at a time, coarse levels
+// first, and evicts least recently drawn textures down to their tail to
+// stay inside the budget. Residency changes rebuild the image from
+// freshly decoded levels and swap the view, the old one is retired like
+// swapchains are. Decoding runs on dedicated threads, uploading and
+// everything else on the render thread.
+struct TextureStreamer
+{
+	VkDevice device = VK_NULL_HANDLE;
+	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+	GpuAllocator* allocator = nullptr;
+	StagingUploader* uploader = nullptr;
+	uint32_t framesInFlight = 0;
+
+	bool memoryBudget = false;
+	uint32_t heap = 0;
+	VkDeviceSize cap = 0;
+	VkDeviceSize budget = 0;
+
+	// Per frame, so uploads don't stall the staging ring
+	VkDeviceSize uploadLimit = 0;
+
+	uint64_t frameCount = 0;
+	std::vector<std::unique_ptr<StreamedTexture>> textures;
+	std::vector<RetiredTexture> retired;
+
+	std::mutex mutex;
+	std::condition_variable queueCond;
+	std::vector<TextureLoad*> queue;
+	std::deque<TextureLoad*> finished;
+	std::vector<std::thread> workers;
+	bool stopping = false;
+
+	// Stats
+	std::chrono::steady_clock::time_point started;
+	VkDeviceSize residentBytes = 0;
+	VkDeviceSize peakBytes = 0;
+	uint64_t loads = 0;
+	uint64_t evictions = 0;
+	uint64_t failures = 0;
+	uint64_t deferred = 0;
+	uint64_t uploadedBytes = 0;
+	double decodeMs = 0.0;
+	double latencyMs = 0.0;
+
+	// cap in bytes, 0 leaves the budget to VK_EXT_memory_budget
+	void init(VkDevice device, VkPhysicalDevice physicalDevice, GpuAllocator* allocator, StagingUploader* uploader, uint32_t frameCount, bool memoryBudget, VkDeviceSize cap);
+
+	void release();
+
+	// The tail is queued right away
+	StreamedTexture* create(uint32_t width, uint32_t height, TextureDecodeFunc decode);
+
+	// From draws, the size the whole texture would cover in pixels
+	void touch(StreamedTexture* texture, float pixelsWide, float pixelsHigh);
+
+	// Once per frame, after the frame's fence
+	void update(uint64_t frameCount);
+
+	TextureStreamerStats stats();
+
+	void updateBudget();
+
+	void schedule();
+
+	void queueLoad(StreamedTexture* texture, uint32_t first);
+
+	void install(TextureLoad* load);
+
+	void decode(TextureLoad* load);
+
+	// Estimated, what levels [first, levels) occupy
+	static VkDeviceSize chainBytes(const StreamedTexture* texture, uint32_t first);
+};
+
+// Instance data of one quad, 40 bytes; sprite.vert builds the corners
+struct SpriteInstance
+{
+	// Pixels, center of the quad
+	glm::vec2 position;
+	glm::vec2 size;
+
+	// u0 v0 u1 v1
+	glm::vec4 uv = glm::vec4(0.0f, 0.0f, 1.0f, 1.0f);
+
+	// R8G8B8A8
+	uint32_t color = 0xffffffff;
+
+	// Radians
+	float rotation = 0.0f;
+};
+
+enum SpritePipeline
+{
+	SpriteAlpha,
+	SpriteOpaque,
+	SpritePipelineCount
+};
+
+struct SpriteTexture
+{
+	VkImage image = VK_NULL_HANDLE;
+	GpuAllocation memory;
+	VkImageView view = VK_NULL_HANDLE;
+
+	// Bindless table slot, UINT32_MAX while a streamed texture has no view
+	uint32_t slot = UINT32_MAX;
+
+	// Owned by the streamer, slot follows its view
+	TextureStreamer* streamer = nullptr;
+	StreamedTexture* streamed = nullptr;
+	uint32_t version = 0;
+};
+
+// One instanced draw
+struct SpriteBatch
+{
+	uint32_t pipeline;
+	uint32_t texture;
+	uint32_t first;
+	uint32_t count;
+};
+
+// Collects sprites during the frame, sorts them by layer, pipeline and
+// texture and writes them to a persistently mapped per-frame instance
+// buffer, so each run of equal state is one instanced draw. Textures live
+// in the bindless table; its set is bound once and batches only push the
+// texture's slot.
+struct SpriteBatcher
+{
+	VkDevice device = VK_NULL_HANDLE;
+	GpuAllocator* allocator = nullptr;
+	StagingUploader* uploader = nullptr;
+	PipelineManager* pipelines = nullptr;
+	BindlessTable* bindless = nullptr;
+
+	// Off when the shaders don't compile or load
+	bool enabled = false;
+
+	VkShaderModule vertexShader = VK_NULL_HANDLE;
+	VkShaderModule fragmentShader = VK_NULL_HANDLE;
+	VkPipelineLayout layout = VK_NULL_HANDLE;
+	VkShaderStageFlags pushStages = 0;
+	VkSampler sampler = VK_NULL_HANDLE;
+
+	// renderPass and subpass are filled in by requestPipelines
+	GraphicsPipelineDesc pipelineDescs[SpritePipelineCount];
+	PipelineHandle pipelineHandles[SpritePipelineCount] = {};
+
+	// 0 is 1x1 white, for untextured quads
+	std::vector<SpriteTexture> textures;
+
+	uint32_t capacity = 0;
+	GpuRingBuffer instances;
+
+	// Submitted this frame, key is layer | pipeline | texture
+	std::vector<uint32_t> keys;
+	std::vector<SpriteInstance> pending;
+
+	// Prepared for recording
+	std::vector<SpriteBatch> batches;
+	VkDeviceSize instanceOffset = 0;
+
+	// Stats
+	uint64_t frames = 0;
+	uint64_t sprites = 0;
+	uint64_t draws = 0;
+	uint64_t dropped = 0;
+	double cpuMs = 0.0;
+
+	void init(VkDevice device, GpuAllocator* allocator, StagingUploader* uploader, PipelineManager* pipelines, ShaderManager* shaders, BindlessTable* bindless, VkRenderPass renderPass, uint32_t frameCount, uint32_t capacity);
+
+	void release();
+
+	// Pipelines for a subpass of renderPass, compiled on first request
+	void requestPipelines(VkRenderPass renderPass, uint32_t subpass);
+
+	uint32_t createTexture(uint32_t width, uint32_t height, const void* rgba);
+
+	// Draws report their size to the streamer; white until the tail is in
+	uint32_t addStreamedTexture(TextureStreamer* streamer, StreamedTexture* texture);
+
+	void beginFrame(uint32_t frame);
+
+	// Layers draw in order, 0-255; submission order is kept inside a batch
+	void draw(const SpriteInstance& sprite, uint32_t texture = 0, uint32_t pipeline = SpriteAlpha, uint32_t layer = 0);
+
+	void prepare();
+
+	// Instances are in pixels of space, the window size when the scene
+	// renders at a different resolution
+	void record(const RenderGraphContext& ctx, VkExtent2D space);
+};
+
+// Bounding sphere and color of one object, std430 as cull.comp reads it
+struct GpuObject
+{
+	glm::vec4 sphere;
+	glm::vec4 color = glm::vec4(1.0f);
+	uint32_t mesh = 0;
+	uint32_t pad[3] = {};
+};
+
+struct GpuMesh
+{
+	uint32_t indexCount;
+	uint32_t firstIndex;
+	int32_t vertexOffset;
+};
+
+struct IndirectFrame
+{
+	// Written from the host when the objects changed since this slot last
+	// ran, shared by the compute and graphics queue families
+	VkBuffer objects = VK_NULL_HANDLE;
+	GpuAllocation objectsMemory;
+	uint64_t version = 0;
+
+	// Written on the compute queue, handed to graphics every frame
+	VkBuffer draws = VK_NULL_HANDLE;
+	GpuAllocation drawsMemory;
+
+	// Survivors per workgroup of the cull pass, then their offsets
+	VkBuffer groups = VK_NULL_HANDLE;
+	GpuAllocation groupsMemory;
+
+	// Host visible, read back for the stats once the fence signalled
+	VkBuffer count = VK_NULL_HANDLE;
+	GpuAllocation countMemory;
+	bool counted = false;
+
+	// From the frame's descriptor pools, written again by prepare
+	VkDescriptorSet set = VK_NULL_HANDLE;
+};
+
+// GPU driven object drawing. Object bounds stay in a storage buffer,
+// cull.comp tests them against the frustum on the compute queue and
+// compacts one indexed indirect command per survivor in object order, so
+// overlapping objects draw the same way every frame, and the draw pass
+// issues all of them with a single vkCmdDrawIndexedIndirectCount whatever
+// the object count. Without draw indirect count every object keeps its
+// slot and culled ones draw zero instances.
+struct IndirectRenderer
+{
+	VkDevice device = VK_NULL_HANDLE;
+	GpuAllocator* allocator = nullptr;
+	StagingUploader* uploader = nullptr;
+	PipelineManager* pipelines = nullptr;
+	FrameDescriptorPools* descriptorPools = nullptr;
+	AsyncCompute* compute = nullptr;
+
+	// Off when the shaders don't load or the device can't draw indirect
+	bool enabled = false;
+
+	// Best first: count from the GPU, one multi-draw, one draw per object
+	PFN_vkCmdDrawIndexedIndirectCountKHR drawIndexedIndirectCount = nullptr;
+	bool multiDraw = false;
+
+	uint32_t capacity = 0;
+	uint32_t vertexCapacity = 0;
+	uint32_t indexCapacity = 0;
+
+	std::vector<GpuObject> objects;
+	uint64_t version = 1;
+
+	// Appended only, so frames in flight never see a range change
+	std::vector<GpuMesh> meshes;
+	uint32_t vertexCount = 0;
+	uint32_t indexCount = 0;
+
+	VkBuffer vertexBuffer = VK_NULL_HANDLE;
+	GpuAllocation vertexMemory;
+	VkBuffer indexBuffer = VK_NULL_HANDLE;
+	GpuAllocation indexMemory;
+
+	// Host visible like the objects, only the cull reads it
+	VkBuffer meshBuffer = VK_NULL_HANDLE;
+	GpuAllocation meshMemory;
+
+	VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
+	VkPipelineLayout cullLayout = VK_NULL_HANDLE;
+	VkPipelineLayout drawLayout = VK_NULL_HANDLE;
+	VkPipeline cullPipeline = VK_NULL_HANDLE;
+
+	// renderPass and subpass are filled in by requestPipelines
+	GraphicsPipelineDesc drawDesc;
+	PipelineHandle drawPipeline = nullptr;
+
+	std::vector<IndirectFrame> frames;
+	uint32_t frame = 0;
+
+	// This frame's camera, set by prepare; pending until cull records it
+	glm::mat4 viewProjection;
+	bool pending = false;
+
+	// Stats
+	uint64_t culledFrames = 0;
+	uint64_t visible = 0;
+	uint64_t tested = 0;
+	double cpuMs = 0.0;
+
+	void init(
+		VkDevice device,
+		GpuAllocator* allocator,
+		StagingUploader* uploader,
+		PipelineManager* pipelines,
+		ShaderManager* shaders,
+		FrameDescriptorPools* descriptorPools,
+		AsyncCompute* compute,
+		VkRenderPass renderPass,
+		uint32_t frameCount,
+		uint32_t capacity,
+		PFN_vkCmdDrawIndexedIndirectCountKHR drawIndexedIndirectCount,
+		bool multiDraw);
+
+	void release();
+
+	// Vertices inside the unit sphere, objects scale them to their bounds
+	uint32_t addMesh(const std::vector<glm::vec3>& vertices, const std::vector<uint32_t>& indices);
+
+	uint32_t addObject(const GpuObject& object);
+
+	void updateObject(uint32_t index, const GpuObject& object);
+
+	// Draw pipeline for a subpass of renderPass, compiled on first request
+	void requestPipelines(VkRenderPass renderPass, uint32_t subpass);
+
+	// After the frame's fence, collects the survivor count of its last use
+	void beginFrame(uint32_t frame);
+
+	// Uploads what changed; the cull dispatch and the draws use viewProjection
+	void prepare(const glm::mat4& viewProjection);
+
+	// Recorded on the compute queue, which releases the commands and the
+	// count to the graphics submission of the same frame
+	void cull();
+
+	void record(const RenderGraphContext& ctx);
+};
+
+struct VulkanTest
+{
+	bool useLayer = false;
+
+	// Instance
+	VkInstance instance;
+
+	// Requested in createInstance, devices are used up to this version
+	uint32_t instanceApiVersion = VK_API_VERSION_1_2;
+
+	// Debug Messenger
+	VkDebugUtilsMessengerEXT debugMessenger = VK_NULL_HANDLE;
+
+	// Surface
+	VkSurfaceKHR surface;
+
+	// Physical Device
+	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+	DeviceCapabilities caps;
+
+	// Devices
+	VkDevice device;
+	VkQueue graphicsQueue;
+	VkQueue presentQueue;
+	VkQueue transferQueue;
+	VkQueue computeQueue;
+	uint32_t graphicsFamily = 0;
+	uint32_t transferFamily = 0;
+	uint32_t computeFamily = 0;
+
+	// VK_EXT_descriptor_indexing, core in 1.2
+	bool descriptorIndexing = false;
+
+	// VK_KHR_present_id + VK_KHR_present_wait
+	bool presentWait = false;
+
+	// VK_EXT_memory_budget
+	bool memoryBudget = false;
+
+	// Indirect drawing for the GPU culled objects
+	bool multiDrawIndirect = false;
+	bool drawIndirectFirstInstance = false;
+
+	// VK_KHR_draw_indirect_count
+	bool drawIndirectCount = false;
+	PFN_vkCmdDrawIndexedIndirectCountKHR drawIndexedIndirectCount = nullptr;
+
+	// Device Memory
+	GpuAllocator allocator;
+
+	// Swap Chain
+	VkSwapchainKHR swapChain = VK_NULL_HANDLE;
+	std::vector<VkImage> swapChainImages;
+	VkFormat swapChainImageFormat;
+	VkExtent2D swapChainExtent;
+	std::vector<VkImageView> swapChainImageViews;
+	uint32_t swapChainIndex = 0;
+
+	// Layout the frame is left in, PRESENT_SRC unless offscreen
+	VkImageLayout presentLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+	// Offscreen Images
+	std::vector<GpuAllocation> offscreenMemory;
+
+	// Swap Chain Recreation
+	bool swapChainDirty = false;
+	bool skipFrame = false;
+	std::vector<RetiredSwapChain> retiredSwapChains;
+
+	// Command Pool
+	VkCommandPool commandPool;
+
+	// Frames In Flight
+	std::vector<FrameData> frames;
+	uint32_t currentFrame = 0;
+	uint64_t frameCount = 0;
+	std::vector<VkFence> imagesInFlight;
+
+	// GPU Timestamps
+	bool gpuTimestamps = false;
+	float timestampPeriod = 1.0f;
+	uint64_t timestampMask = ~0ull;
+
+	// Pipelines
+	PipelineManager pipelines;
+	ShaderManager shaders;
+	TextureStreamer streamer;
+
+	// Uploads
+	StagingUploader uploader;
+
+	// Async Compute
+	AsyncCompute compute;
+
+	// Parallel Recording
+	ParallelRecorder recorder;
+
+	// Frame Graph, the acquired image is imported as backbuffer
+	RenderGraph graph;
+	uint32_t backbuffer = 0;
+
+	// Input To Present Latency
+	LatencyTracker latency;
+	uint64_t presentId = 0;
+
+	// Frame Readback
+	FrameCapture capture;
+	bool swapChainReadable = false;
+
+	// The next frame is captured into memory, see FrameCapture::take
+	bool captureNext = false;
+
+	// Dynamic Resolution, the scene renders into part of a target sized for
+	// the largest scale and is blitted onto the acquired image
+	DynamicResolution resolution;
+	bool dynamicResolution = false;
+	bool swapChainBlitTarget = false;
+	VkImage renderTarget = VK_NULL_HANDLE;
+	VkImageView renderTargetView = VK_NULL_HANDLE;
+	GpuAllocation renderTargetMemory;
+	VkExtent2D renderTargetCapacity = {};
+	VkFormat renderTargetFormat = VK_FORMAT_UNDEFINED;
+	VkFilter upscaleFilter = VK_FILTER_LINEAR;
+
+	// Extent of the backbuffer resource this frame
+	VkExtent2D renderExtent = {};
+
+	// Descriptors
+	BindlessTable bindless;
+	FrameDescriptorPools descriptorPools;
+
+	// Sprites
+	SpriteBatcher sprites;
+
+	// GPU culled objects
+	IndirectRenderer objects;
+
+	// Clear Command Cache
+	std::map<ClearCommandKey, ClearCommandEntry> clearCommandCache;
+	uint32_t clearCommandCacheLimit = 4;
+
+	// Render Pass
+	VkRenderPass clearRenderPass;
+
+	// Framebuffers
+	std::vector<VkFramebuffer> clearFramebuffers;
+
+	void init();
+	
+	void clear(const glm::vec3& color);
+
+	void recordFrame();
+
+	// Copies the finished image out when a screenshot or capture is due
+	void recordCapture();
+
+	void present();
+
+	void release();
+
+	void createInstance();
+	void createDebugMessenger();
+
+	void createSurface();
+
+	void createPhysicalDevice();
+	QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device);
+	DeviceCapabilities queryCapabilities(VkPhysicalDevice device, bool scanQueues);
+	bool loadDeviceCache(const std::vector<VkPhysicalDevice>& devices);
+	void saveDeviceCache(uint32_t deviceCount);
+
+	void createLogicalDevice();
+
+	void createSwapChain();
+
+	bool recreateSwapChain();
+
+	void retireSwapChain();
+
+	void destroyRetired(bool all);
+
+	void resize(uint32_t w, uint32_t h);
+
+	void setPresentPolicy(PresentPolicy policy);
+
+	void setSwapImageCount(uint32_t count);
+
+	// Takes the F8-F10 requests of the event loop
+	void applyRuntimeControls();
+
+	void createOffscreenImages();
+
+	// Keeps the current target unless the swapchain outgrew it or changed format
+	void createRenderTarget();
+
+	void destroyRenderTarget(bool retire);
+
+	void recordUpscale(VkCommandBuffer cmd);
+
+	SwapChainSupportDetails querySwapChainSupport(VkPhysicalDevice device);
+	VkSurfaceFormatKHR chooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR>& formats);
+	VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& presentModes);
+	VkExtent2D chooseSwapExtent(const VkSurfaceCapabilitiesKHR& caps);
+
+	void createSwapChainImageViews();
+
+	void createCommandPool();
+
+	void createRenderPass();
+
+	void createFramebuffers();
+
+	void createSemaphore();
+
+	void createFence();
+
+	void createQueryPools();
+
+	VkCommandBuffer allocCommandBuffer();
+
+	VkCommandBuffer clearCommand(glm::vec3 color);
+
+	void evictClearCommand(uint32_t image);
+
+	VkCommandBuffer beginCommand();
+
+	// Adds a pass drawing over the acquired image, items split into
+	// chunks recorded on all recording threads
+	void drawParallel(uint32_t itemCount, const RecordFunc& record);
+
+	// Adds a pass drawing everything handed to sprites this frame
+	void drawSprites();
+
+	// Adds a pass drawing the objects that survive the cull pass
+	void drawObjects(const glm::mat4& viewProjection);
+
+	void endCommand(VkCommandBuffer cmd);
+
+	uint32_t beginGpuTimer(VkCommandBuffer cmd, const char* name);
+
+	void endGpuTimer(VkCommandBuffer cmd, uint32_t timer);
+
+	void readGpuTimers(FrameData& frame);
+
+	void releaseClearCommandCache();
+};
+
+VulkanTest test;
+
+// --sprites demo: bouncing quads over two textures
+struct DemoSprite
+{
+	SpriteInstance instance;
+
+	// State of the previous tick, for interpolation
+	SpriteInstance previous;
+
+	glm::vec2 velocity;
+	float spin;
+	uint32_t texture;
+};
+
+std::vector<DemoSprite> demoSprites;
+
+// Sprite textures of --stream-textures; every few seconds the sprites move
+// on to the next ones so the set on screen keeps changing
+std::vector<uint32_t> demoStreamed;
+float demoClock = 0.0f;
+
+// Stands in for decoding an asset: tinted rings and a grid, every level
+// computed from scratch at its own resolution
+static bool decodeDemoTexture(uint32_t seed, uint32_t width, uint32_t height, std::vector<uint8_t>& rgba)
+{
+	float r = 0.4f + 0.6f * ((seed * 73) % 255) / 255.0f;
+	float g = 0.4f + 0.6f * ((seed * 151) % 255) / 255.0f;
+	float b = 0.4f + 0.6f * ((seed * 199) % 255) / 255.0f;
+
+	// Detail fades out before it would alias on coarse levels
+	float grid = std::min(1.0f, width / 512.0f);
+
+	for (uint32_t y = 0; y < height; y++)
+	{
+		for (uint32_t x = 0; x < width; x++)
+		{
+			float u = (x + 0.5f) / width - 0.5f;
+			float v = (y + 0.5f) / height - 0.5f;
+
+			float rings = 0.75f + 0.25f * std::cos(std::sqrt(u * u + v * v) * 40.0f);
+			float lines = 1.0f - grid * 0.3f * std::pow(std::abs(std::sin(u * 200.0f) * std::sin(v * 200.0f)), 8.0f);
+			float shade = rings * lines;
+
+			uint8_t* texel = &rgba[((size_t)y * width + x) * 4];
+			texel[0] = (uint8_t)(255.0f * r * shade);
+			texel[1] = (uint8_t)(255.0f * g * shade);
+			texel[2] = (uint8_t)(255.0f * b * shade);
+			texel[3] = 255;
+		}
+	}
+
+	return true;
+}
+
+// --objects demo: a flat grid of cubes around a turning camera, most of
+// them behind it or off to the sides at any time
+static void buildDemoObjects(uint32_t count)
+{
+	std::vector<glm::vec3> vertices;
+
+	// On the unit sphere, the object radius scales it
+	for (uint32_t i = 0; i < 8; i++)
+	{
+		vertices.push_back(glm::vec3(i & 1 ? 0.57735f : -0.57735f, i & 2 ? 0.57735f : -0.57735f, i & 4 ? 0.57735f : -0.57735f));
+	}
+
+	// Counter-clockwise seen from outside
+	std::vector<uint32_t> indices = {
+		4, 6, 2, 4, 2, 0,
+		1, 3, 7, 1, 7, 5,
+		0, 1, 5, 0, 5, 4,
+		6, 7, 3, 6, 3, 2,
+		2, 3, 1, 2, 1, 0,
+		4, 5, 7, 4, 7, 6
+	};
+
+	uint32_t cube = test.objects.addMesh(vertices, indices);
+	uint32_t side = (uint32_t)std::ceil(std::sqrt((float)count));
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t hash = i * 2654435761u;
+
+		GpuObject object;
+		object.sphere = glm::vec4(
+			((i % side) - side * 0.5f) * 4.0f,
+			((hash >> 8) % 100) / 50.0f - 1.0f,
+			((i / side) - side * 0.5f) * 4.0f,
+			0.6f + ((hash >> 16) % 100) / 100.0f
+		);
+		object.color = glm::vec4(
+			0.3f + 0.7f * ((hash >> 4) % 255) / 255.0f,
+			0.3f + 0.7f * ((hash >> 12) % 255) / 255.0f,
+			0.3f + 0.7f * ((hash >> 20) % 255) / 255.0f,
+			1.0f
+		);
+		object.mesh = cube;
+
+		test.objects.addObject(object);
+	}
+}
+
+// Looks out from above the middle of the grid; y flipped for Vulkan
+static glm::mat4 objectCamera(float angle, float aspect)
+{
+	glm::vec3 eye(0.0f, 6.0f, 0.0f);
+	glm::vec3 direction(std::cos(angle), -0.2f, std::sin(angle));
+
+	glm::mat4 projection = glm::perspectiveRH_ZO(glm::radians(60.0f), aspect, 0.1f, 200.0f);
+	projection[1][1] *= -1.0f;
+
+	return projection * glm::lookAt(eye, eye + direction, glm::vec3(0.0f, 1.0f, 0.0f));
+}
+
+// What the render thread sees of the simulation in --threaded mode, the
+// two latest ticks so it can draw in between
+struct AppSnapshot
+{
+	uint64_t tick = 0;
+
+	// Simulated time of current
+	std::chrono::steady_clock::time_point time;
+
+	std::vector<SpriteInstance> previous;
+	std::vector<SpriteInstance> current;
+	std::vector<uint32_t> textures;
+};
+
+// --bench scenario. Drawing doesn't depend on the frame, so the frame
+// captured once the measurement is over can be compared to a golden image
+struct BenchScenario
+{
+	const char* name;
+	glm::vec3 color;
+
+	// Optional; update runs before the frame's clear, draw between clear and present
+	std::function<void()> begin;
+	std::function<void(uint64_t frame)> update;
+	std::function<void()> draw;
+	std::function<void()> end;
+};
+
+struct BenchResult
+{
+	const char* name;
+	uint64_t frames = 0;
+	double seconds = 0.0;
+
+	// Profiler frames [first, last) were measured
+	uint64_t firstFrame = 0;
+	uint64_t lastFrame = 0;
+
+	uint64_t deviceAllocations = 0;
+	uint32_t liveAllocations = 0;
+	uint64_t graphCompiles = 0;
+
+	// skipped, pass, fail, missing, updated or no-capture
+	const char* golden = "skipped";
+	double mismatch = 0.0;
+};
+
+void app_snapshot(AppSnapshot& snapshot);
+void app_render_snapshot(const AppSnapshot& snapshot, float alpha);
+
+void app_init()
+{
+	test.init();
+
+	if (test.objects.enabled)
+	{
+		buildDemoObjects(objectCount);
+	}
+
+	if (spriteCount == 0 || !test.sprites.enabled)
+	{
+		return;
+	}
+
+	uint32_t checker[16 * 16];
+
+	for (uint32_t i = 0; i < 16 * 16; i++)
+	{
+		checker[i] = ((i % 16) / 4 + (i / 16) / 4) % 2 ? 0xffffffff : 0xff808080;
+	}
+
+	uint32_t textures[2] = {
+		0,
+		test.sprites.createTexture(16, 16, checker)
+	};
+
+	// Far more texel data than the budget, only what's on screen is loaded
+	for (uint32_t i = 0; i < streamTextureCount; i++)
+	{
+		StreamedTexture* texture = test.streamer.create(2048, 2048, [i](uint32_t, uint32_t w, uint32_t h, std::vector<uint8_t>& rgba)
+		{
+			return decodeDemoTexture(i, w, h, rgba);
+		});
+
+		demoStreamed.push_back(test.sprites.addStreamedTexture(&test.streamer, texture));
+	}
+
+	std::srand(1);
+
+	demoSprites.resize(spriteCount);
+
+	for (auto& sprite : demoSprites)
+	{
+		sprite.instance.position = glm::vec2(std::rand() % width, std::rand() % height);
+		sprite.instance.size = glm::vec2(4 + std::rand() % 28);
+		sprite.instance.color = 0xff000000 | (std::rand() & 0xffffff);
+		sprite.velocity = glm::vec2(std::rand() % 200 - 100, std::rand() % 200 - 100);
+		sprite.spin = (std::rand() % 100 - 50) / 10.0f;
+		sprite.texture = textures[std::rand() % 2];
+		sprite.previous = sprite.instance;
+	}
+
+	// Big enough on screen to want the finer levels
+	for (size_t i = 0; i < demoSprites.size() && demoStreamed.size() > 0; i++)
+	{
+		demoSprites[i].instance.size = glm::vec2(64 + std::rand() % 448);
+		demoSprites[i].instance.color = 0xffffffff;
+		demoSprites[i].texture = demoStreamed[i % demoStreamed.size()];
+		demoSprites[i].previous = demoSprites[i].instance;
+	}
+}
+
+void app_release()
+{
+	test.release();
+}
+
+void app_update(float delta)
+{
+	float w = (float)width;
+	float h = (float)height;
+
+	demoClock += delta;
+	size_t page = (size_t)(demoClock / 4.0f) * demoSprites.size();
+
+	jobs.parallelFor(demoSprites.size(), 4096, [delta, w, h, page](uint32_t first, uint32_t count)
+	{
+		for (uint32_t i = first; i < first + count; i++)
+		{
+			DemoSprite& sprite = demoSprites[i];
+			sprite.previous = sprite.instance;
+
+			if (demoStreamed.size() > 0)
+			{
+				sprite.texture = demoStreamed[(i + page) % demoStreamed.size()];
+			}
+
+			glm::vec2& p = sprite.instance.position;
+			p += sprite.velocity * delta;
+
+			if (p.x < 0.0f || p.x > w)
+			{
+				sprite.velocity.x = -sprite.velocity.x;
+			}
+
+			if (p.y < 0.0f || p.y > h)
+			{
+				sprite.velocity.y = -sprite.velocity.y;
+			}
+
+			sprite.instance.rotation += sprite.spin * delta;
+		}
+	});
+}
+
+void app_render()
+{
+	test.clear(glm::vec3(1.0f, 0.0f, 0.0f));
+
+	test.drawObjects(objectCamera(test.frameCount * 0.005f, (float)width / height));
+
+	for (const auto& sprite : demoSprites)
+	{
+		test.sprites.draw(sprite.instance, sprite.texture);
+	}
+
+	test.drawSprites();
+
+	test.present();
+}
+
+// Simulation thread, the slots are reused so this rarely allocates
+void app_snapshot(AppSnapshot& snapshot)
+{
+	snapshot.previous.resize(demoSprites.size());
+	snapshot.current.resize(demoSprites.size());
+	snapshot.textures.resize(demoSprites.size());
+
+	for (size_t i = 0; i < demoSprites.size(); i++)
+	{
+		snapshot.previous[i] = demoSprites[i].previous;
+		snapshot.current[i] = demoSprites[i].instance;
+		snapshot.textures[i] = demoSprites[i].texture;
+	}
+}
+
+// Render thread, alpha 0 draws the previous tick and 1 the current one
+void app_render_snapshot(const AppSnapshot& snapshot, float alpha)
+{
+	test.clear(glm::vec3(1.0f, 0.0f, 0.0f));
+
+	test.drawObjects(objectCamera(test.frameCount * 0.005f, (float)width / height));
+
+	for (size_t i = 0; i < snapshot.current.size(); i++)
+	{
+		SpriteInstance instance = snapshot.current[i];
+		instance.position = glm::mix(snapshot.previous[i].position, instance.position, alpha);
+		instance.rotation = glm::mix(snapshot.previous[i].rotation, instance.rotation, alpha);
+
+		test.sprites.draw(instance, snapshot.textures[i]);
+	}
+
+	test.drawSprites();
+
+	test.present();
+}
+
+void handleEvents()
+{
+	SDL_Event e;
+
+	while (SDL_PollEvent(&e))
+	{
+		bool input =
+			e.type == SDL_KEYDOWN ||
+			e.type == SDL_KEYUP ||
+			e.type == SDL_MOUSEMOTION ||
+			e.type == SDL_MOUSEBUTTONDOWN ||
+			e.type == SDL_MOUSEBUTTONUP ||
+			e.type == SDL_MOUSEWHEEL;
+
+		if (input)
+		{
+			// SDL stamps events in milliseconds since SDL_Init, move that onto the steady clock
+			Uint32 age = SDL_GetTicks() - e.common.timestamp;
+			auto when = std::chrono::steady_clock::now() - std::chrono::milliseconds(age);
+
+			pendingInput = std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count();
+		}
+
+		if (e.type == SDL_QUIT)
+		{
+			running = false;
+		}
+		else if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_F12)
+		{
+			logger.cycleSeverity();
+		}
+		else if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_F11)
+		{
+			screenshotRequested = true;
+		}
+		else if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_F10)
+		{
+			presentPolicyCycle = true;
+		}
+		else if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_F9)
+		{
+			swapImagesCycle = true;
+		}
+		else if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_F8)
+		{
+			frameCapCycle = true;
+		}
+		else if (e.type == SDL_WINDOWEVENT && e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)
+		{
+			width = e.window.data1;
+			height = e.window.data2;
+			windowResized = true;
+		}
+	}
+}
+
+// --threaded: this thread polls events and steps the simulation at a fixed
+// rate, a render thread draws the latest snapshot as fast as the present
+// mode and limiter allow. Returns the rendered frame count.
+uint64_t runThreaded()
+{
+	typedef std::chrono::steady_clock Clock;
+
+	TripleBuffer<AppSnapshot> snapshots;
+	std::atomic<uint64_t> frames = { 0 };
+
+	auto step = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / simulationRate));
+
+	// Simulated time starts one tick ahead, the first snapshot exists before the first frame
+	Clock::time_point next = Clock::now();
+
+	app_update((float)(1.0 / simulationRate));
+	app_snapshot(snapshots.writeBuffer());
+	snapshots.writeBuffer().tick = 1;
+	snapshots.writeBuffer().time = next;
+	snapshots.publish();
+
+	std::thread renderer([&]
+	{
+		// Own deque, recording chunks run here while it waits
+		jobs.registerThread();
+
+		while (running)
+		{
+			profiler.begin(PhaseFrame);
+
+			snapshots.update();
+
+			const AppSnapshot& snapshot = snapshots.readBuffer();
+
+			// Draw one tick behind the simulation, between the two latest states
+			double alpha = std::chrono::duration<double>(Clock::now() - snapshot.time).count() * simulationRate;
+
+			app_render_snapshot(snapshot, (float)std::max(0.0, std::min(1.0, alpha)));
+
+			profiler.end(PhaseFrame);
+			profiler.endFrame();
+
+			limiter.wait();
+
+			uint64_t count = ++frames;
+
+			if (maxFrames > 0 && count >= maxFrames)
+			{
+				running = false;
+			}
+		}
+	});
+
+	uint64_t ticks = 1;
+	uint64_t dropped = 0;
+
+	while (running)
+	{
+		handleEvents();
+
+		Clock::time_point now = Clock::now();
+		uint32_t steps = 0;
+
+		// Catch up at most a few ticks, a longer stall is skipped
+		while (now >= next + step && steps < 4)
+		{
+			next += step;
+			app_update((float)(1.0 / simulationRate));
+			ticks++;
+			steps++;
+		}
+
+		if (now >= next + step)
+		{
+			uint64_t behind = (now - next) / step;
+			next += step * behind;
+			dropped += behind;
+		}
+
+		if (steps > 0)
+		{
+			AppSnapshot& snapshot = snapshots.writeBuffer();
+			app_snapshot(snapshot);
+			snapshot.tick = ticks;
+			snapshot.time = next;
+			snapshots.publish();
+		}
+
+		std::this_thread::sleep_until(next + step);
+	}
+
+	renderer.join();
+
+	std::cout << "Simulation: " << ticks << " ticks at " << simulationRate << " Hz";
+
+	if (dropped > 0)
+	{
+		std::cout << ", " << dropped << " skipped after stalls";
+	}
+
+	std::cout << std::endl;
+
+	return frames;
+}
+
+void VulkanTest::init()
+{
+	startup.begin();
+
+	logger.init(1024);
+
+	startup.run("createInstance", [this] { this->createInstance(); });
+	
+	if (this->useLayer)
+	{
+		startup.run("createDebugMessenger", [this] { this->createDebugMessenger(); });
+	}
+
+	startup.run("createSurface", [this] { this->createSurface(); });
+
+	startup.run("createPhysicalDevice", [this] { this->createPhysicalDevice(); });
+	startup.run("createLogicalDevice", [this] { this->createLogicalDevice(); });
+
+	startup.run("allocator", [this] { this->allocator.init(this->device, this->physicalDevice); });
+
+	// Disk cache load and the transfer queue's pools don't touch the swapchain
+	startup.spawn("pipelines", [this] { this->pipelines.init(this->device, this->physicalDevice, pipelineCachePath); });
+
+	// Workers are up before anything requests a shader
+	startup.spawn("shaders", [this] { this->shaders.init(this->device, std::min(this->caps.props.apiVersion, this->instanceApiVersion), shaderCachePath, shaderCompiler); });
+
+	startup.spawn("uploader", [this] {
+		this->uploader.init(
+			this->device,
+			&this->allocator,
+			this->transferQueue,
+			this->transferFamily,
+			this->graphicsFamily,
+			(VkDeviceSize)stagingRingSize * 1024 * 1024
+		);
+	});
+
+	startup.run("createSwapChain", [this] { this->createSwapChain(); });
+
+	startup.run("createSwapChainImageViews", [this] { this->createSwapChainImageViews(); });
+
+	if (dynamicResolutionTarget > 0.0)
+	{
+		this->resolution.init(dynamicResolutionTarget, minResolutionScale, maxResolutionScale);
+
+		startup.run("createRenderTarget", [this] { this->createRenderTarget(); });
+	}
+
+	startup.run("createCommandPool", [this] { this->createCommandPool(); });
+
+	startup.run("createRenderPass", [this] { this->createRenderPass(); });
+
+	startup.run("createFramebuffers", [this] { this->createFramebuffers(); });
+
+	startup.run("createSemaphore", [this] { this->createSemaphore(); });
+
+	startup.run("createFence", [this] { this->createFence(); });
+
+	startup.run("createQueryPools", [this] { this->createQueryPools(); });
+
+	startup.spawn("compute", [this] {
+		this->compute.init(
+			this->device,
+			this->physicalDevice,
+			this->computeQueue,
+			this->computeFamily,
+			this->graphicsFamily,
+			this->frames.size(),
+			this->gpuTimestamps ? this->timestampPeriod : 0.0f
+		);
+	});
+
+	startup.spawn("recorder", [this] { this->recorder.init(this->device, this->graphicsFamily, this->frames.size(), &jobs); });
+
+	startup.run("graph", [this] {
+		this->graph.init(this->device, &this->allocator, this->frames.size());
+
+		this->graph.beginTimer = [this](VkCommandBuffer cmd, const char* name) { return this->beginGpuTimer(cmd, name); };
+		this->graph.endTimer = [this](VkCommandBuffer cmd, uint32_t timer) { this->endGpuTimer(cmd, timer); };
+	});
+
+	if (latencyTracking)
+	{
+		startup.run("latency", [this] { this->latency.init(this->device, this->presentWait); });
+	}
+
+	startup.run("capture", [this] { this->capture.init(this->device, &this->allocator, this->frames.size() + 3); });
+
+	// Everything below needs the uploader or the pipeline manager
+	startup.join();
+
+	startup.run("bindless", [this] {
+		this->bindless.init(this->device, this->physicalDevice, &this->allocator, &this->uploader, this->descriptorIndexing, this->frames.size());
+		this->descriptorPools.init(this->device, this->frames.size());
+	});
+
+	startup.run("streamer", [this] {
+		this->streamer.init(
+			this->device,
+			this->physicalDevice,
+			&this->allocator,
+			&this->uploader,
+			this->frames.size(),
+			this->memoryBudget,
+			(VkDeviceSize)textureBudget * 1024 * 1024
+		);
+	});
+
+	startup.run("sprites", [this] {
+		// Batches pick their texture from the table with a pushed index
+		if (!this->caps.features.shaderSampledImageArrayDynamicIndexing)
+		{
+			logger.log(LogSeverity::Warning, "renderer", 0, "shaderSampledImageArrayDynamicIndexing not supported, sprites disabled");
+			return;
+		}
+
+		this->sprites.init(
+			this->device,
+			&this->allocator,
+			&this->uploader,
+			&this->pipelines,
+			&this->shaders,
+			&this->bindless,
+			this->graph.colorPass(this->swapChainImageFormat),
+			this->frames.size(),
+			std::max(spriteCount, 65536u)
+		);
+	});
+
+	if (objectCount > 0)
+	{
+		startup.run("objects", [this] {
+			if (!this->drawIndirectFirstInstance)
+			{
+				logger.log(LogSeverity::Warning, "renderer", 0, "drawIndirectFirstInstance not supported, GPU culling disabled");
+				return;
+			}
+
+			this->objects.init(
+				this->device,
+				&this->allocator,
+				&this->uploader,
+				&this->pipelines,
+				&this->shaders,
+				&this->descriptorPools,
+				&this->compute,
+				this->graph.colorPass(this->swapChainImageFormat),
+				this->frames.size(),
+				objectCount,
+				this->drawIndexedIndirectCount,
+				this->multiDrawIndirect
+			);
+		});
+	}
+
+	startup.print();
+}
+
+void VulkanTest::clear(const glm::vec3& color)
+{
+	FrameData& frame = this->frames[this->currentFrame];
+
+	// Wait until the GPU is done with this frame's resources
+	vkWaitForFences(device, 1, &frame.inFlight, VK_TRUE, std::numeric_limits<uint64_t>::max());
+
+	if (latencyTracking)
+	{
+		this->latency.releaseFence(frame.inFlight);
+
+		// The newest input belongs to the first frame that starts after it
+		frame.startTime = std::chrono::steady_clock::now();
+		frame.inputTime = pendingInput.exchange(0);
+	}
+
+	this->readGpuTimers(frame);
+
+	// Recycle every buffer of this frame in one call
+	vkResetCommandPool(device, frame.commandPool, 0);
+	frame.commandBufferUsed = 0;
+	frame.commandBufferList.clear();
+
+	this->uploader.collect(this->frameCount, this->frames.size());
+
+	this->capture.collect(this->frameCount, this->frames.size());
+
+	this->streamer.update(this->frameCount);
+
+	this->compute.beginFrame(this->currentFrame);
+
+	this->recorder.beginFrame(this->currentFrame);
+
+	this->graph.reset(this->frameCount);
+
+	this->bindless.beginFrame(this->currentFrame, this->frameCount);
+	this->descriptorPools.beginFrame(this->currentFrame);
+
+	this->sprites.beginFrame(this->currentFrame);
+	this->objects.beginFrame(this->currentFrame);
+
+	this->destroyRetired(false);
+
+	this->applyRuntimeControls();
+
+	if (windowResized || this->swapChainDirty)
+	{
+		if (!this->recreateSwapChain())
+		{
+			// Minimized, nothing to render into
+			this->skipFrame = true;
+			return;
+		}
+	}
+
+	profiler.begin(PhaseAcquire);
+
+	if (surfaceMode == SurfaceMode::Offscreen)
+	{
+		// Nothing to acquire, the ring is only gated by the fences below
+		swapChainIndex = this->frameCount % this->swapChainImages.size();
+	}
+	else
+	{
+		VkResult r = vkAcquireNextImageKHR(
+			device,
+			swapChain,
+			std::numeric_limits<uint64_t>::max(),
+			frame.imageAvailable,
+			VK_NULL_HANDLE,
+			&swapChainIndex
+		);
+
+		// The semaphore is left unsignaled on failure, so it can be reused
+		while (r == VK_ERROR_OUT_OF_DATE_KHR)
+		{
+			if (!this->recreateSwapChain())
+			{
+				profiler.end(PhaseAcquire);
+				this->skipFrame = true;
+				return;
+			}
+
+			r = vkAcquireNextImageKHR(
+				device,
+				swapChain,
+				std::numeric_limits<uint64_t>::max(),
+				frame.imageAvailable,
+				VK_NULL_HANDLE,
+				&swapChainIndex
+			);
+		}
+
+		if (r == VK_SUBOPTIMAL_KHR)
+		{
+			// Still presentable, rebuild after this frame
+			this->swapChainDirty = true;
+		}
+		else if (r != VK_SUCCESS)
+		{
+			throw std::runtime_error("Failed to acquire swapchain image...");
+		}
+	}
+
+	// An older frame may still be rendering into this image
+	if (this->imagesInFlight[swapChainIndex] != VK_NULL_HANDLE)
+	{
+		vkWaitForFences(device, 1, &this->imagesInFlight[swapChainIndex], VK_TRUE, std::numeric_limits<uint64_t>::max());
+	}
+
+	this->imagesInFlight[swapChainIndex] = frame.inFlight;
+
+	profiler.end(PhaseAcquire);
+
+	// Recorded in present(), once every pass of the frame is known
+	if (this->dynamicResolution)
+	{
+		// Upscaled onto the acquired image after the graph, see recordUpscale
+		VkExtent2D extent = this->resolution.extent(this->swapChainExtent);
+
+		this->renderExtent.width = std::min(extent.width, this->renderTargetCapacity.width);
+		this->renderExtent.height = std::min(extent.height, this->renderTargetCapacity.height);
+
+		this->backbuffer = this->graph.importImage(
+			this->renderTarget,
+			this->renderTargetView,
+			this->renderTargetFormat,
+			this->renderExtent,
+			VK_IMAGE_LAYOUT_UNDEFINED,
+			VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+		);
+	}
+	else
+	{
+		this->renderExtent = this->swapChainExtent;
+
+		this->backbuffer = this->graph.importImage(
+			this->swapChainImages[swapChainIndex],
+			this->swapChainImageViews[swapChainIndex],
+			this->swapChainImageFormat,
+			this->swapChainExtent,
+			VK_IMAGE_LAYOUT_UNDEFINED,
+			this->presentLayout
+		);
+	}
+
+	this->graph.addPass("clear").clear(this->backbuffer, glm::vec4(color, 1.0f));
+}
+
+void VulkanTest::recordFrame()
+{
+	FrameData& frame = this->frames[this->currentFrame];
+
+	profiler.begin(PhaseRecord);
+
+	VkCommandBuffer cmd = VK_NULL_HANDLE;
+	uint32_t timer = UINT32_MAX;
+
+	if (this->gpuTimestamps)
+	{
+		cmd = this->beginCommand();
+		vkCmdResetQueryPool(cmd, frame.queryPool, 0, maxGpuTimers * 2);
+	}
+
+	const RenderGraphPass& first = this->graph.passes[0];
+
+	if (this->graph.passes.size() == 1 && !first.execute && first.uses.size() == 1 && !this->dynamicResolution)
+	{
+		// Nothing but the clear, the cached command buffer does it
+		if (this->gpuTimestamps)
+		{
+			timer = this->beginGpuTimer(cmd, "clear");
+			this->endCommand(cmd);
+		}
+
+		const VkClearColorValue& color = first.uses[0].clearValue;
+
+		frame.commandBufferList.push_back(
+			this->clearCommand(glm::vec3(color.float32[0], color.float32[1], color.float32[2]))
+		);
+
+		if (this->gpuTimestamps)
+		{
+			cmd = this->beginCommand();
+			this->endGpuTimer(cmd, timer);
+			this->endCommand(cmd);
+		}
+	}
+	else
+	{
+		if (cmd == VK_NULL_HANDLE)
+		{
+			cmd = this->beginCommand();
+		}
+
+		// The graph only tracks images, the cull runs on the compute queue
+		// and the submission waits for it before the draws
+		if (this->objects.pending)
+		{
+			this->objects.cull();
+			this->compute.submit();
+		}
+
+		// Timed per group, see init
+		this->graph.execute(cmd);
+
+		if (this->dynamicResolution)
+		{
+			timer = this->beginGpuTimer(cmd, "upscale");
+			this->recordUpscale(cmd);
+			this->endGpuTimer(cmd, timer);
+		}
+
+		this->endCommand(cmd);
+	}
+
+	profiler.end(PhaseRecord);
+}
+
+void VulkanTest::recordCapture()
+{
+	bool screenshot = screenshotRequested.exchange(false) || (screenshotFrame > 0 && this->frameCount + 1 == screenshotFrame);
+	bool stream = captureInterval > 0 && this->frameCount % captureInterval == 0;
+	bool keep = this->captureNext;
+
+	this->captureNext = false;
+
+	if (!screenshot && !stream && !keep)
+	{
+		return;
+	}
+
+	if (!this->swapChainReadable || !FrameCapture::supports(this->swapChainImageFormat))
+	{
+		if (screenshot || keep)
+		{
+			logger.log(LogSeverity::Warning, "renderer", 0, "Screenshot skipped, the swapchain can't be read back");
+		}
+
+		return;
+	}
+
+	std::string dir = captureDir.empty() ? "." : captureDir;
+	std::string name = screenshot ? "/screenshot_" : "/frame_";
+
+	std::string number = std::to_string(this->frameCount + 1);
+	number.insert(0, number.size() < 6 ? 6 - number.size() : 0, '0');
+
+	VkCommandBuffer cmd = this->beginCommand();
+
+	bool recorded = this->capture.record(
+		cmd,
+		this->swapChainImages[this->swapChainIndex],
+		this->presentLayout,
+		this->swapChainImageFormat,
+		this->swapChainExtent,
+		this->frameCount,
+		keep ? std::string() : dir + name + number
+	);
+
+	this->endCommand(cmd);
+
+	if (!recorded && (screenshot || keep))
+	{
+		logger.log(LogSeverity::Warning, "renderer", 0, "Screenshot skipped, every readback buffer is busy");
+	}
+}
+
+void VulkanTest::present()
+{
+	VkResult r;
+
+	if (this->skipFrame)
+	{
+		this->skipFrame = false;
+		return;
+	}
+
+	FrameData& frame = this->frames[this->currentFrame];
+
+	this->recordFrame();
+
+	frame.timedFrame = profiler.current.frame;
+	profiler.current.gpuPending = frame.timerCount > 0;
+
+	profiler.begin(PhaseSubmit);
+
+	vkResetFences(device, 1, &frame.inFlight);
+
+	std::vector<VkSemaphore> waitSemaphores;
+	std::vector<VkPipelineStageFlags> waitStages;
+
+	if (surfaceMode != SurfaceMode::Offscreen)
+	{
+		waitSemaphores.push_back(frame.imageAvailable);
+		waitStages.push_back(VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+	}
+
+	// Everything uploaded this frame is visible to it
+	this->uploader.flush();
+
+	bool computePending = this->compute.pending();
+
+	if (this->uploader.hasSubmitted() || computePending)
+	{
+		VkCommandBuffer cmd = this->allocCommandBuffer();
+
+		VkCommandBufferBeginInfo beginInfo = {};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+		vkBeginCommandBuffer(cmd, &beginInfo);
+		this->uploader.consume(cmd, waitSemaphores, waitStages, this->frameCount);
+		this->compute.consume(cmd, waitSemaphores, waitStages);
+		vkEndCommandBuffer(cmd);
+
+		// Ownership has to be acquired before anything reads the data
+		frame.commandBufferList.insert(frame.commandBufferList.begin(), cmd);
+	}
+
+	if (computePending)
+	{
+		VkCommandBuffer cmd = this->beginCommand();
+		this->compute.endGraphicsTimer(cmd);
+		this->endCommand(cmd);
+	}
+
+	this->recordCapture();
+
+	// Submit
+	VkSubmitInfo submitInfo = {};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+
+	submitInfo.commandBufferCount = frame.commandBufferList.size();
+	submitInfo.pCommandBuffers = frame.commandBufferList.data();
+
+	submitInfo.waitSemaphoreCount = waitSemaphores.size();
+	submitInfo.pWaitSemaphores = waitSemaphores.data();
+	submitInfo.pWaitDstStageMask = waitStages.data();
+
+	if (surfaceMode != SurfaceMode::Offscreen)
+	{
+		submitInfo.signalSemaphoreCount = 1;
+		submitInfo.pSignalSemaphores = &frame.renderFinish;
+	}
+
+	r = vkQueueSubmit(graphicsQueue, 1, &submitInfo, frame.inFlight);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to submit to graphics queue...");
+	}
+
+	profiler.end(PhaseSubmit);
+
+	LatencyFrame latencyFrame = {};
+
+	if (latencyTracking)
+	{
+		latencyFrame.start = frame.startTime;
+		latencyFrame.input = frame.inputTime;
+		latencyFrame.submit = std::chrono::steady_clock::now();
+		latencyFrame.fence = frame.inFlight;
+	}
+
+	if (surfaceMode == SurfaceMode::Offscreen)
+	{
+		if (latencyTracking)
+		{
+			this->latency.submitted(latencyFrame);
+		}
+
+		this->currentFrame = (this->currentFrame + 1) % this->frames.size();
+		this->frameCount++;
+		return;
+	}
+
+	// Present
+	VkPresentInfoKHR presentInfo = {};
+	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+	
+	presentInfo.waitSemaphoreCount = 1;
+	presentInfo.pWaitSemaphores = &frame.renderFinish;
+
+	presentInfo.swapchainCount = 1;
+	presentInfo.pSwapchains = &this->swapChain;
+	presentInfo.pImageIndices = &this->swapChainIndex;
+
+	VkPresentIdKHR presentIdInfo = {};
+
+	if (this->presentWait)
+	{
+		latencyFrame.presentId = ++this->presentId;
+		latencyFrame.swapChain = this->swapChain;
+		latencyFrame.fence = VK_NULL_HANDLE;
+
+		presentIdInfo.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+		presentIdInfo.swapchainCount = 1;
+		presentIdInfo.pPresentIds = &latencyFrame.presentId;
+
+		presentInfo.pNext = &presentIdInfo;
+	}
+
+	profiler.begin(PhasePresent);
+
+	r = vkQueuePresentKHR(this->presentQueue, &presentInfo);
+
+	profiler.end(PhasePresent);
+
+	if (latencyTracking)
+	{
+		this->latency.submitted(latencyFrame);
+	}
+
+	if (r == VK_ERROR_OUT_OF_DATE_KHR || r == VK_SUBOPTIMAL_KHR)
+	{
+		this->swapChainDirty = true;
+	}
+	else if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to present swapchain image...");
+	}
+
+	this->currentFrame = (this->currentFrame + 1) % this->frames.size();
+	this->frameCount++;
+}
+
+void VulkanTest::release()
+{
+	vkDeviceWaitIdle(device);
+
+	if (latencyTracking)
+	{
+		this->latency.release();
+	}
+
+	this->capture.release();
+
+	for (auto& frame : this->frames)
+	{
+		this->readGpuTimers(frame);
+
+		if (frame.queryPool != VK_NULL_HANDLE)
+		{
+			vkDestroyQueryPool(device, frame.queryPool, nullptr);
+		}
+
+		vkDestroyFence(device, frame.inFlight, nullptr);
+
+		vkDestroySemaphore(device, frame.renderFinish, nullptr);
+		vkDestroySemaphore(device, frame.imageAvailable, nullptr);
+
+		vkDestroyCommandPool(this->device, frame.commandPool, nullptr);
+	}
+
+	for (uint32_t i = 0; i < this->clearFramebuffers.size(); i++)
+	{
+		vkDestroyFramebuffer(this->device, this->clearFramebuffers[i], nullptr);
+	}
+
+	this->pipelines.release();
+
+	this->uploader.release();
+
+	this->compute.release();
+
+	this->recorder.release();
+
+	this->graph.release();
+
+	this->sprites.release();
+
+	this->objects.release();
+
+	// After the pipeline workers, which may still have been using the modules
+	this->shaders.release();
+
+	// The sprites' sets are gone with their pool, nothing points at the views
+	this->streamer.release();
+
+	this->descriptorPools.release();
+	this->bindless.release();
+
+	vkDestroyRenderPass(this->device, this->clearRenderPass, nullptr);
+
+	this->releaseClearCommandCache();
+
+	this->destroyRetired(true);
+
+	vkDestroyCommandPool(this->device, this->commandPool, nullptr);
+
+	if (dynamicResolutionTarget > 0.0)
+	{
+		this->resolution.printStats();
+		this->destroyRenderTarget(false);
+	}
+
+	for (auto imageView : this->swapChainImageViews)
+	{
+		vkDestroyImageView(device, imageView, nullptr);
+	}
+
+	if (surfaceMode == SurfaceMode::Offscreen)
+	{
+		for (uint32_t i = 0; i < this->swapChainImages.size(); i++)
+		{
+			this->allocator.destroyImage(this->swapChainImages[i], this->offscreenMemory[i]);
+		}
+	}
+	else
+	{
+		vkDestroySwapchainKHR(device, swapChain, nullptr);
+	}
+
+	this->allocator.printStats();
+	this->allocator.release();
+
+	vkDestroyDevice(device, nullptr);
+
+	if (surface != VK_NULL_HANDLE)
+	{
+		vkDestroySurfaceKHR(instance, surface, nullptr);
+	}
+
+	if (this->debugMessenger != VK_NULL_HANDLE)
+	{
+		auto debugDestroy = (PFN_vkDestroyDebugUtilsMessengerEXT)vkGetInstanceProcAddr(this->instance, "vkDestroyDebugUtilsMessengerEXT");
+		debugDestroy(instance, this->debugMessenger, nullptr);
+	}
+
+	vkDestroyInstance(instance, nullptr);
+
+	logger.release();
+}
+
+// May run on any thread the driver or layer calls from
+static VkBool32 VKAPI_CALL _debugCallback(
+	VkDebugUtilsMessageSeverityFlagBitsEXT			severity,
+	VkDebugUtilsMessageTypeFlagsEXT					types,
+	const VkDebugUtilsMessengerCallbackDataEXT*		data,
+	void*)
+{
+	LogSeverity level = LogSeverity::Verbose;
+
+	if (severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT)
+	{
+		level = LogSeverity::Error;
+	}
+	else if (severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT)
+	{
+		level = LogSeverity::Warning;
+	}
+	else if (severity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT)
+	{
+		level = LogSeverity::Info;
+	}
+
+	const char* source = (types & VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT) ? "performance" : "validation";
+
+	logger.log(level, source, data->messageIdNumber, data->pMessage);
+
+	return VK_FALSE;
+}
+
+// Every severity, the logger filters so the level can change at runtime
+static VkDebugUtilsMessengerCreateInfoEXT debugMessengerInfo()
+{
+	VkDebugUtilsMessengerCreateInfoEXT debugInfo = {};
+	debugInfo.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
+	debugInfo.messageSeverity =
+		VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT |
+		VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT |
+		VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT |
+		VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+	debugInfo.messageType =
+		VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT |
+		VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT |
+		VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
+	debugInfo.pfnUserCallback = _debugCallback;
+
+	return debugInfo;
+}
+
+void VulkanTest::createInstance()
+{
+	VkApplicationInfo appInfo = {};
+	appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+	appInfo.pApplicationName = caption.c_str();
+	appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
+	appInfo.pEngineName = caption.c_str();
+	appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
+	appInfo.apiVersion = this->instanceApiVersion;
+
+	VkInstanceCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+	createInfo.pApplicationInfo = &appInfo;
+
+	std::vector<const char*> layers;
+	std::vector<const char*> extensions;
+
+	// Layers, only when installed; a missing layer must not fail startup
+	if (validationLayer)
+	{
+		uint32_t layerCount = 0;
+		vkEnumerateInstanceLayerProperties(&layerCount, nullptr);
+
+		std::vector<VkLayerProperties> available(layerCount);
+		vkEnumerateInstanceLayerProperties(&layerCount, available.data());
+
+		for (const auto& layer : available)
+		{
+			if (strcmp(layer.layerName, "VK_LAYER_KHRONOS_validation") == 0)
+			{
+				this->useLayer = true;
+			}
+		}
+
+		if (this->useLayer)
+		{
+			layers.push_back("VK_LAYER_KHRONOS_validation");
+			extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+		}
+		else
+		{
+			logger.log(LogSeverity::Warning, "renderer", 0, "VK_LAYER_KHRONOS_validation not installed, running without validation");
+		}
+	}
+
+	if (surfaceMode == SurfaceMode::Window)
+	{
+#ifdef _WIN32
+		extensions.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
+		extensions.push_back(VK_KHR_WIN32_SURFACE_EXTENSION_NAME);
+#else
+		unsigned int count = 0;
+		SDL_Vulkan_GetInstanceExtensions(window, &count, nullptr);
+		std::vector<const char*> windowExtensions(count);
+		SDL_Vulkan_GetInstanceExtensions(window, &count, windowExtensions.data());
+		extensions.insert(extensions.end(), windowExtensions.begin(), windowExtensions.end());
+#endif
+	}
+	else if (surfaceMode == SurfaceMode::Headless)
+	{
+		extensions.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
+		extensions.push_back(VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME);
+	}
+
+
+	if (layers.size() > 0)
+	{
+		createInfo.enabledLayerCount = layers.size();
+		createInfo.ppEnabledLayerNames = layers.data();
+	}
+
+	if (extensions.size() > 0)
+	{
+		createInfo.enabledExtensionCount = extensions.size();
+		createInfo.ppEnabledExtensionNames = extensions.data();
+	}
+
+	// Also catches messages from vkCreateInstance and vkDestroyInstance
+	VkDebugUtilsMessengerCreateInfoEXT debugInfo = debugMessengerInfo();
+
+	if (this->useLayer)
+	{
+		createInfo.pNext = &debugInfo;
+	}
+
+	VkResult result = vkCreateInstance(&createInfo, nullptr, &instance);
+
+	if (result != VK_SUCCESS)
+	{
+		throw std::runtime_error("failed to create instance!");
+	}
+}
+
+void VulkanTest::createDebugMessenger()
+{
+	VkDebugUtilsMessengerCreateInfoEXT debugInfo = debugMessengerInfo();
+
+	auto func = (PFN_vkCreateDebugUtilsMessengerEXT)vkGetInstanceProcAddr(instance, "vkCreateDebugUtilsMessengerEXT");
+
+	if (func != nullptr)
+	{
+		VkResult r = func(instance, &debugInfo, nullptr, &this->debugMessenger);
+
+		if (r != VK_SUCCESS)
+		{
+			throw std::runtime_error("Didn't create debug messenger.");
+		}
+	}
+}
+
+void VulkanTest::createSurface()
+{
+	if (surfaceMode == SurfaceMode::Offscreen)
+	{
+		this->surface = VK_NULL_HANDLE;
+		return;
+	}
+
+	if (surfaceMode == SurfaceMode::Headless)
+	{
+		VkHeadlessSurfaceCreateInfoEXT createInfo = {};
+		createInfo.sType = VK_STRUCTURE_TYPE_HEADLESS_SURFACE_CREATE_INFO_EXT;
+
+		auto func = (PFN_vkCreateHeadlessSurfaceEXT)vkGetInstanceProcAddr(instance, "vkCreateHeadlessSurfaceEXT");
+
+		if (func == nullptr || func(instance, &createInfo, nullptr, &this->surface) != VK_SUCCESS)
+		{
+			throw std::runtime_error("Headless surface wasn't created");
+		}
+
+		return;
+	}
+
+#ifndef _WIN32
+	if (!SDL_Vulkan_CreateSurface(window, instance, &this->surface))
+	{
+		throw std::runtime_error("Surface wasn't created");
+	}
+#else
+	SDL_SysWMinfo info;
+	SDL_VERSION(&info.version);
+	SDL_GetWindowWMInfo(window, &info);
+
+	VkWin32SurfaceCreateInfoKHR createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_WIN32_SURFACE_CREATE_INFO_KHR;
+	createInfo.hinstance = info.info.win.hinstance;
+	createInfo.hwnd = info.info.win.window;
+
+	auto func = (PFN_vkCreateWin32SurfaceKHR)vkGetInstanceProcAddr(instance, "vkCreateWin32SurfaceKHR");
+
+	if (func != nullptr)
+	{
+		VkResult r = func(instance, &createInfo, nullptr, &this->surface);
+
+		if (r != VK_SUCCESS)
+		{
+			throw std::runtime_error("Surface wasn't created");
+		}
+	}
+	else
+	{
+		throw std::runtime_error("Vulkan surface wasn't create due to extensions");
+	}
+#endif
+}
+
+void VulkanTest::createPhysicalDevice()
+{
+	uint32_t deviceCount = 0;
+	vkEnumeratePhysicalDevices(instance, &deviceCount, nullptr);
+
+	if (deviceCount == 0)
+	{
+		throw std::runtime_error("Failed to find GPUs with Vulkan support!");
+	}
+
+	std::vector<VkPhysicalDevice> devices(deviceCount);
+	vkEnumeratePhysicalDevices(instance, &deviceCount, devices.data());
+
+	if (deviceCachePath.size() > 0 && this->loadDeviceCache(devices))
+	{
+		this->physicalDevice = this->caps.physicalDevice;
+	}
+	else
+	{
+		// Highest score wins, ties keep enumeration order
+		for (const auto& device : devices)
+		{
+			DeviceCapabilities candidate = this->queryCapabilities(device, true);
+
+			if (candidate.score > this->caps.score)
+			{
+				this->caps = candidate;
+			}
+		}
+
+		if (this->caps.physicalDevice == VK_NULL_HANDLE)
+		{
+			throw std::runtime_error("Failed to find a suitable GPU!");
+		}
+
+		this->physicalDevice = this->caps.physicalDevice;
+
+		if (deviceCachePath.size() > 0)
+		{
+			this->saveDeviceCache(deviceCount);
+		}
+	}
+
+	logger.log(LogSeverity::Info, "renderer", 0, ("Using " + std::string(this->caps.props.deviceName) + (this->caps.cached ? " (cached)" : "")).c_str());
+}
+
+DeviceCapabilities VulkanTest::queryCapabilities(VkPhysicalDevice device, bool scanQueues)
+{
+	DeviceCapabilities caps;
+	caps.physicalDevice = device;
+
+	vkGetPhysicalDeviceProperties(device, &caps.props);
+	vkGetPhysicalDeviceFeatures(device, &caps.features);
+	vkGetPhysicalDeviceMemoryProperties(device, &caps.memProps);
+
+	uint32_t queueFamilyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, nullptr);
+
+	caps.queueFamilies.resize(queueFamilyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, caps.queueFamilies.data());
+
+	uint32_t extensionCount = 0;
+	vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
+
+	std::vector<VkExtensionProperties> extensions(extensionCount);
+	vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, extensions.data());
+
+	for (const auto& extension : extensions)
+	{
+		caps.extensions.insert(extension.extensionName);
+	}
+
+	if (!scanQueues)
+	{
+		return caps;
+	}
+
+	caps.queues = this->findQueueFamilies(device);
+
+	// Zero score is unusable
+	if (!caps.queues.isCompete())
+	{
+		return caps;
+	}
+
+	if (surfaceMode != SurfaceMode::Offscreen && !caps.hasExtension(VK_KHR_SWAPCHAIN_EXTENSION_NAME))
+	{
+		return caps;
+	}
+
+	switch (caps.props.deviceType)
+	{
+	case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+		caps.score = 1000000;
+		break;
+	case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+		caps.score = 100000;
+		break;
+	case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+		caps.score = 10000;
+		break;
+	default:
+		caps.score = 1000;
+		break;
+	}
+
+	// Then device local memory in MiB, then the extra queues
+	for (uint32_t i = 0; i < caps.memProps.memoryHeapCount; i++)
+	{
+		if (caps.memProps.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+		{
+			caps.score += std::min<VkDeviceSize>(caps.memProps.memoryHeaps[i].size >> 20, 65535) * 10;
+		}
+	}
+
+	if (caps.queues.transferFamily != caps.queues.graphicsFamily)
+	{
+		caps.score += 2;
+	}
+
+	if (caps.queues.computeFamily != caps.queues.graphicsFamily)
+	{
+		caps.score += 2;
+	}
+
+	return caps;
+}
+
+bool VulkanTest::loadDeviceCache(const std::vector<VkPhysicalDevice>& devices)
+{
+	std::ifstream in(deviceCachePath, std::ios::binary);
+
+	if (!in.is_open())
+	{
+		return false;
+	}
+
+	DeviceCacheEntry entry = {};
+	in.read((char*)&entry, sizeof(entry));
+
+	if (!in.good() || entry.magic != 0x43564544 || entry.version != 1 || entry.deviceCount != devices.size() || entry.surfaceMode != (uint32_t)surfaceMode)
+	{
+		return false;
+	}
+
+	for (const auto& device : devices)
+	{
+		VkPhysicalDeviceProperties props;
+		vkGetPhysicalDeviceProperties(device, &props);
+
+		bool match =
+			props.vendorID == entry.vendorID &&
+			props.deviceID == entry.deviceID &&
+			props.driverVersion == entry.driverVersion &&
+			std::memcmp(props.pipelineCacheUUID, entry.uuid, VK_UUID_SIZE) == 0;
+
+		if (!match)
+		{
+			continue;
+		}
+
+		DeviceCapabilities caps = this->queryCapabilities(device, false);
+
+		uint32_t families[] = { entry.graphicsFamily, entry.presentFamily, entry.transferFamily, entry.computeFamily };
+
+		for (uint32_t family : families)
+		{
+			if (family >= caps.queueFamilies.size())
+			{
+				return false;
+			}
+		}
+
+		// The surface is new every run, only its support is asked again
+		if (surfaceMode != SurfaceMode::Offscreen)
+		{
+			VkBool32 presentSupport = false;
+			vkGetPhysicalDeviceSurfaceSupportKHR(device, entry.presentFamily, this->surface, &presentSupport);
+
+			if (!presentSupport)
+			{
+				return false;
+			}
+		}
+
+		caps.queues.graphicsFamily = entry.graphicsFamily;
+		caps.queues.presentFamily = entry.presentFamily;
+		caps.queues.transferFamily = entry.transferFamily;
+		caps.queues.computeFamily = entry.computeFamily;
+		caps.score = 1;
+		caps.cached = true;
+
+		this->caps = caps;
+
+		return true;
+	}
+
+	return false;
+}
+
+void VulkanTest::saveDeviceCache(uint32_t deviceCount)
+{
+	DeviceCacheEntry entry = {};
+	entry.magic = 0x43564544;
+	entry.version = 1;
+	entry.vendorID = this->caps.props.vendorID;
+	entry.deviceID = this->caps.props.deviceID;
+	entry.driverVersion = this->caps.props.driverVersion;
+	std::memcpy(entry.uuid, this->caps.props.pipelineCacheUUID, VK_UUID_SIZE);
+	entry.deviceCount = deviceCount;
+	entry.surfaceMode = (uint32_t)surfaceMode;
+	entry.graphicsFamily = this->caps.queues.graphicsFamily.value();
+	entry.presentFamily = this->caps.queues.presentFamily.value();
+	entry.transferFamily = this->caps.queues.transferFamily.value();
+	entry.computeFamily = this->caps.queues.computeFamily.value();
+
+	// Same write-then-rename as the pipeline cache
+	std::string tmpPath = deviceCachePath + ".tmp";
+
+	{
+		std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+
+		if (!out.is_open())
+		{
+			return;
+		}
+
+		out.write((const char*)&entry, sizeof(entry));
+	}
+
+	std::rename(tmpPath.c_str(), deviceCachePath.c_str());
+}
+
+QueueFamilyIndices VulkanTest::findQueueFamilies(VkPhysicalDevice device)
+{
+	QueueFamilyIndices indices;
+
+	uint32_t queueFamilyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, nullptr);
+
+	std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, queueFamilies.data());
+
+	// Best transfer family so far, a family without compute is a DMA engine
+	int32_t transferScore = -1;
+
+	int i = 0;
+	for (const auto& queueFamily : queueFamilies)
+	{
+		if (queueFamily.queueCount > 0 && queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT && !indices.graphicsFamily.has_value())
+		{
+			indices.graphicsFamily = i;
+		}
+
+		if (queueFamily.queueCount > 0 && (queueFamily.queueFlags & VK_QUEUE_TRANSFER_BIT) && !(queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT))
+		{
+			int32_t score = (queueFamily.queueFlags & VK_QUEUE_COMPUTE_BIT) ? 0 : 1;
+
+			if (score > transferScore)
+			{
+				indices.transferFamily = i;
+				transferScore = score;
+			}
+		}
+
+		if (queueFamily.queueCount > 0 && (queueFamily.queueFlags & VK_QUEUE_COMPUTE_BIT) && !(queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) && !indices.computeFamily.has_value())
+		{
+			indices.computeFamily = i;
+		}
+
+		VkBool32 presentSupport = false;
+
+		if (surfaceMode == SurfaceMode::Offscreen)
+		{
+			// Frames never leave the graphics queue
+			presentSupport = (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0;
+		}
+		else
+		{
+			vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+		}
+
+		if (queueFamily.queueCount > 0 && presentSupport && !indices.presentFamily.has_value())
+		{
+			indices.presentFamily = i;
+		}
+
+		i++;
+	}
+
+	if (!indices.transferFamily.has_value())
+	{
+		// Graphics queues can always transfer
+		indices.transferFamily = indices.graphicsFamily;
+	}
+
+	if (!indices.computeFamily.has_value())
+	{
+		// Graphics queues can always dispatch
+		indices.computeFamily = indices.graphicsFamily;
+	}
+
+	return indices;
+}
+
+void VulkanTest::createLogicalDevice()
+{
+	const QueueFamilyIndices& indices = this->caps.queues;
+
+	std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
+	std::set<uint32_t> uniqueQueueFamilies = {
+		indices.graphicsFamily.value(),
+		indices.presentFamily.value(),
+		indices.transferFamily.value(),
+		indices.computeFamily.value()
+	};
+
+	float queuePriority = 1.0f;
+
+	for (uint32_t queueFamily : uniqueQueueFamilies)
+	{
+		VkDeviceQueueCreateInfo queueCreateInfo = {};
+		queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+		queueCreateInfo.queueFamilyIndex = queueFamily;
+		queueCreateInfo.queueCount = 1;
+		queueCreateInfo.pQueuePriorities = &queuePriority;
+		queueCreateInfos.push_back(queueCreateInfo);
+	}
+
+	VkPhysicalDeviceFeatures deviceFeatures = {};
+
+	// GPU culling, one indirect command per object indexed by firstInstance
+	deviceFeatures.multiDrawIndirect = this->caps.features.multiDrawIndirect;
+	deviceFeatures.drawIndirectFirstInstance = this->caps.features.drawIndirectFirstInstance;
+
+	// Sprites index the bindless texture array with a push constant
+	deviceFeatures.shaderSampledImageArrayDynamicIndexing = this->caps.features.shaderSampledImageArrayDynamicIndexing;
+
+	this->multiDrawIndirect = deviceFeatures.multiDrawIndirect;
+	this->drawIndirectFirstInstance = deviceFeatures.drawIndirectFirstInstance;
+
+	VkDeviceCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+	createInfo.pQueueCreateInfos = queueCreateInfos.data();
+	createInfo.queueCreateInfoCount = queueCreateInfos.size();
+
+	createInfo.pEnabledFeatures = &deviceFeatures;
+
+	// Device layers are deprecated, the instance layer covers the device
+	std::vector<const char*> extensions;
+
+	// Descriptor indexing, core in 1.2, the extension on 1.1 drivers
+	bool indexingExtension = this->caps.hasExtension(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+	bool indexingCore = this->caps.props.apiVersion >= VK_API_VERSION_1_2;
+
+	VkPhysicalDeviceDescriptorIndexingFeatures indexing = {};
+	indexing.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES;
+
+	if (bindlessDescriptors && (indexingCore || indexingExtension))
+	{
+		VkPhysicalDeviceFeatures2 features = {};
+		features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+		features.pNext = &indexing;
+
+		vkGetPhysicalDeviceFeatures2(this->physicalDevice, &features);
+
+		this->descriptorIndexing =
+			indexing.runtimeDescriptorArray &&
+			indexing.descriptorBindingPartiallyBound &&
+			indexing.descriptorBindingUpdateUnusedWhilePending &&
+			indexing.descriptorBindingSampledImageUpdateAfterBind &&
+			indexing.descriptorBindingStorageBufferUpdateAfterBind &&
+			indexing.shaderSampledImageArrayNonUniformIndexing &&
+			indexing.shaderStorageBufferArrayNonUniformIndexing;
+	}
+
+	if (this->descriptorIndexing)
+	{
+		// Only what the table uses
+		VkPhysicalDeviceDescriptorIndexingFeatures supported = indexing;
+
+		indexing = {};
+		indexing.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES;
+		indexing.runtimeDescriptorArray = supported.runtimeDescriptorArray;
+		indexing.descriptorBindingPartiallyBound = supported.descriptorBindingPartiallyBound;
+		indexing.descriptorBindingUpdateUnusedWhilePending = supported.descriptorBindingUpdateUnusedWhilePending;
+		indexing.descriptorBindingSampledImageUpdateAfterBind = supported.descriptorBindingSampledImageUpdateAfterBind;
+		indexing.descriptorBindingStorageBufferUpdateAfterBind = supported.descriptorBindingStorageBufferUpdateAfterBind;
+		indexing.shaderSampledImageArrayNonUniformIndexing = supported.shaderSampledImageArrayNonUniformIndexing;
+		indexing.shaderStorageBufferArrayNonUniformIndexing = supported.shaderStorageBufferArrayNonUniformIndexing;
+
+		createInfo.pNext = &indexing;
+
+		if (!indexingCore)
+		{
+			extensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+		}
+	}
+
+	// Present id / wait, only worth it when latency is measured
+	VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures = {};
+	presentIdFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+
+	VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures = {};
+	presentWaitFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+
+	bool presentWaitExtensions =
+		this->caps.hasExtension(VK_KHR_PRESENT_ID_EXTENSION_NAME) &&
+		this->caps.hasExtension(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+
+	if (latencyTracking && surfaceMode != SurfaceMode::Offscreen && presentWaitExtensions)
+	{
+		presentIdFeatures.pNext = &presentWaitFeatures;
+
+		VkPhysicalDeviceFeatures2 features = {};
+		features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+		features.pNext = &presentIdFeatures;
+
+		vkGetPhysicalDeviceFeatures2(this->physicalDevice, &features);
+
+		this->presentWait = presentIdFeatures.presentId && presentWaitFeatures.presentWait;
+	}
+
+	if (this->presentWait)
+	{
+		// In front of whatever is chained already
+		presentIdFeatures = {};
+		presentIdFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+		presentIdFeatures.presentId = VK_TRUE;
+		presentIdFeatures.pNext = &presentWaitFeatures;
+
+		presentWaitFeatures = {};
+		presentWaitFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+		presentWaitFeatures.presentWait = VK_TRUE;
+		presentWaitFeatures.pNext = (void*)createInfo.pNext;
+
+		createInfo.pNext = &presentIdFeatures;
+
+		extensions.push_back(VK_KHR_PRESENT_ID_EXTENSION_NAME);
+		extensions.push_back(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+	}
+
+	if (surfaceMode != SurfaceMode::Offscreen)
+	{
+		extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+	}
+
+	// Only a query, the texture streamer sizes itself from it
+	this->memoryBudget = this->caps.hasExtension(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+
+	if (this->memoryBudget)
+	{
+		extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+	}
+
+	// Lets the cull pass decide how many draws the GPU issues
+	this->drawIndirectCount = objectCount > 0 && this->caps.hasExtension(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+
+	if (this->drawIndirectCount)
+	{
+		extensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+	}
+
+	if (extensions.size() > 0)
+	{
+		createInfo.enabledExtensionCount = extensions.size();
+		createInfo.ppEnabledExtensionNames = extensions.data();
+	}
+
+	VkResult r = vkCreateDevice(physicalDevice, &createInfo, nullptr, &device);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to create logical device!");
+	}
+
+	if (this->drawIndirectCount)
+	{
+		this->drawIndexedIndirectCount = (PFN_vkCmdDrawIndexedIndirectCountKHR)vkGetDeviceProcAddr(this->device, "vkCmdDrawIndexedIndirectCountKHR");
+	}
+
+	vkGetDeviceQueue(this->device, indices.graphicsFamily.value(), 0, &this->graphicsQueue);
+	vkGetDeviceQueue(this->device, indices.presentFamily.value(), 0, &this->presentQueue);
+	vkGetDeviceQueue(this->device, indices.transferFamily.value(), 0, &this->transferQueue);
+	vkGetDeviceQueue(this->device, indices.computeFamily.value(), 0, &this->computeQueue);
+
+	this->graphicsFamily = indices.graphicsFamily.value();
+	this->transferFamily = indices.transferFamily.value();
+	this->computeFamily = indices.computeFamily.value();
+
+	if (this->transferFamily != this->graphicsFamily)
+	{
+		logger.log(LogSeverity::Info, "renderer", 0, ("Using dedicated transfer queue family " + std::to_string(this->transferFamily)).c_str());
+	}
+
+	if (this->computeFamily != this->graphicsFamily)
+	{
+		logger.log(LogSeverity::Info, "renderer", 0, ("Using async compute queue family " + std::to_string(this->computeFamily)).c_str());
+	}
+
+	if (!this->descriptorIndexing)
+	{
+		logger.log(LogSeverity::Info, "renderer", 0, "Descriptor indexing not used, per-frame descriptor tables");
+	}
+}
+
+void VulkanTest::createSwapChain()
+{
+	if (surfaceMode == SurfaceMode::Offscreen)
+	{
+		this->createOffscreenImages();
+		return;
+	}
+
+	SwapChainSupportDetails swapChainSupport = this->querySwapChainSupport(physicalDevice);
+	VkSurfaceFormatKHR surfaceFormat = this->chooseSwapSurfaceFormat(swapChainSupport.formats);
+	VkPresentModeKHR presentMode = this->chooseSwapPresentMode(swapChainSupport.presentModes);
+	VkExtent2D extent = this->chooseSwapExtent(swapChainSupport.caps);
+
+	uint32_t imageCount = swapImageCount > 0 ? swapImageCount : swapChainSupport.caps.minImageCount + 1;
+
+	imageCount = std::max(imageCount, swapChainSupport.caps.minImageCount);
+
+	if (swapChainSupport.caps.maxImageCount > 0 && imageCount > swapChainSupport.caps.maxImageCount)
+	{
+		imageCount = swapChainSupport.caps.maxImageCount;
+	}
+
+	VkSwapchainCreateInfoKHR createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
+	createInfo.surface = surface;
+	createInfo.minImageCount = imageCount;
+	createInfo.imageFormat = surfaceFormat.format;
+	createInfo.imageColorSpace = surfaceFormat.colorSpace;
+	createInfo.imageExtent = extent;
+	createInfo.imageArrayLayers = 1;
+	createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+
+	// Lets screenshots and capture copy straight out of the presented image
+	this->swapChainReadable = (swapChainSupport.caps.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT) != 0;
+
+	if (this->swapChainReadable)
+	{
+		createInfo.imageUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	}
+
+	// Dynamic resolution blits the scene onto the acquired image
+	this->swapChainBlitTarget = (swapChainSupport.caps.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT) != 0;
+
+	if (dynamicResolutionTarget > 0.0 && this->swapChainBlitTarget)
+	{
+		createInfo.imageUsage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	}
+
+	const QueueFamilyIndices& indices = this->caps.queues;
+
+	std::vector<uint32_t> queueFams = {
+		indices.graphicsFamily.value(),
+		indices.presentFamily.value()
+	};
+
+	if (indices.graphicsFamily.value() != indices.presentFamily.value())
+	{
+		createInfo.imageSharingMode = VK_SHARING_MODE_CONCURRENT;
+		createInfo.queueFamilyIndexCount = queueFams.size();
+		createInfo.pQueueFamilyIndices = queueFams.data();
+		logger.log(LogSeverity::Verbose, "renderer", 0, "Concurrent Mode");
+	}
+	else
+	{
+		createInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		logger.log(LogSeverity::Verbose, "renderer", 0, "Exclusive Mode");
+	}
+
+	createInfo.preTransform = swapChainSupport.caps.currentTransform;
+	
+	createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+	
+	createInfo.presentMode = presentMode;
+	createInfo.clipped = VK_TRUE;
+
+	logger.log(LogSeverity::Verbose, "renderer", 0, ("Present mode " + std::to_string(presentMode) + ", " + std::to_string(imageCount) + " images").c_str());
+
+	createInfo.oldSwapchain = this->swapChain;
+
+	VkResult r = vkCreateSwapchainKHR(device, &createInfo, nullptr, &this->swapChain);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("Swapchain failed to create...");
+	}
+
+
+	uint32_t count = 0;
+	vkGetSwapchainImagesKHR(this->device, this->swapChain, &count, nullptr);
+	swapChainImages.resize(count);
+	vkGetSwapchainImagesKHR(this->device, this->swapChain, &count, this->swapChainImages.data());
+
+	this->swapChainImageFormat = surfaceFormat.format;
+	this->swapChainExtent = extent;
+
+
+}
+
+bool VulkanTest::recreateSwapChain()
+{
+	auto start = std::chrono::steady_clock::now();
+
+	windowResized = false;
+
+	if (surfaceMode == SurfaceMode::Window)
+	{
+		VkSurfaceCapabilitiesKHR caps;
+		vkGetPhysicalDeviceSurfaceCapabilitiesKHR(this->physicalDevice, this->surface, &caps);
+
+		if (caps.currentExtent.width == 0 || caps.currentExtent.height == 0 || width == 0 || height == 0)
+		{
+			return false;
+		}
+	}
+
+	VkFormat format = this->swapChainImageFormat;
+
+	// Moves the old views, framebuffers and cached clears aside and keeps
+	// the old swapchain handle so it can be passed as oldSwapchain
+	this->retireSwapChain();
+
+	this->createSwapChain();
+
+	if (this->swapChainImageFormat != format)
+	{
+		// Render passes depend on the format only, this is rare enough
+		// to pay for a full wait
+		vkDeviceWaitIdle(device);
+
+			vkDestroyRenderPass(this->device, this->clearRenderPass, nullptr);
+
+		this->createRenderPass();
+
+		// Pipelines of the old format don't fit the graph's new passes,
+		// compile the new ones now instead of dropping the next frames' draws
+		VkRenderPass colorPass = this->graph.colorPass(this->swapChainImageFormat);
+
+		if (this->sprites.enabled)
+		{
+			this->sprites.requestPipelines(colorPass, 0);
+
+			for (auto handle : this->sprites.pipelineHandles)
+			{
+				this->pipelines.wait(handle);
+			}
+		}
+
+		if (this->objects.enabled)
+		{
+			this->objects.requestPipelines(colorPass, 0);
+			this->pipelines.wait(this->objects.drawPipeline);
+		}
+	}
+
+	this->createSwapChainImageViews();
+
+	if (dynamicResolutionTarget > 0.0)
+	{
+		this->createRenderTarget();
+	}
+
+	this->createFramebuffers();
+
+	this->imagesInFlight.assign(this->swapChainImages.size(), VK_NULL_HANDLE);
+
+	this->swapChainDirty = false;
+
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	std::ostringstream text;
+	text << "Swapchain recreated " << swapChainExtent.width << "x" << swapChainExtent.height << " in " << ms << "ms";
+
+	logger.log(LogSeverity::Info, "renderer", 0, text.str().c_str());
+
+	return true;
+}
+
+void VulkanTest::retireSwapChain()
+{
+	RetiredSwapChain retired;
+	retired.frame = this->frameCount;
+
+	retired.swapChain = this->swapChain;
+	retired.imageViews = std::move(this->swapChainImageViews);
+
+	retired.framebuffers = std::move(this->clearFramebuffers);
+
+	// A recreated view may get the same handle, the graph must not find these
+	for (auto imageView : retired.imageViews)
+	{
+		this->graph.forgetView(imageView, retired.framebuffers);
+	}
+
+	if (surfaceMode == SurfaceMode::Offscreen)
+	{
+		retired.images = std::move(this->swapChainImages);
+		retired.memory = std::move(this->offscreenMemory);
+	}
+
+	// Cached clears point at the old framebuffers and may still be pending
+	for (auto& entry : this->clearCommandCache)
+	{
+		retired.commandBuffers.push_back(entry.second.commandBuffer);
+	}
+
+	this->clearCommandCache.clear();
+
+	this->swapChainImageViews.clear();
+	this->clearFramebuffers.clear();
+	this->swapChainImages.clear();
+	this->offscreenMemory.clear();
+
+	this->retiredSwapChains.push_back(std::move(retired));
+}
+
+void VulkanTest::destroyRetired(bool all)
+{
+	auto it = this->retiredSwapChains.begin();
+
+	while (it != this->retiredSwapChains.end())
+	{
+		if (!all && this->frameCount < it->frame + this->frames.size())
+		{
+			it++;
+			continue;
+		}
+
+		if (it->commandBuffers.size() > 0)
+		{
+			vkFreeCommandBuffers(device, this->commandPool, it->commandBuffers.size(), it->commandBuffers.data());
+		}
+
+		for (auto framebuffer : it->framebuffers)
+		{
+			vkDestroyFramebuffer(device, framebuffer, nullptr);
+		}
+
+		for (auto imageView : it->imageViews)
+		{
+			vkDestroyImageView(device, imageView, nullptr);
+		}
+
+		for (uint32_t i = 0; i < it->images.size(); i++)
+		{
+			this->allocator.destroyImage(it->images[i], it->memory[i]);
+		}
+
+		if (it->swapChain != VK_NULL_HANDLE)
+		{
+			if (latencyTracking)
+			{
+				this->latency.forgetSwapChain(it->swapChain);
+			}
+
+			vkDestroySwapchainKHR(device, it->swapChain, nullptr);
+		}
+
+		it = this->retiredSwapChains.erase(it);
+	}
+}
+
+void VulkanTest::resize(uint32_t w, uint32_t h)
+{
+	width = w;
+	height = h;
+	this->swapChainDirty = true;
+}
+
+void VulkanTest::setPresentPolicy(PresentPolicy policy)
+{
+	presentPolicy = policy;
+	this->swapChainDirty = true;
+}
+
+void VulkanTest::setSwapImageCount(uint32_t count)
+{
+	swapImageCount = count;
+	this->swapChainDirty = true;
+}
+
+void VulkanTest::applyRuntimeControls()
+{
+	if (presentPolicyCycle.exchange(false))
+	{
+		static const char* names[] = { "low-latency", "low-power", "tear-free" };
+
+		PresentPolicy policy = (PresentPolicy)(((int)presentPolicy + 1) % 3);
+		this->setPresentPolicy(policy);
+
+		logger.log(LogSeverity::Info, "renderer", 0, (std::string("Present policy ") + names[(int)policy]).c_str());
+	}
+
+	if (swapImagesCycle.exchange(false))
+	{
+		// Driver default (minImageCount + 1), then 2, 3 and 4
+		this->setSwapImageCount(swapImageCount >= 4 ? 0 : std::max(2u, swapImageCount + 1));
+
+		logger.log(LogSeverity::Info, "renderer", 0, ("Swapchain images " + (swapImageCount > 0 ? std::to_string(swapImageCount) : std::string("default"))).c_str());
+	}
+
+	if (frameCapCycle.exchange(false))
+	{
+		// Off, then the common refresh rates; the limiter waits on this thread
+		static const double caps[] = { 0.0, 30.0, 60.0, 120.0, 144.0 };
+
+		uint32_t next = 0;
+
+		for (uint32_t i = 0; i < 5; i++)
+		{
+			if (caps[i] > frameRateCap)
+			{
+				next = i;
+				break;
+			}
+		}
+
+		frameRateCap = caps[next];
+		limiter.setRate(frameRateCap);
+
+		logger.log(LogSeverity::Info, "renderer", 0, ("Frame cap " + (frameRateCap > 0.0 ? std::to_string((int)frameRateCap) + " fps" : std::string("off"))).c_str());
+	}
+}
+
+void VulkanTest::createOffscreenImages()
+{
+	this->swapChainImageFormat = VK_FORMAT_B8G8R8A8_UNORM;
+	this->swapChainExtent = { width, height };
+	this->presentLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	this->swapChainReadable = true;
+	this->swapChainBlitTarget = true;
+
+	this->swapChainImages.resize(offscreenImageCount);
+	this->offscreenMemory.resize(offscreenImageCount);
+
+	for (uint32_t i = 0; i < offscreenImageCount; i++)
+	{
+		VkImageCreateInfo createInfo = {};
+		createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+		createInfo.imageType = VK_IMAGE_TYPE_2D;
+		createInfo.format = this->swapChainImageFormat;
+		createInfo.extent = { width, height, 1 };
+		createInfo.mipLevels = 1;
+		createInfo.arrayLayers = 1;
+		createInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+		createInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+		createInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+		createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		createInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+		this->allocator.createImage(
+			createInfo,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+			this->swapChainImages[i],
+			this->offscreenMemory[i]
+		);
+	}
+}
+
+SwapChainSupportDetails VulkanTest::querySwapChainSupport(VkPhysicalDevice device)
+{
+	SwapChainSupportDetails details;
+
+	vkGetPhysicalDeviceSurfaceCapabilitiesKHR(device, surface, &details.caps);
+
+	uint32_t count;
+
+	vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &count, nullptr);
+
+	if (count != 0)
+	{
+		details.formats.resize(count);
+		vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &count, details.formats.data());
+	}
+
+	count = 0;
+
+	vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface, &count, nullptr);
+
+	if (count != 0)
+	{
+		details.presentModes.resize(count);
+		vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface, &count, details.presentModes.data());
+	}
+
+	return details;
+}
+
+VkSurfaceFormatKHR VulkanTest::chooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR>& formats)
+{
+	if (formats.size() == 1 && formats[0].format == VK_FORMAT_UNDEFINED)
+	{
+		return { VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR };
+	}
+
+	for (const auto& f : formats)
+	{
+		if (f.format == VK_FORMAT_B8G8R8A8_UNORM &&
+			f.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR)
+		{
+			return f;
+		}
+	}
+
+	return formats[0];
+}
+
+VkPresentModeKHR VulkanTest::chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& modes)
+{
+	// FIFO is the only mode every driver has to support
+	std::vector<VkPresentModeKHR> preferred;
+
+	switch (presentPolicy)
+	{
+	case PresentPolicy::LowLatency:
+		preferred = { VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR };
+		break;
+	case PresentPolicy::LowPower:
+		preferred = { VK_PRESENT_MODE_FIFO_KHR };
+		break;
+	case PresentPolicy::TearFree:
+		preferred = { VK_PRESENT_MODE_MAILBOX_KHR };
+		break;
+	}
+
+	for (const auto& p : preferred)
+	{
+		if (std::find(modes.begin(), modes.end(), p) != modes.end())
+		{
+			return p;
+		}
+	}
+
+	return VK_PRESENT_MODE_FIFO_KHR;
+}
+
+VkExtent2D VulkanTest::chooseSwapExtent(const VkSurfaceCapabilitiesKHR& caps)
+{
+	if (caps.currentExtent.width != std::numeric_limits<uint32_t>::max())
+	{
+		return caps.currentExtent;
+	}
+	else
+	{
+		VkExtent2D actualExtent = { width, height };
+
+		actualExtent.width = std::max(caps.minImageExtent.width, std::min(caps.maxImageExtent.width, actualExtent.width));
+		actualExtent.height = std::max(caps.minImageExtent.height, std::min(caps.maxImageExtent.height, actualExtent.height));
+
+		return actualExtent;
+	}
+}
+
+void VulkanTest::createSwapChainImageViews()
+{
+	this->swapChainImageViews.resize(this->swapChainImages.size());
+
+	for (uint32_t i = 0; i < swapChainImages.size(); i++)
+	{
+		VkImageViewCreateInfo createInfo = {};
+		createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+		createInfo.image = this->swapChainImages[i];
+
+		createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		createInfo.format = this->swapChainImageFormat;
+
+		createInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+		createInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+		createInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+		createInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+
+		createInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		createInfo.subresourceRange.baseMipLevel = 0;
+		createInfo.subresourceRange.levelCount = 1;
+		createInfo.subresourceRange.baseArrayLayer = 0;
+		createInfo.subresourceRange.layerCount = 1;
+
+		VkResult r = vkCreateImageView(device, &createInfo, nullptr, &this->swapChainImageViews[i]);
+
+		if (r != VK_SUCCESS)
+		{
+			throw std::runtime_error("Failed to create image view!");
+		}
+	}
+}
+
+void VulkanTest::createCommandPool()
+{
+	const QueueFamilyIndices& indices = this->caps.queues;
+
+	VkCommandPoolCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	createInfo.queueFamilyIndex = indices.graphicsFamily.value();
+	createInfo.flags = 0;
+
+	VkResult r = vkCreateCommandPool(device, &createInfo, nullptr, &this->commandPool);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("Command Pool wasn't initialized.");
+	}
+
+	// One transient pool per frame in flight, reset as a whole once
+	// the frame's fence has signaled
+	this->frames.resize(framesInFlight);
+
+	createInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+	for (auto& frame : this->frames)
+	{
+		r = vkCreateCommandPool(device, &createInfo, nullptr, &frame.commandPool);
+
+		if (r != VK_SUCCESS)
+		{
+			throw std::runtime_error("Frame Command Pool wasn't initialized.");
+		}
+	}
+}
+
+void VulkanTest::createRenderPass()
+{
+	VkResult r;
+
+	// Clear Render Pass
+
+	// Attachment Description
+	VkAttachmentDescription clearColorAttachment = {};
+	clearColorAttachment.format = this->swapChainImageFormat;
+	clearColorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+	
+	clearColorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	clearColorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+
+	clearColorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	clearColorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+
+	clearColorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	clearColorAttachment.finalLayout = this->presentLayout;
+
+	// Attachment Reference
+	VkAttachmentReference clearColorAttachmentReference = {};
+	clearColorAttachmentReference.attachment = 0;
+	clearColorAttachmentReference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+	// Subpass
+	VkSubpassDescription clearSubpass = {};
+	clearSubpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	clearSubpass.colorAttachmentCount = 1;
+	clearSubpass.pColorAttachments = &clearColorAttachmentReference;
+
+	// Subpass Dependency
+	VkSubpassDependency clearSubpassDep = {};
+	clearSubpassDep.srcSubpass = VK_SUBPASS_EXTERNAL;
+	clearSubpassDep.dstSubpass = 0;
+
+	clearSubpassDep.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	clearSubpassDep.srcAccessMask = 0;
+
+	clearSubpassDep.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	clearSubpassDep.dstAccessMask =
+		VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+		VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+
+	// Create Info
+	VkRenderPassCreateInfo clearCreateInfo = {};
+	clearCreateInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+	clearCreateInfo.attachmentCount = 1;
+	clearCreateInfo.pAttachments = &clearColorAttachment;
+	clearCreateInfo.subpassCount = 1;
+	clearCreateInfo.pSubpasses = &clearSubpass;
+	clearCreateInfo.dependencyCount = 1;
+	clearCreateInfo.pDependencies = &clearSubpassDep;
+
+	r = vkCreateRenderPass(this->device, &clearCreateInfo, nullptr, &this->clearRenderPass);
+
+	if (r != VK_SUCCESS)
+	{
+		std::runtime_error("Failed to create clear render pass.");
+	}
+}
+
+void VulkanTest::createFramebuffers()
+{
+	VkResult r;
+
+	// Clear
+	this->clearFramebuffers.resize(this->swapChainImageViews.size());
+	for (uint32_t i = 0; i < this->swapChainImageViews.size(); i++)
+	{
+		VkFramebufferCreateInfo createInfo = {};
+		createInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+		createInfo.renderPass = clearRenderPass;
+		createInfo.attachmentCount = 1;
+		createInfo.pAttachments = &this->swapChainImageViews[i];
+		createInfo.width = swapChainExtent.width;
+		createInfo.height = swapChainExtent.height;
+		createInfo.layers = 1;
+		r = vkCreateFramebuffer(device, &createInfo, nullptr, &clearFramebuffers[i]);
+
+		if (r != VK_SUCCESS)
+		{
+			std::runtime_error("Failed to create clear framebuffer.");
+		}
+	}
+}
+
+void VulkanTest::createSemaphore()
+{
+	VkResult r;
+
+	VkSemaphoreCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+	for (auto& frame : this->frames)
+	{
+		r = vkCreateSemaphore(this->device, &createInfo, nullptr, &frame.imageAvailable);
+
+		if (r != VK_SUCCESS)
+		{
+			throw std::runtime_error("Image Available semaphore...");
+		}
+
+		r = vkCreateSemaphore(this->device, &createInfo, nullptr, &frame.renderFinish);
+
+		if (r != VK_SUCCESS)
+		{
+			throw std::runtime_error("Render Finished semaphore...");
+		}
+	}
+}
+
+void VulkanTest::createFence()
+{
+	VkResult r;
+	VkFenceCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	createInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+	for (auto& frame : this->frames)
+	{
+		r = vkCreateFence(
+			this->device,
+			&createInfo,
+			nullptr,
+			&frame.inFlight
+		);
+
+		if (r != VK_SUCCESS)
+		{
+			throw std::runtime_error("In Flight Fence...");
+		}
+	}
+
+	this->imagesInFlight.resize(this->swapChainImages.size(), VK_NULL_HANDLE);
+}
+
+VkCommandBuffer VulkanTest::allocCommandBuffer()
+{
+	FrameData& frame = this->frames[this->currentFrame];
+
+	if (frame.commandBufferUsed < frame.commandBuffers.size())
+	{
+		return frame.commandBuffers[frame.commandBufferUsed++];
+	}
+
+	VkCommandBufferAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.commandPool = frame.commandPool;
+	allocInfo.commandBufferCount = 1;
+
+	VkCommandBuffer temp;
+	VkResult r = vkAllocateCommandBuffers(device, &allocInfo, &temp);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to allocate command buffer.");
+	}
+
+	frame.commandBuffers.push_back(temp);
+	frame.commandBufferUsed++;
+
+	return temp;
+}
+
+VkCommandBuffer VulkanTest::clearCommand(glm::vec3 color)
+{
+	VkResult r;
+
+	ClearCommandKey key = { this->swapChainIndex, color };
+
+	auto it = this->clearCommandCache.find(key);
+
+	if (it != this->clearCommandCache.end())
+	{
+		it->second.lastUsed = this->frameCount;
+		return it->second.commandBuffer;
+	}
+
+	this->evictClearCommand(this->swapChainIndex);
+
+	// Cached buffers outlive the frame, so they come from the main pool
+	VkCommandBufferAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.commandPool = this->commandPool;
+	allocInfo.commandBufferCount = 1;
+
+	VkCommandBuffer temp;
+	r = vkAllocateCommandBuffers(device, &allocInfo, &temp);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to allocate clear command buffer.");
+	}
+
+	VkClearValue value = {};
+	value.color = {
+		color.r,
+		color.g,
+		color.b,
+		1.0f
+	};
+
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+	VkRenderPassBeginInfo rp = {};
+	rp.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+	rp.renderPass = this->clearRenderPass;
+	rp.renderArea.offset = { 0, 0 };
+	rp.renderArea.extent = this->swapChainExtent;
+	rp.clearValueCount = 1;
+	rp.pClearValues = &value;
+	rp.framebuffer = this->clearFramebuffers[this->swapChainIndex];
+
+	vkBeginCommandBuffer(temp, &beginInfo);
+	vkCmdBeginRenderPass(temp, &rp, VK_SUBPASS_CONTENTS_INLINE);
+
+	// Do nothing...
+	vkCmdEndRenderPass(temp);
+	r = vkEndCommandBuffer(temp);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("Falied to kill command buffer...");
+	}
+
+	this->clearCommandCache[key] = { temp, this->frameCount };
+
+	return temp;
+}
+
+void VulkanTest::createQueryPools()
+{
+	// Dynamic resolution is driven by the timestamps
+	if (!profiling && dynamicResolutionTarget <= 0.0)
+	{
+		return;
+	}
+
+	const QueueFamilyIndices& indices = this->caps.queues;
+	const VkPhysicalDeviceProperties& props = this->caps.props;
+
+	uint32_t validBits = this->caps.queueFamilies[indices.graphicsFamily.value()].timestampValidBits;
+
+	if (validBits == 0 || props.limits.timestampPeriod == 0.0f)
+	{
+		logger.log(LogSeverity::Warning, "renderer", 0, "GPU timestamps not supported, CPU timing only");
+		return;
+	}
+
+	this->gpuTimestamps = true;
+	this->timestampPeriod = props.limits.timestampPeriod;
+	this->timestampMask = validBits >= 64 ? ~0ull : ((1ull << validBits) - 1);
+
+	VkQueryPoolCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	createInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	createInfo.queryCount = maxGpuTimers * 2;
+
+	for (auto& frame : this->frames)
+	{
+		VkResult r = vkCreateQueryPool(device, &createInfo, nullptr, &frame.queryPool);
+
+		if (r != VK_SUCCESS)
+		{
+			throw std::runtime_error("Failed to create timestamp query pool.");
+		}
+	}
+}
+
+VkCommandBuffer VulkanTest::beginCommand()
+{
+	VkCommandBuffer cmd = this->allocCommandBuffer();
+
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+	vkBeginCommandBuffer(cmd, &beginInfo);
+
+	return cmd;
+}
+
+void VulkanTest::drawParallel(uint32_t itemCount, const RecordFunc& record)
+{
+	if (this->skipFrame || itemCount == 0)
+	{
+		return;
+	}
+
+	// Merged with the frame's clear into one subpass by the graph
+	RenderGraphPass& pass = this->graph.addPass("draw");
+	pass.write(this->backbuffer);
+	pass.secondary = true;
+
+	pass.execute = [this, itemCount, record](const RenderGraphContext& ctx)
+	{
+		VkCommandBufferInheritanceInfo inheritance = {};
+		inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+		inheritance.renderPass = ctx.renderPass;
+		inheritance.subpass = ctx.subpass;
+		inheritance.framebuffer = ctx.framebuffer;
+
+		std::vector<VkCommandBuffer> secondaries;
+		this->recorder.record(inheritance, itemCount, record, secondaries);
+
+		vkCmdExecuteCommands(ctx.cmd, secondaries.size(), secondaries.data());
+	};
+}
+
+void VulkanTest::drawSprites()
+{
+	if (this->skipFrame || this->sprites.pending.size() == 0)
+	{
+		return;
+	}
+
+	this->sprites.prepare();
+
+	RenderGraphPass& pass = this->graph.addPass("sprites");
+	pass.write(this->backbuffer);
+
+	pass.execute = [this](const RenderGraphContext& ctx)
+	{
+		this->sprites.record(ctx, this->swapChainExtent);
+	};
+}
+
+void VulkanTest::drawObjects(const glm::mat4& viewProjection)
+{
+	if (this->skipFrame || !this->objects.enabled || this->objects.objects.size() == 0)
+	{
+		return;
+	}
+
+	this->objects.prepare(viewProjection);
+
+	RenderGraphPass& pass = this->graph.addPass("objects");
+	pass.write(this->backbuffer);
+
+	pass.execute = [this](const RenderGraphContext& ctx)
+	{
+		this->objects.record(ctx);
+	};
+}
+
+void VulkanTest::endCommand(VkCommandBuffer cmd)
+{
+	VkResult r = vkEndCommandBuffer(cmd);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to end command buffer.");
+	}
+
+	this->frames[this->currentFrame].commandBufferList.push_back(cmd);
+}
+
+uint32_t VulkanTest::beginGpuTimer(VkCommandBuffer cmd, const char* name)
+{
+	FrameData& frame = this->frames[this->currentFrame];
+
+	if (!this->gpuTimestamps || frame.timerCount >= maxGpuTimers)
+	{
+		return UINT32_MAX;
+	}
+
+	uint32_t timer = frame.timerCount++;
+	frame.timerNames[timer] = name;
+
+	vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame.queryPool, timer * 2);
+
+	return timer;
+}
+
+void VulkanTest::endGpuTimer(VkCommandBuffer cmd, uint32_t timer)
+{
+	if (timer == UINT32_MAX)
+	{
+		return;
+	}
+
+	FrameData& frame = this->frames[this->currentFrame];
+
+	vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame.queryPool, timer * 2 + 1);
+}
+
+void VulkanTest::readGpuTimers(FrameData& frame)
+{
+	if (frame.timerCount == 0)
+	{
+		return;
+	}
+
+	uint64_t stamps[maxGpuTimers * 2];
+
+	// The frame fence has signaled, so no WAIT bit; a timer that was
+	// never ended leaves the results unavailable and is dropped
+	VkResult r = vkGetQueryPoolResults(
+		device,
+		frame.queryPool,
+		0,
+		frame.timerCount * 2,
+		sizeof(stamps),
+		stamps,
+		sizeof(uint64_t),
+		VK_QUERY_RESULT_64_BIT
+	);
+
+	double times[maxGpuTimers];
+	uint32_t count = r == VK_SUCCESS ? frame.timerCount : 0;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint64_t ticks = ((stamps[i * 2 + 1] - stamps[i * 2]) & this->timestampMask);
+		times[i] = ticks * this->timestampPeriod / 1000000.0;
+	}
+
+	profiler.resolveGpu(frame.timedFrame, count, frame.timerNames, times);
+
+	if (this->dynamicResolution && count > 0)
+	{
+		double total = 0.0;
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			total += times[i];
+		}
+
+		this->resolution.update(total);
+	}
+
+	frame.timerCount = 0;
+}
+
+void VulkanTest::evictClearCommand(uint32_t image)
+{
+	// Only entries of the acquired image are safe to free here: its last
+	// submission has already been waited on in clear()
+	auto begin = this->clearCommandCache.lower_bound({ image, glm::vec3(-std::numeric_limits<float>::max()) });
+	auto end = this->clearCommandCache.lower_bound({ image + 1, glm::vec3(-std::numeric_limits<float>::max()) });
+
+	uint32_t count = std::distance(begin, end);
+
+	if (count < this->clearCommandCacheLimit)
+	{
+		return;
+	}
+
+	auto oldest = begin;
+
+	for (auto it = begin; it != end; it++)
+	{
+		if (it->second.lastUsed < oldest->second.lastUsed)
+		{
+			oldest = it;
+		}
+	}
+
+	vkFreeCommandBuffers(device, this->commandPool, 1, &oldest->second.commandBuffer);
+	this->clearCommandCache.erase(oldest);
+}
+
+void VulkanTest::releaseClearCommandCache()
+{
+	for (auto& entry : this->clearCommandCache)
+	{
+		vkFreeCommandBuffers(device, this->commandPool, 1, &entry.second.commandBuffer);
+	}
+
+	this->clearCommandCache.clear();
+}
+
+void FrameProfiler::init(uint32_t capacity)
+{
+	if (!profiling)
+	{
+		return;
+	}
+
+	this->ring.resize(capacity);
+
+	this->writerRunning = true;
+	this->writer = std::thread([this]()
+	{
+		while (this->writerRunning)
+		{
+			this->drain();
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+	});
+}
+
+void FrameProfiler::release()
+{
+	if (!profiling)
+	{
+		return;
+	}
+
+	this->flushPending(true);
+
+	this->writerRunning = false;
+
+	if (this->writer.joinable())
+	{
+		this->writer.join();
+	}
+
+	this->drain();
+
+	if (this->dropped > 0)
+	{
+		std::cout << "Profiler dropped " << this->dropped << " frames" << std::endl;
+	}
+
+	if (!this->csvPath.empty())
+	{
+		this->writeCsv();
+	}
+
+	if (!this->jsonPath.empty())
+	{
+		this->writeJson();
+	}
+
+	this->printSummary();
+}
+
+void FrameProfiler::begin(TimingPhase phase)
+{
+	this->phaseStart[phase] = Clock::now();
+}
+
+void FrameProfiler::end(TimingPhase phase)
+{
+	this->current.cpu[phase] += std::chrono::duration<double, std::milli>(Clock::now() - this->phaseStart[phase]).count();
+}
+
+void FrameProfiler::endFrame()
+{
+	uint64_t frame = this->current.frame;
+
+	if (profiling)
+	{
+		this->pending.push_back(this->current);
+		this->flushPending(false);
+	}
+
+	this->current = FrameTiming();
+	this->current.frame = frame + 1;
+}
+
+void FrameProfiler::resolveGpu(uint64_t frame, uint32_t count, const char* const* names, const double* times)
+{
+	for (auto& timing : this->pending)
+	{
+		if (timing.frame != frame)
+		{
+			continue;
+		}
+
+		timing.gpuCount = count;
+		timing.gpuTotal = 0.0;
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			timing.gpuNames[i] = names[i];
+			timing.gpu[i] = times[i];
+			timing.gpuTotal += times[i];
+		}
+
+		timing.gpuPending = false;
+		break;
+	}
+
+	this->flushPending(false);
+}
+
+const char* FrameProfiler::intern(const std::string& name)
+{
+	return this->names.insert(name).first->c_str();
+}
+
+void FrameProfiler::flushPending(bool force)
+{
+	while (this->pending.size() > 0 && (force || !this->pending.front().gpuPending))
+	{
+		if (!this->push(this->pending.front()))
+		{
+			this->dropped++;
+		}
+
+		this->pending.pop_front();
+	}
+}
+
+bool FrameProfiler::push(const FrameTiming& timing)
+{
+	uint64_t h = this->head.load(std::memory_order_relaxed);
+
+	if (h - this->tail.load(std::memory_order_acquire) >= this->ring.size())
+	{
+		return false;
+	}
+
+	this->ring[h % this->ring.size()] = timing;
+	this->head.store(h + 1, std::memory_order_release);
+
+	return true;
+}
+
+void FrameProfiler::drain()
+{
+	uint64_t t = this->tail.load(std::memory_order_relaxed);
+	uint64_t h = this->head.load(std::memory_order_acquire);
+
+	for (; t < h; t++)
+	{
+		this->history.push_back(this->ring[t % this->ring.size()]);
+	}
+
+	this->tail.store(t, std::memory_order_release);
+}
+
+static double percentile(std::vector<double> values, double p)
+{
+	if (values.size() == 0)
+	{
+		return 0.0;
+	}
+
+	std::sort(values.begin(), values.end());
+
+	size_t rank = (size_t)std::ceil(p * values.size());
+
+	return values[std::max<size_t>(rank, 1) - 1];
+}
+
+static std::vector<std::string> gpuTimerNames(const std::vector<FrameTiming>& history)
+{
+	std::vector<std::string> names;
+
+	for (const auto& timing : history)
+	{
+		for (uint32_t i = 0; i < timing.gpuCount; i++)
+		{
+			if (std::find(names.begin(), names.end(), timing.gpuNames[i]) == names.end())
+			{
+				names.push_back(timing.gpuNames[i]);
+			}
+		}
+	}
+
+	return names;
+}
+
+static double gpuTimerValue(const FrameTiming& timing, const std::string& name)
+{
+	double total = 0.0;
+
+	for (uint32_t i = 0; i < timing.gpuCount; i++)
+	{
+		if (name == timing.gpuNames[i])
+		{
+			total += timing.gpu[i];
+		}
+	}
+
+	return total;
+}
+
+void FrameProfiler::writeCsv()
+{
+	std::ofstream out(this->csvPath);
+
+	if (!out.is_open())
+	{
+		std::cout << "Can't write timing csv " << this->csvPath << std::endl;
+		return;
+	}
+
+	std::vector<std::string> names = gpuTimerNames(this->history);
+
+	out << "frame";
+
+	for (uint32_t i = 0; i < PhaseCount; i++)
+	{
+		out << "," << timingPhaseNames[i];
+	}
+
+	out << ",gpu_total";
+
+	for (const auto& name : names)
+	{
+		out << ",gpu_" << name;
+	}
+
+	out << "\n";
+
+	for (const auto& timing : this->history)
+	{
+		out << timing.frame;
+
+		for (uint32_t i = 0; i < PhaseCount; i++)
+		{
+			out << "," << timing.cpu[i];
+		}
+
+		out << "," << timing.gpuTotal;
+
+		for (const auto& name : names)
+		{
+			out << "," << gpuTimerValue(timing, name);
+		}
+
+		out << "\n";
+	}
+}
+
+void FrameProfiler::writeJson()
+{
+	std::ofstream out(this->jsonPath);
+
+	if (!out.is_open())
+	{
+		std::cout << "Can't write timing json " << this->jsonPath << std::endl;
+		return;
+	}
+
+	std::vector<std::string> names = gpuTimerNames(this->history);
+
+	auto summary = [&](const char* key, const std::vector<double>& values)
+	{
+		out << "\"" << key << "\":{\"p50\":" << percentile(values, 0.50)
+			<< ",\"p95\":" << percentile(values, 0.95)
+			<< ",\"p99\":" << percentile(values, 0.99) << "}";
+	};
+
+	out << "{\"frames\":[";
+
+	for (size_t f = 0; f < this->history.size(); f++)
+	{
+		const FrameTiming& timing = this->history[f];
+
+		out << (f > 0 ? "," : "") << "{\"frame\":" << timing.frame;
+
+		for (uint32_t i = 0; i < PhaseCount; i++)
+		{
+			out << ",\"" << timingPhaseNames[i] << "\":" << timing.cpu[i];
+		}
+
+		out << ",\"gpu_total\":" << timing.gpuTotal;
+
+		for (uint32_t i = 0; i < timing.gpuCount; i++)
+		{
+			out << ",\"gpu_" << timing.gpuNames[i] << "\":" << timing.gpu[i];
+		}
+
+		out << "}";
+	}
+
+	out << "],\"summary\":{";
+
+	for (uint32_t i = 0; i < PhaseCount; i++)
+	{
+		std::vector<double> values;
+
+		for (const auto& timing : this->history)
+		{
+			values.push_back(timing.cpu[i]);
+		}
+
+		summary(timingPhaseNames[i], values);
+		out << ",";
+	}
+
+	std::vector<double> totals;
+
+	for (const auto& timing : this->history)
+	{
+		totals.push_back(timing.gpuTotal);
+	}
+
+	summary("gpu_total", totals);
+
+	for (const auto& name : names)
+	{
+		std::vector<double> values;
+
+		for (const auto& timing : this->history)
+		{
+			values.push_back(gpuTimerValue(timing, name));
+		}
+
+		out << ",";
+		summary(("gpu_" + name).c_str(), values);
+	}
+
+	out << "}}\n";
+}
+
+void FrameProfiler::printSummary()
+{
+	std::cout << "Frame timing over " << this->history.size() << " frames (ms, p50/p95/p99)" << std::endl;
+
+	for (uint32_t i = 0; i < PhaseCount; i++)
+	{
+		std::vector<double> values;
+
+		for (const auto& timing : this->history)
+		{
+			values.push_back(timing.cpu[i]);
+		}
+
+		std::cout << "  " << timingPhaseNames[i] << ": "
+			<< percentile(values, 0.50) << " / "
+			<< percentile(values, 0.95) << " / "
+			<< percentile(values, 0.99) << std::endl;
+	}
+
+	for (const auto& name : gpuTimerNames(this->history))
+	{
+		std::vector<double> values;
+
+		for (const auto& timing : this->history)
+		{
+			values.push_back(gpuTimerValue(timing, name));
+		}
+
+		std::cout << "  gpu " << name << ": "
+			<< percentile(values, 0.50) << " / "
+			<< percentile(values, 0.95) << " / "
+			<< percentile(values, 0.99) << std::endl;
+	}
+}
+
+void FrameLimiter::setRate(double fps)
+{
+	if (fps <= 0.0)
+	{
+		this->period = std::chrono::nanoseconds(0);
+		return;
+	}
+
+	this->period = std::chrono::nanoseconds((int64_t)(1000000000.0 / fps));
+	this->deadline = Clock::now() + this->period;
+}
+
+void FrameLimiter::wait()
+{
+	if (this->period.count() == 0)
+	{
+		return;
+	}
+
+	this->frames++;
+
+	Clock::time_point now = Clock::now();
+
+	if (now > this->deadline)
+	{
+		// Late: count it and restart the schedule instead of bursting to catch up
+		this->missed++;
+		this->worstMiss = std::max(this->worstMiss, std::chrono::duration_cast<std::chrono::nanoseconds>(now - this->deadline));
+		this->deadline = now + this->period;
+		return;
+	}
+
+	std::chrono::nanoseconds margin = std::max(this->spinMargin, this->sleepError * 2);
+	std::chrono::nanoseconds remaining = this->deadline - now;
+
+	if (remaining > margin)
+	{
+		std::chrono::nanoseconds request = remaining - margin;
+
+		std::this_thread::sleep_for(request);
+
+		std::chrono::nanoseconds slept = Clock::now() - now;
+		std::chrono::nanoseconds error = slept > request ? slept - request : std::chrono::nanoseconds(0);
+
+		// Moving average of the oversleep
+		this->sleepError = (this->sleepError * 7 + error) / 8;
+	}
+
+	while (Clock::now() < this->deadline)
+	{
+		std::this_thread::yield();
+	}
+
+	this->deadline += this->period;
+}
+
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t size)
+{
+	// FNV-1a
+	const uint8_t* bytes = (const uint8_t*)data;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
+template<typename T>
+static uint64_t hashValue(uint64_t hash, const T& value)
+{
+	return hashBytes(hash, &value, sizeof(T));
+}
+
+uint64_t GraphicsPipelineDesc::hash() const
+{
+	uint64_t h = 14695981039346656037ull;
+
+	h = hashValue(h, this->vertexShader);
+	h = hashValue(h, this->fragmentShader);
+
+	for (const auto& b : this->bindings)
+	{
+		h = hashValue(h, b.binding);
+		h = hashValue(h, b.stride);
+		h = hashValue(h, b.inputRate);
+	}
+
+	for (const auto& a : this->attributes)
+	{
+		h = hashValue(h, a.location);
+		h = hashValue(h, a.binding);
+		h = hashValue(h, a.format);
+		h = hashValue(h, a.offset);
+	}
+
+	h = hashValue(h, this->topology);
+	h = hashValue(h, this->polygonMode);
+	h = hashValue(h, this->cullMode);
+	h = hashValue(h, this->frontFace);
+	h = hashValue(h, this->blend);
+	h = hashValue(h, this->depthTest);
+	h = hashValue(h, this->depthWrite);
+	h = hashValue(h, this->layout);
+	h = hashValue(h, this->renderPass);
+	h = hashValue(h, this->subpass);
+
+	return h;
+}
+
+bool GraphicsPipelineDesc::operator==(const GraphicsPipelineDesc& other) const
+{
+	if (this->bindings.size() != other.bindings.size() || this->attributes.size() != other.attributes.size())
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < this->bindings.size(); i++)
+	{
+		const auto& a = this->bindings[i];
+		const auto& b = other.bindings[i];
+
+		if (a.binding != b.binding || a.stride != b.stride || a.inputRate != b.inputRate)
+		{
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < this->attributes.size(); i++)
+	{
+		const auto& a = this->attributes[i];
+		const auto& b = other.attributes[i];
+
+		if (a.location != b.location || a.binding != b.binding || a.format != b.format || a.offset != b.offset)
+		{
+			return false;
+		}
+	}
+
+	return
+		this->vertexShader == other.vertexShader &&
+		this->fragmentShader == other.fragmentShader &&
+		this->topology == other.topology &&
+		this->polygonMode == other.polygonMode &&
+		this->cullMode == other.cullMode &&
+		this->frontFace == other.frontFace &&
+		this->blend == other.blend &&
+		this->depthTest == other.depthTest &&
+		this->depthWrite == other.depthWrite &&
+		this->layout == other.layout &&
+		this->renderPass == other.renderPass &&
+		this->subpass == other.subpass;
+}
+
+void PipelineManager::init(VkDevice device, VkPhysicalDevice physicalDevice, const std::string& cachePath)
+{
+	this->device = device;
+	this->cachePath = cachePath;
+
+	vkGetPhysicalDeviceProperties(physicalDevice, &this->props);
+
+	this->loadCache();
+
+	// Leave a core to the render thread, hardware_concurrency() is 0 when unknown
+	uint32_t cores = std::thread::hardware_concurrency();
+	uint32_t count = cores > 1 ? cores - 1 : 1;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		this->workers.push_back(std::thread([this]()
+		{
+			while (true)
+			{
+				PipelineEntry* entry = nullptr;
+
+				{
+					std::unique_lock<std::mutex> lock(this->mutex);
+					this->queueCond.wait(lock, [this]() { return this->stopping || this->queue.size() > 0; });
+
+					if (this->queue.size() == 0)
+					{
+						return;
+					}
+
+					entry = this->queue.front();
+					this->queue.pop_front();
+				}
+
+				this->compile(entry);
+			}
+		}));
+	}
+}
+
+void PipelineManager::release()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->queue.clear();
+		this->stopping = true;
+	}
+
+	this->queueCond.notify_all();
+
+	for (auto& worker : this->workers)
+	{
+		worker.join();
+	}
+
+	this->workers.clear();
+
+	if (this->compiled > 0)
+	{
+		std::cout << "Compiled " << this->compiled << " pipelines in "
+			<< this->compileMicros / 1000.0 << "ms of worker time" << std::endl;
+
+		this->saveCache();
+	}
+
+	for (auto& entry : this->entries)
+	{
+		if (entry.second->pipeline != VK_NULL_HANDLE)
+		{
+			vkDestroyPipeline(this->device, entry.second->pipeline, nullptr);
+		}
+	}
+
+	this->entries.clear();
+
+	vkDestroyPipelineCache(this->device, this->cache, nullptr);
+}
+
+PipelineHandle PipelineManager::request(const GraphicsPipelineDesc& desc)
+{
+	uint64_t hash = desc.hash();
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	auto range = this->entries.equal_range(hash);
+
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		if (it->second->desc == desc)
+		{
+			return it->second.get();
+		}
+	}
+
+	PipelineEntry* entry = new PipelineEntry();
+	entry->hash = hash;
+	entry->desc = desc;
+
+	this->entries.emplace(hash, std::unique_ptr<PipelineEntry>(entry));
+	this->queue.push_back(entry);
+	this->queueCond.notify_one();
+
+	return entry;
+}
+
+VkPipeline PipelineManager::get(PipelineHandle handle)
+{
+	return handle->pipeline.load(std::memory_order_acquire);
+}
+
+void PipelineManager::wait(PipelineHandle handle)
+{
+	std::unique_lock<std::mutex> lock(this->mutex);
+	this->readyCond.wait(lock, [handle]() { return handle->ready.load(); });
+}
+
+void PipelineManager::waitAll()
+{
+	std::unique_lock<std::mutex> lock(this->mutex);
+	this->readyCond.wait(lock, [this]()
+	{
+		for (auto& entry : this->entries)
+		{
+			if (!entry.second->ready)
+			{
+				return false;
+			}
+		}
+
+		return true;
+	});
+}
+
+void PipelineManager::compile(PipelineEntry* entry)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	const GraphicsPipelineDesc& desc = entry->desc;
+
+	// Shader Stages
+	VkPipelineShaderStageCreateInfo stages[2] = {};
+	stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+	stages[0].module = desc.vertexShader;
+	stages[0].pName = "main";
+
+	stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+	stages[1].module = desc.fragmentShader;
+	stages[1].pName = "main";
+
+	// Vertex Input
+	VkPipelineVertexInputStateCreateInfo vertexInput = {};
+	vertexInput.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+	vertexInput.vertexBindingDescriptionCount = desc.bindings.size();
+	vertexInput.pVertexBindingDescriptions = desc.bindings.data();
+	vertexInput.vertexAttributeDescriptionCount = desc.attributes.size();
+	vertexInput.pVertexAttributeDescriptions = desc.attributes.data();
+
+	// Input Assembly
+	VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
+	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+	inputAssembly.topology = desc.topology;
+
+	// Viewport, set at record time
+	VkPipelineViewportStateCreateInfo viewport = {};
+	viewport.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+	viewport.viewportCount = 1;
+	viewport.scissorCount = 1;
+
+	VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+
+	VkPipelineDynamicStateCreateInfo dynamic = {};
+	dynamic.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamic.dynamicStateCount = 2;
+	dynamic.pDynamicStates = dynamicStates;
+
+	// Rasterization
+	VkPipelineRasterizationStateCreateInfo raster = {};
+	raster.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+	raster.polygonMode = desc.polygonMode;
+	raster.cullMode = desc.cullMode;
+	raster.frontFace = desc.frontFace;
+	raster.lineWidth = 1.0f;
+
+	// Multisample
+	VkPipelineMultisampleStateCreateInfo multisample = {};
+	multisample.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+	multisample.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+	// Depth Stencil
+	VkPipelineDepthStencilStateCreateInfo depthStencil = {};
+	depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+	depthStencil.depthTestEnable = desc.depthTest;
+	depthStencil.depthWriteEnable = desc.depthWrite;
+	depthStencil.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+
+	// Color Blend
+	VkPipelineColorBlendAttachmentState blendAttachment = {};
+	blendAttachment.colorWriteMask =
+		VK_COLOR_COMPONENT_R_BIT |
+		VK_COLOR_COMPONENT_G_BIT |
+		VK_COLOR_COMPONENT_B_BIT |
+		VK_COLOR_COMPONENT_A_BIT;
+
+	if (desc.blend)
+	{
+		blendAttachment.blendEnable = VK_TRUE;
+		blendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+		blendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+		blendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+		blendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+		blendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+		blendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+	}
+
+	VkPipelineColorBlendStateCreateInfo blend = {};
+	blend.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+	blend.attachmentCount = 1;
+	blend.pAttachments = &blendAttachment;
+
+	// Create Info
+	VkGraphicsPipelineCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	createInfo.stageCount = 2;
+	createInfo.pStages = stages;
+	createInfo.pVertexInputState = &vertexInput;
+	createInfo.pInputAssemblyState = &inputAssembly;
+	createInfo.pViewportState = &viewport;
+	createInfo.pRasterizationState = &raster;
+	createInfo.pMultisampleState = &multisample;
+	createInfo.pDepthStencilState = &depthStencil;
+	createInfo.pColorBlendState = &blend;
+	createInfo.pDynamicState = &dynamic;
+	createInfo.layout = desc.layout;
+	createInfo.renderPass = desc.renderPass;
+	createInfo.subpass = desc.subpass;
+	createInfo.basePipelineIndex = -1;
+
+	// The cache is internally synchronized, workers share it
+	VkPipeline pipeline = VK_NULL_HANDLE;
+	VkResult r = vkCreateGraphicsPipelines(this->device, this->cache, 1, &createInfo, nullptr, &pipeline);
+
+	if (r != VK_SUCCESS)
+	{
+		std::ostringstream text;
+		text << "Failed to create graphics pipeline " << std::hex << entry->hash;
+
+		logger.log(LogSeverity::Error, "renderer", 0, text.str().c_str());
+		entry->failed = true;
+	}
+
+	this->compiled++;
+	this->compileMicros += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+	entry->pipeline.store(pipeline, std::memory_order_release);
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		entry->ready = true;
+	}
+
+	this->readyCond.notify_all();
+}
+
+void PipelineManager::loadCache()
+{
+	std::vector<char> data;
+
+	std::ifstream in(this->cachePath, std::ios::binary | std::ios::ate);
+
+	if (in.is_open())
+	{
+		uint64_t fileSize = (uint64_t)in.tellg();
+		in.seekg(0);
+
+		PipelineCacheHeader header = {};
+		in.read((char*)&header, sizeof(header));
+
+		// A truncated or corrupt header mustn't size the read
+		bool valid =
+			in.good() &&
+			header.dataSize == fileSize - sizeof(header) &&
+			header.magic == 0x48434350 &&
+			header.version == 1 &&
+			header.vendorID == this->props.vendorID &&
+			header.deviceID == this->props.deviceID &&
+			header.driverVersion == this->props.driverVersion &&
+			std::memcmp(header.uuid, this->props.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+
+		if (valid)
+		{
+			data.resize(header.dataSize);
+			in.read(data.data(), data.size());
+
+			if (!in.good())
+			{
+				data.clear();
+			}
+		}
+
+		if (data.size() == 0)
+		{
+			logger.log(LogSeverity::Info, "renderer", 0, ("Pipeline cache " + this->cachePath + " is stale, starting cold").c_str());
+		}
+	}
+
+	this->loadedCacheSize = data.size();
+
+	VkPipelineCacheCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	createInfo.initialDataSize = data.size();
+	createInfo.pInitialData = data.size() > 0 ? data.data() : nullptr;
+
+	VkResult r = vkCreatePipelineCache(this->device, &createInfo, nullptr, &this->cache);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to create pipeline cache.");
+	}
+}
+
+void PipelineManager::saveCache()
+{
+	size_t size = 0;
+	vkGetPipelineCacheData(this->device, this->cache, &size, nullptr);
+
+	std::vector<char> data(size);
+
+	if (size == 0 || vkGetPipelineCacheData(this->device, this->cache, &size, data.data()) != VK_SUCCESS)
+	{
+		return;
+	}
+
+	PipelineCacheHeader header = {};
+	header.magic = 0x48434350;
+	header.version = 1;
+	header.vendorID = this->props.vendorID;
+	header.deviceID = this->props.deviceID;
+	header.driverVersion = this->props.driverVersion;
+	std::memcpy(header.uuid, this->props.pipelineCacheUUID, VK_UUID_SIZE);
+	header.dataSize = size;
+
+	// Write aside and rename, a crash mid-write must not leave a torn cache
+	std::string temp = this->cachePath + ".tmp";
+
+	{
+		std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+
+		if (!out.is_open())
+		{
+			return;
+		}
+
+		out.write((const char*)&header, sizeof(header));
+		out.write(data.data(), size);
+	}
+
+#ifdef _WIN32
+	// std::rename won't replace an existing file here
+	bool renamed = MoveFileExA(temp.c_str(), this->cachePath.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	bool renamed = std::rename(temp.c_str(), this->cachePath.c_str()) == 0;
+#endif
+
+	if (!renamed)
+	{
+		std::remove(temp.c_str());
+	}
+}
+
+void GpuAllocator::init(VkDevice device, VkPhysicalDevice physicalDevice)
+{
+	this->device = device;
+
+	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &this->memProps);
+
+	VkPhysicalDeviceProperties props;
+	vkGetPhysicalDeviceProperties(physicalDevice, &props);
+
+	this->maxDeviceAllocations = props.limits.maxMemoryAllocationCount;
+}
+
+void GpuAllocator::release()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	if (this->liveAllocations > 0)
+	{
+		std::cout << "GpuAllocator: " << this->liveAllocations << " allocations leaked" << std::endl;
+	}
+
+	for (auto& block : this->blocks)
+	{
+		vkFreeMemory(this->device, block->memory, nullptr);
+	}
+
+	this->blocks.clear();
+}
+
+uint32_t GpuAllocator::findMemoryType(uint32_t typeBits, VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred)
+{
+	// Types are ordered by the driver from most to least performant
+	for (uint32_t pass = 0; pass < 2; pass++)
+	{
+		VkMemoryPropertyFlags flags = pass == 0 ? required | preferred : required;
+
+		for (uint32_t i = 0; i < this->memProps.memoryTypeCount; i++)
+		{
+			if ((typeBits & (1 << i)) && (this->memProps.memoryTypes[i].propertyFlags & flags) == flags)
+			{
+				return i;
+			}
+		}
+	}
+
+	throw std::runtime_error("Failed to find suitable memory type!");
+}
+
+void GpuAllocator::allocate(
+	const VkMemoryRequirements& reqs,
+	VkMemoryPropertyFlags required,
+	VkMemoryPropertyFlags preferred,
+	bool linear,
+	bool dedicated,
+	VkBuffer dedicatedBuffer,
+	VkImage dedicatedImage,
+	GpuAllocation& allocation)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	uint32_t memoryType = this->findMemoryType(reqs.memoryTypeBits, required, preferred);
+
+	allocation = GpuAllocation();
+
+	// Anything over half a block would waste most of it
+	if (dedicated || reqs.size > this->blockSizeFor(memoryType) / 2)
+	{
+		allocation.memory = this->allocateDeviceMemory(reqs.size, memoryType, dedicatedBuffer, dedicatedImage, &allocation.mapped);
+		allocation.size = reqs.size;
+
+		this->dedicatedCount++;
+		this->dedicatedBytes += reqs.size;
+		this->liveAllocations++;
+		return;
+	}
+
+	VkDeviceSize size = std::max(reqs.size, reqs.alignment);
+
+	for (auto& block : this->blocks)
+	{
+		if (block->memoryType == memoryType && block->linear == linear && this->allocateFromBlock(block.get(), size, allocation))
+		{
+			this->liveAllocations++;
+			return;
+		}
+	}
+
+	GpuMemoryBlock* block = this->createBlock(memoryType, linear);
+
+	if (!this->allocateFromBlock(block, size, allocation))
+	{
+		throw std::runtime_error("GpuAllocator: allocation doesn't fit a fresh block.");
+	}
+
+	this->liveAllocations++;
+}
+
+void GpuAllocator::free(GpuAllocation& allocation)
+{
+	if (allocation.memory == VK_NULL_HANDLE)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	this->liveAllocations--;
+
+	if (allocation.block == nullptr)
+	{
+		vkFreeMemory(this->device, allocation.memory, nullptr);
+
+		this->deviceAllocations--;
+		this->dedicatedCount--;
+		this->dedicatedBytes -= allocation.size;
+	}
+	else
+	{
+		GpuMemoryBlock* block = allocation.block;
+
+		this->freeToBlock(block, allocation.offset, allocation.order);
+
+		// Empty blocks go back to the driver unless they are the last one of
+		// their type, so a steady state alloc/free pattern doesn't hit it
+		if (block->allocations == 0)
+		{
+			uint32_t siblings = 0;
+
+			for (auto& other : this->blocks)
+			{
+				if (other->memoryType == block->memoryType && other->linear == block->linear)
+				{
+					siblings++;
+				}
+			}
+
+			if (siblings > 1)
+			{
+				vkFreeMemory(this->device, block->memory, nullptr);
+				this->deviceAllocations--;
+
+				this->blocks.erase(std::find_if(this->blocks.begin(), this->blocks.end(),
+					[block](const std::unique_ptr<GpuMemoryBlock>& b) { return b.get() == block; }));
+			}
+		}
+	}
+
+	allocation = GpuAllocation();
+}
+
+void GpuAllocator::createBuffer(
+	VkDeviceSize size,
+	VkBufferUsageFlags usage,
+	VkMemoryPropertyFlags required,
+	VkMemoryPropertyFlags preferred,
+	VkBuffer& buffer,
+	GpuAllocation& allocation,
+	const std::vector<uint32_t>& families)
+{
+	std::vector<uint32_t> shared = families;
+	std::sort(shared.begin(), shared.end());
+	shared.erase(std::unique(shared.begin(), shared.end()), shared.end());
+
+	VkBufferCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	createInfo.size = size;
+	createInfo.usage = usage;
+	createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+	if (shared.size() > 1)
+	{
+		createInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+		createInfo.queueFamilyIndexCount = shared.size();
+		createInfo.pQueueFamilyIndices = shared.data();
+	}
+
+	VkResult r = vkCreateBuffer(this->device, &createInfo, nullptr, &buffer);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to create buffer.");
+	}
+
+	VkMemoryDedicatedRequirements dedicatedReqs = {};
+	dedicatedReqs.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS;
+
+	VkMemoryRequirements2 reqs = {};
+	reqs.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+	reqs.pNext = &dedicatedReqs;
+
+	VkBufferMemoryRequirementsInfo2 info = {};
+	info.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_REQUIREMENTS_INFO_2;
+	info.buffer = buffer;
+
+	vkGetBufferMemoryRequirements2(this->device, &info, &reqs);
+
+	bool dedicated = dedicatedReqs.prefersDedicatedAllocation || dedicatedReqs.requiresDedicatedAllocation;
+
+	this->allocate(reqs.memoryRequirements, required, preferred, true, dedicated, buffer, VK_NULL_HANDLE, allocation);
+
+	vkBindBufferMemory(this->device, buffer, allocation.memory, allocation.offset);
+}
+
+void GpuAllocator::createImage(
+	const VkImageCreateInfo& createInfo,
+	VkMemoryPropertyFlags required,
+	VkImage& image,
+	GpuAllocation& allocation)
+{
+	VkResult r = vkCreateImage(this->device, &createInfo, nullptr, &image);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to create image.");
+	}
+
+	VkMemoryDedicatedRequirements dedicatedReqs = {};
+	dedicatedReqs.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS;
+
+	VkMemoryRequirements2 reqs = {};
+	reqs.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+	reqs.pNext = &dedicatedReqs;
+
+	VkImageMemoryRequirementsInfo2 info = {};
+	info.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2;
+	info.image = image;
+
+	vkGetImageMemoryRequirements2(this->device, &info, &reqs);
+
+	bool dedicated = dedicatedReqs.prefersDedicatedAllocation || dedicatedReqs.requiresDedicatedAllocation;
+	bool linear = createInfo.tiling == VK_IMAGE_TILING_LINEAR;
+
+	this->allocate(reqs.memoryRequirements, required, 0, linear, dedicated, VK_NULL_HANDLE, image, allocation);
+
+	vkBindImageMemory(this->device, image, allocation.memory, allocation.offset);
+}
+
+void GpuAllocator::destroyBuffer(VkBuffer buffer, GpuAllocation& allocation)
+{
+	vkDestroyBuffer(this->device, buffer, nullptr);
+	this->free(allocation);
+}
+
+void GpuAllocator::destroyImage(VkImage image, GpuAllocation& allocation)
+{
+	vkDestroyImage(this->device, image, nullptr);
+	this->free(allocation);
+}
+
+GpuAllocatorStats GpuAllocator::stats()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	GpuAllocatorStats stats;
+	stats.blocks = this->blocks.size();
+	stats.dedicated = this->dedicatedCount;
+	stats.allocations = this->liveAllocations;
+	stats.deviceAllocationCalls = this->deviceAllocationCalls;
+	stats.reserved = this->dedicatedBytes;
+	stats.used = this->dedicatedBytes;
+
+	VkDeviceSize free = 0;
+
+	for (auto& block : this->blocks)
+	{
+		stats.reserved += block->size;
+		stats.used += block->used;
+		free += block->size - block->used;
+
+		for (int32_t order = block->freeLists.size() - 1; order >= 0; order--)
+		{
+			if (block->freeLists[order].size() > 0)
+			{
+				stats.largestFree = std::max(stats.largestFree, this->minAllocation << order);
+				break;
+			}
+		}
+	}
+
+	if (free > 0)
+	{
+		stats.fragmentation = 1.0f - (float)stats.largestFree / (float)free;
+	}
+
+	return stats;
+}
+
+void GpuAllocator::printStats()
+{
+	GpuAllocatorStats s = this->stats();
+
+	std::cout << "GpuAllocator: " << s.allocations << " allocations in "
+		<< s.blocks << " blocks + " << s.dedicated << " dedicated, "
+		<< s.used / 1024 << "/" << s.reserved / 1024 << " KiB used, "
+		<< "fragmentation " << s.fragmentation << ", "
+		<< s.deviceAllocationCalls << " vkAllocateMemory calls" << std::endl;
+}
+
+VkDeviceMemory GpuAllocator::allocateDeviceMemory(VkDeviceSize size, uint32_t memoryType, VkBuffer dedicatedBuffer, VkImage dedicatedImage, void** mapped)
+{
+	if (this->deviceAllocations >= this->maxDeviceAllocations)
+	{
+		throw std::runtime_error("GpuAllocator: maxMemoryAllocationCount reached.");
+	}
+
+	VkMemoryDedicatedAllocateInfo dedicatedInfo = {};
+	dedicatedInfo.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+	dedicatedInfo.buffer = dedicatedBuffer;
+	dedicatedInfo.image = dedicatedImage;
+
+	VkMemoryAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.allocationSize = size;
+	allocInfo.memoryTypeIndex = memoryType;
+
+	if (dedicatedBuffer != VK_NULL_HANDLE || dedicatedImage != VK_NULL_HANDLE)
+	{
+		allocInfo.pNext = &dedicatedInfo;
+	}
+
+	VkDeviceMemory memory;
+	VkResult r = vkAllocateMemory(this->device, &allocInfo, nullptr, &memory);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("GpuAllocator: vkAllocateMemory failed.");
+	}
+
+	this->deviceAllocations++;
+	this->deviceAllocationCalls++;
+
+	*mapped = nullptr;
+
+	// Host visible memory stays mapped for its whole life
+	if (this->memProps.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+	{
+		r = vkMapMemory(this->device, memory, 0, VK_WHOLE_SIZE, 0, mapped);
+
+		if (r != VK_SUCCESS)
+		{
+			vkFreeMemory(this->device, memory, nullptr);
+			this->deviceAllocations--;
+
+			throw std::runtime_error("GpuAllocator: vkMapMemory failed.");
+		}
+	}
+
+	return memory;
+}
+
+VkDeviceSize GpuAllocator::blockSizeFor(uint32_t memoryType)
+{
+	// Small heaps (integrated parts, BAR windows) get smaller blocks
+	VkDeviceSize heapSize = this->memProps.memoryHeaps[this->memProps.memoryTypes[memoryType].heapIndex].size;
+	VkDeviceSize size = this->blockSize;
+
+	while (size > this->minAllocation && size > heapSize / 8)
+	{
+		size /= 2;
+	}
+
+	return size;
+}
+
+GpuMemoryBlock* GpuAllocator::createBlock(uint32_t memoryType, bool linear)
+{
+	VkDeviceSize size = this->blockSizeFor(memoryType);
+
+	GpuMemoryBlock* block = new GpuMemoryBlock();
+	block->memory = this->allocateDeviceMemory(size, memoryType, VK_NULL_HANDLE, VK_NULL_HANDLE, &block->mapped);
+	block->size = size;
+	block->memoryType = memoryType;
+	block->linear = linear;
+
+	uint32_t orders = 1;
+
+	while ((this->minAllocation << (orders - 1)) < size)
+	{
+		orders++;
+	}
+
+	block->freeLists.resize(orders);
+	block->freeLists[orders - 1].insert(0);
+
+	this->blocks.push_back(std::unique_ptr<GpuMemoryBlock>(block));
+
+	return block;
+}
+
+bool GpuAllocator::allocateFromBlock(GpuMemoryBlock* block, VkDeviceSize size, GpuAllocation& allocation)
+{
+	uint32_t order = 0;
+
+	while ((this->minAllocation << order) < size)
+	{
+		order++;
+	}
+
+	uint32_t maxOrder = block->freeLists.size() - 1;
+
+	if (order > maxOrder)
+	{
+		return false;
+	}
+
+	uint32_t o = order;
+
+	while (o <= maxOrder && block->freeLists[o].size() == 0)
+	{
+		o++;
+	}
+
+	if (o > maxOrder)
+	{
+		return false;
+	}
+
+	VkDeviceSize offset = *block->freeLists[o].begin();
+	block->freeLists[o].erase(block->freeLists[o].begin());
+
+	// Split down, the upper halves become free buddies
+	while (o > order)
+	{
+		o--;
+		block->freeLists[o].insert(offset + (this->minAllocation << o));
+	}
+
+	block->used += this->minAllocation << order;
+	block->allocations++;
+
+	allocation.memory = block->memory;
+	allocation.offset = offset;
+	allocation.size = this->minAllocation << order;
+	allocation.mapped = block->mapped != nullptr ? (char*)block->mapped + offset : nullptr;
+	allocation.block = block;
+	allocation.order = order;
+
+	return true;
+}
+
+void GpuAllocator::freeToBlock(GpuMemoryBlock* block, VkDeviceSize offset, uint32_t order)
+{
+	block->used -= this->minAllocation << order;
+	block->allocations--;
+
+	uint32_t maxOrder = block->freeLists.size() - 1;
+
+	// Merge with the buddy for as long as it is free too
+	while (order < maxOrder)
+	{
+		VkDeviceSize buddy = offset ^ (this->minAllocation << order);
+		auto it = block->freeLists[order].find(buddy);
+
+		if (it == block->freeLists[order].end())
+		{
+			break;
+		}
+
+		block->freeLists[order].erase(it);
+		offset = std::min(offset, buddy);
+		order++;
+	}
+
+	block->freeLists[order].insert(offset);
+}
+
+void GpuRingBuffer::init(GpuAllocator& allocator, VkDeviceSize frameSize, uint32_t frames, VkBufferUsageFlags usage)
+{
+	this->frameSize = frameSize;
+
+	allocator.createBuffer(
+		frameSize * frames,
+		usage,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		this->buffer,
+		this->allocation
+	);
+}
+
+void GpuRingBuffer::release(GpuAllocator& allocator)
+{
+	if (this->buffer != VK_NULL_HANDLE)
+	{
+		allocator.destroyBuffer(this->buffer, this->allocation);
+		this->buffer = VK_NULL_HANDLE;
+	}
+}
+
+void GpuRingBuffer::beginFrame(uint32_t frame)
+{
+	// The caller has waited on this frame's fence, its region is free again
+	this->frameBase = frame * this->frameSize;
+	this->head = 0;
+}
+
+bool GpuRingBuffer::allocate(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset, void*& data)
+{
+	// Align the offset into the buffer, frameSize needn't be a multiple of alignment
+	VkDeviceSize aligned = (this->frameBase + this->head + alignment - 1) / alignment * alignment - this->frameBase;
+
+	if (aligned + size > this->frameSize)
+	{
+		this->overflows++;
+		return false;
+	}
+
+	this->head = aligned + size;
+
+	offset = this->frameBase + aligned;
+	data = (char*)this->allocation.mapped + offset;
+
+	return true;
+}
+
+// Stages that may read uploaded data, graphics waits on uploads only there
+static const VkPipelineStageFlags uploadConsumerStages =
+	VK_PIPELINE_STAGE_TRANSFER_BIT |
+	VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+	VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+	VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+	VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+
+void StagingUploader::init(VkDevice device, GpuAllocator* allocator, VkQueue queue, uint32_t queueFamily, uint32_t graphicsFamily, VkDeviceSize ringSize)
+{
+	this->device = device;
+	this->allocator = allocator;
+	this->queue = queue;
+	this->queueFamily = queueFamily;
+	this->graphicsFamily = graphicsFamily;
+	this->ringSize = ringSize;
+
+	VkCommandPoolCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	createInfo.queueFamilyIndex = queueFamily;
+	createInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+
+	VkResult r = vkCreateCommandPool(device, &createInfo, nullptr, &this->commandPool);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("Transfer Command Pool wasn't initialized.");
+	}
+
+	allocator->createBuffer(
+		ringSize,
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		0,
+		this->ring,
+		this->ringMemory
+	);
+}
+
+void StagingUploader::release()
+{
+	if (this->uploadCount > 0)
+	{
+		std::cout << "StagingUploader: " << this->uploadCount << " uploads, "
+			<< this->uploadBytes / 1024 << " KiB in " << this->batchCount << " batches, "
+			<< this->ringStalls << " ring stalls" << std::endl;
+	}
+
+	for (auto& batch : this->batches)
+	{
+		vkDestroyFence(this->device, batch->fence, nullptr);
+		vkDestroySemaphore(this->device, batch->semaphore, nullptr);
+	}
+
+	this->batches.clear();
+	this->submitted.clear();
+	this->consumed.clear();
+	this->freeBatches.clear();
+	this->open = nullptr;
+
+	this->allocator->destroyBuffer(this->ring, this->ringMemory);
+
+	vkDestroyCommandPool(this->device, this->commandPool, nullptr);
+}
+
+void StagingUploader::uploadBuffer(VkBuffer dst, VkDeviceSize dstOffset, const void* data, VkDeviceSize size)
+{
+	VkDeviceSize offset = this->reserve(size, 16);
+	std::memcpy((char*)this->ringMemory.mapped + offset, data, size);
+
+	UploadBatch* batch = this->openBatch();
+
+	VkBufferCopy region = {};
+	region.srcOffset = offset;
+	region.dstOffset = dstOffset;
+	region.size = size;
+
+	vkCmdCopyBuffer(batch->cmd, this->ring, dst, 1, &region);
+
+	if (this->queueFamily != this->graphicsFamily)
+	{
+		VkBufferMemoryBarrier barrier = {};
+		barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = 0;
+		barrier.srcQueueFamilyIndex = this->queueFamily;
+		barrier.dstQueueFamilyIndex = this->graphicsFamily;
+		barrier.buffer = dst;
+		barrier.offset = dstOffset;
+		barrier.size = size;
+
+		// Release half
+		vkCmdPipelineBarrier(
+			batch->cmd,
+			VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+			0,
+			0, nullptr,
+			1, &barrier,
+			0, nullptr
+		);
+
+		barrier.srcAccessMask = 0;
+		barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+		batch->bufferAcquires.push_back(barrier);
+	}
+
+	batch->uploadBytes += size;
+	this->uploadCount++;
+	this->uploadBytes += size;
+}
+
+void StagingUploader::uploadImage(VkImage dst, VkExtent3D extent, const void* data, VkDeviceSize size, uint32_t mipLevel)
+{
+	UploadBatch* batch = this->openBatch();
+
+	VkImageMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = dst;
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.baseMipLevel = mipLevel;
+	barrier.subresourceRange.levelCount = 1;
+	barrier.subresourceRange.layerCount = 1;
+
+	vkCmdPipelineBarrier(
+		batch->cmd,
+		VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		0,
+		0, nullptr,
+		0, nullptr,
+		1, &barrier
+	);
+
+	// A stall in reserve submits the open batch, later batches on the same
+	// queue are still ordered after the transition above
+	VkDeviceSize rowBytes = size / std::max(extent.height, 1u);
+	uint32_t bandRows = std::max<VkDeviceSize>(this->ringSize / 4 / std::max<VkDeviceSize>(rowBytes, 1), 1);
+
+	for (uint32_t y = 0; y < extent.height; y += bandRows)
+	{
+		uint32_t rows = std::min(bandRows, extent.height - y);
+
+		VkDeviceSize offset = this->reserve(rows * rowBytes, 16);
+		std::memcpy((char*)this->ringMemory.mapped + offset, (const char*)data + y * rowBytes, rows * rowBytes);
+
+		VkBufferImageCopy region = {};
+		region.bufferOffset = offset;
+		region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		region.imageSubresource.mipLevel = mipLevel;
+		region.imageSubresource.layerCount = 1;
+		region.imageOffset.y = y;
+		region.imageExtent = { extent.width, rows, extent.depth };
+
+		vkCmdCopyBufferToImage(this->openBatch()->cmd, this->ring, dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+	}
+
+	batch = this->openBatch();
+
+	// Same family: the semaphore alone covers visibility, so the whole
+	// transition happens here. Otherwise this is the release half.
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = 0;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+	if (this->queueFamily != this->graphicsFamily)
+	{
+		barrier.srcQueueFamilyIndex = this->queueFamily;
+		barrier.dstQueueFamilyIndex = this->graphicsFamily;
+	}
+
+	vkCmdPipelineBarrier(
+		batch->cmd,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+		0,
+		0, nullptr,
+		0, nullptr,
+		1, &barrier
+	);
+
+	if (this->queueFamily != this->graphicsFamily)
+	{
+		barrier.srcAccessMask = 0;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		batch->imageAcquires.push_back(barrier);
+	}
+
+	batch->uploadBytes += size;
+	this->uploadCount++;
+	this->uploadBytes += size;
+}
+
+void StagingUploader::flush()
+{
+	UploadBatch* batch = this->open;
+
+	if (batch == nullptr)
+	{
+		return;
+	}
+
+	this->open = nullptr;
+
+	vkEndCommandBuffer(batch->cmd);
+
+	// The ring range ends wherever the head is now
+	batch->ringEnd = this->head;
+
+	vkResetFences(this->device, 1, &batch->fence);
+
+	VkSubmitInfo submitInfo = {};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &batch->cmd;
+	submitInfo.signalSemaphoreCount = 1;
+	submitInfo.pSignalSemaphores = &batch->semaphore;
+
+	VkResult r = vkQueueSubmit(this->queue, 1, &submitInfo, batch->fence);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to submit to transfer queue...");
+	}
+
+	this->submitted.push_back(batch);
+	this->batchCount++;
+}
+
+bool StagingUploader::hasSubmitted()
+{
+	for (UploadBatch* batch : this->submitted)
+	{
+		if (batch->consumedFrame == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void StagingUploader::consume(VkCommandBuffer cmd, std::vector<VkSemaphore>& waits, std::vector<VkPipelineStageFlags>& stages, uint64_t frame)
+{
+	std::vector<VkBufferMemoryBarrier> bufferAcquires;
+	std::vector<VkImageMemoryBarrier> imageAcquires;
+
+	for (UploadBatch* batch : this->submitted)
+	{
+		if (batch->consumedFrame != 0)
+		{
+			continue;
+		}
+
+		// +1 so frame 0 isn't mistaken for "not consumed"
+		batch->consumedFrame = frame + 1;
+
+		waits.push_back(batch->semaphore);
+		stages.push_back(uploadConsumerStages);
+
+		bufferAcquires.insert(bufferAcquires.end(), batch->bufferAcquires.begin(), batch->bufferAcquires.end());
+		imageAcquires.insert(imageAcquires.end(), batch->imageAcquires.begin(), batch->imageAcquires.end());
+
+		batch->bufferAcquires.clear();
+		batch->imageAcquires.clear();
+	}
+
+	if (bufferAcquires.size() > 0 || imageAcquires.size() > 0)
+	{
+		vkCmdPipelineBarrier(
+			cmd,
+			uploadConsumerStages,
+			uploadConsumerStages,
+			0,
+			0, nullptr,
+			bufferAcquires.size(), bufferAcquires.data(),
+			imageAcquires.size(), imageAcquires.data()
+		);
+	}
+}
+
+void StagingUploader::collect(uint64_t frame, uint32_t framesInFlight)
+{
+	// Ring space comes back in submission order as transfers finish
+	for (UploadBatch* batch : this->submitted)
+	{
+		if (batch->ringFreed)
+		{
+			continue;
+		}
+
+		if (vkGetFenceStatus(this->device, batch->fence) != VK_SUCCESS)
+		{
+			break;
+		}
+
+		batch->ringFreed = true;
+		this->tail = batch->ringEnd;
+		this->used -= batch->ringBytes;
+	}
+
+	// The semaphore is only free once the frame that waited on it is done
+	while (this->submitted.size() > 0)
+	{
+		UploadBatch* batch = this->submitted.front();
+
+		if (!batch->ringFreed || batch->consumedFrame == 0 || frame < batch->consumedFrame - 1 + framesInFlight)
+		{
+			break;
+		}
+
+		this->submitted.pop_front();
+		this->freeBatches.push_back(batch);
+	}
+}
+
+VkDeviceSize StagingUploader::reserve(VkDeviceSize size, VkDeviceSize alignment)
+{
+	if (size > this->ringSize)
+	{
+		throw std::runtime_error("Upload is larger than the staging ring.");
+	}
+
+	for (;;)
+	{
+		if (this->used == 0)
+		{
+			this->head = 0;
+			this->tail = 0;
+		}
+
+		VkDeviceSize offset = (this->head + alignment - 1) / alignment * alignment;
+
+		// head == tail with data in flight means the ring is full
+		if (this->head > this->tail || this->used == 0)
+		{
+			if (offset + size <= this->ringSize)
+			{
+				this->openBatch()->ringBytes += offset + size - this->head;
+				this->used += offset + size - this->head;
+				this->head = offset + size;
+				return offset;
+			}
+
+			// Wrap, the skipped tail end is charged to the open batch
+			if (size <= this->tail)
+			{
+				VkDeviceSize skipped = this->ringSize - this->head + size;
+				this->openBatch()->ringBytes += skipped;
+				this->used += skipped;
+				this->head = size;
+				return 0;
+			}
+		}
+		else if (this->head < this->tail && offset + size <= this->tail)
+		{
+			this->openBatch()->ringBytes += offset + size - this->head;
+			this->used += offset + size - this->head;
+			this->head = offset + size;
+			return offset;
+		}
+
+		// Full: get the open batch going and wait for the oldest transfer
+		this->ringStalls++;
+		this->flush();
+
+		UploadBatch* oldest = nullptr;
+
+		for (UploadBatch* batch : this->submitted)
+		{
+			if (!batch->ringFreed)
+			{
+				oldest = batch;
+				break;
+			}
+		}
+
+		vkWaitForFences(this->device, 1, &oldest->fence, VK_TRUE, std::numeric_limits<uint64_t>::max());
+
+		// Only ring space is reclaimed here, batches wait for their frame
+		this->collect(0, 1);
+	}
+}
+
+UploadBatch* StagingUploader::openBatch()
+{
+	if (this->open != nullptr)
+	{
+		return this->open;
+	}
+
+	UploadBatch* batch;
+
+	if (this->freeBatches.size() > 0)
+	{
+		batch = this->freeBatches.back();
+		this->freeBatches.pop_back();
+	}
+	else
+	{
+		this->batches.push_back(std::unique_ptr<UploadBatch>(new UploadBatch()));
+		batch = this->batches.back().get();
+
+		VkCommandBufferAllocateInfo allocInfo = {};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = this->commandPool;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		allocInfo.commandBufferCount = 1;
+
+		vkAllocateCommandBuffers(this->device, &allocInfo, &batch->cmd);
+
+		VkFenceCreateInfo fenceInfo = {};
+		fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+		vkCreateFence(this->device, &fenceInfo, nullptr, &batch->fence);
+
+		VkSemaphoreCreateInfo semaphoreInfo = {};
+		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		vkCreateSemaphore(this->device, &semaphoreInfo, nullptr, &batch->semaphore);
+	}
+
+	batch->ringEnd = 0;
+	batch->ringBytes = 0;
+	batch->uploadBytes = 0;
+	batch->ringFreed = false;
+	batch->consumedFrame = 0;
+
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+	vkBeginCommandBuffer(batch->cmd, &beginInfo);
+
+	this->open = batch;
+
+	return batch;
+}
+
+// Graphics waits on compute results only where they can be read
+static const VkPipelineStageFlags computeConsumerStages = uploadConsumerStages | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT;
+
+void AsyncCompute::init(VkDevice device, VkPhysicalDevice physicalDevice, VkQueue queue, uint32_t queueFamily, uint32_t graphicsFamily, uint32_t frameCount, float timestampPeriod)
+{
+	this->device = device;
+	this->queue = queue;
+	this->queueFamily = queueFamily;
+	this->graphicsFamily = graphicsFamily;
+
+	uint32_t queueFamilyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+
+	std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+
+	uint32_t validBits = std::min(
+		queueFamilies[queueFamily].timestampValidBits,
+		queueFamilies[graphicsFamily].timestampValidBits
+	);
+
+	// timestampPeriod is 0 when frame profiling is off
+	this->timestamps = timestampPeriod > 0.0f && validBits > 0;
+	this->timestampPeriod = timestampPeriod;
+	this->timestampMask = validBits >= 64 ? ~0ull : ((1ull << validBits) - 1);
+
+	this->frames.resize(frameCount);
+
+	for (auto& frame : this->frames)
+	{
+		VkCommandPoolCreateInfo poolInfo = {};
+		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		poolInfo.queueFamilyIndex = queueFamily;
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+		VkResult r = vkCreateCommandPool(device, &poolInfo, nullptr, &frame.commandPool);
+
+		if (r != VK_SUCCESS)
+		{
+			throw std::runtime_error("Compute Command Pool wasn't initialized.");
+		}
+
+		VkCommandBufferAllocateInfo allocInfo = {};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = frame.commandPool;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		allocInfo.commandBufferCount = 1;
+
+		vkAllocateCommandBuffers(device, &allocInfo, &frame.cmd);
+
+		// Signaled, the first beginFrame() has nothing to wait for
+		VkFenceCreateInfo fenceInfo = {};
+		fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+		fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+		vkCreateFence(device, &fenceInfo, nullptr, &frame.fence);
+
+		VkSemaphoreCreateInfo semaphoreInfo = {};
+		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		vkCreateSemaphore(device, &semaphoreInfo, nullptr, &frame.semaphore);
+
+		if (this->timestamps)
+		{
+			VkQueryPoolCreateInfo queryInfo = {};
+			queryInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+			queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+			queryInfo.queryCount = 2;
+
+			vkCreateQueryPool(device, &queryInfo, nullptr, &frame.computeQueries);
+			vkCreateQueryPool(device, &queryInfo, nullptr, &frame.graphicsQueries);
+		}
+	}
+}
+
+void AsyncCompute::release()
+{
+	if (this->submits > 0)
+	{
+		std::cout << "AsyncCompute: " << this->submits << " submits";
+
+		if (this->timedFrames > 0)
+		{
+			std::cout << ", compute " << this->computeMs / this->timedFrames << " ms"
+				<< ", graphics " << this->graphicsMs / this->timedFrames << " ms"
+				<< ", overlap " << this->overlapMs / this->timedFrames << " ms per frame";
+		}
+
+		std::cout << std::endl;
+	}
+
+	for (auto& frame : this->frames)
+	{
+		this->readTimestamps(frame);
+
+		if (frame.computeQueries != VK_NULL_HANDLE)
+		{
+			vkDestroyQueryPool(this->device, frame.computeQueries, nullptr);
+			vkDestroyQueryPool(this->device, frame.graphicsQueries, nullptr);
+		}
+
+		vkDestroySemaphore(this->device, frame.semaphore, nullptr);
+		vkDestroyFence(this->device, frame.fence, nullptr);
+		vkDestroyCommandPool(this->device, frame.commandPool, nullptr);
+	}
+
+	this->frames.clear();
+}
+
+void AsyncCompute::beginFrame(uint32_t frameIndex)
+{
+	this->current = frameIndex;
+
+	ComputeFrame& frame = this->frames[frameIndex];
+
+	vkWaitForFences(this->device, 1, &frame.fence, VK_TRUE, std::numeric_limits<uint64_t>::max());
+
+	this->readTimestamps(frame);
+
+	if (frame.submitted && !frame.consumed)
+	{
+		// Skipped frame: the semaphore is signaled with nobody waiting,
+		// replace it rather than signal it twice
+		vkDestroySemaphore(this->device, frame.semaphore, nullptr);
+
+		VkSemaphoreCreateInfo semaphoreInfo = {};
+		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		vkCreateSemaphore(this->device, &semaphoreInfo, nullptr, &frame.semaphore);
+	}
+
+	if (frame.recording)
+	{
+		vkEndCommandBuffer(frame.cmd);
+	}
+
+	vkResetCommandPool(this->device, frame.commandPool, 0);
+
+	frame.recording = false;
+	frame.submitted = false;
+	frame.consumed = false;
+	frame.graphicsTimed = false;
+	frame.bufferAcquires.clear();
+	frame.imageAcquires.clear();
+}
+
+VkCommandBuffer AsyncCompute::begin()
+{
+	ComputeFrame& frame = this->frames[this->current];
+
+	if (frame.submitted)
+	{
+		throw std::runtime_error("AsyncCompute: one submission per frame.");
+	}
+
+	if (frame.recording)
+	{
+		return frame.cmd;
+	}
+
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+	vkBeginCommandBuffer(frame.cmd, &beginInfo);
+
+	if (this->timestamps)
+	{
+		vkCmdResetQueryPool(frame.cmd, frame.computeQueries, 0, 2);
+		vkCmdWriteTimestamp(frame.cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame.computeQueries, 0);
+	}
+
+	frame.recording = true;
+
+	return frame.cmd;
+}
+
+void AsyncCompute::releaseBuffer(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size, VkAccessFlags srcAccess, VkAccessFlags dstAccess)
+{
+	if (this->queueFamily == this->graphicsFamily)
+	{
+		// The semaphore alone covers availability and visibility
+		return;
+	}
+
+	ComputeFrame& frame = this->frames[this->current];
+
+	VkBufferMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcAccessMask = srcAccess;
+	barrier.dstAccessMask = 0;
+	barrier.srcQueueFamilyIndex = this->queueFamily;
+	barrier.dstQueueFamilyIndex = this->graphicsFamily;
+	barrier.buffer = buffer;
+	barrier.offset = offset;
+	barrier.size = size;
+
+	vkCmdPipelineBarrier(
+		this->begin(),
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+		0,
+		0, nullptr,
+		1, &barrier,
+		0, nullptr
+	);
+
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = dstAccess;
+	frame.bufferAcquires.push_back(barrier);
+}
+
+void AsyncCompute::releaseImage(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, VkAccessFlags srcAccess, VkAccessFlags dstAccess)
+{
+	ComputeFrame& frame = this->frames[this->current];
+
+	VkImageMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.srcAccessMask = srcAccess;
+	barrier.dstAccessMask = 0;
+	barrier.oldLayout = oldLayout;
+	barrier.newLayout = newLayout;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = image;
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+	barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+
+	// Same family: only the layout changes, on the compute side
+	if (this->queueFamily != this->graphicsFamily)
+	{
+		barrier.srcQueueFamilyIndex = this->queueFamily;
+		barrier.dstQueueFamilyIndex = this->graphicsFamily;
+	}
+
+	vkCmdPipelineBarrier(
+		this->begin(),
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+		0,
+		0, nullptr,
+		0, nullptr,
+		1, &barrier
+	);
+
+	if (this->queueFamily != this->graphicsFamily)
+	{
+		barrier.srcAccessMask = 0;
+		barrier.dstAccessMask = dstAccess;
+		frame.imageAcquires.push_back(barrier);
+	}
+}
+
+void AsyncCompute::submit()
+{
+	ComputeFrame& frame = this->frames[this->current];
+
+	if (!frame.recording)
+	{
+		return;
+	}
+
+	if (this->timestamps)
+	{
+		vkCmdWriteTimestamp(frame.cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame.computeQueries, 1);
+	}
+
+	VkResult r = vkEndCommandBuffer(frame.cmd);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to end compute command buffer.");
+	}
+
+	frame.recording = false;
+
+	vkResetFences(this->device, 1, &frame.fence);
+
+	VkSubmitInfo submitInfo = {};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &frame.cmd;
+	submitInfo.signalSemaphoreCount = 1;
+	submitInfo.pSignalSemaphores = &frame.semaphore;
+
+	r = vkQueueSubmit(this->queue, 1, &submitInfo, frame.fence);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to submit to compute queue...");
+	}
+
+	frame.submitted = true;
+	this->submits++;
+}
+
+bool AsyncCompute::pending()
+{
+	for (auto& frame : this->frames)
+	{
+		if (frame.submitted && !frame.consumed)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void AsyncCompute::consume(VkCommandBuffer cmd, std::vector<VkSemaphore>& waits, std::vector<VkPipelineStageFlags>& stages)
+{
+	std::vector<VkBufferMemoryBarrier> bufferAcquires;
+	std::vector<VkImageMemoryBarrier> imageAcquires;
+
+	for (auto& frame : this->frames)
+	{
+		if (!frame.submitted || frame.consumed)
+		{
+			continue;
+		}
+
+		frame.consumed = true;
+
+		waits.push_back(frame.semaphore);
+		stages.push_back(computeConsumerStages);
+
+		bufferAcquires.insert(bufferAcquires.end(), frame.bufferAcquires.begin(), frame.bufferAcquires.end());
+		imageAcquires.insert(imageAcquires.end(), frame.imageAcquires.begin(), frame.imageAcquires.end());
+	}
+
+	ComputeFrame& frame = this->frames[this->current];
+
+	// Top of pipe isn't held back by the semaphore wait, so this marks
+	// when graphics actually started
+	if (this->timestamps && frame.submitted)
+	{
+		vkCmdResetQueryPool(cmd, frame.graphicsQueries, 0, 2);
+		vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame.graphicsQueries, 0);
+		frame.graphicsTimed = true;
+	}
+
+	if (bufferAcquires.size() > 0 || imageAcquires.size() > 0)
+	{
+		vkCmdPipelineBarrier(
+			cmd,
+			computeConsumerStages,
+			computeConsumerStages,
+			0,
+			0, nullptr,
+			bufferAcquires.size(), bufferAcquires.data(),
+			imageAcquires.size(), imageAcquires.data()
+		);
+	}
+}
+
+void AsyncCompute::endGraphicsTimer(VkCommandBuffer cmd)
+{
+	ComputeFrame& frame = this->frames[this->current];
+
+	if (frame.graphicsTimed)
+	{
+		vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame.graphicsQueries, 1);
+	}
+}
+
+void AsyncCompute::readTimestamps(ComputeFrame& frame)
+{
+	if (!frame.graphicsTimed)
+	{
+		return;
+	}
+
+	frame.graphicsTimed = false;
+
+	uint64_t compute[2];
+	uint64_t graphics[2];
+
+	VkResult r0 = vkGetQueryPoolResults(this->device, frame.computeQueries, 0, 2, sizeof(compute), compute, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+	VkResult r1 = vkGetQueryPoolResults(this->device, frame.graphicsQueries, 0, 2, sizeof(graphics), graphics, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+
+	if (r0 != VK_SUCCESS || r1 != VK_SUCCESS)
+	{
+		return;
+	}
+
+	// Both queues stamp in the device's timestamp domain
+	double scale = this->timestampPeriod / 1000000.0;
+
+	uint64_t start = std::max(compute[0], graphics[0]);
+	uint64_t end = std::min(compute[1], graphics[1]);
+
+	this->computeMs += ((compute[1] - compute[0]) & this->timestampMask) * scale;
+	this->graphicsMs += ((graphics[1] - graphics[0]) & this->timestampMask) * scale;
+	this->overlapMs += end > start ? ((end - start) & this->timestampMask) * scale : 0.0;
+	this->timedFrames++;
+}
+
+void ParallelRecorder::init(VkDevice device, uint32_t queueFamily, uint32_t frameCount, JobSystem* jobs)
+{
+	this->device = device;
+	this->jobs = jobs;
+
+	this->pools.resize(jobs->slotCount() + 1);
+
+	VkCommandPoolCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	createInfo.queueFamilyIndex = queueFamily;
+	createInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+	for (auto& threadPools : this->pools)
+	{
+		threadPools.resize(frameCount);
+
+		for (auto& pool : threadPools)
+		{
+			VkResult r = vkCreateCommandPool(device, &createInfo, nullptr, &pool.commandPool);
+
+			if (r != VK_SUCCESS)
+			{
+				throw std::runtime_error("Recording Command Pool wasn't initialized.");
+			}
+		}
+	}
+}
+
+void ParallelRecorder::release()
+{
+	if (this->passes > 0)
+	{
+		std::cout << "ParallelRecorder: " << this->passes << " passes in "
+			<< this->chunks << " chunks on " << this->jobs->slotCount() << " job slots" << std::endl;
+	}
+
+	for (auto& threadPools : this->pools)
+	{
+		for (auto& pool : threadPools)
+		{
+			vkDestroyCommandPool(this->device, pool.commandPool, nullptr);
+		}
+	}
+
+	this->pools.clear();
+}
+
+void ParallelRecorder::beginFrame(uint32_t frame)
+{
+	this->frame = frame;
+
+	// record() waits for its jobs, so no chunk is in flight here
+	for (auto& threadPools : this->pools)
+	{
+		RecordPool& pool = threadPools[frame];
+
+		vkResetCommandPool(this->device, pool.commandPool, 0);
+		pool.commandBufferUsed = 0;
+	}
+}
+
+void ParallelRecorder::record(const VkCommandBufferInheritanceInfo& inheritance, uint32_t itemCount, const RecordFunc& func, std::vector<VkCommandBuffer>& commandBuffers)
+{
+	// A few chunks per thread so a slow chunk doesn't hold up the pass
+	uint32_t chunkCount = std::min(itemCount, this->jobs->slotCount() * 4);
+
+	commandBuffers.assign(chunkCount, VK_NULL_HANDLE);
+
+	JobCounter counter;
+
+	for (uint32_t chunk = 0; chunk < chunkCount; chunk++)
+	{
+		uint32_t first = (uint64_t)chunk * itemCount / chunkCount;
+		uint32_t last = (uint64_t)(chunk + 1) * itemCount / chunkCount;
+
+		// Slot by chunk index keeps the execution order deterministic
+		VkCommandBuffer* output = &commandBuffers[chunk];
+
+		this->jobs->run([this, &inheritance, &func, first, last, output]()
+		{
+			this->recordChunk(inheritance, func, first, last - first, *output);
+		}, &counter);
+	}
+
+	this->jobs->wait(counter);
+
+	this->passes++;
+	this->chunks += chunkCount;
+}
+
+void ParallelRecorder::recordChunk(const VkCommandBufferInheritanceInfo& inheritance, const RecordFunc& func, uint32_t first, uint32_t count, VkCommandBuffer& output)
+{
+	uint32_t slot = this->jobs->threadIndex();
+
+	// Unregistered threads share the last pools
+	std::unique_lock<std::mutex> lock(this->externalMutex, std::defer_lock);
+
+	if (slot == UINT32_MAX)
+	{
+		slot = this->pools.size() - 1;
+		lock.lock();
+	}
+
+	VkCommandBuffer cmd = this->allocSecondary(slot);
+
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+	beginInfo.pInheritanceInfo = &inheritance;
+
+	vkBeginCommandBuffer(cmd, &beginInfo);
+
+	func(cmd, first, count);
+
+	VkResult r = vkEndCommandBuffer(cmd);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to end secondary command buffer.");
+	}
+
+	output = cmd;
+}
+
+VkCommandBuffer ParallelRecorder::allocSecondary(uint32_t slot)
+{
+	RecordPool& pool = this->pools[slot][this->frame];
+
+	if (pool.commandBufferUsed < pool.commandBuffers.size())
+	{
+		return pool.commandBuffers[pool.commandBufferUsed++];
+	}
+
+	VkCommandBufferAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+	allocInfo.commandPool = pool.commandPool;
+	allocInfo.commandBufferCount = 1;
+
+	VkCommandBuffer temp;
+	VkResult r = vkAllocateCommandBuffers(this->device, &allocInfo, &temp);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to allocate secondary command buffer.");
+	}
+
+	pool.commandBuffers.push_back(temp);
+	pool.commandBufferUsed++;
+
+	return temp;
+}
+
+static bool renderGraphWrites(RenderGraphAccess access)
+{
+	return access == RenderGraphAccess::ColorWrite || access == RenderGraphAccess::StorageWrite;
+}
+
+static bool renderGraphAttachment(RenderGraphAccess access)
+{
+	return access == RenderGraphAccess::ColorWrite || access == RenderGraphAccess::InputRead;
+}
+
+// Layout an access needs, attachments are transitioned by the render pass
+static VkImageLayout renderGraphLayout(RenderGraphAccess access)
+{
+	switch (access)
+	{
+	case RenderGraphAccess::SampledRead:
+		return VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	case RenderGraphAccess::StorageRead:
+	case RenderGraphAccess::StorageWrite:
+		return VK_IMAGE_LAYOUT_GENERAL;
+	default:
+		return VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	}
+}
+
+// Anything that may have touched a transient image's memory before, it
+// can be aliased with an image used earlier in the frame
+static const VkPipelineStageFlags renderGraphPriorStages =
+	VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+	VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+	VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+
+// Every subpass waits for whatever came before the render pass and is
+// waited on by whatever comes after; subpasses sharing an attachment are
+// ordered by region. useMask is per subpass and attachment, 1 color write,
+// 2 input read.
+static void renderGraphDependencies(const std::vector<std::vector<uint8_t>>& useMask, std::vector<VkSubpassDependency>& dependencies)
+{
+	for (uint32_t s = 0; s < useMask.size(); s++)
+	{
+		// Whatever touched the attachments before this render pass
+		VkSubpassDependency in = {};
+		in.srcSubpass = VK_SUBPASS_EXTERNAL;
+		in.dstSubpass = s;
+		in.srcStageMask = renderGraphPriorStages;
+		in.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+		in.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+		in.dstAccessMask =
+			VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+			VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+			VK_ACCESS_INPUT_ATTACHMENT_READ_BIT |
+			VK_ACCESS_SHADER_READ_BIT;
+		dependencies.push_back(in);
+
+		// Whatever reads the results after it
+		VkSubpassDependency out = {};
+		out.srcSubpass = s;
+		out.dstSubpass = VK_SUBPASS_EXTERNAL;
+		out.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+		out.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+		out.dstStageMask = renderGraphPriorStages | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT;
+		out.dstAccessMask =
+			VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+			VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+			VK_ACCESS_INPUT_ATTACHMENT_READ_BIT |
+			VK_ACCESS_SHADER_READ_BIT |
+			VK_ACCESS_SHADER_WRITE_BIT;
+		dependencies.push_back(out);
+
+		for (uint32_t t = s + 1; t < useMask.size(); t++)
+		{
+			VkSubpassDependency dep = {};
+			dep.srcSubpass = s;
+			dep.dstSubpass = t;
+			dep.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+
+			for (uint32_t a = 0; a < useMask[s].size(); a++)
+			{
+				if (useMask[s][a] == 0 || useMask[t][a] == 0)
+				{
+					continue;
+				}
+
+				if (useMask[s][a] & 1)
+				{
+					dep.srcStageMask |= VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+					dep.srcAccessMask |= VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+				}
+
+				if (useMask[s][a] & 2)
+				{
+					dep.srcStageMask |= VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+				}
+
+				if (useMask[t][a] & 1)
+				{
+					dep.dstStageMask |= VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+					dep.dstAccessMask |= VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+				}
+
+				if (useMask[t][a] & 2)
+				{
+					dep.dstStageMask |= VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+					dep.dstAccessMask |= VK_ACCESS_INPUT_ATTACHMENT_READ_BIT;
+				}
+			}
+
+			if (dep.srcStageMask != 0)
+			{
+				dependencies.push_back(dep);
+			}
+		}
+	}
+}
+
+void RenderGraphPass::write(uint32_t resource)
+{
+	RenderGraphUse use;
+	use.resource = resource;
+	use.access = RenderGraphAccess::ColorWrite;
+	this->uses.push_back(use);
+}
+
+void RenderGraphPass::clear(uint32_t resource, const glm::vec4& color)
+{
+	RenderGraphUse use;
+	use.resource = resource;
+	use.access = RenderGraphAccess::ColorWrite;
+	use.clear = true;
+	use.clearValue.float32[0] = color.r;
+	use.clearValue.float32[1] = color.g;
+	use.clearValue.float32[2] = color.b;
+	use.clearValue.float32[3] = color.a;
+	this->uses.push_back(use);
+}
+
+void RenderGraphPass::readInput(uint32_t resource)
+{
+	RenderGraphUse use;
+	use.resource = resource;
+	use.access = RenderGraphAccess::InputRead;
+	this->uses.push_back(use);
+}
+
+void RenderGraphPass::sample(uint32_t resource)
+{
+	RenderGraphUse use;
+	use.resource = resource;
+	use.access = RenderGraphAccess::SampledRead;
+	this->uses.push_back(use);
+}
+
+void RenderGraphPass::readStorage(uint32_t resource)
+{
+	RenderGraphUse use;
+	use.resource = resource;
+	use.access = RenderGraphAccess::StorageRead;
+	this->uses.push_back(use);
+}
+
+void RenderGraphPass::writeStorage(uint32_t resource)
+{
+	RenderGraphUse use;
+	use.resource = resource;
+	use.access = RenderGraphAccess::StorageWrite;
+	this->uses.push_back(use);
+}
+
+void RenderGraph::init(VkDevice device, GpuAllocator* allocator, uint32_t framesInFlight)
+{
+	this->device = device;
+	this->allocator = allocator;
+	this->framesInFlight = framesInFlight;
+}
+
+void RenderGraph::release()
+{
+	if (this->compiles > 0)
+	{
+		std::cout << "RenderGraph: " << this->compiles << " compiles";
+
+		for (auto& entry : this->compiled)
+		{
+			CompiledRenderGraph& graph = *entry.second;
+
+			std::cout << ", [" << graph.groups.size() << " groups, " << graph.subpasses << " subpasses, "
+				<< graph.folded << " clears folded, " << graph.culled << " culled, "
+				<< graph.aliasedBytes / 1024 << " KiB aliased]";
+		}
+
+		std::cout << std::endl;
+	}
+
+	for (auto& entry : this->compiled)
+	{
+		this->destroy(*entry.second);
+	}
+
+	this->compiled.clear();
+
+	for (auto& entry : this->compatiblePasses)
+	{
+		vkDestroyRenderPass(this->device, entry.second, nullptr);
+	}
+
+	this->compatiblePasses.clear();
+}
+
+void RenderGraph::reset(uint64_t frame)
+{
+	this->frame = frame;
+
+	this->resources.clear();
+	this->passes.clear();
+
+	// Only objects the GPU is done with, this frame's fence has signaled
+	uint64_t keep = std::max(this->keepFrames, this->framesInFlight);
+
+	for (auto it = this->compiled.begin(); it != this->compiled.end();)
+	{
+		CompiledRenderGraph& graph = *it->second;
+
+		if (graph.lastUsed + keep <= frame)
+		{
+			this->destroy(graph);
+			it = this->compiled.erase(it);
+			continue;
+		}
+
+		for (auto& group : graph.groups)
+		{
+			for (auto fb = group.framebuffers.begin(); fb != group.framebuffers.end();)
+			{
+				if (fb->second.lastUsed + keep <= frame)
+				{
+					vkDestroyFramebuffer(this->device, fb->second.framebuffer, nullptr);
+					fb = group.framebuffers.erase(fb);
+				}
+				else
+				{
+					fb++;
+				}
+			}
+		}
+
+		it++;
+	}
+}
+
+uint32_t RenderGraph::importImage(VkImage image, VkImageView view, VkFormat format, VkExtent2D extent, VkImageLayout initialLayout, VkImageLayout finalLayout)
+{
+	RenderGraphResource resource;
+	resource.format = format;
+	resource.extent = extent;
+	resource.imported = true;
+	resource.image = image;
+	resource.view = view;
+	resource.initialLayout = initialLayout;
+	resource.finalLayout = finalLayout;
+
+	this->resources.push_back(resource);
+
+	return this->resources.size() - 1;
+}
+
+uint32_t RenderGraph::createImage(VkFormat format, VkExtent2D extent)
+{
+	RenderGraphResource resource;
+	resource.format = format;
+	resource.extent = extent;
+
+	this->resources.push_back(resource);
+
+	return this->resources.size() - 1;
+}
+
+RenderGraphPass& RenderGraph::addPass(const char* name, bool compute)
+{
+	this->passes.push_back(RenderGraphPass());
+
+	RenderGraphPass& pass = this->passes.back();
+	pass.name = name;
+	pass.compute = compute;
+
+	return pass;
+}
+
+void RenderGraph::execute(VkCommandBuffer cmd)
+{
+	uint64_t h = this->hash();
+
+	auto range = this->compiled.equal_range(h);
+	auto it = range.first;
+
+	while (it != range.second && it->second->key != this->key)
+	{
+		it++;
+	}
+
+	if (it == range.second)
+	{
+		CompiledRenderGraph* graph = this->compile();
+		graph->key = this->key;
+
+		it = this->compiled.insert({ h, std::unique_ptr<CompiledRenderGraph>(graph) });
+		this->compiles++;
+	}
+
+	CompiledRenderGraph& graph = *it->second;
+	graph.lastUsed = this->frame;
+
+	this->views.resize(this->resources.size());
+
+	for (uint32_t r = 0; r < this->resources.size(); r++)
+	{
+		this->views[r] = this->resources[r].imported ? this->resources[r].view : graph.views[r];
+	}
+
+	for (auto& group : graph.groups)
+	{
+		uint32_t timer = this->beginTimer ? this->beginTimer(cmd, group.name) : UINT32_MAX;
+
+		this->recordBarriers(cmd, graph, group.before);
+
+		RenderGraphContext ctx = {};
+		ctx.cmd = cmd;
+		ctx.extent = group.extent;
+
+		if (group.compute)
+		{
+			for (uint32_t p : group.passes)
+			{
+				if (this->passes[p].execute)
+				{
+					this->passes[p].execute(ctx);
+				}
+			}
+
+			if (this->endTimer)
+			{
+				this->endTimer(cmd, timer);
+			}
+
+			continue;
+		}
+
+		ctx.renderPass = group.renderPass;
+		ctx.compatiblePass = group.compatiblePass;
+		ctx.framebuffer = this->framebuffer(graph, group);
+
+		std::vector<VkClearValue> clearValues(group.attachments.size());
+
+		for (uint32_t a = 0; a < group.attachments.size(); a++)
+		{
+			if (group.clearPasses[a] == UINT32_MAX)
+			{
+				continue;
+			}
+
+			for (const auto& use : this->passes[group.clearPasses[a]].uses)
+			{
+				if (use.clear && use.resource == group.attachments[a])
+				{
+					clearValues[a].color = use.clearValue;
+				}
+			}
+		}
+
+		VkRenderPassBeginInfo rp = {};
+		rp.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+		rp.renderPass = group.renderPass;
+		rp.framebuffer = ctx.framebuffer;
+		rp.renderArea.offset = { 0, 0 };
+		rp.renderArea.extent = group.extent;
+		rp.clearValueCount = clearValues.size();
+		rp.pClearValues = clearValues.data();
+
+		for (uint32_t s = 0; s < group.passes.size(); s++)
+		{
+			const RenderGraphPass& pass = this->passes[group.passes[s]];
+
+			VkSubpassContents contents = pass.secondary ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE;
+
+			if (s == 0)
+			{
+				vkCmdBeginRenderPass(cmd, &rp, contents);
+			}
+			else
+			{
+				vkCmdNextSubpass(cmd, contents);
+			}
+
+			ctx.subpass = s;
+
+			if (pass.execute)
+			{
+				pass.execute(ctx);
+			}
+		}
+
+		vkCmdEndRenderPass(cmd);
+
+		if (this->endTimer)
+		{
+			this->endTimer(cmd, timer);
+		}
+	}
+
+	this->recordBarriers(cmd, graph, graph.after);
+}
+
+uint64_t RenderGraph::hash()
+{
+	this->key.clear();
+
+	for (const auto& resource : this->resources)
+	{
+		this->key.push_back(resource.format);
+		this->key.push_back(resource.extent.width);
+		this->key.push_back(resource.extent.height);
+		this->key.push_back(resource.imported);
+		this->key.push_back(resource.initialLayout);
+		this->key.push_back(resource.finalLayout);
+	}
+
+	// Resources and passes can't run into each other, the pass count goes between
+	this->key.push_back(UINT64_MAX);
+	this->key.push_back(this->passes.size());
+
+	for (const auto& pass : this->passes)
+	{
+		// Names are literals; they label the group timers
+		this->key.push_back((uint64_t)(uintptr_t)pass.name);
+		this->key.push_back(pass.compute);
+		this->key.push_back(pass.secondary);
+		this->key.push_back((bool)pass.execute);
+		this->key.push_back(pass.uses.size());
+
+		for (const auto& use : pass.uses)
+		{
+			this->key.push_back(use.resource);
+			this->key.push_back((uint64_t)use.access);
+			this->key.push_back(use.clear);
+		}
+	}
+
+	uint64_t h = 14695981039346656037ull;
+
+	for (uint64_t value : this->key)
+	{
+		h = hashValue(h, value);
+	}
+
+	return h;
+}
+
+void RenderGraph::forgetView(VkImageView view, std::vector<VkFramebuffer>& retired)
+{
+	for (auto& entry : this->compiled)
+	{
+		for (auto& group : entry.second->groups)
+		{
+			for (auto fb = group.framebuffers.begin(); fb != group.framebuffers.end();)
+			{
+				if (std::find(fb->first.begin(), fb->first.end(), view) != fb->first.end())
+				{
+					retired.push_back(fb->second.framebuffer);
+					fb = group.framebuffers.erase(fb);
+				}
+				else
+				{
+					fb++;
+				}
+			}
+		}
+	}
+}
+
+CompiledRenderGraph* RenderGraph::compile()
+{
+	CompiledRenderGraph* graph = new CompiledRenderGraph();
+
+	uint32_t passCount = this->passes.size();
+	uint32_t resourceCount = this->resources.size();
+
+	// Cull, walking back from the imported images: a pass lives if
+	// something later reads what it writes
+	std::vector<bool> live(passCount, false);
+	std::vector<bool> needed(resourceCount, false);
+
+	for (uint32_t r = 0; r < resourceCount; r++)
+	{
+		needed[r] = this->resources[r].imported;
+	}
+
+	for (int32_t p = passCount - 1; p >= 0; p--)
+	{
+		const RenderGraphPass& pass = this->passes[p];
+
+		for (const auto& use : pass.uses)
+		{
+			if (renderGraphWrites(use.access) && needed[use.resource])
+			{
+				live[p] = true;
+			}
+		}
+
+		if (!live[p])
+		{
+			graph->culled++;
+			continue;
+		}
+
+		// Nothing written before a clear survives it, every other use
+		// depends on the previous contents
+		for (const auto& use : pass.uses)
+		{
+			needed[use.resource] = !use.clear;
+		}
+	}
+
+	// Group, a graphics pass joins the open render pass unless it would
+	// sample what the render pass writes or needs a clear mid-pass
+	std::vector<bool> written(resourceCount);
+	std::vector<bool> attached(resourceCount);
+	std::vector<bool> shaderUsed(resourceCount);
+
+	for (uint32_t p = 0; p < passCount; p++)
+	{
+		if (!live[p])
+		{
+			continue;
+		}
+
+		const RenderGraphPass& pass = this->passes[p];
+
+		VkExtent2D extent = {};
+		bool hasAttachment = false;
+
+		for (const auto& use : pass.uses)
+		{
+			if (renderGraphAttachment(use.access))
+			{
+				extent = this->resources[use.resource].extent;
+				hasAttachment = true;
+			}
+		}
+
+		if (!pass.compute && !hasAttachment)
+		{
+			throw std::runtime_error("RenderGraph: graphics pass without attachments.");
+		}
+
+		bool join =
+			graph->groups.size() > 0 &&
+			!pass.compute &&
+			!graph->groups.back().compute &&
+			graph->groups.back().extent.width == extent.width &&
+			graph->groups.back().extent.height == extent.height;
+
+		for (const auto& use : pass.uses)
+		{
+			uint32_t r = use.resource;
+
+			if (renderGraphAttachment(use.access))
+			{
+				if (shaderUsed[r] || (use.clear && (attached[r] || written[r])))
+				{
+					join = false;
+				}
+			}
+			else if (written[r] || attached[r])
+			{
+				join = false;
+			}
+		}
+
+		if (!join)
+		{
+			graph->groups.push_back(RenderGraphGroup());
+			graph->groups.back().compute = pass.compute;
+			graph->groups.back().extent = extent;
+
+			written.assign(resourceCount, false);
+			attached.assign(resourceCount, false);
+			shaderUsed.assign(resourceCount, false);
+		}
+
+		graph->groups.back().passes.push_back(p);
+
+		for (const auto& use : pass.uses)
+		{
+			written[use.resource] = written[use.resource] || renderGraphWrites(use.access);
+			attached[use.resource] = attached[use.resource] || renderGraphAttachment(use.access);
+			shaderUsed[use.resource] = shaderUsed[use.resource] || !renderGraphAttachment(use.access);
+		}
+	}
+
+	// First access of every resource in every group, for the lookahead
+	std::vector<std::vector<std::pair<uint32_t, RenderGraphAccess>>> timeline(resourceCount);
+
+	for (uint32_t g = 0; g < graph->groups.size(); g++)
+	{
+		for (uint32_t p : graph->groups[g].passes)
+		{
+			for (const auto& use : this->passes[p].uses)
+			{
+				auto& entries = timeline[use.resource];
+
+				if (entries.size() == 0 || entries.back().first != g)
+				{
+					entries.push_back({ g, use.access });
+				}
+			}
+		}
+	}
+
+	// State of every resource as the groups are walked in order
+	std::vector<VkImageLayout> layouts(resourceCount);
+	std::vector<bool> defined(resourceCount);
+	std::vector<VkPipelineStageFlags> lastStages(resourceCount);
+	std::vector<VkAccessFlags> pendingWrites(resourceCount, 0);
+
+	for (uint32_t r = 0; r < resourceCount; r++)
+	{
+		const RenderGraphResource& resource = this->resources[r];
+
+		layouts[r] = resource.imported ? resource.initialLayout : VK_IMAGE_LAYOUT_UNDEFINED;
+		defined[r] = layouts[r] != VK_IMAGE_LAYOUT_UNDEFINED;
+		lastStages[r] = resource.imported ? 0 : renderGraphPriorStages;
+	}
+
+	for (uint32_t g = 0; g < graph->groups.size(); g++)
+	{
+		RenderGraphGroup& group = graph->groups[g];
+
+		VkPipelineStageFlags shaderStages = group.compute ?
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT :
+			VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+
+		// Shader accesses get their transitions batched in front of the group
+		std::vector<bool> seen(resourceCount, false);
+		std::vector<bool> shaderWrites(resourceCount, false);
+
+		for (uint32_t p : group.passes)
+		{
+			for (const auto& use : this->passes[p].uses)
+			{
+				if (use.access == RenderGraphAccess::StorageWrite)
+				{
+					shaderWrites[use.resource] = true;
+				}
+			}
+		}
+
+		for (uint32_t p : group.passes)
+		{
+			for (const auto& use : this->passes[p].uses)
+			{
+				uint32_t r = use.resource;
+
+				if (renderGraphAttachment(use.access) || seen[r])
+				{
+					continue;
+				}
+
+				seen[r] = true;
+
+				VkImageLayout layout = renderGraphLayout(use.access);
+
+				if (layouts[r] != layout || pendingWrites[r] != 0 || (shaderWrites[r] && lastStages[r] != 0))
+				{
+					RenderGraphBarrier barrier;
+					barrier.resource = r;
+					barrier.oldLayout = defined[r] ? layouts[r] : VK_IMAGE_LAYOUT_UNDEFINED;
+					barrier.newLayout = layout;
+					barrier.srcAccess = pendingWrites[r];
+					barrier.dstAccess = shaderWrites[r] ? VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT : VK_ACCESS_SHADER_READ_BIT;
+
+					group.before.barriers.push_back(barrier);
+					group.before.srcStages |= lastStages[r] != 0 ? lastStages[r] : (VkPipelineStageFlags)VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+					group.before.dstStages |= shaderStages;
+				}
+
+				layouts[r] = layout;
+				lastStages[r] = shaderStages;
+
+				// The render pass' outgoing dependency covers shader writes
+				// of graphics groups, only compute leaves them pending
+				pendingWrites[r] = shaderWrites[r] && group.compute ? VK_ACCESS_SHADER_WRITE_BIT : 0;
+				defined[r] = defined[r] || shaderWrites[r];
+			}
+		}
+
+		if (group.compute)
+		{
+			continue;
+		}
+
+		// Attachments in order of first use, before clears are folded away
+		for (uint32_t p : group.passes)
+		{
+			for (const auto& use : this->passes[p].uses)
+			{
+				if (!renderGraphAttachment(use.access))
+				{
+					continue;
+				}
+
+				auto it = std::find(group.attachments.begin(), group.attachments.end(), use.resource);
+
+				if (it == group.attachments.end())
+				{
+					group.attachments.push_back(use.resource);
+					group.clearPasses.push_back(use.clear ? p : UINT32_MAX);
+				}
+			}
+		}
+
+		// A pass that only clears becomes the load op of its attachments,
+		// as long as a later subpass still uses them
+		std::vector<uint32_t> subpasses;
+		std::vector<bool> referencedLater(resourceCount, false);
+
+		for (int32_t i = group.passes.size() - 1; i >= 0; i--)
+		{
+			const RenderGraphPass& pass = this->passes[group.passes[i]];
+
+			bool fold = !pass.execute;
+
+			for (const auto& use : pass.uses)
+			{
+				if (!use.clear || !referencedLater[use.resource])
+				{
+					fold = false;
+				}
+			}
+
+			if (fold)
+			{
+				graph->folded++;
+				continue;
+			}
+
+			subpasses.insert(subpasses.begin(), group.passes[i]);
+
+			for (const auto& use : pass.uses)
+			{
+				referencedLater[use.resource] = true;
+			}
+		}
+
+		group.passes = subpasses;
+		graph->subpasses += subpasses.size();
+
+		uint32_t attachmentCount = group.attachments.size();
+		uint32_t subpassCount = subpasses.size();
+
+		std::vector<VkAttachmentDescription> attachments(attachmentCount);
+
+		for (uint32_t a = 0; a < attachmentCount; a++)
+		{
+			uint32_t r = group.attachments[a];
+			const RenderGraphResource& resource = this->resources[r];
+
+			const std::pair<uint32_t, RenderGraphAccess>* next = nullptr;
+
+			for (const auto& entry : timeline[r])
+			{
+				if (entry.first > g)
+				{
+					next = &entry;
+					break;
+				}
+			}
+
+			VkAttachmentDescription& desc = attachments[a];
+			desc.format = resource.format;
+			desc.samples = VK_SAMPLE_COUNT_1_BIT;
+
+			if (group.clearPasses[a] != UINT32_MAX)
+			{
+				desc.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+			}
+			else
+			{
+				desc.loadOp = defined[r] ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+			}
+
+			desc.storeOp = next != nullptr || resource.imported ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+
+			desc.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+			desc.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+
+			desc.initialLayout = desc.loadOp == VK_ATTACHMENT_LOAD_OP_LOAD ? layouts[r] : VK_IMAGE_LAYOUT_UNDEFINED;
+
+			// Leave it in the layout of its next use, the render pass does
+			// the transition for free
+			if (next != nullptr)
+			{
+				desc.finalLayout = renderGraphLayout(next->second);
+			}
+			else if (resource.imported && resource.finalLayout != VK_IMAGE_LAYOUT_UNDEFINED)
+			{
+				desc.finalLayout = resource.finalLayout;
+			}
+			else
+			{
+				desc.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+			}
+
+			layouts[r] = desc.finalLayout;
+			defined[r] = desc.storeOp == VK_ATTACHMENT_STORE_OP_STORE;
+			lastStages[r] = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+			pendingWrites[r] = 0;
+		}
+
+		// Per subpass and attachment: 1 color write, 2 input read
+		std::vector<std::vector<uint8_t>> useMask(subpassCount, std::vector<uint8_t>(attachmentCount, 0));
+		std::vector<std::vector<VkAttachmentReference>> colorRefs(subpassCount);
+		std::vector<std::vector<VkAttachmentReference>> inputRefs(subpassCount);
+		std::vector<std::vector<uint32_t>> preserveRefs(subpassCount);
+
+		for (uint32_t s = 0; s < subpassCount; s++)
+		{
+			for (const auto& use : this->passes[subpasses[s]].uses)
+			{
+				if (!renderGraphAttachment(use.access))
+				{
+					continue;
+				}
+
+				uint32_t a = std::find(group.attachments.begin(), group.attachments.end(), use.resource) - group.attachments.begin();
+
+				if (use.access == RenderGraphAccess::ColorWrite)
+				{
+					colorRefs[s].push_back({ a, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL });
+					useMask[s][a] |= 1;
+				}
+				else
+				{
+					inputRefs[s].push_back({ a, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL });
+					useMask[s][a] |= 2;
+				}
+			}
+		}
+
+		for (uint32_t s = 0; s < subpassCount; s++)
+		{
+			for (uint32_t a = 0; a < attachmentCount; a++)
+			{
+				if (useMask[s][a] != 0)
+				{
+					continue;
+				}
+
+				bool before = attachments[a].loadOp != VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+				bool after = false;
+
+				for (uint32_t t = 0; t < subpassCount; t++)
+				{
+					before = before || (t < s && useMask[t][a] != 0);
+					after = after || (t > s && useMask[t][a] != 0);
+				}
+
+				if (before && after)
+				{
+					preserveRefs[s].push_back(a);
+				}
+			}
+		}
+
+		std::vector<VkSubpassDescription> subpassDescs(subpassCount);
+
+		for (uint32_t s = 0; s < subpassCount; s++)
+		{
+			VkSubpassDescription& desc = subpassDescs[s];
+			desc.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+			desc.colorAttachmentCount = colorRefs[s].size();
+			desc.pColorAttachments = colorRefs[s].data();
+			desc.inputAttachmentCount = inputRefs[s].size();
+			desc.pInputAttachments = inputRefs[s].data();
+			desc.preserveAttachmentCount = preserveRefs[s].size();
+			desc.pPreserveAttachments = preserveRefs[s].data();
+		}
+
+		std::vector<VkSubpassDependency> dependencies;
+		renderGraphDependencies(useMask, dependencies);
+
+		VkRenderPassCreateInfo createInfo = {};
+		createInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+		createInfo.attachmentCount = attachmentCount;
+		createInfo.pAttachments = attachments.data();
+		createInfo.subpassCount = subpassCount;
+		createInfo.pSubpasses = subpassDescs.data();
+		createInfo.dependencyCount = dependencies.size();
+		createInfo.pDependencies = dependencies.data();
+
+		VkResult r = vkCreateRenderPass(this->device, &createInfo, nullptr, &group.renderPass);
+
+		if (r != VK_SUCCESS)
+		{
+			throw std::runtime_error("RenderGraph: failed to create render pass.");
+		}
+
+		group.compatiblePass = this->compatiblePass(createInfo);
+	}
+
+	// Imported images that didn't end in their final layout
+	for (uint32_t r = 0; r < resourceCount; r++)
+	{
+		const RenderGraphResource& resource = this->resources[r];
+
+		if (!resource.imported || resource.finalLayout == VK_IMAGE_LAYOUT_UNDEFINED || layouts[r] == resource.finalLayout)
+		{
+			continue;
+		}
+
+		RenderGraphBarrier barrier;
+		barrier.resource = r;
+		barrier.oldLayout = defined[r] ? layouts[r] : VK_IMAGE_LAYOUT_UNDEFINED;
+		barrier.newLayout = resource.finalLayout;
+		barrier.srcAccess = pendingWrites[r];
+		barrier.dstAccess = 0;
+
+		graph->after.barriers.push_back(barrier);
+		graph->after.srcStages |= lastStages[r] != 0 ? lastStages[r] : (VkPipelineStageFlags)VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+		graph->after.dstStages |= VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+	}
+
+	for (auto& group : graph->groups)
+	{
+		std::string name;
+
+		for (uint32_t p : group.passes)
+		{
+			name += (name.empty() ? "" : "+") + std::string(this->passes[p].name);
+		}
+
+		group.name = profiler.intern(name);
+	}
+
+	this->createImages(*graph);
+
+	return graph;
+}
+
+VkRenderPass RenderGraph::compatiblePass(const VkRenderPassCreateInfo& createInfo)
+{
+	std::vector<uint64_t> key;
+	key.push_back(createInfo.attachmentCount);
+
+	for (uint32_t a = 0; a < createInfo.attachmentCount; a++)
+	{
+		key.push_back(createInfo.pAttachments[a].format);
+		key.push_back(createInfo.pAttachments[a].samples);
+	}
+
+	key.push_back(createInfo.subpassCount);
+
+	for (uint32_t s = 0; s < createInfo.subpassCount; s++)
+	{
+		const VkSubpassDescription& subpass = createInfo.pSubpasses[s];
+
+		key.push_back(subpass.colorAttachmentCount);
+
+		for (uint32_t i = 0; i < subpass.colorAttachmentCount; i++)
+		{
+			key.push_back(subpass.pColorAttachments[i].attachment);
+		}
+
+		key.push_back(subpass.inputAttachmentCount);
+
+		for (uint32_t i = 0; i < subpass.inputAttachmentCount; i++)
+		{
+			key.push_back(subpass.pInputAttachments[i].attachment);
+		}
+
+		key.push_back(subpass.preserveAttachmentCount);
+
+		for (uint32_t i = 0; i < subpass.preserveAttachmentCount; i++)
+		{
+			key.push_back(subpass.pPreserveAttachments[i]);
+		}
+	}
+
+	key.push_back(createInfo.dependencyCount);
+
+	for (uint32_t d = 0; d < createInfo.dependencyCount; d++)
+	{
+		const VkSubpassDependency& dep = createInfo.pDependencies[d];
+
+		key.push_back(dep.srcSubpass);
+		key.push_back(dep.dstSubpass);
+		key.push_back(dep.srcStageMask);
+		key.push_back(dep.dstStageMask);
+		key.push_back(dep.srcAccessMask);
+		key.push_back(dep.dstAccessMask);
+		key.push_back(dep.dependencyFlags);
+	}
+
+	auto it = this->compatiblePasses.find(key);
+
+	if (it != this->compatiblePasses.end())
+	{
+		return it->second;
+	}
+
+	// Load/store ops and layouts don't affect compatibility, any valid ones do
+	std::vector<VkAttachmentDescription> attachments(createInfo.pAttachments, createInfo.pAttachments + createInfo.attachmentCount);
+
+	for (auto& attachment : attachments)
+	{
+		attachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+		attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		attachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	}
+
+	VkRenderPassCreateInfo compatibleInfo = createInfo;
+	compatibleInfo.pAttachments = attachments.data();
+
+	VkRenderPass renderPass;
+	VkResult r = vkCreateRenderPass(this->device, &compatibleInfo, nullptr, &renderPass);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("RenderGraph: failed to create compatible render pass.");
+	}
+
+	this->compatiblePasses[key] = renderPass;
+
+	return renderPass;
+}
+
+VkRenderPass RenderGraph::colorPass(VkFormat format)
+{
+	VkAttachmentDescription attachment = {};
+	attachment.format = format;
+	attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+
+	VkAttachmentReference colorRef = { 0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
+
+	VkSubpassDescription subpass = {};
+	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	subpass.colorAttachmentCount = 1;
+	subpass.pColorAttachments = &colorRef;
+
+	std::vector<VkSubpassDependency> dependencies;
+	renderGraphDependencies({ { 1 } }, dependencies);
+
+	VkRenderPassCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+	createInfo.attachmentCount = 1;
+	createInfo.pAttachments = &attachment;
+	createInfo.subpassCount = 1;
+	createInfo.pSubpasses = &subpass;
+	createInfo.dependencyCount = dependencies.size();
+	createInfo.pDependencies = dependencies.data();
+
+	return this->compatiblePass(createInfo);
+}
+
+void RenderGraph::createImages(CompiledRenderGraph& graph)
+{
+	uint32_t resourceCount = this->resources.size();
+
+	graph.images.assign(resourceCount, VK_NULL_HANDLE);
+	graph.views.assign(resourceCount, VK_NULL_HANDLE);
+
+	// Lifetime in groups and usage of every transient image
+	std::vector<int32_t> first(resourceCount, -1);
+	std::vector<int32_t> last(resourceCount, -1);
+	std::vector<VkImageUsageFlags> usage(resourceCount, 0);
+
+	for (uint32_t g = 0; g < graph.groups.size(); g++)
+	{
+		for (uint32_t p : graph.groups[g].passes)
+		{
+			for (const auto& use : this->passes[p].uses)
+			{
+				uint32_t r = use.resource;
+
+				if (this->resources[r].imported)
+				{
+					continue;
+				}
+
+				if (first[r] < 0)
+				{
+					first[r] = g;
+				}
+
+				last[r] = g;
+
+				switch (use.access)
+				{
+				case RenderGraphAccess::ColorWrite:
+					usage[r] |= VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+					break;
+				case RenderGraphAccess::InputRead:
+					usage[r] |= VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
+					break;
+				case RenderGraphAccess::SampledRead:
+					usage[r] |= VK_IMAGE_USAGE_SAMPLED_BIT;
+					break;
+				case RenderGraphAccess::StorageRead:
+				case RenderGraphAccess::StorageWrite:
+					usage[r] |= VK_IMAGE_USAGE_STORAGE_BIT;
+					break;
+				}
+			}
+		}
+	}
+
+	std::vector<VkMemoryRequirements> reqs(resourceCount);
+	std::vector<uint32_t> order;
+
+	for (uint32_t r = 0; r < resourceCount; r++)
+	{
+		if (first[r] < 0)
+		{
+			continue;
+		}
+
+		// Never leaves one render pass, tile memory may be enough
+		VkImageUsageFlags attachmentOnly = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
+
+		if (first[r] == last[r] && (usage[r] & ~attachmentOnly) == 0)
+		{
+			usage[r] |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+		}
+
+		VkImageCreateInfo createInfo = {};
+		createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+		createInfo.imageType = VK_IMAGE_TYPE_2D;
+		createInfo.format = this->resources[r].format;
+		createInfo.extent.width = this->resources[r].extent.width;
+		createInfo.extent.height = this->resources[r].extent.height;
+		createInfo.extent.depth = 1;
+		createInfo.mipLevels = 1;
+		createInfo.arrayLayers = 1;
+		createInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+		createInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+		createInfo.usage = usage[r];
+		createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		createInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+		VkResult result = vkCreateImage(this->device, &createInfo, nullptr, &graph.images[r]);
+
+		if (result != VK_SUCCESS)
+		{
+			throw std::runtime_error("RenderGraph: failed to create transient image.");
+		}
+
+		vkGetImageMemoryRequirements(this->device, graph.images[r], &reqs[r]);
+		order.push_back(r);
+	}
+
+	// Greedy aliasing, biggest first: an image moves into the first slot
+	// whose images are all dead before it starts or born after it ends
+	std::sort(order.begin(), order.end(), [&reqs](uint32_t a, uint32_t b) { return reqs[a].size > reqs[b].size; });
+
+	std::vector<VkMemoryRequirements> slots;
+	std::vector<std::vector<uint32_t>> slotUsers;
+
+	for (uint32_t r : order)
+	{
+		uint32_t slot = 0;
+
+		for (; slot < slots.size(); slot++)
+		{
+			if ((slots[slot].memoryTypeBits & reqs[r].memoryTypeBits) == 0)
+			{
+				continue;
+			}
+
+			bool overlaps = false;
+
+			for (uint32_t other : slotUsers[slot])
+			{
+				overlaps = overlaps || !(last[other] < first[r] || first[other] > last[r]);
+			}
+
+			if (!overlaps)
+			{
+				break;
+			}
+		}
+
+		if (slot == slots.size())
+		{
+			slots.push_back(reqs[r]);
+			slotUsers.push_back({});
+		}
+		else
+		{
+			slots[slot].size = std::max(slots[slot].size, reqs[r].size);
+			slots[slot].alignment = std::max(slots[slot].alignment, reqs[r].alignment);
+			slots[slot].memoryTypeBits &= reqs[r].memoryTypeBits;
+			graph.aliasedBytes += reqs[r].size;
+		}
+
+		slotUsers[slot].push_back(r);
+	}
+
+	graph.memory.resize(slots.size());
+
+	for (uint32_t slot = 0; slot < slots.size(); slot++)
+	{
+		this->allocator->allocate(slots[slot], VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, false, false, VK_NULL_HANDLE, VK_NULL_HANDLE, graph.memory[slot]);
+
+		for (uint32_t r : slotUsers[slot])
+		{
+			vkBindImageMemory(this->device, graph.images[r], graph.memory[slot].memory, graph.memory[slot].offset);
+
+			VkImageViewCreateInfo viewInfo = {};
+			viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+			viewInfo.image = graph.images[r];
+			viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+			viewInfo.format = this->resources[r].format;
+			viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+			viewInfo.subresourceRange.levelCount = 1;
+			viewInfo.subresourceRange.layerCount = 1;
+
+			VkResult result = vkCreateImageView(this->device, &viewInfo, nullptr, &graph.views[r]);
+
+			if (result != VK_SUCCESS)
+			{
+				throw std::runtime_error("RenderGraph: failed to create transient image view.");
+			}
+		}
+	}
+}
+
+void RenderGraph::destroy(CompiledRenderGraph& graph)
+{
+	for (auto& group : graph.groups)
+	{
+		for (auto& fb : group.framebuffers)
+		{
+			vkDestroyFramebuffer(this->device, fb.second.framebuffer, nullptr);
+		}
+
+		if (group.renderPass != VK_NULL_HANDLE)
+		{
+			vkDestroyRenderPass(this->device, group.renderPass, nullptr);
+		}
+	}
+
+	for (uint32_t r = 0; r < graph.images.size(); r++)
+	{
+		if (graph.images[r] != VK_NULL_HANDLE)
+		{
+			vkDestroyImageView(this->device, graph.views[r], nullptr);
+			vkDestroyImage(this->device, graph.images[r], nullptr);
+		}
+	}
+
+	for (auto& memory : graph.memory)
+	{
+		this->allocator->free(memory);
+	}
+}
+
+VkFramebuffer RenderGraph::framebuffer(CompiledRenderGraph& graph, RenderGraphGroup& group)
+{
+	std::vector<VkImageView> views;
+
+	for (uint32_t r : group.attachments)
+	{
+		views.push_back(this->resources[r].imported ? this->resources[r].view : graph.views[r]);
+	}
+
+	auto it = group.framebuffers.find(views);
+
+	if (it == group.framebuffers.end())
+	{
+		VkFramebufferCreateInfo createInfo = {};
+		createInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+		createInfo.renderPass = group.renderPass;
+		createInfo.attachmentCount = views.size();
+		createInfo.pAttachments = views.data();
+		createInfo.width = group.extent.width;
+		createInfo.height = group.extent.height;
+		createInfo.layers = 1;
+
+		VkFramebuffer framebuffer;
+		VkResult r = vkCreateFramebuffer(this->device, &createInfo, nullptr, &framebuffer);
+
+		if (r != VK_SUCCESS)
+		{
+			throw std::runtime_error("RenderGraph: failed to create framebuffer.");
+		}
+
+		it = group.framebuffers.insert({ views, { framebuffer, 0 } }).first;
+	}
+
+	it->second.lastUsed = this->frame;
+
+	return it->second.framebuffer;
+}
+
+void RenderGraph::recordBarriers(VkCommandBuffer cmd, CompiledRenderGraph& graph, const RenderGraphBarrierBatch& batch)
+{
+	if (batch.barriers.size() == 0)
+	{
+		return;
+	}
+
+	std::vector<VkImageMemoryBarrier> barriers(batch.barriers.size());
+
+	for (uint32_t i = 0; i < batch.barriers.size(); i++)
+	{
+		const RenderGraphBarrier& src = batch.barriers[i];
+		const RenderGraphResource& resource = this->resources[src.resource];
+
+		VkImageMemoryBarrier& barrier = barriers[i];
+		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.srcAccessMask = src.srcAccess;
+		barrier.dstAccessMask = src.dstAccess;
+		barrier.oldLayout = src.oldLayout;
+		barrier.newLayout = src.newLayout;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.image = resource.imported ? resource.image : graph.images[src.resource];
+		barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		barrier.subresourceRange.levelCount = 1;
+		barrier.subresourceRange.layerCount = 1;
+	}
+
+	vkCmdPipelineBarrier(
+		cmd,
+		batch.srcStages,
+		batch.dstStages,
+		0,
+		0, nullptr,
+		0, nullptr,
+		barriers.size(), barriers.data()
+	);
+}
+
+void SpriteBatcher::init(VkDevice device, GpuAllocator* allocator, StagingUploader* uploader, PipelineManager* pipelines, ShaderManager* shaders, BindlessTable* bindless, VkRenderPass renderPass, uint32_t frameCount, uint32_t capacity)
+{
+	this->device = device;
+	this->allocator = allocator;
+	this->uploader = uploader;
+	this->pipelines = pipelines;
+	this->bindless = bindless;
+	this->capacity = capacity;
+
+	// The texture array is as long as the table's binding
+	std::vector<ShaderHandle> handles = {
+		shaders->request({ shaderDir + "/sprite.vert", VK_SHADER_STAGE_VERTEX_BIT, {} }),
+		shaders->request({ shaderDir + "/sprite.frag", VK_SHADER_STAGE_FRAGMENT_BIT, { "BINDLESS_TEXTURES=" + std::to_string(bindless->maxTextures) } })
+	};
+
+	shaders->wait(handles[0]);
+	shaders->wait(handles[1]);
+
+	this->vertexShader = shaders->get(handles[0]);
+	this->fragmentShader = shaders->get(handles[1]);
+
+	if (this->vertexShader == VK_NULL_HANDLE || this->fragmentShader == VK_NULL_HANDLE)
+	{
+		logger.log(LogSeverity::Warning, "renderer", 0, ("sprite shaders not found in " + shaderDir + ", sprites disabled").c_str());
+		return;
+	}
+
+	// Scale for the vertex shader, the texture slot for the fragment shader
+	VkPushConstantRange pushRange = shaders->pushConstantRange(handles);
+
+	if (pushRange.size == 0)
+	{
+		pushRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+		pushRange.size = sizeof(glm::vec2) + sizeof(uint32_t);
+	}
+
+	this->pushStages = pushRange.stageFlags;
+
+	// Set 0 is the bindless table
+	VkPipelineLayoutCreateInfo layoutInfo = {};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	layoutInfo.setLayoutCount = 1;
+	layoutInfo.pSetLayouts = &bindless->setLayout;
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &pushRange;
+
+	VkResult r = vkCreatePipelineLayout(device, &layoutInfo, nullptr, &this->layout);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("SpriteBatcher: failed to create pipeline layout.");
+	}
+
+	VkSamplerCreateInfo samplerInfo = {};
+	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	samplerInfo.magFilter = VK_FILTER_NEAREST;
+	samplerInfo.minFilter = VK_FILTER_LINEAR;
+	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
+
+	r = vkCreateSampler(device, &samplerInfo, nullptr, &this->sampler);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("SpriteBatcher: failed to create sampler.");
+	}
+
+	// Instances are the only vertex input
+	GraphicsPipelineDesc desc;
+	desc.vertexShader = this->vertexShader;
+	desc.fragmentShader = this->fragmentShader;
+	desc.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP;
+	desc.layout = this->layout;
+
+	desc.bindings.push_back({ 0, sizeof(SpriteInstance), VK_VERTEX_INPUT_RATE_INSTANCE });
+
+	desc.attributes.push_back({ 0, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SpriteInstance, position) });
+	desc.attributes.push_back({ 1, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SpriteInstance, size) });
+	desc.attributes.push_back({ 2, 0, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(SpriteInstance, uv) });
+	desc.attributes.push_back({ 3, 0, VK_FORMAT_R8G8B8A8_UNORM, offsetof(SpriteInstance, color) });
+	desc.attributes.push_back({ 4, 0, VK_FORMAT_R32_SFLOAT, offsetof(SpriteInstance, rotation) });
+
+	desc.blend = true;
+	this->pipelineDescs[SpriteAlpha] = desc;
+
+	desc.blend = false;
+	this->pipelineDescs[SpriteOpaque] = desc;
+
+	// Ready by the first frame when the graph's pass matches renderPass
+	this->requestPipelines(renderPass, 0);
+
+	this->instances.init(*allocator, capacity * sizeof(SpriteInstance), frameCount, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT);
+
+	this->enabled = true;
+
+	uint32_t white = 0xffffffff;
+	this->createTexture(1, 1, &white);
+}
+
+void SpriteBatcher::release()
+{
+	if (this->frames > 0)
+	{
+		std::cout << "SpriteBatcher: " << this->sprites / this->frames << " sprites in "
+			<< this->draws / this->frames << " draws per frame, "
+			<< (this->cpuMs > 0.0 ? this->sprites / this->cpuMs : 0.0) << " sprites/ms";
+
+		if (this->dropped > 0)
+		{
+			std::cout << ", " << this->dropped << " dropped";
+		}
+
+		std::cout << std::endl;
+	}
+
+	for (auto& texture : this->textures)
+	{
+		if (texture.slot != UINT32_MAX)
+		{
+			this->bindless->removeTexture(texture.slot);
+		}
+
+		if (texture.streamed != nullptr)
+		{
+			continue;
+		}
+
+		vkDestroyImageView(this->device, texture.view, nullptr);
+		this->allocator->destroyImage(texture.image, texture.memory);
+	}
+
+	this->textures.clear();
+
+	this->instances.release(*this->allocator);
+
+	if (this->enabled)
+	{
+		vkDestroySampler(this->device, this->sampler, nullptr);
+		vkDestroyPipelineLayout(this->device, this->layout, nullptr);
+	}
+}
+
+void SpriteBatcher::requestPipelines(VkRenderPass renderPass, uint32_t subpass)
+{
+	for (uint32_t i = 0; i < SpritePipelineCount; i++)
+	{
+		this->pipelineDescs[i].renderPass = renderPass;
+		this->pipelineDescs[i].subpass = subpass;
+
+		this->pipelineHandles[i] = this->pipelines->request(this->pipelineDescs[i]);
+	}
+}
+
+uint32_t SpriteBatcher::createTexture(uint32_t width, uint32_t height, const void* rgba)
+{
+	SpriteTexture texture;
+
+	VkImageCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	createInfo.imageType = VK_IMAGE_TYPE_2D;
+	createInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+	createInfo.extent.width = width;
+	createInfo.extent.height = height;
+	createInfo.extent.depth = 1;
+	createInfo.mipLevels = 1;
+	createInfo.arrayLayers = 1;
+	createInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	createInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	createInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	createInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+	this->allocator->createImage(createInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, texture.image, texture.memory);
+
+	// Visible to the first frame that submits after this
+	this->uploader->uploadImage(texture.image, createInfo.extent, rgba, width * height * 4);
+
+	VkImageViewCreateInfo viewInfo = {};
+	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	viewInfo.image = texture.image;
+	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	viewInfo.format = createInfo.format;
+	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	viewInfo.subresourceRange.levelCount = 1;
+	viewInfo.subresourceRange.layerCount = 1;
+
+	VkResult r = vkCreateImageView(this->device, &viewInfo, nullptr, &texture.view);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("SpriteBatcher: failed to create texture view.");
+	}
+
+	texture.slot = this->bindless->addTexture(texture.view, this->sampler);
+
+	this->textures.push_back(texture);
+
+	return this->textures.size() - 1;
+}
+
+uint32_t SpriteBatcher::addStreamedTexture(TextureStreamer* streamer, StreamedTexture* texture)
+{
+	SpriteTexture sprite;
+	sprite.streamer = streamer;
+	sprite.streamed = texture;
+
+	this->textures.push_back(sprite);
+
+	return this->textures.size() - 1;
+}
+
+void SpriteBatcher::beginFrame(uint32_t frame)
+{
+	if (!this->enabled)
+	{
+		return;
+	}
+
+	this->instances.beginFrame(frame);
+
+	this->keys.clear();
+	this->pending.clear();
+	this->batches.clear();
+}
+
+void SpriteBatcher::draw(const SpriteInstance& sprite, uint32_t texture, uint32_t pipeline, uint32_t layer)
+{
+	if (!this->enabled)
+	{
+		return;
+	}
+
+	const SpriteTexture& spriteTexture = this->textures[texture];
+
+	if (spriteTexture.streamed != nullptr)
+	{
+		// The part of the texture the quad shows, scaled up to all of it
+		float spanX = std::max(std::abs(sprite.uv.z - sprite.uv.x), 1e-6f);
+		float spanY = std::max(std::abs(sprite.uv.w - sprite.uv.y), 1e-6f);
+
+		spriteTexture.streamer->touch(spriteTexture.streamed, sprite.size.x / spanX, sprite.size.y / spanY);
+	}
+
+	this->keys.push_back((layer & 0xff) << 24 | (pipeline & 0xff) << 16 | (texture & 0xffff));
+	this->pending.push_back(sprite);
+}
+
+void SpriteBatcher::prepare()
+{
+	auto start = std::chrono::steady_clock::now();
+
+	// Streamed views change between frames, never while one records
+	for (auto& texture : this->textures)
+	{
+		if (texture.streamed == nullptr || texture.version == texture.streamed->version)
+		{
+			continue;
+		}
+
+		// The table keeps the old slot until frames in flight are done with it
+		if (texture.slot != UINT32_MAX)
+		{
+			this->bindless->removeTexture(texture.slot);
+			texture.slot = UINT32_MAX;
+		}
+
+		if (texture.streamed->view != VK_NULL_HANDLE)
+		{
+			texture.slot = this->bindless->addTexture(texture.streamed->view, this->sampler);
+		}
+
+		texture.version = texture.streamed->version;
+	}
+
+	uint32_t count = std::min<uint32_t>(this->pending.size(), this->capacity);
+
+	this->dropped += this->pending.size() - count;
+
+	// Key above, submission index below: one plain sort, still stable
+	std::vector<uint64_t> order(count);
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		order[i] = (uint64_t)this->keys[i] << 32 | i;
+	}
+
+	std::sort(order.begin(), order.end());
+
+	void* data = nullptr;
+
+	if (!this->instances.allocate(count * sizeof(SpriteInstance), sizeof(SpriteInstance), this->instanceOffset, data))
+	{
+		this->dropped += count;
+		this->pending.clear();
+		return;
+	}
+
+	SpriteInstance* dst = (SpriteInstance*)data;
+
+	// Gather into the mapped ring on all cores, batching stays serial
+	jobs.parallelFor(count, 8192, [this, dst, &order](uint32_t first, uint32_t n)
+	{
+		for (uint32_t i = first; i < first + n; i++)
+		{
+			dst[i] = this->pending[order[i] & 0xffffffff];
+		}
+	});
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t key = order[i] >> 32;
+
+		uint32_t pipeline = (key >> 16) & 0xff;
+		uint32_t texture = key & 0xffff;
+
+		if (this->batches.size() == 0 || this->batches.back().pipeline != pipeline || this->batches.back().texture != texture)
+		{
+			this->batches.push_back({ pipeline, texture, i, 0 });
+		}
+
+		this->batches.back().count++;
+	}
+
+	this->sprites += count;
+	this->frames++;
+
+	this->cpuMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void SpriteBatcher::record(const RenderGraphContext& ctx, VkExtent2D space)
+{
+	if (this->batches.size() == 0)
+	{
+		return;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	VkCommandBuffer cmd = ctx.cmd;
+	VkExtent2D extent = ctx.extent;
+
+	// Cached by the manager, only a new kind of pass compiles
+	this->requestPipelines(ctx.compatiblePass, ctx.subpass);
+
+	VkViewport viewport = {};
+	viewport.width = (float)extent.width;
+	viewport.height = (float)extent.height;
+	viewport.maxDepth = 1.0f;
+
+	VkRect2D scissor = {};
+	scissor.extent = extent;
+
+	vkCmdSetViewport(cmd, 0, 1, &viewport);
+	vkCmdSetScissor(cmd, 0, 1, &scissor);
+
+	glm::vec2 scale(2.0f / space.width, 2.0f / space.height);
+
+	vkCmdPushConstants(cmd, this->layout, this->pushStages, 0, sizeof(scale), &scale);
+
+	// Every texture is in it, bound once for all batches
+	VkDescriptorSet set = this->bindless->set();
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, this->layout, 0, 1, &set, 0, nullptr);
+
+	// Instances of this frame start at instanceOffset, batches index from there
+	vkCmdBindVertexBuffers(cmd, 0, 1, &this->instances.buffer, &this->instanceOffset);
+
+	VkPipeline bound = VK_NULL_HANDLE;
+	uint32_t boundTexture = UINT32_MAX;
+
+	for (const auto& batch : this->batches)
+	{
+		// Still compiling on a worker, skip rather than stall the frame
+		VkPipeline pipeline = this->pipelines->get(this->pipelineHandles[batch.pipeline]);
+
+		if (pipeline == VK_NULL_HANDLE)
+		{
+			continue;
+		}
+
+		if (pipeline != bound)
+		{
+			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+			bound = pipeline;
+		}
+
+		if (batch.texture != boundTexture)
+		{
+			// Streamed textures without a tail yet draw white
+			uint32_t slot = this->textures[batch.texture].slot;
+
+			if (slot == UINT32_MAX)
+			{
+				slot = this->textures[0].slot;
+			}
+
+			vkCmdPushConstants(cmd, this->layout, this->pushStages, sizeof(glm::vec2), sizeof(slot), &slot);
+			boundTexture = batch.texture;
+		}
+
+		vkCmdDraw(cmd, 4, batch.count, 0, batch.first);
+		this->draws++;
+	}
+
+	this->cpuMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void BindlessTable::init(VkDevice device, VkPhysicalDevice physicalDevice, GpuAllocator* allocator, StagingUploader* uploader, bool indexing, uint32_t frameCount)
+{
+	this->device = device;
+	this->allocator = allocator;
+	this->indexing = indexing;
+	this->framesInFlight = frameCount;
+
+	VkPhysicalDeviceDescriptorIndexingProperties indexingProps = {};
+	indexingProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES;
+
+	VkPhysicalDeviceProperties2 props = {};
+	props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+	props.pNext = indexing ? &indexingProps : nullptr;
+
+	vkGetPhysicalDeviceProperties2(physicalDevice, &props);
+
+	const VkPhysicalDeviceLimits& limits = props.properties.limits;
+
+	// The fallback rewrites whole arrays, so it stays small
+	if (indexing)
+	{
+		this->maxTextures = std::min(16384u, std::min(indexingProps.maxDescriptorSetUpdateAfterBindSampledImages, indexingProps.maxPerStageDescriptorUpdateAfterBindSampledImages));
+		this->maxBuffers = std::min(4096u, std::min(indexingProps.maxDescriptorSetUpdateAfterBindStorageBuffers, indexingProps.maxPerStageDescriptorUpdateAfterBindStorageBuffers));
+	}
+	else
+	{
+		this->maxTextures = std::min(128u, std::min(limits.maxPerStageDescriptorSampledImages, limits.maxPerStageDescriptorSamplers));
+		this->maxBuffers = std::min(16u, limits.maxPerStageDescriptorStorageBuffers);
+	}
+
+	VkDescriptorSetLayoutBinding bindings[2] = {};
+	bindings[0].binding = 0;
+	bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	bindings[0].descriptorCount = this->maxTextures;
+	bindings[0].stageFlags = VK_SHADER_STAGE_ALL;
+
+	bindings[1].binding = 1;
+	bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	bindings[1].descriptorCount = this->maxBuffers;
+	bindings[1].stageFlags = VK_SHADER_STAGE_ALL;
+
+	VkDescriptorBindingFlags bindingFlags[2] = {};
+
+	for (auto& flags : bindingFlags)
+	{
+		flags =
+			VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT |
+			VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT |
+			VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT;
+	}
+
+	VkDescriptorSetLayoutBindingFlagsCreateInfo flagsInfo = {};
+	flagsInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+	flagsInfo.bindingCount = 2;
+	flagsInfo.pBindingFlags = bindingFlags;
+
+	VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.bindingCount = 2;
+	layoutInfo.pBindings = bindings;
+
+	if (indexing)
+	{
+		layoutInfo.pNext = &flagsInfo;
+		layoutInfo.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+	}
+
+	VkResult r = vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &this->setLayout);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("BindlessTable: failed to create descriptor set layout.");
+	}
+
+	uint32_t setCount = indexing ? 1 : frameCount;
+
+	VkDescriptorPoolSize poolSizes[2] = {};
+	poolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	poolSizes[0].descriptorCount = this->maxTextures * setCount;
+	poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	poolSizes[1].descriptorCount = this->maxBuffers * setCount;
+
+	VkDescriptorPoolCreateInfo poolInfo = {};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.flags = indexing ? VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT : 0;
+	poolInfo.maxSets = setCount;
+	poolInfo.poolSizeCount = 2;
+	poolInfo.pPoolSizes = poolSizes;
+
+	r = vkCreateDescriptorPool(device, &poolInfo, nullptr, &this->pool);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("BindlessTable: failed to create descriptor pool.");
+	}
+
+	std::vector<VkDescriptorSetLayout> layouts(setCount, this->setLayout);
+
+	VkDescriptorSetAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = this->pool;
+	allocInfo.descriptorSetCount = setCount;
+	allocInfo.pSetLayouts = layouts.data();
+
+	this->sets.resize(setCount);
+
+	r = vkAllocateDescriptorSets(device, &allocInfo, this->sets.data());
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("BindlessTable: failed to allocate descriptor sets.");
+	}
+
+	// Highest slot last, so slot 0 is handed out first
+	for (uint32_t i = this->maxTextures; i > 0; i--)
+	{
+		this->freeTextures.push_back(i - 1);
+	}
+
+	for (uint32_t i = this->maxBuffers; i > 0; i--)
+	{
+		this->freeBuffers.push_back(i - 1);
+	}
+
+	if (indexing)
+	{
+		logger.log(LogSeverity::Info, "renderer", 0, ("Bindless table: " + std::to_string(this->maxTextures) + " textures, " + std::to_string(this->maxBuffers) + " buffers").c_str());
+		return;
+	}
+
+	// Every slot of a statically used array must be valid without
+	// partially bound, so empty slots point at a 1x1 image and a small buffer
+	VkImageCreateInfo imageInfo = {};
+	imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	imageInfo.imageType = VK_IMAGE_TYPE_2D;
+	imageInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+	imageInfo.extent = { 1, 1, 1 };
+	imageInfo.mipLevels = 1;
+	imageInfo.arrayLayers = 1;
+	imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	imageInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+	allocator->createImage(imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, this->defaultImage, this->defaultImageMemory);
+
+	uint32_t white = 0xffffffff;
+	uploader->uploadImage(this->defaultImage, imageInfo.extent, &white, sizeof(white));
+
+	VkImageViewCreateInfo viewInfo = {};
+	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	viewInfo.image = this->defaultImage;
+	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	viewInfo.format = imageInfo.format;
+	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	viewInfo.subresourceRange.levelCount = 1;
+	viewInfo.subresourceRange.layerCount = 1;
+
+	r = vkCreateImageView(device, &viewInfo, nullptr, &this->defaultView);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("BindlessTable: failed to create default image view.");
+	}
+
+	VkSamplerCreateInfo samplerInfo = {};
+	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	samplerInfo.magFilter = VK_FILTER_NEAREST;
+	samplerInfo.minFilter = VK_FILTER_NEAREST;
+
+	r = vkCreateSampler(device, &samplerInfo, nullptr, &this->defaultSampler);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("BindlessTable: failed to create default sampler.");
+	}
+
+	allocator->createBuffer(256, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, this->defaultBuffer, this->defaultBufferMemory);
+
+	this->textures.assign(this->maxTextures, { this->defaultSampler, this->defaultView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL });
+	this->buffers.assign(this->maxBuffers, { this->defaultBuffer, 0, VK_WHOLE_SIZE });
+
+	this->dirty.assign(setCount, true);
+}
+
+void BindlessTable::release()
+{
+	std::cout << "BindlessTable: " << this->writes << " descriptor writes";
+
+	if (!this->indexing)
+	{
+		std::cout << ", " << this->rewrites << " frame table rewrites";
+	}
+
+	std::cout << std::endl;
+
+	if (this->defaultImage != VK_NULL_HANDLE)
+	{
+		vkDestroySampler(this->device, this->defaultSampler, nullptr);
+		vkDestroyImageView(this->device, this->defaultView, nullptr);
+		this->allocator->destroyImage(this->defaultImage, this->defaultImageMemory);
+		this->allocator->destroyBuffer(this->defaultBuffer, this->defaultBufferMemory);
+	}
+
+	vkDestroyDescriptorPool(this->device, this->pool, nullptr);
+	vkDestroyDescriptorSetLayout(this->device, this->setLayout, nullptr);
+}
+
+void BindlessTable::beginFrame(uint32_t frame, uint64_t frameCount)
+{
+	this->frame = frame;
+	this->frameCount = frameCount;
+	this->handedOut = false;
+
+	// Same rule as retired swapchains, every frame that could still
+	// index the slot has signalled its fence
+	for (auto& list : { std::make_pair(&this->retiredTextures, &this->freeTextures), std::make_pair(&this->retiredBuffers, &this->freeBuffers) })
+	{
+		auto& retired = *list.first;
+
+		for (size_t i = 0; i < retired.size();)
+		{
+			if (frameCount >= retired[i].first + this->framesInFlight)
+			{
+				list.second->push_back(retired[i].second);
+				retired[i] = retired.back();
+				retired.pop_back();
+			}
+			else
+			{
+				i++;
+			}
+		}
+	}
+
+	if (this->indexing || !this->dirty[frame])
+	{
+		return;
+	}
+
+	// Not in use by the GPU any more, rewrite it whole
+	VkWriteDescriptorSet writes[2] = {};
+	writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	writes[0].dstSet = this->sets[frame];
+	writes[0].dstBinding = 0;
+	writes[0].descriptorCount = this->maxTextures;
+	writes[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	writes[0].pImageInfo = this->textures.data();
+
+	writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	writes[1].dstSet = this->sets[frame];
+	writes[1].dstBinding = 1;
+	writes[1].descriptorCount = this->maxBuffers;
+	writes[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	writes[1].pBufferInfo = this->buffers.data();
+
+	vkUpdateDescriptorSets(this->device, 2, writes, 0, nullptr);
+
+	this->dirty[frame] = false;
+	this->rewrites++;
+}
+
+VkDescriptorSet BindlessTable::set()
+{
+	this->handedOut = true;
+
+	return this->indexing ? this->sets[0] : this->sets[this->frame];
+}
+
+uint32_t BindlessTable::addTexture(VkImageView view, VkSampler sampler)
+{
+	if (this->freeTextures.size() == 0)
+	{
+		throw std::runtime_error("BindlessTable: out of texture slots.");
+	}
+
+	uint32_t index = this->freeTextures.back();
+	this->freeTextures.pop_back();
+
+	if (this->textures.size() <= index)
+	{
+		this->textures.resize(index + 1);
+	}
+
+	this->textures[index] = { sampler, view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+	this->write(0, index);
+
+	return index;
+}
+
+uint32_t BindlessTable::addBuffer(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range)
+{
+	if (this->freeBuffers.size() == 0)
+	{
+		throw std::runtime_error("BindlessTable: out of buffer slots.");
+	}
+
+	uint32_t index = this->freeBuffers.back();
+	this->freeBuffers.pop_back();
+
+	if (this->buffers.size() <= index)
+	{
+		this->buffers.resize(index + 1);
+	}
+
+	this->buffers[index] = { buffer, offset, range };
+	this->write(1, index);
+
+	return index;
+}
+
+void BindlessTable::removeTexture(uint32_t index)
+{
+	if (!this->indexing)
+	{
+		this->textures[index] = { this->defaultSampler, this->defaultView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+		this->write(0, index);
+	}
+
+	// Partially bound, a stale slot is fine as long as nothing indexes it
+	this->retiredTextures.push_back({ this->frameCount, index });
+}
+
+void BindlessTable::removeBuffer(uint32_t index)
+{
+	if (!this->indexing)
+	{
+		this->buffers[index] = { this->defaultBuffer, 0, VK_WHOLE_SIZE };
+		this->write(1, index);
+	}
+
+	this->retiredBuffers.push_back({ this->frameCount, index });
+}
+
+void BindlessTable::write(uint32_t binding, uint32_t index)
+{
+	this->writes++;
+
+	VkDescriptorSet set = this->sets[0];
+
+	if (!this->indexing)
+	{
+		// This frame's set is current and nothing has bound it yet, so it
+		// can take the write now; the others may be executing and catch up
+		// in beginFrame
+		bool current = !this->dirty[this->frame] && !this->handedOut;
+
+		std::fill(this->dirty.begin(), this->dirty.end(), true);
+
+		if (!current)
+		{
+			return;
+		}
+
+		this->dirty[this->frame] = false;
+		set = this->sets[this->frame];
+	}
+
+	VkWriteDescriptorSet write = {};
+	write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	write.dstSet = set;
+	write.dstBinding = binding;
+	write.dstArrayElement = index;
+	write.descriptorCount = 1;
+
+	if (binding == 0)
+	{
+		write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		write.pImageInfo = &this->textures[index];
+	}
+	else
+	{
+		write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		write.pBufferInfo = &this->buffers[index];
+	}
+
+	vkUpdateDescriptorSets(this->device, 1, &write, 0, nullptr);
+}
+
+void FrameDescriptorPools::init(VkDevice device, uint32_t frameCount)
+{
+	this->device = device;
+
+	this->pools.resize(frameCount);
+	this->used.assign(frameCount, 0);
+}
+
+void FrameDescriptorPools::release()
+{
+	if (this->allocations > 0)
+	{
+		std::cout << "FrameDescriptorPools: " << this->allocations << " transient sets from " << this->poolsCreated << " pools" << std::endl;
+	}
+
+	for (auto& framePools : this->pools)
+	{
+		for (auto pool : framePools)
+		{
+			vkDestroyDescriptorPool(this->device, pool, nullptr);
+		}
+	}
+
+	this->pools.clear();
+}
+
+void FrameDescriptorPools::beginFrame(uint32_t frame)
+{
+	this->frame = frame;
+
+	// Only pools handed out last time around need a reset
+	for (uint32_t i = 0; i < this->used[frame]; i++)
+	{
+		vkResetDescriptorPool(this->device, this->pools[frame][i], 0);
+	}
+
+	this->used[frame] = 0;
+}
+
+VkDescriptorSet FrameDescriptorPools::allocate(VkDescriptorSetLayout layout)
+{
+	auto& framePools = this->pools[this->frame];
+	uint32_t& used = this->used[this->frame];
+
+	VkDescriptorSetAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &layout;
+
+	VkDescriptorSet set = VK_NULL_HANDLE;
+
+	if (used > 0)
+	{
+		allocInfo.descriptorPool = framePools[used - 1];
+
+		VkResult r = vkAllocateDescriptorSets(this->device, &allocInfo, &set);
+
+		if (r == VK_SUCCESS)
+		{
+			this->allocations++;
+			return set;
+		}
+
+		if (r != VK_ERROR_OUT_OF_POOL_MEMORY && r != VK_ERROR_FRAGMENTED_POOL)
+		{
+			throw std::runtime_error("FrameDescriptorPools: failed to allocate descriptor set.");
+		}
+	}
+
+	// Current pool is full, move on to the next one or grow the list
+	if (used == framePools.size())
+	{
+		framePools.push_back(this->createPool());
+	}
+
+	allocInfo.descriptorPool = framePools[used++];
+
+	VkResult r = vkAllocateDescriptorSets(this->device, &allocInfo, &set);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("FrameDescriptorPools: failed to allocate descriptor set.");
+	}
+
+	this->allocations++;
+
+	return set;
+}
+
+VkDescriptorPool FrameDescriptorPools::createPool()
+{
+	const VkDescriptorType types[] = {
+		VK_DESCRIPTOR_TYPE_SAMPLER,
+		VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+		VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
+		VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+		VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+		VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+		VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+		VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+		VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT
+	};
+
+	std::vector<VkDescriptorPoolSize> sizes;
+
+	for (auto type : types)
+	{
+		sizes.push_back({ type, this->setsPerPool * 4 });
+	}
+
+	VkDescriptorPoolCreateInfo poolInfo = {};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.maxSets = this->setsPerPool;
+	poolInfo.poolSizeCount = sizes.size();
+	poolInfo.pPoolSizes = sizes.data();
+
+	VkDescriptorPool pool;
+	VkResult r = vkCreateDescriptorPool(this->device, &poolInfo, nullptr, &pool);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("FrameDescriptorPools: failed to create descriptor pool.");
+	}
+
+	this->poolsCreated++;
+
+	return pool;
+}
+
+bool DeviceCapabilities::hasExtension(const char* name) const
+{
+	return this->extensions.count(name) > 0;
+}
+
+void StartupProfiler::begin()
+{
+	this->origin = Clock::now();
+	this->steps.clear();
+}
+
+void StartupProfiler::run(const char* name, const std::function<void()>& func)
+{
+	Clock::time_point start = Clock::now();
+
+	try
+	{
+		func();
+	}
+	catch (...)
+	{
+		// Spawned steps still use the device, let them finish first
+		for (auto& task : this->tasks)
+		{
+			task.join();
+		}
+
+		this->tasks.clear();
+		throw;
+	}
+
+	this->record(name, start, false);
+}
+
+void StartupProfiler::spawn(const char* name, std::function<void()> func)
+{
+	this->tasks.emplace_back([this, name, func]
+	{
+		Clock::time_point start = Clock::now();
+
+		try
+		{
+			func();
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+
+			if (!this->error)
+			{
+				this->error = std::current_exception();
+			}
+		}
+
+		this->record(name, start, true);
+	});
+}
+
+void StartupProfiler::join()
+{
+	for (auto& task : this->tasks)
+	{
+		task.join();
+	}
+
+	this->tasks.clear();
+
+	if (this->error)
+	{
+		std::exception_ptr error = this->error;
+		this->error = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+void StartupProfiler::record(const char* name, Clock::time_point start, bool async)
+{
+	Clock::time_point end = Clock::now();
+
+	Step step;
+	step.name = name;
+	step.start = std::chrono::duration<double, std::milli>(start - this->origin).count();
+	step.ms = std::chrono::duration<double, std::milli>(end - start).count();
+	step.async = async;
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->steps.push_back(step);
+}
+
+void StartupProfiler::print()
+{
+	double total = std::chrono::duration<double, std::milli>(Clock::now() - this->origin).count();
+
+	std::cout << "Startup: " << total << " ms" << std::endl;
+
+	if (!profiling)
+	{
+		return;
+	}
+
+	// Sum of steps above the total is what the spawned steps saved
+	double serial = 0.0;
+
+	for (const auto& step : this->steps)
+	{
+		std::cout << "  " << step.name << ": " << step.ms << " ms at " << step.start
+			<< (step.async ? " (async)" : "") << std::endl;
+
+		serial += step.ms;
+	}
+
+	std::cout << "  serial sum: " << serial << " ms" << std::endl;
+}
+
+LogSeverity logSeverityFromName(const std::string& name)
+{
+	for (uint32_t i = 0; i <= (uint32_t)LogSeverity::Error; i++)
+	{
+		if (name == logSeverityNames[i])
+		{
+			return (LogSeverity)i;
+		}
+	}
+
+	throw std::runtime_error("Unknown log level " + name + ", expected verbose, info, warning or error.");
+}
+
+void MessageLogger::init(uint32_t capacity)
+{
+	// Power of two for the index mask
+	uint32_t size = 1;
+
+	while (size < capacity)
+	{
+		size <<= 1;
+	}
+
+	this->ring.reset(new LogMessage[size]);
+	this->mask = size - 1;
+
+	// Slot i is free for the producer that claims position i
+	for (uint32_t i = 0; i < size; i++)
+	{
+		this->ring[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	this->dedupKeys.reset(new std::atomic<uint64_t>[dedupSize]);
+	this->dedupCounts.reset(new std::atomic<uint32_t>[dedupSize]);
+
+	for (uint32_t i = 0; i < dedupSize; i++)
+	{
+		this->dedupKeys[i].store(0, std::memory_order_relaxed);
+		this->dedupCounts[i].store(0, std::memory_order_relaxed);
+	}
+
+	this->running = true;
+
+	this->writer = std::thread([this]
+	{
+		while (this->running.load(std::memory_order_acquire))
+		{
+			this->drain();
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+
+		this->drain();
+	});
+}
+
+void MessageLogger::release()
+{
+	if (!this->running)
+	{
+		return;
+	}
+
+	this->running = false;
+	this->writer.join();
+
+	this->printRepeats();
+
+	if (this->limited > 0 || this->overflowed > 0)
+	{
+		std::cout << "MessageLogger: " << this->limited << " rate limited, " << this->overflowed << " dropped on a full ring" << std::endl;
+	}
+}
+
+void MessageLogger::setSeverity(LogSeverity severity)
+{
+	this->minSeverity.store((int)severity, std::memory_order_relaxed);
+}
+
+void MessageLogger::cycleSeverity()
+{
+	int next = (this->minSeverity.load(std::memory_order_relaxed) + 1) % 4;
+	this->setSeverity((LogSeverity)next);
+
+	std::string text = std::string("log level ") + logSeverityNames[next];
+	this->push(LogSeverity::Error, "logger", 0, text.c_str());
+}
+
+void MessageLogger::log(LogSeverity severity, const char* source, int64_t id, const char* text)
+{
+	if (!this->running.load(std::memory_order_relaxed) || (int)severity < this->minSeverity.load(std::memory_order_relaxed))
+	{
+		return;
+	}
+
+	// Layers without message IDs dedup by their text
+	uint64_t key = id != 0 ? (uint64_t)(uint32_t)id : hashBytes(14695981039346656037ull, text, strlen(text));
+
+	// Never 0, that marks an empty table slot
+	key |= 1ull << 63;
+
+	if (!this->dedup(key))
+	{
+		this->repeated.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	if (!this->rateAllowed())
+	{
+		this->limited.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	this->push(severity, source, key, text);
+}
+
+bool MessageLogger::dedup(uint64_t key)
+{
+	uint32_t index = (uint32_t)(hashValue(14695981039346656037ull, key) % dedupSize);
+
+	for (uint32_t probe = 0; probe < dedupSize; probe++)
+	{
+		std::atomic<uint64_t>& slot = this->dedupKeys[index];
+		uint64_t current = slot.load(std::memory_order_acquire);
+
+		if (current == 0)
+		{
+			// Claim it; losing the race to the same key is fine too
+			if (slot.compare_exchange_strong(current, key, std::memory_order_acq_rel) || current == key)
+			{
+				return this->dedupCounts[index].fetch_add(1, std::memory_order_relaxed) < this->repeatLimit;
+			}
+		}
+
+		if (current == key)
+		{
+			return this->dedupCounts[index].fetch_add(1, std::memory_order_relaxed) < this->repeatLimit;
+		}
+
+		index = (index + 1) % dedupSize;
+	}
+
+	// Table full, nothing is suppressed from here on
+	return true;
+}
+
+bool MessageLogger::rateAllowed()
+{
+	int64_t second = std::chrono::duration_cast<std::chrono::seconds>(Clock::now().time_since_epoch()).count();
+	int64_t window = this->rateWindow.load(std::memory_order_relaxed);
+
+	// First producer of a new second restarts the count
+	if (second != window && this->rateWindow.compare_exchange_strong(window, second, std::memory_order_relaxed))
+	{
+		this->rateCount.store(0, std::memory_order_relaxed);
+	}
+
+	return this->rateCount.fetch_add(1, std::memory_order_relaxed) < this->rateLimit;
+}
+
+bool MessageLogger::push(LogSeverity severity, const char* source, uint64_t key, const char* text)
+{
+	if (!this->ring)
+	{
+		return false;
+	}
+
+	uint64_t pos = this->head.load(std::memory_order_relaxed);
+	LogMessage* message;
+
+	// Bounded MPMC ring: a slot whose sequence equals the position is free
+	for (;;)
+	{
+		message = &this->ring[pos & this->mask];
+
+		uint64_t sequence = message->sequence.load(std::memory_order_acquire);
+		int64_t diff = (int64_t)sequence - (int64_t)pos;
+
+		if (diff == 0)
+		{
+			if (this->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if (diff < 0)
+		{
+			this->overflowed.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		else
+		{
+			pos = this->head.load(std::memory_order_relaxed);
+		}
+	}
+
+	message->severity = severity;
+	message->key = key;
+
+	strncpy(message->source, source, sizeof(message->source) - 1);
+	message->source[sizeof(message->source) - 1] = 0;
+
+	strncpy(message->text, text, sizeof(message->text) - 1);
+	message->text[sizeof(message->text) - 1] = 0;
+
+	message->sequence.store(pos + 1, std::memory_order_release);
+
+	this->accepted.fetch_add(1, std::memory_order_relaxed);
+
+	return true;
+}
+
+void MessageLogger::drain()
+{
+	bool wrote = false;
+
+	for (;;)
+	{
+		LogMessage& message = this->ring[this->tail & this->mask];
+
+		if (message.sequence.load(std::memory_order_acquire) != this->tail + 1)
+		{
+			break;
+		}
+
+		// No endl, one flush per drained batch
+		std::cout << "[" << message.source << " " << logSeverityNames[(int)message.severity] << "] " << message.text << "\n";
+		wrote = true;
+
+		message.sequence.store(this->tail + this->mask + 1, std::memory_order_release);
+		this->tail++;
+	}
+
+	if (wrote)
+	{
+		std::cout.flush();
+	}
+}
+
+void MessageLogger::printRepeats()
+{
+	uint64_t suppressed = this->repeated.load();
+
+	if (suppressed == 0)
+	{
+		return;
+	}
+
+	std::cout << "MessageLogger: " << suppressed << " repeated messages suppressed" << std::endl;
+
+	for (uint32_t i = 0; i < dedupSize; i++)
+	{
+		uint32_t count = this->dedupCounts[i].load();
+
+		if (count > this->repeatLimit)
+		{
+			uint64_t key = this->dedupKeys[i].load() & ~(1ull << 63);
+			std::cout << "  id " << std::hex << key << std::dec << ": " << count << " times" << std::endl;
+		}
+	}
+}
+
+bool JobDeque::push(Job* job)
+{
+	int64_t b = this->bottom.load(std::memory_order_relaxed);
+	int64_t t = this->top.load(std::memory_order_acquire);
+
+	if (b - t >= capacity)
+	{
+		return false;
+	}
+
+	this->buffer[b & (capacity - 1)].store(job, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	this->bottom.store(b + 1, std::memory_order_relaxed);
+
+	return true;
+}
+
+Job* JobDeque::pop()
+{
+	int64_t b = this->bottom.load(std::memory_order_relaxed) - 1;
+	this->bottom.store(b, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t t = this->top.load(std::memory_order_relaxed);
+
+	if (t > b)
+	{
+		// Empty
+		this->bottom.store(b + 1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	Job* job = this->buffer[b & (capacity - 1)].load(std::memory_order_relaxed);
+
+	if (t == b)
+	{
+		// Last one, race the thieves for it
+		if (!this->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+		{
+			job = nullptr;
+		}
+
+		this->bottom.store(b + 1, std::memory_order_relaxed);
+	}
+
+	return job;
+}
+
+Job* JobDeque::steal()
+{
+	int64_t t = this->top.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t b = this->bottom.load(std::memory_order_acquire);
+
+	if (t >= b)
+	{
+		return nullptr;
+	}
+
+	Job* job = this->buffer[t & (capacity - 1)].load(std::memory_order_relaxed);
+
+	if (!this->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+	{
+		return nullptr;
+	}
+
+	return job;
+}
+
+// Slot of this thread and the system it belongs to, a thread can outlive
+// a benchmark's job system
+static thread_local JobSystem* jobSlotOwner = nullptr;
+static thread_local uint32_t jobSlot = UINT32_MAX;
+
+void JobSystem::init(uint32_t threadCount)
+{
+	if (threadCount == 0)
+	{
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	this->workerCount = threadCount - 1;
+
+	for (uint32_t i = 0; i < this->slotCount(); i++)
+	{
+		this->deques.emplace_back(new JobDeque());
+	}
+
+	for (uint32_t i = 0; i < this->workerCount; i++)
+	{
+		this->workers.push_back(std::thread([this, i]() { this->workerLoop(i); }));
+	}
+
+	this->registerThread();
+}
+
+void JobSystem::release()
+{
+	this->stopping = true;
+
+	{
+		std::lock_guard<std::mutex> lock(this->sleepMutex);
+		this->sleepCond.notify_all();
+	}
+
+	for (auto& worker : this->workers)
+	{
+		worker.join();
+	}
+
+	this->workers.clear();
+
+	if (this->printStats && this->executed > 0)
+	{
+		std::cout << "JobSystem: " << this->executed << " jobs on " << this->workerCount + 1 << " threads, "
+			<< this->stolen << " stolen" << std::endl;
+	}
+
+	if (jobSlotOwner == this)
+	{
+		jobSlotOwner = nullptr;
+		jobSlot = UINT32_MAX;
+	}
+}
+
+void JobSystem::registerThread()
+{
+	if (jobSlotOwner == this)
+	{
+		return;
+	}
+
+	uint32_t index = this->registered.fetch_add(1);
+
+	if (index >= maxExternal)
+	{
+		// Still works, just without a deque of its own
+		this->registered--;
+		return;
+	}
+
+	jobSlotOwner = this;
+	jobSlot = this->workerCount + index;
+}
+
+uint32_t JobSystem::threadIndex()
+{
+	return jobSlotOwner == this ? jobSlot : UINT32_MAX;
+}
+
+uint32_t JobSystem::slotCount()
+{
+	return this->workerCount + maxExternal;
+}
+
+void JobSystem::run(std::function<void()> func, JobCounter* counter)
+{
+	Job* job = new Job();
+	job->func = std::move(func);
+	job->counter = counter;
+
+	if (counter != nullptr)
+	{
+		counter->pending.fetch_add(1);
+	}
+
+	this->submit(job);
+}
+
+void JobSystem::then(JobCounter& after, std::function<void()> func, JobCounter* counter)
+{
+	Job* job = new Job();
+	job->func = std::move(func);
+	job->counter = counter;
+
+	if (counter != nullptr)
+	{
+		counter->pending.fetch_add(1);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(after.mutex);
+
+		if (after.pending.load() > 0)
+		{
+			after.continuations.push_back(job);
+			return;
+		}
+	}
+
+	this->submit(job);
+}
+
+void JobSystem::wait(JobCounter& counter)
+{
+	uint32_t slot = this->threadIndex();
+
+	while (counter.pending.load(std::memory_order_acquire) > 0)
+	{
+		Job* job = this->find(slot);
+
+		if (job != nullptr)
+		{
+			this->execute(job);
+		}
+		else
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	// The job that brought it to zero may still hold the lock
+	std::lock_guard<std::mutex> lock(counter.mutex);
+}
+
+void JobSystem::parallelFor(uint32_t count, uint32_t grain, const ParallelForFunc& func)
+{
+	if (count == 0)
+	{
+		return;
+	}
+
+	uint32_t chunks = std::min((count + grain - 1) / std::max(grain, 1u), (this->workerCount + 1) * 4);
+
+	if (chunks <= 1)
+	{
+		func(0, count);
+		return;
+	}
+
+	JobCounter counter;
+
+	// Chunk 0 stays on this thread
+	for (uint32_t chunk = 1; chunk < chunks; chunk++)
+	{
+		uint32_t first = (uint64_t)chunk * count / chunks;
+		uint32_t last = (uint64_t)(chunk + 1) * count / chunks;
+
+		this->run([&func, first, last]() { func(first, last - first); }, &counter);
+	}
+
+	func(0, (uint64_t)count / chunks);
+
+	this->wait(counter);
+}
+
+void JobSystem::submit(Job* job)
+{
+	uint32_t slot = this->threadIndex();
+
+	// Counted before it is visible, a sleeper that misses it still wakes
+	this->queued.fetch_add(1);
+
+	if (slot != UINT32_MAX)
+	{
+		if (!this->deques[slot]->push(job))
+		{
+			this->queued.fetch_sub(1);
+			this->execute(job);
+			return;
+		}
+	}
+	else
+	{
+		std::lock_guard<std::mutex> lock(this->injectMutex);
+		this->injected.push_back(job);
+	}
+
+	if (this->sleepers.load() > 0)
+	{
+		std::lock_guard<std::mutex> lock(this->sleepMutex);
+		this->sleepCond.notify_one();
+	}
+}
+
+Job* JobSystem::find(uint32_t slot)
+{
+	Job* job = nullptr;
+
+	if (slot != UINT32_MAX)
+	{
+		job = this->deques[slot]->pop();
+	}
+
+	// Steal, starting past our own deque so thieves spread out
+	uint32_t count = this->deques.size();
+	uint32_t start = slot != UINT32_MAX ? slot + 1 : 0;
+
+	for (uint32_t i = 0; i < count && job == nullptr; i++)
+	{
+		uint32_t victim = (start + i) % count;
+
+		if (victim != slot)
+		{
+			job = this->deques[victim]->steal();
+
+			if (job != nullptr)
+			{
+				this->stolen.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	if (job == nullptr)
+	{
+		std::lock_guard<std::mutex> lock(this->injectMutex);
+
+		if (this->injected.size() > 0)
+		{
+			job = this->injected.front();
+			this->injected.pop_front();
+		}
+	}
+
+	if (job != nullptr)
+	{
+		this->queued.fetch_sub(1);
+	}
+
+	return job;
+}
+
+void JobSystem::execute(Job* job)
+{
+	job->func();
+
+	this->executed.fetch_add(1, std::memory_order_relaxed);
+
+	JobCounter* counter = job->counter;
+	delete job;
+
+	if (counter == nullptr)
+	{
+		return;
+	}
+
+	std::vector<Job*> next;
+
+	{
+		std::lock_guard<std::mutex> lock(counter->mutex);
+
+		if (counter->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			next.swap(counter->continuations);
+		}
+	}
+
+	for (Job* continuation : next)
+	{
+		this->submit(continuation);
+	}
+}
+
+void JobSystem::workerLoop(uint32_t slot)
+{
+	jobSlotOwner = this;
+	jobSlot = slot;
+
+	uint32_t idle = 0;
+
+	while (!this->stopping.load(std::memory_order_relaxed))
+	{
+		Job* job = this->find(slot);
+
+		if (job != nullptr)
+		{
+			this->execute(job);
+			idle = 0;
+			continue;
+		}
+
+		// Spin a little, new work often follows right away
+		if (++idle < 64)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		this->sleepers.fetch_add(1);
+
+		{
+			std::unique_lock<std::mutex> lock(this->sleepMutex);
+			this->sleepCond.wait(lock, [this]() { return this->stopping.load() || this->queued.load() > 0; });
+		}
+
+		this->sleepers.fetch_sub(1);
+		idle = 0;
+	}
+}
+
+// --bench-jobs: scheduling overhead and scaling of the job system from one
+// thread to all of them, without a window or a device
+int runJobBenchmark()
+{
+	typedef std::chrono::steady_clock Clock;
+
+	uint32_t maxThreads = jobThreads > 0 ? jobThreads : std::max(1u, std::thread::hardware_concurrency());
+
+	const uint32_t emptyJobs = 100000;
+	const uint32_t items = 1 << 22;
+	const uint32_t chainLength = 10000;
+
+	std::vector<float> data(items);
+	double baseMs = 0.0;
+
+	std::cout << "threads, empty job ns, parallel_for ms, speedup, continuation ns" << std::endl;
+
+	for (uint32_t threads = 1; threads <= maxThreads; threads++)
+	{
+		std::unique_ptr<JobSystem> system(new JobSystem());
+		system->printStats = false;
+		system->init(threads);
+
+		// Spawn and wait on jobs that do nothing
+		Clock::time_point start = Clock::now();
+
+		{
+			JobCounter counter;
+
+			for (uint32_t i = 0; i < emptyJobs; i++)
+			{
+				system->run([]() {}, &counter);
+			}
+
+			system->wait(counter);
+		}
+
+		double emptyNs = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / emptyJobs;
+
+		// Enough arithmetic per item that scaling, not overhead, shows
+		start = Clock::now();
+
+		system->parallelFor(items, 16384, [&data](uint32_t first, uint32_t count)
+		{
+			for (uint32_t i = first; i < first + count; i++)
+			{
+				float x = (float)i;
+
+				for (uint32_t k = 0; k < 16; k++)
+				{
+					x = std::sqrt(x + k);
+				}
+
+				data[i] = x;
+			}
+		});
+
+		double forMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+		if (threads == 1)
+		{
+			baseMs = forMs;
+		}
+
+		// Each job starts only when the previous one finished
+		start = Clock::now();
+
+		{
+			std::unique_ptr<JobCounter[]> counters(new JobCounter[chainLength]);
+
+			system->run([]() {}, &counters[0]);
+
+			for (uint32_t i = 1; i < chainLength; i++)
+			{
+				system->then(counters[i - 1], []() {}, &counters[i]);
+			}
+
+			system->wait(counters[chainLength - 1]);
+		}
+
+		double chainNs = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / chainLength;
+
+		std::cout << threads << ", " << emptyNs << ", " << forMs << ", " << baseMs / forMs << ", " << chainNs << std::endl;
+
+		system->release();
+	}
+
+	return 0;
+}
+
+void LatencyTracker::init(VkDevice device, bool presentWait)
+{
+	this->device = device;
+
+	if (presentWait)
+	{
+		this->waitForPresent = (PFN_vkWaitForPresentKHR)vkGetDeviceProcAddr(device, "vkWaitForPresentKHR");
+	}
+
+	std::cout << "Latency measured by " << (this->usesPresentWait() ? "present wait" : "frame fence (estimate)") << std::endl;
+
+	this->worker = std::thread([this]() { this->run(); });
+}
+
+void LatencyTracker::release()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+
+	this->cond.notify_all();
+
+	if (this->worker.joinable())
+	{
+		this->worker.join();
+	}
+
+	const char* method = this->usesPresentWait() ? "present wait" : "fence estimate";
+
+	std::cout << "Latency (" << method << ", ms, p50/p95/p99)" << std::endl;
+
+	this->printHistogram("input to present", this->inputToPresent);
+	this->printHistogram("frame start to present", this->startToPresent);
+	this->printHistogram("submit to present", this->submitToPresent);
+
+	if (this->dropped > 0)
+	{
+		std::cout << "  " << this->dropped << " frames dropped by swapchain recreation" << std::endl;
+	}
+}
+
+bool LatencyTracker::usesPresentWait()
+{
+	return this->waitForPresent != nullptr;
+}
+
+void LatencyTracker::submitted(const LatencyFrame& frame)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->queue.push_back(frame);
+	}
+
+	this->cond.notify_all();
+}
+
+void LatencyTracker::releaseFence(VkFence fence)
+{
+	std::unique_lock<std::mutex> lock(this->mutex);
+
+	// Already signalled, so the worker gets past it quickly
+	this->cond.wait(lock, [this, fence]()
+	{
+		for (const auto& frame : this->queue)
+		{
+			if (frame.fence == fence)
+			{
+				return false;
+			}
+		}
+
+		return true;
+	});
+}
+
+void LatencyTracker::forgetSwapChain(VkSwapchainKHR swapChain)
+{
+	std::unique_lock<std::mutex> lock(this->mutex);
+
+	for (auto& frame : this->queue)
+	{
+		if (frame.swapChain == swapChain)
+		{
+			frame.dropped = true;
+		}
+	}
+
+	// Waits time out every few milliseconds and notice the drop
+	this->cond.wait(lock, [this, swapChain]() { return this->busySwapChain != swapChain; });
+}
+
+void LatencyTracker::run()
+{
+	const uint64_t timeout = 5000000;
+
+	std::unique_lock<std::mutex> lock(this->mutex);
+
+	while (true)
+	{
+		this->cond.wait(lock, [this]() { return this->stopping || this->queue.size() > 0; });
+
+		if (this->stopping)
+		{
+			// Whatever is left never gets a completion time
+			this->queue.clear();
+			this->cond.notify_all();
+			return;
+		}
+
+		LatencyFrame frame = this->queue.front();
+		bool done = false;
+
+		while (!frame.dropped && !this->stopping)
+		{
+			this->busySwapChain = frame.swapChain;
+			lock.unlock();
+
+			VkResult r;
+
+			if (frame.presentId != 0)
+			{
+				r = this->waitForPresent(this->device, frame.swapChain, frame.presentId, timeout);
+			}
+			else
+			{
+				r = vkWaitForFences(this->device, 1, &frame.fence, VK_TRUE, timeout);
+			}
+
+			lock.lock();
+			this->busySwapChain = VK_NULL_HANDLE;
+
+			if (r == VK_SUCCESS)
+			{
+				done = true;
+				break;
+			}
+
+			if (r != VK_TIMEOUT)
+			{
+				// Out of date or lost, this frame never shows
+				break;
+			}
+
+			frame.dropped = this->queue.front().dropped;
+		}
+
+		Clock::time_point now = Clock::now();
+
+		if (done)
+		{
+			if (frame.input != 0)
+			{
+				int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count() - frame.input;
+				this->inputToPresent.push_back(ns / 1000000.0);
+			}
+
+			this->startToPresent.push_back(std::chrono::duration<double, std::milli>(now - frame.start).count());
+			this->submitToPresent.push_back(std::chrono::duration<double, std::milli>(now - frame.submit).count());
+		}
+		else
+		{
+			this->dropped++;
+		}
+
+		this->queue.pop_front();
+		this->cond.notify_all();
+	}
+}
+
+void LatencyTracker::printHistogram(const char* name, const std::vector<double>& values)
+{
+	std::cout << "  " << name << ": ";
+
+	if (values.size() == 0)
+	{
+		std::cout << "no samples" << std::endl;
+		return;
+	}
+
+	std::cout << percentile(values, 0.50) << " / "
+		<< percentile(values, 0.95) << " / "
+		<< percentile(values, 0.99) << " over " << values.size() << " frames" << std::endl;
+
+	// 2 ms buckets, the last one takes everything above
+	const uint32_t bucketCount = 33;
+	const double bucketMs = 2.0;
+
+	std::vector<uint32_t> buckets(bucketCount, 0);
+	uint32_t peak = 0;
+
+	for (double value : values)
+	{
+		uint32_t bucket = std::min<uint32_t>((uint32_t)(value / bucketMs), bucketCount - 1);
+		peak = std::max(peak, ++buckets[bucket]);
+	}
+
+	for (uint32_t i = 0; i < bucketCount; i++)
+	{
+		if (buckets[i] == 0)
+		{
+			continue;
+		}
+
+		std::string bar((size_t)buckets[i] * 40 / peak + 1, '#');
+
+		if (i + 1 < bucketCount)
+		{
+			std::cout << "    " << i * bucketMs << "-" << (i + 1) * bucketMs << " ms: ";
+		}
+		else
+		{
+			std::cout << "    " << i * bucketMs << "+ ms: ";
+		}
+
+		std::cout << bar << " " << buckets[i] << std::endl;
+	}
+}
+
+static uint32_t pngCrc(uint32_t crc, const uint8_t* data, size_t size)
+{
+	static uint32_t table[256] = {};
+
+	if (table[1] == 0)
+	{
+		for (uint32_t n = 0; n < 256; n++)
+		{
+			uint32_t c = n;
+
+			for (int k = 0; k < 8; k++)
+			{
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			}
+
+			table[n] = c;
+		}
+	}
+
+	crc = ~crc;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
+
+static void appendBigEndian(std::vector<uint8_t>& out, uint32_t value)
+{
+	out.push_back((uint8_t)(value >> 24));
+	out.push_back((uint8_t)(value >> 16));
+	out.push_back((uint8_t)(value >> 8));
+	out.push_back((uint8_t)value);
+}
+
+static void appendPngChunk(std::vector<uint8_t>& out, const char* type, const std::vector<uint8_t>& data)
+{
+	appendBigEndian(out, (uint32_t)data.size());
+
+	size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data.begin(), data.end());
+
+	appendBigEndian(out, pngCrc(0, out.data() + start, out.size() - start));
+}
+
+// Uncompressed deflate blocks; capture has to keep up with the frame rate,
+// a real compressor is left to whatever consumes the files
+static std::vector<uint8_t> encodePng(uint32_t width, uint32_t height, const uint8_t* pixels, bool bgra)
+{
+	size_t stride = (size_t)width * 4;
+
+	// Filter type 0 in front of every row
+	std::vector<uint8_t> rows(height * (stride + 1));
+
+	for (uint32_t y = 0; y < height; y++)
+	{
+		uint8_t* dst = rows.data() + y * (stride + 1);
+		const uint8_t* src = pixels + y * stride;
+
+		dst[0] = 0;
+		std::memcpy(dst + 1, src, stride);
+
+		if (bgra)
+		{
+			for (size_t x = 1; x < stride + 1; x += 4)
+			{
+				std::swap(dst[x], dst[x + 2]);
+			}
+		}
+	}
+
+	std::vector<uint8_t> zlib = { 0x78, 0x01 };
+	zlib.reserve(rows.size() + rows.size() / 65535 * 5 + 16);
+
+	uint32_t a = 1;
+	uint32_t b = 0;
+
+	for (size_t offset = 0; offset < rows.size() || offset == 0; )
+	{
+		size_t size = std::min<size_t>(rows.size() - offset, 65535);
+		bool last = offset + size == rows.size();
+
+		zlib.push_back(last ? 1 : 0);
+		zlib.push_back((uint8_t)size);
+		zlib.push_back((uint8_t)(size >> 8));
+		zlib.push_back((uint8_t)~size);
+		zlib.push_back((uint8_t)(~size >> 8));
+		zlib.insert(zlib.end(), rows.begin() + offset, rows.begin() + offset + size);
+
+		for (size_t i = offset; i < offset + size; i++)
+		{
+			a = (a + rows[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+
+		offset += size;
+
+		if (last)
+		{
+			break;
+		}
+	}
+
+	appendBigEndian(zlib, (b << 16) | a);
+
+	std::vector<uint8_t> header;
+	appendBigEndian(header, width);
+	appendBigEndian(header, height);
+	header.push_back(8);
+	header.push_back(6);
+	header.push_back(0);
+	header.push_back(0);
+	header.push_back(0);
+
+	std::vector<uint8_t> out = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	appendPngChunk(out, "IHDR", header);
+	appendPngChunk(out, "IDAT", zlib);
+	appendPngChunk(out, "IEND", {});
+
+	return out;
+}
+
+void FrameCapture::init(VkDevice device, GpuAllocator* allocator, uint32_t slotCount)
+{
+	this->device = device;
+	this->allocator = allocator;
+	this->slots = std::vector<CaptureSlot>(slotCount);
+
+	this->writer = std::thread([this]() { this->run(); });
+}
+
+void FrameCapture::release()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		// The device is idle, whatever is still copying is done
+		for (uint32_t i = 0; i < this->slots.size(); i++)
+		{
+			if (this->slots[i].busy && !this->slots[i].writing)
+			{
+				this->slots[i].writing = true;
+				this->queue.push_back(i);
+			}
+		}
+
+		this->stopping = true;
+	}
+
+	this->cond.notify_all();
+
+	if (this->writer.joinable())
+	{
+		this->writer.join();
+	}
+
+	for (auto& slot : this->slots)
+	{
+		if (slot.buffer != VK_NULL_HANDLE)
+		{
+			this->allocator->destroyBuffer(slot.buffer, slot.memory);
+		}
+	}
+
+	this->slots.clear();
+
+	if (this->written > 0 || this->skipped > 0)
+	{
+		std::cout << "FrameCapture: " << this->written << " frames written, " << this->skipped << " skipped (ring busy), "
+			<< this->bytes / (1024 * 1024) << " MiB, " << (this->written > 0 ? this->writeMs / this->written : 0.0) << "ms per frame";
+
+		if (this->failed > 0)
+		{
+			std::cout << ", " << this->failed << " failed";
+		}
+
+		std::cout << std::endl;
+	}
+}
+
+bool FrameCapture::supports(VkFormat format)
+{
+	return format == VK_FORMAT_B8G8R8A8_UNORM ||
+		format == VK_FORMAT_B8G8R8A8_SRGB ||
+		format == VK_FORMAT_R8G8B8A8_UNORM ||
+		format == VK_FORMAT_R8G8B8A8_SRGB;
+}
+
+bool FrameCapture::record(
+	VkCommandBuffer cmd,
+	VkImage image,
+	VkImageLayout layout,
+	VkFormat format,
+	VkExtent2D extent,
+	uint64_t frame,
+	const std::string& path)
+{
+	VkDeviceSize size = (VkDeviceSize)extent.width * extent.height * 4;
+	CaptureSlot* slot = nullptr;
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		// Oldest first, so the files come out in frame order
+		for (uint32_t i = 0; i < this->slots.size() && slot == nullptr; i++)
+		{
+			CaptureSlot& candidate = this->slots[(this->next + i) % this->slots.size()];
+
+			if (!candidate.busy)
+			{
+				slot = &candidate;
+				slot->busy = true;
+				this->next = (this->next + i + 1) % this->slots.size();
+			}
+		}
+	}
+
+	if (slot == nullptr)
+	{
+		this->skipped++;
+		return false;
+	}
+
+	// Neither the GPU nor the writer touches a slot that isn't busy
+	if (slot->capacity < size)
+	{
+		if (slot->buffer != VK_NULL_HANDLE)
+		{
+			this->allocator->destroyBuffer(slot->buffer, slot->memory);
+		}
+
+		this->allocator->createBuffer(
+			size,
+			VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+			slot->buffer,
+			slot->memory
+		);
+
+		slot->capacity = size;
+	}
+
+	slot->submitted = frame;
+	slot->width = extent.width;
+	slot->height = extent.height;
+	slot->format = format;
+	slot->path = path;
+
+	VkImageMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	barrier.oldLayout = layout;
+	barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = image;
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.levelCount = 1;
+	barrier.subresourceRange.layerCount = 1;
+
+	vkCmdPipelineBarrier(
+		cmd,
+		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		0,
+		0, nullptr,
+		0, nullptr,
+		1, &barrier
+	);
+
+	VkBufferImageCopy region = {};
+	region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	region.imageSubresource.layerCount = 1;
+	region.imageExtent = { extent.width, extent.height, 1 };
+
+	vkCmdCopyImageToBuffer(cmd, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, slot->buffer, 1, &region);
+
+	// Back for present; the next frame's attachment writes wait for the read
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = 0;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	barrier.newLayout = layout;
+
+	VkBufferMemoryBarrier bufferBarrier = {};
+	bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	bufferBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	bufferBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	bufferBarrier.buffer = slot->buffer;
+	bufferBarrier.size = size;
+
+	vkCmdPipelineBarrier(
+		cmd,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_HOST_BIT,
+		0,
+		0, nullptr,
+		1, &bufferBarrier,
+		1, &barrier
+	);
+
+	return true;
+}
+
+void FrameCapture::collect(uint64_t frame, uint32_t framesInFlight)
+{
+	bool handed = false;
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		for (uint32_t i = 0; i < this->slots.size(); i++)
+		{
+			CaptureSlot& slot = this->slots[i];
+
+			if (slot.busy && !slot.writing && frame >= slot.submitted + framesInFlight)
+			{
+				slot.writing = true;
+				this->queue.push_back(i);
+				handed = true;
+			}
+		}
+	}
+
+	if (handed)
+	{
+		this->cond.notify_all();
+	}
+}
+
+bool FrameCapture::take(uint64_t frame, CapturedFrame& captured)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	for (auto it = this->kept.begin(); it != this->kept.end(); ++it)
+	{
+		if (it->frame == frame)
+		{
+			captured = std::move(*it);
+			this->kept.erase(it);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void FrameCapture::run()
+{
+	std::unique_lock<std::mutex> lock(this->mutex);
+
+	while (true)
+	{
+		this->cond.wait(lock, [this]() { return this->stopping || !this->queue.empty(); });
+
+		if (this->queue.empty())
+		{
+			return;
+		}
+
+		CaptureSlot& slot = this->slots[this->queue.front()];
+		this->queue.pop_front();
+
+		lock.unlock();
+
+		auto start = Clock::now();
+
+		const uint8_t* pixels = (const uint8_t*)slot.memory.mapped;
+		bool bgra = slot.format == VK_FORMAT_B8G8R8A8_UNORM || slot.format == VK_FORMAT_B8G8R8A8_SRGB;
+		size_t size = (size_t)slot.width * slot.height * 4;
+
+		if (slot.path.empty())
+		{
+			CapturedFrame captured;
+			captured.frame = slot.submitted;
+			captured.width = slot.width;
+			captured.height = slot.height;
+			captured.pixels.assign(pixels, pixels + size);
+
+			if (bgra)
+			{
+				for (size_t i = 0; i < size; i += 4)
+				{
+					std::swap(captured.pixels[i], captured.pixels[i + 2]);
+				}
+			}
+
+			lock.lock();
+
+			this->kept.push_back(std::move(captured));
+			slot.writing = false;
+			slot.busy = false;
+			continue;
+		}
+
+		std::string path = slot.path;
+		std::vector<uint8_t> png;
+
+		if (capturePng)
+		{
+			path += ".png";
+			png = encodePng(slot.width, slot.height, pixels, bgra);
+			pixels = png.data();
+			size = png.size();
+		}
+		else
+		{
+			// No header, the name carries what's needed to read it back
+			path += "_" + std::to_string(slot.width) + "x" + std::to_string(slot.height) + (bgra ? ".bgra" : ".rgba");
+		}
+
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		out.write((const char*)pixels, size);
+		bool ok = out.good();
+		out.close();
+
+		double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+		if (!ok)
+		{
+			logger.log(LogSeverity::Warning, "renderer", 0, ("Failed to write capture " + path).c_str());
+		}
+
+		lock.lock();
+
+		if (ok)
+		{
+			this->written++;
+			this->bytes += size;
+			this->writeMs += ms;
+		}
+		else
+		{
+			this->failed++;
+		}
+
+		slot.writing = false;
+		slot.busy = false;
+	}
+}
+
+// Only what encodePng writes: 8 bit RGBA, stored deflate blocks, no filters
+static bool decodePng(const std::vector<uint8_t>& file, uint32_t& width, uint32_t& height, std::vector<uint8_t>& pixels)
+{
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+	if (file.size() < 8 || std::memcmp(file.data(), signature, 8) != 0)
+	{
+		return false;
+	}
+
+	auto bigEndian = [&file](size_t at)
+	{
+		return ((uint32_t)file[at] << 24) | ((uint32_t)file[at + 1] << 16) | ((uint32_t)file[at + 2] << 8) | file[at + 3];
+	};
+
+	std::vector<uint8_t> zlib;
+	width = 0;
+	height = 0;
+
+	for (size_t at = 8; at + 12 <= file.size(); )
+	{
+		uint32_t size = bigEndian(at);
+
+		if (at + 12 + size > file.size())
+		{
+			return false;
+		}
+
+		const uint8_t* type = file.data() + at + 4;
+		const uint8_t* data = type + 4;
+
+		if (std::memcmp(type, "IHDR", 4) == 0)
+		{
+			// 8 bits, RGBA, no interlacing
+			if (size != 13 || data[8] != 8 || data[9] != 6 || data[12] != 0)
+			{
+				return false;
+			}
+
+			width = bigEndian(at + 8);
+			height = bigEndian(at + 12);
+		}
+		else if (std::memcmp(type, "IDAT", 4) == 0)
+		{
+			zlib.insert(zlib.end(), data, data + size);
+		}
+
+		at += 12 + size;
+	}
+
+	size_t stride = (size_t)width * 4;
+	std::vector<uint8_t> rows;
+
+	for (size_t at = 2; at < zlib.size(); )
+	{
+		uint8_t header = zlib[at];
+
+		// Stored blocks only
+		if (((header >> 1) & 3) != 0 || at + 5 > zlib.size())
+		{
+			return false;
+		}
+
+		size_t size = zlib[at + 1] | (zlib[at + 2] << 8);
+
+		if (at + 5 + size > zlib.size())
+		{
+			return false;
+		}
+
+		rows.insert(rows.end(), zlib.begin() + at + 5, zlib.begin() + at + 5 + size);
+		at += 5 + size;
+
+		if (header & 1)
+		{
+			break;
+		}
+	}
+
+	if (width == 0 || rows.size() != height * (stride + 1))
+	{
+		return false;
+	}
+
+	pixels.resize(height * stride);
+
+	for (uint32_t y = 0; y < height; y++)
+	{
+		const uint8_t* row = rows.data() + y * (stride + 1);
+
+		if (row[0] != 0)
+		{
+			return false;
+		}
+
+		std::memcpy(pixels.data() + y * stride, row + 1, stride);
+	}
+
+	return true;
+}
+
+static bool readFile(const std::string& path, std::vector<uint8_t>& data)
+{
+	std::ifstream in(path, std::ios::binary);
+
+	if (!in.is_open())
+	{
+		return false;
+	}
+
+	data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+
+	return true;
+}
+
+static bool writeFile(const std::string& path, const std::vector<uint8_t>& data)
+{
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	out.write((const char*)data.data(), data.size());
+
+	return out.good();
+}
+
+// Inside a render pass, with the pass' first color attachment
+static void clearRect(VkCommandBuffer cmd, int32_t x, int32_t y, uint32_t w, uint32_t h, const glm::vec3& color)
+{
+	VkClearAttachment attachment = {};
+	attachment.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	attachment.colorAttachment = 0;
+	attachment.clearValue.color = { { color.r, color.g, color.b, 1.0f } };
+
+	VkClearRect rect = {};
+	rect.rect.offset = { x, y };
+	rect.rect.extent = { w, h };
+	rect.layerCount = 1;
+
+	vkCmdClearAttachments(cmd, 1, &attachment, 1, &rect);
+}
+
+// Compares the captured frame against goldenDir/<name>.png, or replaces
+// the golden with --update-golden. A mismatch leaves <name>.actual.png
+// next to the golden.
+static void checkGolden(BenchResult& result, const CapturedFrame& captured)
+{
+	// Per channel, the software rasterizers round differently
+	const int tolerance = 2;
+	const double allowedMismatch = 0.001;
+
+	std::string path = goldenDir + "/" + result.name + ".png";
+
+	if (updateGolden)
+	{
+		result.golden = writeFile(path, encodePng(captured.width, captured.height, captured.pixels.data(), false)) ? "updated" : "fail";
+		return;
+	}
+
+	std::vector<uint8_t> file;
+	std::vector<uint8_t> golden;
+	uint32_t goldenWidth = 0;
+	uint32_t goldenHeight = 0;
+
+	if (!readFile(path, file))
+	{
+		result.golden = "missing";
+		return;
+	}
+
+	if (!decodePng(file, goldenWidth, goldenHeight, golden))
+	{
+		std::cout << "Can't read golden " << path << ", only images written by --update-golden are supported" << std::endl;
+		result.golden = "fail";
+		return;
+	}
+
+	if (goldenWidth != captured.width || goldenHeight != captured.height)
+	{
+		result.golden = "fail";
+		result.mismatch = 1.0;
+	}
+	else
+	{
+		uint64_t different = 0;
+
+		for (size_t i = 0; i < golden.size(); i += 4)
+		{
+			for (size_t c = 0; c < 4; c++)
+			{
+				if (std::abs((int)golden[i + c] - (int)captured.pixels[i + c]) > tolerance)
+				{
+					different++;
+					break;
+				}
+			}
+		}
+
+		result.mismatch = (double)different / (golden.size() / 4);
+		result.golden = result.mismatch <= allowedMismatch ? "pass" : "fail";
+	}
+
+	if (std::strcmp(result.golden, "fail") == 0)
+	{
+		writeFile(goldenDir + "/" + result.name + ".actual.png", encodePng(captured.width, captured.height, captured.pixels.data(), false));
+	}
+}
+
+int runRenderBenchmark()
+{
+	typedef std::chrono::steady_clock Clock;
+
+	const uint64_t warmupFrames = 10;
+	const uint64_t measuredFrames = maxFrames > 0 ? maxFrames : 300;
+
+	const uint32_t passCount = 8;
+	const uint32_t drawCount = 10000;
+	const uint32_t uploadChunks = 4;
+	const VkDeviceSize uploadChunkSize = 1024 * 1024;
+	const uint64_t resizeInterval = 4;
+
+	uint32_t baseWidth = width;
+	uint32_t baseHeight = height;
+
+	VkBuffer uploadBuffer = VK_NULL_HANDLE;
+	GpuAllocation uploadMemory;
+	std::vector<uint8_t> uploadData(uploadChunkSize);
+
+	// n-pass samples its layers through these, without the shaders it clears the bands instead
+	VkDescriptorSetLayout composeSetLayout = VK_NULL_HANDLE;
+	VkPipelineLayout composeLayout = VK_NULL_HANDLE;
+	GraphicsPipelineDesc composeDesc;
+
+	std::vector<BenchScenario> scenarios;
+
+	// The cached clear command buffer, nothing else
+	scenarios.push_back({ "clear-only", glm::vec3(0.2f, 0.3f, 0.4f), nullptr, nullptr, nullptr, nullptr });
+
+	// Render passes split by sampling, each layer drawn then composited as a band
+	scenarios.push_back({ "n-pass", glm::vec3(0.1f, 0.1f, 0.1f), [&]()
+	{
+		std::vector<ShaderHandle> handles = {
+			test.shaders.request({ shaderDir + "/compose.vert", VK_SHADER_STAGE_VERTEX_BIT, {} }),
+			test.shaders.request({ shaderDir + "/compose.frag", VK_SHADER_STAGE_FRAGMENT_BIT, {} })
+		};
+
+		test.shaders.wait(handles[0]);
+		test.shaders.wait(handles[1]);
+
+		composeDesc.vertexShader = test.shaders.get(handles[0]);
+		composeDesc.fragmentShader = test.shaders.get(handles[1]);
+
+		if (composeDesc.vertexShader == VK_NULL_HANDLE || composeDesc.fragmentShader == VK_NULL_HANDLE)
+		{
+			logger.log(LogSeverity::Warning, "renderer", 0, ("compose shaders not found in " + shaderDir + ", n-pass clears its bands").c_str());
+			return;
+		}
+
+		VkDescriptorSetLayoutBinding binding = {};
+		binding.binding = 0;
+		binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		binding.descriptorCount = 1;
+		binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+		VkDescriptorSetLayoutCreateInfo setInfo = {};
+		setInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+		setInfo.bindingCount = 1;
+		setInfo.pBindings = &binding;
+
+		if (vkCreateDescriptorSetLayout(test.device, &setInfo, nullptr, &composeSetLayout) != VK_SUCCESS)
+		{
+			throw std::runtime_error("Benchmark: failed to create the compose descriptor set layout.");
+		}
+
+		VkPushConstantRange pushRange = {};
+		pushRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+		pushRange.size = sizeof(glm::vec2);
+
+		VkPipelineLayoutCreateInfo layoutInfo = {};
+		layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+		layoutInfo.setLayoutCount = 1;
+		layoutInfo.pSetLayouts = &composeSetLayout;
+		layoutInfo.pushConstantRangeCount = 1;
+		layoutInfo.pPushConstantRanges = &pushRange;
+
+		if (vkCreatePipelineLayout(test.device, &layoutInfo, nullptr, &composeLayout) != VK_SUCCESS)
+		{
+			throw std::runtime_error("Benchmark: failed to create the compose pipeline layout.");
+		}
+
+		composeDesc.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP;
+		composeDesc.layout = composeLayout;
+	}, nullptr, [&]()
+	{
+		VkExtent2D extent = test.renderExtent;
+
+		for (uint32_t i = 0; i < passCount; i++)
+		{
+			uint32_t layer = test.graph.createImage(test.swapChainImageFormat, extent);
+			glm::vec3 color((i & 1) ? 1.0f : 0.25f, (i & 2) ? 1.0f : 0.25f, (i & 4) ? 1.0f : 0.25f);
+
+			RenderGraphPass& draw = test.graph.addPass("layer");
+			draw.clear(layer, glm::vec4(color, 1.0f));
+			draw.execute = [extent](const RenderGraphContext& ctx)
+			{
+				clearRect(ctx.cmd, extent.width / 4, extent.height / 4, extent.width / 2, extent.height / 2, glm::vec3(1.0f));
+			};
+
+			RenderGraphPass& compose = test.graph.addPass("compose");
+			compose.sample(layer);
+			compose.write(test.backbuffer);
+			compose.execute = [&, extent, color, i, layer](const RenderGraphContext& ctx)
+			{
+				uint32_t band = extent.height / passCount;
+
+				if (composeLayout == VK_NULL_HANDLE)
+				{
+					clearRect(ctx.cmd, 0, band * i, extent.width, band, color);
+					return;
+				}
+
+				composeDesc.renderPass = ctx.compatiblePass;
+				composeDesc.subpass = ctx.subpass;
+
+				// Cached after the first frame, the golden image needs every band drawn
+				PipelineHandle handle = test.pipelines.request(composeDesc);
+				test.pipelines.wait(handle);
+
+				VkPipeline pipeline = test.pipelines.get(handle);
+
+				if (pipeline == VK_NULL_HANDLE)
+				{
+					return;
+				}
+
+				VkDescriptorSet set = test.descriptorPools.allocate(composeSetLayout);
+
+				VkDescriptorImageInfo imageInfo = { test.bindless.defaultSampler, test.graph.views[layer], VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+
+				VkWriteDescriptorSet write = {};
+				write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+				write.dstSet = set;
+				write.dstBinding = 0;
+				write.descriptorCount = 1;
+				write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+				write.pImageInfo = &imageInfo;
+
+				vkUpdateDescriptorSets(test.device, 1, &write, 0, nullptr);
+
+				VkViewport viewport = {};
+				viewport.width = (float)extent.width;
+				viewport.height = (float)extent.height;
+				viewport.maxDepth = 1.0f;
+
+				VkRect2D scissor = {};
+				scissor.extent = extent;
+
+				// Rows to clip space, y points down
+				glm::vec2 edges(-1.0f + 2.0f * band * i / extent.height, -1.0f + 2.0f * band * (i + 1) / extent.height);
+
+				vkCmdSetViewport(ctx.cmd, 0, 1, &viewport);
+				vkCmdSetScissor(ctx.cmd, 0, 1, &scissor);
+				vkCmdBindPipeline(ctx.cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+				vkCmdBindDescriptorSets(ctx.cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, composeLayout, 0, 1, &set, 0, nullptr);
+				vkCmdPushConstants(ctx.cmd, composeLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(edges), &edges);
+				vkCmdDraw(ctx.cmd, 4, 1, 0, 0);
+			};
+		}
+	}, [&]()
+	{
+		vkDeviceWaitIdle(test.device);
+		vkDestroyPipelineLayout(test.device, composeLayout, nullptr);
+		vkDestroyDescriptorSetLayout(test.device, composeSetLayout, nullptr);
+		composeLayout = VK_NULL_HANDLE;
+		composeSetLayout = VK_NULL_HANDLE;
+	} });
+
+	// One clear rect per draw, recorded on every job thread; no shaders needed
+	scenarios.push_back({ "many-draw", glm::vec3(0.0f), nullptr, nullptr, [&]()
+	{
+		VkExtent2D extent = test.renderExtent;
+
+		test.drawParallel(drawCount, [extent, drawCount](VkCommandBuffer cmd, uint32_t first, uint32_t count)
+		{
+			uint32_t columns = 100;
+			uint32_t rows = (drawCount + columns - 1) / columns;
+			uint32_t w = std::max(1u, extent.width / columns);
+			uint32_t h = std::max(1u, extent.height / rows);
+
+			for (uint32_t i = first; i < first + count; i++)
+			{
+				uint32_t hash = (i * 2654435761u) >> 8;
+				glm::vec3 color((hash & 0xff) / 255.0f, ((hash >> 8) & 0xff) / 255.0f, ((hash >> 16) & 0xff) / 255.0f);
+
+				clearRect(cmd, (i % columns) * w, (i / columns) * h, w, h, color);
+			}
+		});
+	}, nullptr });
+
+	// Megabytes through the staging ring every frame
+	scenarios.push_back({ "upload-heavy", glm::vec3(0.4f, 0.2f, 0.1f), [&]()
+	{
+		test.allocator.createBuffer(
+			uploadChunks * uploadChunkSize,
+			VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+			0,
+			uploadBuffer,
+			uploadMemory
+		);
+	}, [&](uint64_t frame)
+	{
+		std::memset(uploadData.data(), (int)(frame & 0xff), uploadData.size());
+
+		for (uint32_t i = 0; i < uploadChunks; i++)
+		{
+			test.uploader.uploadBuffer(uploadBuffer, i * uploadChunkSize, uploadData.data(), uploadChunkSize);
+		}
+	}, nullptr, [&]()
+	{
+		vkDeviceWaitIdle(test.device);
+		test.allocator.destroyBuffer(uploadBuffer, uploadMemory);
+	} });
+
+	// Swapchain recreation every few frames
+	scenarios.push_back({ "resize-storm", glm::vec3(0.1f, 0.4f, 0.2f), nullptr, [&](uint64_t frame)
+	{
+		if (frame % resizeInterval != 0)
+		{
+			return;
+		}
+
+		static const uint32_t scales[] = { 4, 2, 3, 5 };
+		uint32_t scale = scales[(frame / resizeInterval) % 4];
+
+		test.resize(baseWidth * scale / 4, baseHeight * scale / 4);
+	}, nullptr, nullptr });
+
+	// Frustum culled cubes from one compute dispatch and one indirect draw
+	scenarios.push_back({ "gpu-cull", glm::vec3(0.05f, 0.05f, 0.1f), [&]()
+	{
+		if (!test.objects.enabled)
+		{
+			logger.log(LogSeverity::Warning, "renderer", 0, "gpu-cull needs the object shaders and drawIndirectFirstInstance, drawing nothing");
+		}
+		else if (test.objects.objects.size() == 0)
+		{
+			buildDemoObjects(objectCount);
+		}
+	}, nullptr, [&]()
+	{
+		test.drawObjects(objectCamera(0.7f, (float)test.renderExtent.width / test.renderExtent.height));
+	}, nullptr });
+
+	std::vector<const BenchScenario*> selected;
+	std::stringstream names(benchScenarios);
+	std::string name;
+
+	while (std::getline(names, name, ','))
+	{
+		bool found = false;
+
+		for (const auto& scenario : scenarios)
+		{
+			if (name == "all" || name == scenario.name)
+			{
+				selected.push_back(&scenario);
+				found = true;
+			}
+		}
+
+		if (!found)
+		{
+			std::cout << "Unknown benchmark scenario " << name << ", expected all";
+
+			for (const auto& scenario : scenarios)
+			{
+				std::cout << ", " << scenario.name;
+			}
+
+			std::cout << std::endl;
+			return 1;
+		}
+	}
+
+	for (const BenchScenario* scenario : selected)
+	{
+		if (objectCount == 0 && std::strcmp(scenario->name, "gpu-cull") == 0)
+		{
+			objectCount = 20000;
+		}
+	}
+
+	test.init();
+
+	auto frame = [](const BenchScenario& scenario, uint64_t index, bool update)
+	{
+		profiler.begin(PhaseFrame);
+
+		if (update && scenario.update)
+		{
+			profiler.begin(PhaseUpdate);
+			scenario.update(index);
+			profiler.end(PhaseUpdate);
+		}
+
+		test.clear(scenario.color);
+
+		if (scenario.draw)
+		{
+			scenario.draw();
+		}
+
+		test.present();
+
+		profiler.end(PhaseFrame);
+		profiler.endFrame();
+	};
+
+	std::vector<BenchResult> results;
+
+	for (const BenchScenario* scenario : selected)
+	{
+		BenchResult result;
+		result.name = scenario->name;
+
+		if (scenario->begin)
+		{
+			scenario->begin();
+		}
+
+		for (uint64_t i = 0; i < warmupFrames; i++)
+		{
+			frame(*scenario, i, true);
+		}
+
+		GpuAllocatorStats before = test.allocator.stats();
+		uint64_t compiles = test.graph.compiles;
+
+		result.firstFrame = profiler.current.frame;
+		Clock::time_point start = Clock::now();
+
+		for (uint64_t i = 0; i < measuredFrames; i++)
+		{
+			frame(*scenario, warmupFrames + i, true);
+		}
+
+		result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		result.lastFrame = profiler.current.frame;
+		result.frames = measuredFrames;
+
+		GpuAllocatorStats after = test.allocator.stats();
+		result.deviceAllocations = after.deviceAllocationCalls - before.deviceAllocationCalls;
+		result.liveAllocations = after.allocations;
+		result.graphCompiles = test.graph.compiles - compiles;
+
+		// The next scenario and the golden image are at the requested size
+		if (width != baseWidth || height != baseHeight)
+		{
+			test.resize(baseWidth, baseHeight);
+		}
+
+		if (!goldenDir.empty())
+		{
+			// The readback completes frames in flight later, keep rendering until it's back
+			test.captureNext = true;
+
+			uint64_t captureFrame = test.frameCount;
+			CapturedFrame captured;
+			bool found = false;
+
+			frame(*scenario, 0, false);
+
+			for (uint32_t i = 0; i < 100 && !found; i++)
+			{
+				frame(*scenario, 0, false);
+				found = test.capture.take(captureFrame, captured);
+			}
+
+			if (found)
+			{
+				checkGolden(result, captured);
+			}
+			else
+			{
+				result.golden = "no-capture";
+			}
+		}
+
+		if (scenario->end)
+		{
+			scenario->end();
+		}
+
+		results.push_back(result);
+	}
+
+	std::string deviceName = test.caps.props.deviceName;
+	uint32_t framesInFlightUsed = test.frames.size();
+
+	test.release();
+
+	// Flushes the GPU times still pending into the history
+	profiler.release();
+
+	std::ofstream out(benchJsonPath);
+
+	if (!out.is_open())
+	{
+		std::cout << "Can't write benchmark json " << benchJsonPath << std::endl;
+	}
+
+	auto summary = [&out](const char* key, const std::vector<double>& values)
+	{
+		out << "\"" << key << "\":";
+
+		if (values.size() == 0)
+		{
+			out << "null";
+			return;
+		}
+
+		out << "{\"p50\":" << percentile(values, 0.50)
+			<< ",\"p95\":" << percentile(values, 0.95)
+			<< ",\"p99\":" << percentile(values, 0.99) << "}";
+	};
+
+	// Device names are plain ASCII, quotes and backslashes aside
+	std::string escaped;
+
+	for (char c : deviceName)
+	{
+		if (c == '"' || c == '\\')
+		{
+			escaped += '\\';
+		}
+
+		escaped += c;
+	}
+
+	out << "{\"device\":\"" << escaped << "\",\"width\":" << baseWidth << ",\"height\":" << baseHeight
+		<< ",\"frames_in_flight\":" << framesInFlightUsed << ",\"scenarios\":[";
+
+	bool failed = false;
+
+	std::cout << "Benchmark on " << deviceName << " (fps, cpu ms p50/p95/p99, gpu ms p50/p95/p99, vkAllocateMemory calls, golden)" << std::endl;
+
+	for (size_t r = 0; r < results.size(); r++)
+	{
+		const BenchResult& result = results[r];
+
+		std::vector<double> cpu;
+		std::vector<double> gpu;
+
+		for (const auto& timing : profiler.history)
+		{
+			if (timing.frame < result.firstFrame || timing.frame >= result.lastFrame)
+			{
+				continue;
+			}
+
+			cpu.push_back(timing.cpu[PhaseFrame]);
+
+			if (timing.gpuCount > 0)
+			{
+				gpu.push_back(timing.gpuTotal);
+			}
+		}
+
+		double fps = result.seconds > 0.0 ? result.frames / result.seconds : 0.0;
+
+		out << (r > 0 ? "," : "") << "{\"name\":\"" << result.name << "\",\"frames\":" << result.frames
+			<< ",\"seconds\":" << result.seconds << ",\"fps\":" << fps << ",";
+		summary("cpu_ms", cpu);
+		out << ",";
+		summary("gpu_ms", gpu);
+		out << ",\"device_allocations\":" << result.deviceAllocations
+			<< ",\"live_allocations\":" << result.liveAllocations
+			<< ",\"graph_compiles\":" << result.graphCompiles
+			<< ",\"golden\":\"" << result.golden << "\",\"mismatch\":" << result.mismatch << "}";
+
+		std::cout << "  " << result.name << ": " << fps << " fps, cpu "
+			<< percentile(cpu, 0.50) << " / " << percentile(cpu, 0.95) << " / " << percentile(cpu, 0.99) << ", gpu "
+			<< percentile(gpu, 0.50) << " / " << percentile(gpu, 0.95) << " / " << percentile(gpu, 0.99) << ", "
+			<< result.deviceAllocations << ", " << result.golden << std::endl;
+
+		// --update-golden never reports missing, a new scenario has to be recorded first
+		if (std::strcmp(result.golden, "fail") == 0 || std::strcmp(result.golden, "no-capture") == 0 ||
+			std::strcmp(result.golden, "missing") == 0)
+		{
+			failed = true;
+		}
+	}
+
+	out << "]}" << std::endl;
+
+	return failed ? 1 : 0;
+}
+
+void DynamicResolution::init(double targetMs, float minScale, float maxScale)
+{
+	this->targetMs = targetMs;
+	this->minScale = minScale;
+	this->maxScale = maxScale;
+	this->scale = std::max(minScale, std::min(maxScale, 1.0f));
+}
+
+void DynamicResolution::update(double gpuMs)
+{
+	this->frames++;
+	this->scaleSum += this->scale;
+
+	// Frames in flight still report times from the previous scale
+	if (this->holdFrames > 0)
+	{
+		this->holdFrames--;
+		return;
+	}
+
+	if (gpuMs <= 0.0)
+	{
+		return;
+	}
+
+	this->averageMs = this->averageMs == 0.0 ? gpuMs : this->averageMs * 0.9 + gpuMs * 0.1;
+
+	// Between 70% and 95% of the budget nothing changes
+	if (this->averageMs > this->targetMs * 0.7 && this->averageMs < this->targetMs * 0.95)
+	{
+		return;
+	}
+
+	// Cost follows the pixel count, aim for the middle of the band
+	float wanted = this->scale * (float)std::sqrt(this->targetMs * 0.85 / this->averageMs);
+	wanted = std::round(wanted * 16.0f) / 16.0f;
+	wanted = std::max(this->minScale, std::min(this->maxScale, wanted));
+
+	if (wanted == this->scale)
+	{
+		return;
+	}
+
+	this->averageMs *= (wanted * wanted) / (this->scale * this->scale);
+	this->scale = wanted;
+	this->holdFrames = 8;
+	this->changes++;
+}
+
+VkExtent2D DynamicResolution::extent(VkExtent2D full)
+{
+	VkExtent2D extent;
+	extent.width = std::max(1u, (uint32_t)(full.width * this->scale + 0.5f));
+	extent.height = std::max(1u, (uint32_t)(full.height * this->scale + 0.5f));
+
+	return extent;
+}
+
+void DynamicResolution::printStats()
+{
+	std::cout << "Dynamic resolution: target " << this->targetMs << "ms, scale " << this->minScale << "-" << this->maxScale
+		<< ", average " << (this->frames > 0 ? this->scaleSum / this->frames : this->scale)
+		<< ", " << this->changes << " changes, ended at " << this->scale << std::endl;
+}
+
+void VulkanTest::createRenderTarget()
+{
+	VkFormatProperties props;
+	vkGetPhysicalDeviceFormatProperties(this->physicalDevice, this->swapChainImageFormat, &props);
+
+	VkFormatFeatureFlags blit = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT;
+
+	if (!this->swapChainBlitTarget || (props.optimalTilingFeatures & blit) != blit)
+	{
+		logger.log(LogSeverity::Warning, "renderer", 0, "Dynamic resolution off, the swapchain format can't be blitted");
+
+		this->dynamicResolution = false;
+		this->destroyRenderTarget(true);
+		return;
+	}
+
+	this->dynamicResolution = true;
+	this->upscaleFilter = (props.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT) ? VK_FILTER_LINEAR : VK_FILTER_NEAREST;
+
+	VkExtent2D needed = this->resolution.extent(this->swapChainExtent);
+	needed.width = std::max(needed.width, (uint32_t)std::ceil(this->swapChainExtent.width * this->resolution.maxScale));
+	needed.height = std::max(needed.height, (uint32_t)std::ceil(this->swapChainExtent.height * this->resolution.maxScale));
+
+	// Shrinking keeps the bigger target, scale changes only move the render area
+	if (this->renderTarget != VK_NULL_HANDLE &&
+		this->renderTargetFormat == this->swapChainImageFormat &&
+		this->renderTargetCapacity.width >= needed.width &&
+		this->renderTargetCapacity.height >= needed.height)
+	{
+		return;
+	}
+
+	this->destroyRenderTarget(true);
+
+	VkImageCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	createInfo.imageType = VK_IMAGE_TYPE_2D;
+	createInfo.format = this->swapChainImageFormat;
+	createInfo.extent = { needed.width, needed.height, 1 };
+	createInfo.mipLevels = 1;
+	createInfo.arrayLayers = 1;
+	createInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	createInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	createInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	createInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+	this->allocator.createImage(createInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, this->renderTarget, this->renderTargetMemory);
+
+	VkImageViewCreateInfo viewInfo = {};
+	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	viewInfo.image = this->renderTarget;
+	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	viewInfo.format = this->swapChainImageFormat;
+	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	viewInfo.subresourceRange.levelCount = 1;
+	viewInfo.subresourceRange.layerCount = 1;
+
+	VkResult r = vkCreateImageView(this->device, &viewInfo, nullptr, &this->renderTargetView);
+
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to create render target view.");
+	}
+
+	this->renderTargetCapacity = needed;
+	this->renderTargetFormat = this->swapChainImageFormat;
+
+	std::ostringstream text;
+	text << "Render target " << needed.width << "x" << needed.height << " for scales "
+		<< this->resolution.minScale << "-" << this->resolution.maxScale;
+
+	logger.log(LogSeverity::Info, "renderer", 0, text.str().c_str());
+}
+
+void VulkanTest::destroyRenderTarget(bool retire)
+{
+	if (this->renderTarget == VK_NULL_HANDLE)
+	{
+		return;
+	}
+
+	if (retire)
+	{
+		// Frames in flight may still render into it
+		RetiredSwapChain retired;
+		retired.frame = this->frameCount;
+		retired.images.push_back(this->renderTarget);
+		retired.memory.push_back(this->renderTargetMemory);
+		retired.imageViews.push_back(this->renderTargetView);
+
+		this->graph.forgetView(this->renderTargetView, retired.framebuffers);
+
+		this->retiredSwapChains.push_back(std::move(retired));
+	}
+	else
+	{
+		std::vector<VkFramebuffer> framebuffers;
+		this->graph.forgetView(this->renderTargetView, framebuffers);
+
+		for (auto framebuffer : framebuffers)
+		{
+			vkDestroyFramebuffer(this->device, framebuffer, nullptr);
+		}
+
+		vkDestroyImageView(this->device, this->renderTargetView, nullptr);
+		this->allocator.destroyImage(this->renderTarget, this->renderTargetMemory);
+	}
+
+	this->renderTarget = VK_NULL_HANDLE;
+	this->renderTargetView = VK_NULL_HANDLE;
+	this->renderTargetMemory = GpuAllocation();
+	this->renderTargetCapacity = {};
+}
+
+void VulkanTest::recordUpscale(VkCommandBuffer cmd)
+{
+	VkImage image = this->swapChainImages[this->swapChainIndex];
+
+	// Waits on the acquire semaphore through the color output stage
+	VkImageMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = image;
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.levelCount = 1;
+	barrier.subresourceRange.layerCount = 1;
+
+	vkCmdPipelineBarrier(
+		cmd,
+		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		0,
+		0, nullptr,
+		0, nullptr,
+		1, &barrier
+	);
+
+	VkImageBlit blit = {};
+	blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	blit.srcSubresource.layerCount = 1;
+	blit.srcOffsets[1] = { (int32_t)this->renderExtent.width, (int32_t)this->renderExtent.height, 1 };
+	blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	blit.dstSubresource.layerCount = 1;
+	blit.dstOffsets[1] = { (int32_t)this->swapChainExtent.width, (int32_t)this->swapChainExtent.height, 1 };
+
+	vkCmdBlitImage(
+		cmd,
+		this->renderTarget,
+		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+		image,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		1, &blit,
+		this->upscaleFilter
+	);
+
+	VkImageMemoryBarrier barriers[2] = { barrier, barrier };
+
+	// Present, or a capture copy that waits on the color output stage
+	barriers[0].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barriers[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	barriers[0].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barriers[0].newLayout = this->presentLayout;
+
+	// The next frame renders into the target again once the blit has read it
+	barriers[1].srcAccessMask = 0;
+	barriers[1].dstAccessMask = 0;
+	barriers[1].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	barriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	barriers[1].image = this->renderTarget;
+
+	vkCmdPipelineBarrier(
+		cmd,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+		0,
+		0, nullptr,
+		0, nullptr,
+		2, barriers
+	);
+}
+
+// The source and everything it includes with quotes, as the compiler sees it
+static bool hashShaderSource(const std::string& path, uint64_t& hash, std::set<std::string>& seen)
+{
+	if (!seen.insert(path).second)
+	{
+		return true;
+	}
+
+	std::ifstream file(path, std::ios::binary);
+
+	if (!file.is_open())
+	{
+		return false;
+	}
+
+	std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	hash = hashBytes(hash, text.data(), text.size());
+
+	std::string dir = path.substr(0, path.find_last_of("/\\") + 1);
+	std::istringstream lines(text);
+	std::string line;
+
+	while (std::getline(lines, line))
+	{
+		size_t start = line.find_first_not_of(" \t");
+
+		if (start == std::string::npos || line.compare(start, 8, "#include") != 0)
+		{
+			continue;
+		}
+
+		size_t open = line.find('"', start);
+		size_t close = open == std::string::npos ? open : line.find('"', open + 1);
+
+		// A missing include fails the compile, which reports it better
+		if (close != std::string::npos)
+		{
+			hashShaderSource(dir + line.substr(open + 1, close - open - 1), hash, seen);
+		}
+	}
+
+	return true;
+}
+
+static bool readSpirv(const std::string& path, std::vector<uint32_t>& code)
+{
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+
+	if (!file.is_open())
+	{
+		return false;
+	}
+
+	size_t size = file.tellg();
+
+	if (size < 20 || size % 4 != 0)
+	{
+		return false;
+	}
+
+	code.resize(size / 4);
+	file.seekg(0);
+	file.read((char*)code.data(), size);
+
+	return file.good() && code[0] == 0x07230203;
+}
+
+static const char* shaderStageName(VkShaderStageFlagBits stage)
+{
+	switch (stage)
+	{
+	case VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT:
+		return "tesc";
+	case VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT:
+		return "tese";
+	case VK_SHADER_STAGE_GEOMETRY_BIT:
+		return "geom";
+	case VK_SHADER_STAGE_FRAGMENT_BIT:
+		return "frag";
+	case VK_SHADER_STAGE_COMPUTE_BIT:
+		return "comp";
+	default:
+		return "vert";
+	}
+}
+
+void ShaderManager::init(VkDevice device, uint32_t apiVersion, const std::string& cacheDir, const std::string& compiler)
+{
+	this->device = device;
+	this->cacheDir = cacheDir;
+	this->compiler = compiler;
+
+	// vulkan1.2 emits SPIR-V 1.5, which 1.1 devices reject
+	if (apiVersion >= VK_API_VERSION_1_2)
+	{
+		this->targetEnv = "vulkan1.2";
+	}
+	else if (apiVersion >= VK_API_VERSION_1_1)
+	{
+		this->targetEnv = "vulkan1.1";
+	}
+	else
+	{
+		this->targetEnv = "vulkan1.0";
+	}
+
+	std::error_code error;
+	std::filesystem::create_directories(cacheDir, error);
+
+	// Mostly waiting on the compiler process
+	uint32_t count = std::max(1u, std::thread::hardware_concurrency() / 2);
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		this->workers.push_back(std::thread([this]()
+		{
+			while (true)
+			{
+				ShaderEntry* entry = nullptr;
+
+				{
+					std::unique_lock<std::mutex> lock(this->mutex);
+					this->queueCond.wait(lock, [this]() { return this->stopping || this->queue.size() > 0; });
+
+					if (this->queue.size() == 0)
+					{
+						return;
+					}
+
+					entry = this->queue.front();
+					this->queue.pop_front();
+				}
+
+				this->build(entry);
+			}
+		}));
+	}
+}
+
+void ShaderManager::release()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->queue.clear();
+		this->stopping = true;
+	}
+
+	this->queueCond.notify_all();
+
+	for (auto& worker : this->workers)
+	{
+		worker.join();
+	}
+
+	this->workers.clear();
+
+	if (this->entries.size() > 0)
+	{
+		std::cout << "Shaders: " << this->entries.size() << " requested, " << this->cacheHits << " from cache, "
+			<< this->compiled << " compiled in " << this->compileMicros / 1000.0 << "ms of worker time, "
+			<< this->failures << " failed, " << this->deduplicated << " modules shared" << std::endl;
+	}
+
+	for (auto& module : this->modules)
+	{
+		vkDestroyShaderModule(this->device, module.second.second, nullptr);
+	}
+
+	this->modules.clear();
+	this->entries.clear();
+}
+
+ShaderHandle ShaderManager::request(const ShaderDesc& desc)
+{
+	uint64_t key = hashBytes(14695981039346656037ull, desc.path.data(), desc.path.size());
+	key = hashValue(key, desc.stage);
+
+	for (const auto& define : desc.defines)
+	{
+		key = hashBytes(key, define.data(), define.size() + 1);
+	}
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	auto it = this->entries.find(key);
+
+	if (it != this->entries.end())
+	{
+		return it->second.get();
+	}
+
+	ShaderEntry* entry = new ShaderEntry();
+	entry->desc = desc;
+
+	this->entries[key] = std::unique_ptr<ShaderEntry>(entry);
+	this->queue.push_back(entry);
+	this->queueCond.notify_one();
+
+	return entry;
+}
+
+VkShaderModule ShaderManager::get(ShaderHandle handle)
+{
+	return handle->module.load(std::memory_order_acquire);
+}
+
+void ShaderManager::wait(ShaderHandle handle)
+{
+	std::unique_lock<std::mutex> lock(this->mutex);
+	this->readyCond.wait(lock, [handle]() { return handle->ready.load(); });
+}
+
+void ShaderManager::waitAll()
+{
+	std::unique_lock<std::mutex> lock(this->mutex);
+	this->readyCond.wait(lock, [this]()
+	{
+		for (auto& entry : this->entries)
+		{
+			if (!entry.second->ready)
+			{
+				return false;
+			}
+		}
+
+		return true;
+	});
+}
+
+const ShaderReflection& ShaderManager::reflection(ShaderHandle handle)
+{
+	return handle->reflection;
+}
+
+std::vector<VkDescriptorSetLayoutBinding> ShaderManager::layoutBindings(const std::vector<ShaderHandle>& handles, uint32_t set)
+{
+	std::vector<VkDescriptorSetLayoutBinding> bindings;
+
+	for (ShaderHandle handle : handles)
+	{
+		const ShaderReflection& reflection = handle->reflection;
+
+		for (const auto& binding : reflection.bindings)
+		{
+			if (binding.set != set)
+			{
+				continue;
+			}
+
+			auto it = std::find_if(bindings.begin(), bindings.end(), [&binding](const VkDescriptorSetLayoutBinding& b)
+			{
+				return b.binding == binding.binding;
+			});
+
+			if (it != bindings.end())
+			{
+				it->stageFlags |= reflection.stage;
+				continue;
+			}
+
+			// Runtime arrays keep count 0, the caller picks their size
+			VkDescriptorSetLayoutBinding layoutBinding = {};
+			layoutBinding.binding = binding.binding;
+			layoutBinding.descriptorType = binding.type;
+			layoutBinding.descriptorCount = binding.count;
+			layoutBinding.stageFlags = reflection.stage;
+
+			bindings.push_back(layoutBinding);
+		}
+	}
+
+	return bindings;
+}
+
+VkPushConstantRange ShaderManager::pushConstantRange(const std::vector<ShaderHandle>& handles)
+{
+	VkPushConstantRange range = {};
+
+	for (ShaderHandle handle : handles)
+	{
+		const ShaderReflection& reflection = handle->reflection;
+
+		if (reflection.pushConstantSize > 0)
+		{
+			range.stageFlags |= reflection.stage;
+			range.size = std::max(range.size, reflection.pushConstantSize);
+		}
+	}
+
+	return range;
+}
+
+void ShaderManager::build(ShaderEntry* entry)
+{
+	const ShaderDesc& desc = entry->desc;
+
+	std::vector<uint32_t> code;
+	bool loaded = false;
+	bool precompiled = desc.path.size() > 4 && desc.path.compare(desc.path.size() - 4, 4, ".spv") == 0;
+
+	uint64_t hash = 14695981039346656037ull;
+	std::set<std::string> seen;
+
+	if (!precompiled && hashShaderSource(desc.path, hash, seen))
+	{
+		std::call_once(this->versionOnce, [this]() { this->queryVersion(); });
+
+		hash = hashBytes(hash, this->compilerVersion.data(), this->compilerVersion.size());
+		hash = hashBytes(hash, this->targetEnv.data(), this->targetEnv.size());
+		hash = hashValue(hash, desc.stage);
+
+		for (const auto& define : desc.defines)
+		{
+			hash = hashBytes(hash, define.data(), define.size() + 1);
+		}
+
+		entry->hash = hash;
+
+		char name[17];
+		std::snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+
+		std::string base = this->cacheDir + "/" + name;
+
+		if (readSpirv(base + ".spv", code))
+		{
+			this->cacheHits++;
+			loaded = true;
+		}
+		else if (this->compile(entry, base + ".spv") && readSpirv(base + ".spv", code))
+		{
+			this->compiled++;
+			loaded = true;
+		}
+
+		if (loaded && !this->loadReflection(base + ".refl", entry->reflection))
+		{
+			reflect(code, entry->reflection);
+			this->saveReflection(base + ".refl", entry->reflection);
+		}
+	}
+
+	// Shipped SPIR-V, when there's no source or compiler
+	if (!loaded)
+	{
+		loaded = readSpirv(precompiled ? desc.path : desc.path + ".spv", code);
+
+		if (loaded)
+		{
+			reflect(code, entry->reflection);
+		}
+	}
+
+	VkShaderModule module = loaded ? this->createModule(code) : VK_NULL_HANDLE;
+
+	if (module == VK_NULL_HANDLE)
+	{
+		this->failures++;
+		logger.log(LogSeverity::Warning, "shaders", 0, ("No SPIR-V for " + desc.path).c_str());
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		entry->module.store(module, std::memory_order_release);
+		entry->failed = module == VK_NULL_HANDLE;
+		entry->ready = true;
+	}
+
+	this->readyCond.notify_all();
+}
+
+bool ShaderManager::compile(ShaderEntry* entry, const std::string& output)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	const ShaderDesc& desc = entry->desc;
+
+	// Two descs can hash the same, each writes its own temporary
+	std::string temp = output + "." + std::to_string((uintptr_t)entry) + ".tmp";
+	std::string log = temp + ".log";
+
+	bool hlsl = desc.path.size() > 5 && desc.path.compare(desc.path.size() - 5, 5, ".hlsl") == 0;
+
+	std::string command = "\"" + this->compiler + "\" -V --target-env " + this->targetEnv + " -S " + shaderStageName(desc.stage);
+
+	if (hlsl)
+	{
+		command += " -D -e main";
+	}
+
+	for (const auto& define : desc.defines)
+	{
+		command += " \"-D" + define + "\"";
+	}
+
+	command += " \"" + desc.path + "\" -o \"" + temp + "\" > \"" + log + "\" 2>&1";
+
+#ifdef _WIN32
+	// cmd.exe drops the outermost quotes
+	command = "\"" + command + "\"";
+#endif
+
+	bool ok = std::system(command.c_str()) == 0 && std::rename(temp.c_str(), output.c_str()) == 0;
+
+	if (!ok)
+	{
+		std::ifstream file(log);
+		std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+		logger.log(LogSeverity::Warning, "shaders", 0, ("Failed to compile " + desc.path + ": " + text).c_str());
+
+		std::remove(temp.c_str());
+	}
+
+	std::remove(log.c_str());
+
+	this->compileMicros += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+	return ok;
+}
+
+void ShaderManager::queryVersion()
+{
+	std::string path = this->cacheDir + "/compiler_version.txt";
+	std::string temp = path + ".tmp";
+
+	std::string command = "\"" + this->compiler + "\" --version > \"" + temp + "\" 2>&1";
+
+#ifdef _WIN32
+	command = "\"" + command + "\"";
+#endif
+
+	if (std::system(command.c_str()) == 0)
+	{
+		std::ifstream file(temp);
+		this->compilerVersion.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		file.close();
+
+		std::remove(path.c_str());
+		std::rename(temp.c_str(), path.c_str());
+		return;
+	}
+
+	std::remove(temp.c_str());
+
+	// No compiler here, keep using what the cache was built with
+	std::ifstream file(path);
+	this->compilerVersion.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+VkShaderModule ShaderManager::createModule(const std::vector<uint32_t>& code)
+{
+	uint64_t hash = hashBytes(14695981039346656037ull, code.data(), code.size() * 4);
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	auto range = this->modules.equal_range(hash);
+
+	for (auto it = range.first; it != range.second; it++)
+	{
+		if (it->second.first == code)
+		{
+			this->deduplicated++;
+			return it->second.second;
+		}
+	}
+
+	VkShaderModuleCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	createInfo.codeSize = code.size() * 4;
+	createInfo.pCode = code.data();
+
+	VkShaderModule module;
+	VkResult r = vkCreateShaderModule(this->device, &createInfo, nullptr, &module);
+
+	if (r != VK_SUCCESS)
+	{
+		return VK_NULL_HANDLE;
+	}
+
+	this->modules.insert({ hash, { code, module } });
+
+	return module;
+}
+
+// Bindings, push constant size and workgroup size straight from the SPIR-V
+// words; only the instructions that describe those are looked at
+bool ShaderManager::reflect(const std::vector<uint32_t>& code, ShaderReflection& reflection)
+{
+	enum
+	{
+		OpEntryPoint = 15,
+		OpExecutionMode = 16,
+		OpTypeBool = 20,
+		OpTypeInt = 21,
+		OpTypeFloat = 22,
+		OpTypeVector = 23,
+		OpTypeMatrix = 24,
+		OpTypeImage = 25,
+		OpTypeSampler = 26,
+		OpTypeSampledImage = 27,
+		OpTypeArray = 28,
+		OpTypeRuntimeArray = 29,
+		OpTypeStruct = 30,
+		OpTypePointer = 32,
+		OpConstant = 43,
+		OpVariable = 59,
+		OpDecorate = 71,
+		OpMemberDecorate = 72
+	};
+
+	struct SpirvId
+	{
+		uint32_t opcode = 0;
+
+		// Type operands, a constant's value or a variable's type and storage class
+		uint32_t operands[2] = {};
+		std::vector<uint32_t> members;
+		std::vector<uint32_t> offsets;
+		std::vector<uint32_t> matrixStrides;
+
+		bool hasBinding = false;
+		uint32_t set = 0;
+		uint32_t binding = 0;
+		bool bufferBlock = false;
+		uint32_t arrayStride = 0;
+	};
+
+	if (code.size() < 5 || code[0] != 0x07230203)
+	{
+		return false;
+	}
+
+	reflection = ShaderReflection();
+
+	// Id 0 is never valid, out of range ids land there
+	std::vector<SpirvId> ids(code[3]);
+	std::vector<uint32_t> variables;
+
+	auto id = [&ids](uint32_t i) -> SpirvId&
+	{
+		return ids[i < ids.size() ? i : 0];
+	};
+
+	for (size_t at = 5; at < code.size(); )
+	{
+		uint32_t count = code[at] >> 16;
+		uint32_t opcode = code[at] & 0xFFFF;
+
+		if (count == 0 || at + count > code.size())
+		{
+			return false;
+		}
+
+		const uint32_t* op = &code[at + 1];
+
+		switch (opcode)
+		{
+		case OpEntryPoint:
+		{
+			static const VkShaderStageFlagBits models[] = {
+				VK_SHADER_STAGE_VERTEX_BIT,
+				VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT,
+				VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT,
+				VK_SHADER_STAGE_GEOMETRY_BIT,
+				VK_SHADER_STAGE_FRAGMENT_BIT,
+				VK_SHADER_STAGE_COMPUTE_BIT
+			};
+
+			if (op[0] < 6)
+			{
+				reflection.stage = models[op[0]];
+			}
+
+			break;
+		}
+		case OpExecutionMode:
+			// LocalSize
+			if (count >= 6 && op[1] == 17)
+			{
+				reflection.localSize[0] = op[2];
+				reflection.localSize[1] = op[3];
+				reflection.localSize[2] = op[4];
+			}
+
+			break;
+		case OpDecorate:
+		{
+			SpirvId& target = id(op[0]);
+
+			if (count >= 4 && op[1] == 33)
+			{
+				target.hasBinding = true;
+				target.binding = op[2];
+			}
+			else if (count >= 4 && op[1] == 34)
+			{
+				target.set = op[2];
+			}
+			else if (op[1] == 3)
+			{
+				target.bufferBlock = true;
+			}
+			else if (count >= 4 && op[1] == 6)
+			{
+				target.arrayStride = op[2];
+			}
+
+			break;
+		}
+		case OpMemberDecorate:
+		{
+			SpirvId& target = id(op[0]);
+			uint32_t member = op[1];
+
+			if (count < 5 || member > 1024)
+			{
+				break;
+			}
+
+			// Offset and MatrixStride
+			if (op[2] == 35)
+			{
+				target.offsets.resize(std::max<size_t>(target.offsets.size(), member + 1));
+				target.offsets[member] = op[3];
+			}
+			else if (op[2] == 7)
+			{
+				target.matrixStrides.resize(std::max<size_t>(target.matrixStrides.size(), member + 1));
+				target.matrixStrides[member] = op[3];
+			}
+
+			break;
+		}
+		case OpTypeBool:
+		case OpTypeSampler:
+		case OpTypeSampledImage:
+			id(op[0]).opcode = opcode;
+			break;
+		case OpTypeInt:
+		case OpTypeFloat:
+		case OpTypeRuntimeArray:
+			id(op[0]).opcode = opcode;
+			id(op[0]).operands[0] = op[1];
+			break;
+		case OpTypeVector:
+		case OpTypeMatrix:
+		case OpTypeArray:
+			id(op[0]).opcode = opcode;
+			id(op[0]).operands[0] = op[1];
+			id(op[0]).operands[1] = op[2];
+			break;
+		case OpTypeImage:
+			// Dim and Sampled
+			id(op[0]).opcode = opcode;
+			id(op[0]).operands[0] = op[2];
+			id(op[0]).operands[1] = op[6];
+			break;
+		case OpTypeStruct:
+			id(op[0]).opcode = opcode;
+			id(op[0]).members.assign(op + 1, op + count - 1);
+			break;
+		case OpTypePointer:
+			id(op[0]).opcode = opcode;
+			id(op[0]).operands[0] = op[1];
+			id(op[0]).operands[1] = op[2];
+			break;
+		case OpConstant:
+			id(op[1]).opcode = opcode;
+			id(op[1]).operands[0] = op[2];
+			break;
+		case OpVariable:
+			id(op[1]).opcode = opcode;
+			id(op[1]).operands[0] = op[0];
+			id(op[1]).operands[1] = op[2];
+			variables.push_back(op[1]);
+			break;
+		}
+
+		at += count;
+	}
+
+	// Byte size under the explicit layout decorations
+	std::function<uint32_t(uint32_t, uint32_t)> size = [&](uint32_t type, uint32_t matrixStride) -> uint32_t
+	{
+		const SpirvId& t = id(type);
+
+		switch (t.opcode)
+		{
+		case OpTypeBool:
+			return 4;
+		case OpTypeInt:
+		case OpTypeFloat:
+			return t.operands[0] / 8;
+		case OpTypeVector:
+			return t.operands[1] * size(t.operands[0], 0);
+		case OpTypeMatrix:
+			return t.operands[1] * (matrixStride > 0 ? matrixStride : size(t.operands[0], 0));
+		case OpTypeArray:
+			return id(t.operands[1]).operands[0] * (t.arrayStride > 0 ? t.arrayStride : size(t.operands[0], 0));
+		case OpTypeStruct:
+		{
+			uint32_t end = 0;
+
+			for (size_t m = 0; m < t.members.size(); m++)
+			{
+				uint32_t offset = m < t.offsets.size() ? t.offsets[m] : end;
+				uint32_t stride = m < t.matrixStrides.size() ? t.matrixStrides[m] : 0;
+
+				end = std::max(end, offset + size(t.members[m], stride));
+			}
+
+			return end;
+		}
+		default:
+			return 0;
+		}
+	};
+
+	for (uint32_t v : variables)
+	{
+		const SpirvId& variable = id(v);
+		uint32_t storage = variable.operands[1];
+		uint32_t type = id(variable.operands[0]).operands[1];
+
+		// PushConstant
+		if (storage == 9)
+		{
+			reflection.pushConstantSize = std::max(reflection.pushConstantSize, size(type, 0));
+			continue;
+		}
+
+		// UniformConstant, Uniform and StorageBuffer hold descriptors
+		if (!variable.hasBinding || (storage != 0 && storage != 2 && storage != 12))
+		{
+			continue;
+		}
+
+		uint32_t descriptorCount = 1;
+
+		while (id(type).opcode == OpTypeArray || id(type).opcode == OpTypeRuntimeArray)
+		{
+			const SpirvId& array = id(type);
+
+			descriptorCount = array.opcode == OpTypeArray ? descriptorCount * id(array.operands[1]).operands[0] : 0;
+			type = array.operands[0];
+		}
+
+		const SpirvId& resource = id(type);
+		VkDescriptorType descriptorType;
+
+		switch (resource.opcode)
+		{
+		case OpTypeSampler:
+			descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
+			break;
+		case OpTypeSampledImage:
+			descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+			break;
+		case OpTypeImage:
+			// SubpassData, then Buffer dims
+			if (resource.operands[0] == 6)
+			{
+				descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+			}
+			else if (resource.operands[0] == 5)
+			{
+				descriptorType = resource.operands[1] == 1 ? VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER;
+			}
+			else
+			{
+				descriptorType = resource.operands[1] == 1 ? VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE : VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+			}
+
+			break;
+		case OpTypeStruct:
+			descriptorType = storage == 12 || resource.bufferBlock ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+			break;
+		default:
+			continue;
+		}
+
+		reflection.bindings.push_back({ variable.set, variable.binding, descriptorType, descriptorCount });
+	}
+
+	std::sort(reflection.bindings.begin(), reflection.bindings.end(), [](const ShaderBinding& a, const ShaderBinding& b)
+	{
+		return a.set != b.set ? a.set < b.set : a.binding < b.binding;
+	});
+
+	return true;
+}
+
+bool ShaderManager::loadReflection(const std::string& path, ShaderReflection& reflection)
+{
+	const uint32_t magic = 0x46455253;
+
+	std::ifstream in(path, std::ios::binary);
+
+	if (!in.is_open())
+	{
+		return false;
+	}
+
+	uint32_t header[7] = {};
+	in.read((char*)header, sizeof(header));
+
+	if (!in.good() || header[0] != magic || header[6] > 4096)
+	{
+		return false;
+	}
+
+	reflection.stage = (VkShaderStageFlagBits)header[1];
+	reflection.pushConstantSize = header[2];
+	reflection.localSize[0] = header[3];
+	reflection.localSize[1] = header[4];
+	reflection.localSize[2] = header[5];
+	reflection.bindings.resize(header[6]);
+
+	in.read((char*)reflection.bindings.data(), reflection.bindings.size() * sizeof(ShaderBinding));
+
+	return in.good() || reflection.bindings.empty();
+}
+
+void ShaderManager::saveReflection(const std::string& path, const ShaderReflection& reflection)
+{
+	const uint32_t magic = 0x46455253;
+
+	uint32_t header[7] = {
+		magic,
+		(uint32_t)reflection.stage,
+		reflection.pushConstantSize,
+		reflection.localSize[0],
+		reflection.localSize[1],
+		reflection.localSize[2],
+		(uint32_t)reflection.bindings.size()
+	};
+
+	// Readers never see a half written file
+	std::string temp = path + ".tmp";
+
+	{
+		std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+		out.write((const char*)header, sizeof(header));
+		out.write((const char*)reflection.bindings.data(), reflection.bindings.size() * sizeof(ShaderBinding));
+	}
+
+	std::remove(path.c_str());
+	std::rename(temp.c_str(), path.c_str());
+}
+
+void TextureStreamer::init(VkDevice device, VkPhysicalDevice physicalDevice, GpuAllocator* allocator, StagingUploader* uploader, uint32_t frameCount, bool memoryBudget, VkDeviceSize cap)
+{
+	this->device = device;
+	this->physicalDevice = physicalDevice;
+	this->allocator = allocator;
+	this->uploader = uploader;
+	this->framesInFlight = frameCount;
+	this->memoryBudget = memoryBudget;
+	this->cap = cap;
+	this->uploadLimit = uploader->ringSize / 2;
+	this->started = std::chrono::steady_clock::now();
+
+	// Textures live in the largest device local heap
+	const VkPhysicalDeviceMemoryProperties& memProps = allocator->memProps;
+
+	for (uint32_t i = 0; i < memProps.memoryHeapCount; i++)
+	{
+		if ((memProps.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) && memProps.memoryHeaps[i].size > memProps.memoryHeaps[this->heap].size)
+		{
+			this->heap = i;
+		}
+	}
+
+	this->updateBudget();
+
+	// Decoding is CPU bound but long, off the job system so frames don't wait behind it
+	uint32_t count = std::max(1u, std::min(4u, std::thread::hardware_concurrency() / 2));
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		this->workers.push_back(std::thread([this]()
+		{
+			while (true)
+			{
+				TextureLoad* load = nullptr;
+
+				{
+					std::unique_lock<std::mutex> lock(this->mutex);
+					this->queueCond.wait(lock, [this]() { return this->stopping || this->queue.size() > 0; });
+
+					if (this->queue.size() == 0)
+					{
+						return;
+					}
+
+					// Coarsest first, a blurry texture beats a missing one
+					auto next = std::min_element(this->queue.begin(), this->queue.end(), [](const TextureLoad* a, const TextureLoad* b)
+					{
+						return chainBytes(a->texture, a->first) < chainBytes(b->texture, b->first);
+					});
+
+					load = *next;
+					*next = this->queue.back();
+					this->queue.pop_back();
+				}
+
+				this->decode(load);
+
+				std::lock_guard<std::mutex> lock(this->mutex);
+				this->finished.push_back(load);
+			}
+		}));
+	}
+}
+
+void TextureStreamer::release()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+
+	this->queueCond.notify_all();
+
+	for (auto& worker : this->workers)
+	{
+		worker.join();
+	}
+
+	this->workers.clear();
+
+	for (TextureLoad* load : this->queue)
+	{
+		delete load;
+	}
+
+	for (TextureLoad* load : this->finished)
+	{
+		delete load;
+	}
+
+	this->queue.clear();
+	this->finished.clear();
+
+	if (this->textures.size() > 0)
+	{
+		TextureStreamerStats stats = this->stats();
+
+		std::cout << "TextureStreamer: " << stats.textures << " textures, " << stats.fullyResident << " at full detail, "
+			<< stats.residentBytes / (1024 * 1024) << " MiB resident of " << stats.budget / (1024 * 1024) << " MiB budget (peak "
+			<< stats.peakBytes / (1024 * 1024) << " MiB), " << stats.loads << " loads, " << stats.evictions << " evictions, "
+			<< stats.failures << " failed, " << stats.deferred << " deferred by budget" << std::endl;
+
+		if (stats.loads > 0)
+		{
+			std::cout << "TextureStreamer: " << stats.uploadedBytes / (1024 * 1024) << " MiB uploaded at " << stats.uploadMBps << " MiB/s, "
+				<< stats.decodeMs / stats.loads << "ms decode and " << stats.latencyMs / stats.loads << "ms request to resident per load" << std::endl;
+		}
+	}
+
+	for (auto& texture : this->textures)
+	{
+		if (texture->image != VK_NULL_HANDLE)
+		{
+			vkDestroyImageView(this->device, texture->view, nullptr);
+			this->allocator->destroyImage(texture->image, texture->memory);
+		}
+	}
+
+	for (auto& retired : this->retired)
+	{
+		vkDestroyImageView(this->device, retired.view, nullptr);
+		this->allocator->destroyImage(retired.image, retired.memory);
+	}
+
+	this->textures.clear();
+	this->retired.clear();
 }
 
-void VulkanTest::createSurface()
+StreamedTexture* TextureStreamer::create(uint32_t width, uint32_t height, TextureDecodeFunc decode)
 {
-	SDL_SysWMinfo info;
-	SDL_VERSION(&info.version);
-	SDL_GetWindowWMInfo(window, &info);
+	StreamedTexture* texture = new StreamedTexture();
+	texture->width = width;
+	texture->height = height;
+	texture->decode = decode;
 
-	VkWin32SurfaceCreateInfoKHR createInfo = {};
-	createInfo.sType = VK_STRUCTURE_TYPE_WIN32_SURFACE_CREATE_INFO_KHR;
-	createInfo.hinstance = info.info.win.hinstance;
-	createInfo.hwnd = info.info.win.window;
+	while (std::max(width, height) >> texture->levels > 0)
+	{
+		texture->levels++;
+	}
 
-	auto func = (PFN_vkCreateWin32SurfaceKHR)vkGetInstanceProcAddr(instance, "vkCreateWin32SurfaceKHR");
+	texture->resident = texture->levels;
+	texture->wanted = texture->levels - 1;
 
-	if (func != nullptr)
+	while (texture->tail + 1 < texture->levels && std::max(width, height) >> texture->tail > 64)
 	{
-		VkResult r = func(instance, &createInfo, nullptr, &this->surface);
+		texture->tail++;
+	}
 
-		if (r != VK_SUCCESS)
-		{
-			throw std::runtime_error("Surface wasn't created");
-		}
+	// The finest level is installed in one frame's upload budget
+	while (texture->finest < texture->tail && chainBytes(texture, texture->finest) > this->uploadLimit)
+	{
+		texture->finest++;
+	}
+
+	this->textures.push_back(std::unique_ptr<StreamedTexture>(texture));
+	this->queueLoad(texture, texture->tail);
+
+	return texture;
+}
+
+void TextureStreamer::touch(StreamedTexture* texture, float pixelsWide, float pixelsHigh)
+{
+	// One texel per pixel along the denser axis
+	float ratio = std::max(texture->width / std::max(pixelsWide, 1.0f), texture->height / std::max(pixelsHigh, 1.0f));
+	uint32_t level = ratio > 1.0f ? std::min<uint32_t>(std::floor(std::log2(ratio)), texture->levels - 1) : 0;
+
+	if (!texture->used || texture->lastUsed != this->frameCount)
+	{
+		texture->wanted = level;
 	}
 	else
 	{
-		throw std::runtime_error("Vulkan surface wasn't create due to extensions");
+		texture->wanted = std::min(texture->wanted, level);
 	}
+
+	texture->used = true;
+	texture->lastUsed = this->frameCount;
 }
 
-void VulkanTest::createPhysicalDevice()
+void TextureStreamer::update(uint64_t frameCount)
 {
-	uint32_t deviceCount = 0;
-	vkEnumeratePhysicalDevices(instance, &deviceCount, nullptr);
+	this->frameCount = frameCount;
 
-	if (deviceCount == 0)
+	for (size_t i = 0; i < this->retired.size();)
 	{
-		throw std::runtime_error("Failed to find GPUs with Vulkan support!");
+		if (frameCount >= this->retired[i].frame + this->framesInFlight)
+		{
+			vkDestroyImageView(this->device, this->retired[i].view, nullptr);
+			this->residentBytes -= this->retired[i].memory.size;
+			this->allocator->destroyImage(this->retired[i].image, this->retired[i].memory);
+
+			this->retired[i] = this->retired.back();
+			this->retired.pop_back();
+		}
+		else
+		{
+			i++;
+		}
 	}
 
-	std::vector<VkPhysicalDevice> devices(deviceCount);
-	vkEnumeratePhysicalDevices(instance, &deviceCount, devices.data());
+	if (this->textures.size() == 0)
+	{
+		return;
+	}
 
-	for (const auto& device : devices)
+	// Cheap, but the driver's numbers only move every so often
+	if (frameCount % 16 == 0)
+	{
+		this->updateBudget();
+	}
+
+	VkDeviceSize uploaded = 0;
+
+	while (uploaded < this->uploadLimit)
 	{
-		if (this->isDeviceSuitable(device))
+		TextureLoad* load = nullptr;
+
 		{
-			this->physicalDevice = device;
-			break;
+			std::lock_guard<std::mutex> lock(this->mutex);
+
+			if (this->finished.size() == 0)
+			{
+				break;
+			}
+
+			load = this->finished.front();
+			this->finished.pop_front();
 		}
+
+		if (!load->failed)
+		{
+			uploaded += chainBytes(load->texture, load->first);
+		}
+
+		this->install(load);
+		delete load;
 	}
 
-	if (this->physicalDevice == VK_NULL_HANDLE)
+	this->schedule();
+}
+
+TextureStreamerStats TextureStreamer::stats()
+{
+	TextureStreamerStats stats;
+	stats.textures = this->textures.size();
+	stats.residentBytes = this->residentBytes;
+	stats.peakBytes = this->peakBytes;
+	stats.budget = this->budget;
+	stats.loads = this->loads;
+	stats.evictions = this->evictions;
+	stats.failures = this->failures;
+	stats.deferred = this->deferred;
+	stats.uploadedBytes = this->uploadedBytes;
+	stats.decodeMs = this->decodeMs;
+	stats.latencyMs = this->latencyMs;
+
+	for (const auto& texture : this->textures)
 	{
-		throw std::runtime_error("Failed to find a suitable GPU!");
+		if (texture->resident == texture->finest)
+		{
+			stats.fullyResident++;
+		}
+
+		if (texture->pending != UINT32_MAX)
+		{
+			stats.pendingLoads++;
+		}
 	}
 
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - this->started).count();
+	stats.uploadMBps = seconds > 0.0 ? this->uploadedBytes / (1024.0 * 1024.0) / seconds : 0.0;
 
+	return stats;
 }
 
-bool VulkanTest::isDeviceSuitable(VkPhysicalDevice device)
+void TextureStreamer::updateBudget()
 {
-	QueueFamilyIndices indices = this->findQueueFamilies(device);
-	return indices.isCompete();
+	VkDeviceSize budget = this->allocator->memProps.memoryHeaps[this->heap].size / 2;
+
+	if (this->memoryBudget)
+	{
+		VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProps = {};
+		budgetProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+
+		VkPhysicalDeviceMemoryProperties2 props = {};
+		props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+		props.pNext = &budgetProps;
+
+		vkGetPhysicalDeviceMemoryProperties2(this->physicalDevice, &props);
+
+		// What we hold is ours to redistribute, everyone else's usage stays;
+		// a tenth is left for the rest of the process to grow into
+		VkDeviceSize heapBudget = budgetProps.heapBudget[this->heap];
+		VkDeviceSize heapUsage = budgetProps.heapUsage[this->heap];
+		VkDeviceSize others = heapUsage > this->residentBytes ? heapUsage - this->residentBytes : 0;
+
+		budget = heapBudget > others ? (heapBudget - others) / 10 * 9 : 0;
+	}
+
+	if (this->cap > 0)
+	{
+		budget = std::min(budget, this->cap);
+	}
+
+	this->budget = budget;
 }
 
-QueueFamilyIndices VulkanTest::findQueueFamilies(VkPhysicalDevice device)
+void TextureStreamer::schedule()
 {
-	QueueFamilyIndices indices;
+	// Loads already queued count at their target size
+	VkDeviceSize committed = 0;
 
-	uint32_t queueFamilyCount = 0;
-	vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, nullptr);
+	std::vector<StreamedTexture*> finer;
+	std::vector<StreamedTexture*> victims;
 
-	std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
-	vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, queueFamilies.data());
+	for (const auto& texture : this->textures)
+	{
+		StreamedTexture* t = texture.get();
 
-	int i = 0;
-	for (const auto& queueFamily : queueFamilies)
+		committed += chainBytes(t, t->pending != UINT32_MAX ? t->pending : t->resident);
+
+		if (t->pending != UINT32_MAX || t->resident == t->levels)
+		{
+			continue;
+		}
+
+		bool visible = t->used && t->lastUsed + 1 >= this->frameCount;
+		uint32_t target = std::max(t->wanted, t->finest);
+
+		if (visible && target < t->resident)
+		{
+			finer.push_back(t);
+		}
+		else if (t->resident < t->tail && (!visible || t->resident < target))
+		{
+			victims.push_back(t);
+		}
+	}
+
+	// Coarsest first, so everything on screen sharpens evenly
+	std::sort(finer.begin(), finer.end(), [](const StreamedTexture* a, const StreamedTexture* b)
+	{
+		return chainBytes(a, a->resident - 1) < chainBytes(b, b->resident - 1);
+	});
+
+	// Least recently drawn first, textures still on screen but shown
+	// smaller than they're loaded only go after those
+	std::sort(victims.begin(), victims.end(), [this](const StreamedTexture* a, const StreamedTexture* b)
+	{
+		bool aVisible = a->lastUsed + 1 >= this->frameCount;
+		bool bVisible = b->lastUsed + 1 >= this->frameCount;
+
+		return aVisible != bVisible ? bVisible : a->lastUsed < b->lastUsed;
+	});
+
+	size_t victim = 0;
+	size_t inFlight = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		inFlight = this->queue.size() + this->finished.size();
+	}
+
+	// Decisions are made on fresh demand, the queue stays short
+	size_t maxInFlight = this->workers.size() * 2;
+
+	for (StreamedTexture* texture : finer)
 	{
-		if (queueFamily.queueCount > 0 && queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT)
+		if (inFlight >= maxInFlight)
 		{
-			indices.graphicsFamily = i;
+			break;
 		}
 
-		VkBool32 presentSupport = false;
-		vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+		uint32_t next = texture->resident - 1;
+		VkDeviceSize growth = chainBytes(texture, next) - chainBytes(texture, texture->resident);
 
-		if (queueFamily.queueCount > 0 && presentSupport)
+		while (committed + growth > this->budget && victim < victims.size())
 		{
-			indices.presentFamily = i;
+			StreamedTexture* evicted = victims[victim++];
+			bool visible = evicted->lastUsed + 1 >= this->frameCount;
+			uint32_t level = visible ? std::min(std::max(evicted->wanted, evicted->finest), evicted->tail) : evicted->tail;
+
+			committed -= chainBytes(evicted, evicted->resident) - chainBytes(evicted, level);
+
+			this->queueLoad(evicted, level);
+			this->evictions++;
+			inFlight++;
 		}
 
-		if (indices.isCompete())
+		if (committed + growth > this->budget)
 		{
+			this->deferred++;
 			break;
 		}
 
-		i++;
-	}
+		committed += growth;
 
-	return indices;
+		this->queueLoad(texture, next);
+		inFlight++;
+	}
 }
 
-void VulkanTest::createLogicalDevice()
+void TextureStreamer::queueLoad(StreamedTexture* texture, uint32_t first)
 {
-	QueueFamilyIndices indices = this->findQueueFamilies(this->physicalDevice);
-
-	std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
-	std::set<uint32_t> uniqueQueueFamilies = {
-		indices.graphicsFamily.value(),
-		indices.presentFamily.value()
-	};
+	TextureLoad* load = new TextureLoad();
+	load->texture = texture;
+	load->first = first;
+	load->queued = std::chrono::steady_clock::now();
 
-	float queuePriority = 1.0f;
+	texture->pending = first;
 
-	for (uint32_t queueFamily : uniqueQueueFamilies)
 	{
-		VkDeviceQueueCreateInfo queueCreateInfo = {};
-		queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-		queueCreateInfo.queueFamilyIndex = queueFamily;
-		queueCreateInfo.queueCount = 1;
-		queueCreateInfo.pQueuePriorities = &queuePriority;
-		queueCreateInfos.push_back(queueCreateInfo);
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->queue.push_back(load);
 	}
 
-	VkPhysicalDeviceFeatures deviceFeatures = {};
+	this->queueCond.notify_one();
+}
 
-	VkDeviceCreateInfo createInfo = {};
-	createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-	createInfo.pQueueCreateInfos = queueCreateInfos.data();
-	createInfo.queueCreateInfoCount = queueCreateInfos.size();
+void TextureStreamer::install(TextureLoad* load)
+{
+	StreamedTexture* texture = load->texture;
+	texture->pending = UINT32_MAX;
 
-	createInfo.pEnabledFeatures = &deviceFeatures;
+	this->decodeMs += load->decodeMs;
 
-	std::vector<const char*> layers;
-	std::vector<const char*> extensions;
+	if (load->failed)
+	{
+		// Not retried, the texture stays at what it has
+		texture->finest = std::max(texture->finest, std::min(load->first + 1, texture->tail));
 
-	if (this->useLayer)
+		this->failures++;
+		logger.log(LogSeverity::Warning, "streamer", 0, "texture level failed to decode, residency unchanged");
+		return;
+	}
+
+	uint32_t levelCount = texture->levels - load->first;
+
+	VkImageCreateInfo createInfo = {};
+	createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	createInfo.imageType = VK_IMAGE_TYPE_2D;
+	createInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
+	createInfo.extent.width = std::max(texture->width >> load->first, 1u);
+	createInfo.extent.height = std::max(texture->height >> load->first, 1u);
+	createInfo.extent.depth = 1;
+	createInfo.mipLevels = levelCount;
+	createInfo.arrayLayers = 1;
+	createInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	createInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	createInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	createInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+	VkImage image;
+	GpuAllocation memory;
+	this->allocator->createImage(createInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, memory);
+
+	// Visible to the first frame that submits after this
+	for (uint32_t i = 0; i < levelCount; i++)
 	{
-		layers.push_back("VK_LAYER_LUNARG_standard_validation");
+		VkExtent3D extent = { std::max(createInfo.extent.width >> i, 1u), std::max(createInfo.extent.height >> i, 1u), 1 };
+
+		this->uploader->uploadImage(image, extent, load->levels[i].data(), load->levels[i].size(), i);
+		this->uploadedBytes += load->levels[i].size();
 	}
 
-	extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+	VkImageViewCreateInfo viewInfo = {};
+	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	viewInfo.image = image;
+	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	viewInfo.format = createInfo.format;
+	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	viewInfo.subresourceRange.levelCount = levelCount;
+	viewInfo.subresourceRange.layerCount = 1;
 
-	if (layers.size() > 0)
+	VkImageView view;
+	VkResult r = vkCreateImageView(this->device, &viewInfo, nullptr, &view);
+
+	if (r != VK_SUCCESS)
 	{
-		createInfo.enabledLayerCount = layers.size();
-		createInfo.ppEnabledLayerNames = layers.data();
+		throw std::runtime_error("TextureStreamer: failed to create image view.");
 	}
 
-	if (extensions.size() > 0)
+	// Frames in flight may still sample the old levels
+	if (texture->image != VK_NULL_HANDLE)
 	{
-		createInfo.enabledExtensionCount = extensions.size();
-		createInfo.ppEnabledExtensionNames = extensions.data();
+		this->retired.push_back({ this->frameCount, texture->image, texture->memory, texture->view });
 	}
 
-	VkResult r = vkCreateDevice(physicalDevice, &createInfo, nullptr, &device);
+	texture->image = image;
+	texture->memory = memory;
+	texture->view = view;
+	texture->resident = load->first;
+	texture->version++;
 
-	if (r != VK_SUCCESS)
+	this->residentBytes += memory.size;
+	this->peakBytes = std::max(this->peakBytes, this->residentBytes);
+	this->loads++;
+	this->latencyMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - load->queued).count();
+}
+
+void TextureStreamer::decode(TextureLoad* load)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	const StreamedTexture* texture = load->texture;
+
+	load->levels.resize(texture->levels - load->first);
+
+	for (uint32_t level = load->first; level < texture->levels && !load->failed; level++)
 	{
-		throw std::runtime_error("Failed to create logical device!");
+		uint32_t width = std::max(texture->width >> level, 1u);
+		uint32_t height = std::max(texture->height >> level, 1u);
+
+		std::vector<uint8_t>& rgba = load->levels[level - load->first];
+		rgba.resize((size_t)width * height * 4);
+
+		load->failed = !texture->decode(level, width, height, rgba) || rgba.size() != (size_t)width * height * 4;
 	}
 
-	vkGetDeviceQueue(this->device, indices.graphicsFamily.value(), 0, &this->graphicsQueue);
-	vkGetDeviceQueue(this->device, indices.presentFamily.value(), 0, &this->presentQueue);
+	load->decodeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+VkDeviceSize TextureStreamer::chainBytes(const StreamedTexture* texture, uint32_t first)
+{
+	VkDeviceSize bytes = 0;
+
+	for (uint32_t level = first; level < texture->levels; level++)
+	{
+		bytes += (VkDeviceSize)std::max(texture->width >> level, 1u) * std::max(texture->height >> level, 1u) * 4;
+	}
 
+	return bytes;
 }
 
-void VulkanTest::createSwapChain()
+void IndirectRenderer::init(
+	VkDevice device,
+	GpuAllocator* allocator,
+	StagingUploader* uploader,
+	PipelineManager* pipelines,
+	ShaderManager* shaders,
+	FrameDescriptorPools* descriptorPools,
+	AsyncCompute* compute,
+	VkRenderPass renderPass,
+	uint32_t frameCount,
+	uint32_t capacity,
+	PFN_vkCmdDrawIndexedIndirectCountKHR drawIndexedIndirectCount,
+	bool multiDraw)
 {
-	SwapChainSupportDetails swapChainSupport = this->querySwapChainSupport(physicalDevice);
-	VkSurfaceFormatKHR surfaceFormat = this->chooseSwapSurfaceFormat(swapChainSupport.formats);
-	VkPresentModeKHR presentMode = this->chooseSwapPresentMode(swapChainSupport.presentModes);
-	VkExtent2D extent = this->chooseSwapExtent(swapChainSupport.caps);
+	this->device = device;
+	this->allocator = allocator;
+	this->uploader = uploader;
+	this->descriptorPools = descriptorPools;
+	this->compute = compute;
+	this->pipelines = pipelines;
+	this->capacity = capacity;
+	this->vertexCapacity = 65536;
+	this->indexCapacity = 262144;
+	this->drawIndexedIndirectCount = drawIndexedIndirectCount;
+	this->multiDraw = multiDraw;
+
+	std::vector<ShaderHandle> handles = {
+		shaders->request({ shaderDir + "/cull.comp", VK_SHADER_STAGE_COMPUTE_BIT, {} }),
+		shaders->request({ shaderDir + "/object.vert", VK_SHADER_STAGE_VERTEX_BIT, {} }),
+		shaders->request({ shaderDir + "/object.frag", VK_SHADER_STAGE_FRAGMENT_BIT, {} })
+	};
 
-	uint32_t imageCount = swapChainSupport.caps.minImageCount + 1;
+	for (ShaderHandle handle : handles)
+	{
+		shaders->wait(handle);
 
-	if (swapChainSupport.caps.maxImageCount > 0 && imageCount > swapChainSupport.caps.maxImageCount)
+		if (shaders->get(handle) == VK_NULL_HANDLE)
+		{
+			logger.log(LogSeverity::Warning, "renderer", 0, ("object shaders not found in " + shaderDir + ", GPU culling disabled").c_str());
+			return;
+		}
+	}
+
+	// One layout for both pipelines, the objects at binding 0 are shared
+	std::vector<VkDescriptorSetLayoutBinding> bindings = shaders->layoutBindings(handles, 0);
+
+	if (bindings.empty())
 	{
-		imageCount = swapChainSupport.caps.maxImageCount;
+		for (uint32_t i = 0; i < 5; i++)
+		{
+			VkDescriptorSetLayoutBinding binding = {};
+			binding.binding = i;
+			binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			binding.descriptorCount = 1;
+			binding.stageFlags = i == 0 ? VK_SHADER_STAGE_COMPUTE_BIT | VK_SHADER_STAGE_VERTEX_BIT : VK_SHADER_STAGE_COMPUTE_BIT;
+
+			bindings.push_back(binding);
+		}
 	}
 
-	VkSwapchainCreateInfoKHR createInfo = {};
-	createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
-	createInfo.surface = surface;
-	createInfo.minImageCount = imageCount;
-	createInfo.imageFormat = surfaceFormat.format;
-	createInfo.imageColorSpace = surfaceFormat.colorSpace;
-	createInfo.imageExtent = extent;
-	createInfo.imageArrayLayers = 1;
-	createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+	VkDescriptorSetLayoutCreateInfo setLayoutInfo = {};
+	setLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	setLayoutInfo.bindingCount = bindings.size();
+	setLayoutInfo.pBindings = bindings.data();
 
-	QueueFamilyIndices indices = this->findQueueFamilies(physicalDevice);
+	VkResult r = vkCreateDescriptorSetLayout(device, &setLayoutInfo, nullptr, &this->setLayout);
 
-	std::vector<uint32_t> queueFams = {
-		indices.graphicsFamily.value(),
-		indices.presentFamily.value()
-	};
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("IndirectRenderer: failed to create descriptor set layout.");
+	}
 
-	if (indices.graphicsFamily.value() != indices.presentFamily.value())
+	VkPushConstantRange cullRange = shaders->pushConstantRange({ handles[0] });
+	VkPushConstantRange drawRange = shaders->pushConstantRange({ handles[1], handles[2] });
+
+	if (cullRange.size == 0)
 	{
-		createInfo.imageSharingMode = VK_SHARING_MODE_CONCURRENT;
-		createInfo.queueFamilyIndexCount = queueFams.size();
-		createInfo.pQueueFamilyIndices = queueFams.data();
-		std::cout << "Concurrent Mode" << std::endl;
+		cullRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+		cullRange.size = 6 * sizeof(glm::vec4) + 3 * sizeof(uint32_t);
 	}
-	else
+
+	if (drawRange.size == 0)
 	{
-		createInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
-		std::cout << "Exclusive Mode" << std::endl;
+		drawRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+		drawRange.size = sizeof(glm::mat4);
 	}
 
-	createInfo.preTransform = swapChainSupport.caps.currentTransform;
-	
-	createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
-	
-	createInfo.presentMode = presentMode;
-	createInfo.clipped = VK_TRUE;
+	VkPipelineLayoutCreateInfo layoutInfo = {};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	layoutInfo.setLayoutCount = 1;
+	layoutInfo.pSetLayouts = &this->setLayout;
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &cullRange;
 
-	createInfo.oldSwapchain = VK_NULL_HANDLE;
+	r = vkCreatePipelineLayout(device, &layoutInfo, nullptr, &this->cullLayout);
 
-	VkResult r = vkCreateSwapchainKHR(device, &createInfo, nullptr, &this->swapChain);
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("IndirectRenderer: failed to create the cull pipeline layout.");
+	}
+
+	layoutInfo.pPushConstantRanges = &drawRange;
+
+	r = vkCreatePipelineLayout(device, &layoutInfo, nullptr, &this->drawLayout);
 
 	if (r != VK_SUCCESS)
 	{
-		throw std::runtime_error("Swapchain failed to create...");
+		throw std::runtime_error("IndirectRenderer: failed to create the draw pipeline layout.");
 	}
 
+	// A single small pipeline, built here rather than through the manager's graphics queue
+	VkComputePipelineCreateInfo computeInfo = {};
+	computeInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	computeInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	computeInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	computeInfo.stage.module = shaders->get(handles[0]);
+	computeInfo.stage.pName = "main";
+	computeInfo.layout = this->cullLayout;
 
-	uint32_t count = 0;
-	vkGetSwapchainImagesKHR(this->device, this->swapChain, &count, nullptr);
-	swapChainImages.resize(count);
-	vkGetSwapchainImagesKHR(this->device, this->swapChain, &count, this->swapChainImages.data());
+	r = vkCreateComputePipelines(device, pipelines->cache, 1, &computeInfo, nullptr, &this->cullPipeline);
 
-	this->swapChainImageFormat = surfaceFormat.format;
-	this->swapChainExtent = extent;
+	if (r != VK_SUCCESS)
+	{
+		throw std::runtime_error("IndirectRenderer: failed to create the cull pipeline.");
+	}
 
+	GraphicsPipelineDesc desc;
+	desc.vertexShader = shaders->get(handles[1]);
+	desc.fragmentShader = shaders->get(handles[2]);
+	desc.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	desc.cullMode = VK_CULL_MODE_BACK_BIT;
 
-}
+	// Counter-clockwise from outside, the projection flips y
+	desc.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+	desc.layout = this->drawLayout;
 
-SwapChainSupportDetails VulkanTest::querySwapChainSupport(VkPhysicalDevice device)
-{
-	SwapChainSupportDetails details;
+	desc.bindings.push_back({ 0, sizeof(glm::vec3), VK_VERTEX_INPUT_RATE_VERTEX });
+	desc.attributes.push_back({ 0, 0, VK_FORMAT_R32G32B32_SFLOAT, 0 });
 
-	vkGetPhysicalDeviceSurfaceCapabilitiesKHR(device, surface, &details.caps);
+	this->drawDesc = desc;
 
-	uint32_t count;
+	// Ready by the first frame when the graph's pass matches renderPass
+	this->requestPipelines(renderPass, 0);
 
-	vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &count, nullptr);
+	allocator->createBuffer(
+		this->vertexCapacity * sizeof(glm::vec3),
+		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		0,
+		this->vertexBuffer,
+		this->vertexMemory
+	);
 
-	if (count != 0)
-	{
-		details.formats.resize(count);
-		vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &count, details.formats.data());
-	}
+	allocator->createBuffer(
+		this->indexCapacity * sizeof(uint32_t),
+		VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		0,
+		this->indexBuffer,
+		this->indexMemory
+	);
 
-	count = 0;
+	const uint32_t maxMeshes = 256;
 
-	vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface, &count, nullptr);
+	// Read on both queues without ownership transfers
+	std::vector<uint32_t> families = { compute->graphicsFamily, compute->queueFamily };
 
-	if (count != 0)
+	allocator->createBuffer(
+		maxMeshes * sizeof(GpuMesh),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		this->meshBuffer,
+		this->meshMemory,
+		families
+	);
+
+	this->frames.resize(frameCount);
+
+	for (auto& frame : this->frames)
 	{
-		details.presentModes.resize(count);
-		vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface, &count, details.presentModes.data());
+		allocator->createBuffer(
+			capacity * sizeof(GpuObject),
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+			frame.objects,
+			frame.objectsMemory,
+			families
+		);
+
+		allocator->createBuffer(
+			capacity * sizeof(VkDrawIndexedIndirectCommand),
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+			0,
+			frame.draws,
+			frame.drawsMemory
+		);
+
+		allocator->createBuffer(
+			(capacity + 63) / 64 * sizeof(uint32_t),
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+			0,
+			frame.groups,
+			frame.groupsMemory
+		);
+
+		allocator->createBuffer(
+			sizeof(uint32_t),
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+			frame.count,
+			frame.countMemory
+		);
 	}
 
-	return details;
+	this->enabled = true;
 }
 
-VkSurfaceFormatKHR VulkanTest::chooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR>& formats)
+void IndirectRenderer::release()
 {
-	if (formats.size() == 1 && formats[0].format == VK_FORMAT_UNDEFINED)
+	if (!this->enabled)
 	{
-		return { VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR };
+		return;
 	}
 
-	for (const auto& f : formats)
+	if (this->culledFrames > 0)
 	{
-		if (f.format == VK_FORMAT_B8G8R8A8_UNORM &&
-			f.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR)
-		{
-			return f;
-		}
-	}
+		const char* path = this->drawIndexedIndirectCount ? "vkCmdDrawIndexedIndirectCount" :
+			this->multiDraw ? "one vkCmdDrawIndexedIndirect" : "a vkCmdDrawIndexedIndirect per object";
 
-	return formats[0];
-}
-
-VkPresentModeKHR VulkanTest::chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& modes)
-{
-	VkPresentModeKHR bestMode = VK_PRESENT_MODE_FIFO_KHR;
+		std::cout << "IndirectRenderer: " << this->objects.size() << " objects, "
+			<< this->visible / this->culledFrames << " visible per frame ("
+			<< (this->tested > 0 ? 100.0 * this->visible / this->tested : 0.0) << "%) drawn with " << path << ", "
+			<< this->cpuMs / this->culledFrames << "ms CPU per frame" << std::endl;
+	}
 
-	for (const auto& m : modes)
+	for (auto& frame : this->frames)
 	{
-		if (m == VK_PRESENT_MODE_MAILBOX_KHR)
-		{
-			return m;
-		}
-		else if (m == VK_PRESENT_MODE_IMMEDIATE_KHR)
-		{
-			return m;
-		}
+		this->allocator->destroyBuffer(frame.objects, frame.objectsMemory);
+		this->allocator->destroyBuffer(frame.draws, frame.drawsMemory);
+		this->allocator->destroyBuffer(frame.groups, frame.groupsMemory);
+		this->allocator->destroyBuffer(frame.count, frame.countMemory);
 	}
 
-	return bestMode;
-}
+	this->frames.clear();
 
-VkExtent2D VulkanTest::chooseSwapExtent(const VkSurfaceCapabilitiesKHR& caps)
-{
-	if (caps.currentExtent.width != std::numeric_limits<uint32_t>::max())
-	{
-		return caps.currentExtent;
-	}
-	else
-	{
-		VkExtent2D actualExtent = { width, height };
+	this->allocator->destroyBuffer(this->vertexBuffer, this->vertexMemory);
+	this->allocator->destroyBuffer(this->indexBuffer, this->indexMemory);
+	this->allocator->destroyBuffer(this->meshBuffer, this->meshMemory);
 
-		actualExtent.width = std::max(caps.minImageExtent.width, std::min(caps.maxImageExtent.width, actualExtent.width));
-		actualExtent.height = std::max(caps.minImageExtent.height, std::min(caps.maxImageExtent.height, actualExtent.height));
+	vkDestroyPipeline(this->device, this->cullPipeline, nullptr);
+	vkDestroyPipelineLayout(this->device, this->cullLayout, nullptr);
+	vkDestroyPipelineLayout(this->device, this->drawLayout, nullptr);
+	vkDestroyDescriptorSetLayout(this->device, this->setLayout, nullptr);
 
-		return actualExtent;
-	}
+	this->enabled = false;
 }
 
-void VulkanTest::createSwapChainImageViews()
+uint32_t IndirectRenderer::addMesh(const std::vector<glm::vec3>& vertices, const std::vector<uint32_t>& indices)
 {
-	this->swapChainImageViews.resize(this->swapChainImages.size());
+	const uint32_t maxMeshes = 256;
 
-	for (uint32_t i = 0; i < swapChainImages.size(); i++)
+	if (this->vertexCount + vertices.size() > this->vertexCapacity || this->indexCount + indices.size() > this->indexCapacity || this->meshes.size() >= maxMeshes)
 	{
-		VkImageViewCreateInfo createInfo = {};
-		createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-		createInfo.image = this->swapChainImages[i];
-
-		createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-		createInfo.format = this->swapChainImageFormat;
+		throw std::runtime_error("IndirectRenderer: out of mesh space.");
+	}
 
-		createInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
-		createInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
-		createInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
-		createInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+	GpuMesh mesh;
+	mesh.indexCount = indices.size();
+	mesh.firstIndex = this->indexCount;
+	mesh.vertexOffset = this->vertexCount;
 
-		createInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		createInfo.subresourceRange.baseMipLevel = 0;
-		createInfo.subresourceRange.levelCount = 1;
-		createInfo.subresourceRange.baseArrayLayer = 0;
-		createInfo.subresourceRange.layerCount = 1;
+	// Past everything in use, frames in flight never read these ranges
+	this->uploader->uploadBuffer(this->vertexBuffer, this->vertexCount * sizeof(glm::vec3), vertices.data(), vertices.size() * sizeof(glm::vec3));
+	this->uploader->uploadBuffer(this->indexBuffer, this->indexCount * sizeof(uint32_t), indices.data(), indices.size() * sizeof(uint32_t));
+	std::memcpy((GpuMesh*)this->meshMemory.mapped + this->meshes.size(), &mesh, sizeof(GpuMesh));
 
-		VkResult r = vkCreateImageView(device, &createInfo, nullptr, &this->swapChainImageViews[i]);
+	this->vertexCount += vertices.size();
+	this->indexCount += indices.size();
+	this->meshes.push_back(mesh);
 
-		if (r != VK_SUCCESS)
-		{
-			throw std::runtime_error("Failed to create image view!");
-		}
-	}
+	return this->meshes.size() - 1;
 }
 
-void VulkanTest::createCommandPool()
+uint32_t IndirectRenderer::addObject(const GpuObject& object)
 {
-	QueueFamilyIndices indices = this->findQueueFamilies(this->physicalDevice);
-
-	VkCommandPoolCreateInfo createInfo = {};
-	createInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-	createInfo.queueFamilyIndex = indices.graphicsFamily.value();
-	createInfo.flags = 0;
-
-	VkResult r = vkCreateCommandPool(device, &createInfo, nullptr, &this->commandPool);
-
-	if (r != VK_SUCCESS)
+	if (this->objects.size() >= this->capacity)
 	{
-		std::runtime_error("Command Pool wasn't initialized.");
+		throw std::runtime_error("IndirectRenderer: out of object slots.");
 	}
+
+	this->objects.push_back(object);
+	this->version++;
+
+	return this->objects.size() - 1;
 }
 
-void VulkanTest::createRenderPass()
+void IndirectRenderer::updateObject(uint32_t index, const GpuObject& object)
 {
-	VkResult r;
+	this->objects[index] = object;
+	this->version++;
+}
 
-	// Clear Render Pass
+void IndirectRenderer::beginFrame(uint32_t frame)
+{
+	this->frame = frame;
+	this->pending = false;
 
-	// Attachment Description
-	VkAttachmentDescription clearColorAttachment = {};
-	clearColorAttachment.format = this->swapChainImageFormat;
-	clearColorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
-	
-	clearColorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-	clearColorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	if (!this->enabled)
+	{
+		return;
+	}
 
-	clearColorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-	clearColorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	IndirectFrame& slot = this->frames[frame];
 
-	clearColorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-	clearColorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	if (slot.counted)
+	{
+		this->visible += *(const uint32_t*)slot.countMemory.mapped;
+		slot.counted = false;
+	}
+}
 
-	// Attachment Reference
-	VkAttachmentReference clearColorAttachmentReference = {};
-	clearColorAttachmentReference.attachment = 0;
-	clearColorAttachmentReference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+void IndirectRenderer::prepare(const glm::mat4& viewProjection)
+{
+	if (!this->enabled || this->objects.size() == 0)
+	{
+		return;
+	}
 
-	// Subpass
-	VkSubpassDescription clearSubpass = {};
-	clearSubpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-	clearSubpass.colorAttachmentCount = 1;
-	clearSubpass.pColorAttachments = &clearColorAttachmentReference;
+	auto start = std::chrono::steady_clock::now();
 
-	// Subpass Dependency
-	VkSubpassDependency clearSubpassDep = {};
-	clearSubpassDep.srcSubpass = VK_SUBPASS_EXTERNAL;
-	clearSubpassDep.dstSubpass = 0;
+	IndirectFrame& frame = this->frames[this->frame];
 
-	clearSubpassDep.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	clearSubpassDep.srcAccessMask = 0;
+	// This slot's last frame is done on both queues, the whole array goes in at once
+	if (frame.version != this->version)
+	{
+		std::memcpy(frame.objectsMemory.mapped, this->objects.data(), this->objects.size() * sizeof(GpuObject));
+		frame.version = this->version;
+	}
 
-	clearSubpassDep.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	clearSubpassDep.dstAccessMask =
-		VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
-		VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	// The slot's pools were reset with the fence, the cull and the draws share one set
+	frame.set = this->descriptorPools->allocate(this->setLayout);
 
-	// Create Info
-	VkRenderPassCreateInfo clearCreateInfo = {};
-	clearCreateInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-	clearCreateInfo.attachmentCount = 1;
-	clearCreateInfo.pAttachments = &clearColorAttachment;
-	clearCreateInfo.subpassCount = 1;
-	clearCreateInfo.pSubpasses = &clearSubpass;
-	clearCreateInfo.dependencyCount = 1;
-	clearCreateInfo.pDependencies = &clearSubpassDep;
+	VkDescriptorBufferInfo buffers[5] = {
+		{ frame.objects, 0, VK_WHOLE_SIZE },
+		{ this->meshBuffer, 0, VK_WHOLE_SIZE },
+		{ frame.draws, 0, VK_WHOLE_SIZE },
+		{ frame.count, 0, VK_WHOLE_SIZE },
+		{ frame.groups, 0, VK_WHOLE_SIZE }
+	};
 
-	r = vkCreateRenderPass(this->device, &clearCreateInfo, nullptr, &this->clearRenderPass);
+	VkWriteDescriptorSet writes[5] = {};
 
-	if (r != VK_SUCCESS)
+	for (uint32_t i = 0; i < 5; i++)
 	{
-		std::runtime_error("Failed to create clear render pass.");
+		writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writes[i].dstSet = frame.set;
+		writes[i].dstBinding = i;
+		writes[i].descriptorCount = 1;
+		writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		writes[i].pBufferInfo = &buffers[i];
 	}
 
-	// Draw Render Pass
+	vkUpdateDescriptorSets(this->device, 5, writes, 0, nullptr);
 
-	// Attachment Description
-	VkAttachmentDescription drawColorAttachment = {};
-	drawColorAttachment.format = this->swapChainImageFormat;
-	drawColorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+	this->viewProjection = viewProjection;
+	this->pending = true;
 
-	drawColorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
-	drawColorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	this->cpuMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
 
-	drawColorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-	drawColorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+void IndirectRenderer::cull()
+{
+	auto start = std::chrono::steady_clock::now();
 
-	drawColorAttachment.initialLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-	drawColorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	IndirectFrame& frame = this->frames[this->frame];
+	VkCommandBuffer cmd = this->compute->begin();
 
-	// Attachment Reference
-	VkAttachmentReference drawColorAttachmentReference = {};
-	drawColorAttachmentReference.attachment = 0;
-	drawColorAttachmentReference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	struct
+	{
+		glm::vec4 planes[6];
+		uint32_t objectCount;
+		uint32_t compact;
+		uint32_t phase;
+	} push;
 
-	// Subpass
-	VkSubpassDescription drawSubpass = {};
-	drawSubpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-	drawSubpass.colorAttachmentCount = 1;
-	drawSubpass.pColorAttachments = &drawColorAttachmentReference;
+	// Gribb-Hartmann on a 0..1 depth projection: left, right, bottom, top, near, far
+	const glm::mat4& m = this->viewProjection;
 
-	// Subpass Reference
-	VkSubpassDependency drawSubpassDep = {};
-	drawSubpassDep.srcSubpass = VK_SUBPASS_EXTERNAL;
-	drawSubpassDep.dstSubpass = 0;
+	for (uint32_t i = 0; i < 6; i++)
+	{
+		uint32_t axis = i / 2;
+		float sign = i % 2 == 0 ? 1.0f : -1.0f;
 
-	drawSubpassDep.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	drawSubpassDep.srcAccessMask = 0;
+		glm::vec4 plane;
 
-	drawSubpassDep.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	drawSubpassDep.dstAccessMask =
-		VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
-		VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		for (uint32_t c = 0; c < 4; c++)
+		{
+			plane[c] = i == 4 ? m[c][2] : m[c][3] + sign * m[c][axis];
+		}
 
-	// Create Info
-	VkRenderPassCreateInfo drawCreateInfo = {};
-	drawCreateInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-	drawCreateInfo.attachmentCount = 1;
-	drawCreateInfo.pAttachments = &drawColorAttachment;
-	drawCreateInfo.subpassCount = 1;
-	drawCreateInfo.pSubpasses = &drawSubpass;
-	drawCreateInfo.dependencyCount = 1;
-	drawCreateInfo.pDependencies = &drawSubpassDep;
+		float length = std::sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+		push.planes[i] = plane * (1.0f / std::max(length, 1e-6f));
+	}
 
-	r = vkCreateRenderPass(this->device, &drawCreateInfo, nullptr, &this->drawRenderPass);
+	push.objectCount = this->objects.size();
+	push.compact = this->drawIndexedIndirectCount != nullptr;
 
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, this->cullPipeline);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, this->cullLayout, 0, 1, &frame.set, 0, nullptr);
 
-	if (r != VK_SUCCESS)
-	{
-		std::runtime_error("Failed to create draw render pass.");
-	}
-}
+	// Count per workgroup, offsets from one workgroup, then the commands
+	uint32_t groupCounts[3] = { (push.objectCount + 63) / 64, 1, (push.objectCount + 63) / 64 };
 
-void VulkanTest::createFramebuffers()
-{
-	VkResult r;
+	VkMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
 
-	// Clear
-	this->clearFramebuffers.resize(this->swapChainImageViews.size());
-	for (uint32_t i = 0; i < this->swapChainImageViews.size(); i++)
+	for (uint32_t phase = 0; phase < 3; phase++)
 	{
-		VkFramebufferCreateInfo createInfo = {};
-		createInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-		createInfo.renderPass = clearRenderPass;
-		createInfo.attachmentCount = 1;
-		createInfo.pAttachments = &this->swapChainImageViews[i];
-		createInfo.width = swapChainExtent.width;
-		createInfo.height = swapChainExtent.height;
-		createInfo.layers = 1;
-		r = vkCreateFramebuffer(device, &createInfo, nullptr, &clearFramebuffers[i]);
-
-		if (r != VK_SUCCESS)
+		if (phase > 0)
 		{
-			std::runtime_error("Failed to create clear framebuffer.");
+			vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
 		}
-	}
 
-	// Draw
-	this->drawFramebuffers.resize(this->swapChainImageViews.size());
-	for (uint32_t i = 0; i < this->swapChainImageViews.size(); i++)
-	{
-		VkFramebufferCreateInfo createInfo = {};
-		createInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-		createInfo.renderPass = drawRenderPass;
-		createInfo.attachmentCount = 1;
-		createInfo.pAttachments = &this->swapChainImageViews[i];
-		createInfo.width = swapChainExtent.width;
-		createInfo.height = swapChainExtent.height;
-		createInfo.layers = 1;
-		r = vkCreateFramebuffer(device, &createInfo, nullptr, &drawFramebuffers[i]);
+		push.phase = phase;
 
-		if (r != VK_SUCCESS)
-		{
-			std::runtime_error("Failed to create draw framebuffers.");
-		}
+		vkCmdPushConstants(cmd, this->cullLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push), &push);
+		vkCmdDispatch(cmd, groupCounts[phase], 1, 1);
 	}
-}
 
-void VulkanTest::createSemaphore()
-{
-	VkResult r;
+	// The count is also read back on the host once the fence signalled
+	barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+
+	vkCmdPipelineBarrier(
+		cmd,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_HOST_BIT,
+		0,
+		1, &barrier,
+		0, nullptr,
+		0, nullptr
+	);
 
-	VkSemaphoreCreateInfo createInfo = {};
-	createInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	// Acquired by the frame's graphics submission ahead of the draws
+	this->compute->releaseBuffer(frame.draws, 0, VK_WHOLE_SIZE, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+	this->compute->releaseBuffer(frame.count, 0, VK_WHOLE_SIZE, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
 
-	r = vkCreateSemaphore(this->device, &createInfo, nullptr, &this->imageAvailable);
+	frame.counted = true;
+	this->pending = false;
+	this->culledFrames++;
+	this->tested += push.objectCount;
 
-	if (r != VK_SUCCESS)
-	{
-		std::runtime_error("Image Available semaphore...");
-	}
+	this->cpuMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
 
-	r = vkCreateSemaphore(this->device, &createInfo, nullptr, &this->renderFinish);
+void IndirectRenderer::requestPipelines(VkRenderPass renderPass, uint32_t subpass)
+{
+	this->drawDesc.renderPass = renderPass;
+	this->drawDesc.subpass = subpass;
 
-	if (r != VK_SUCCESS)
-	{
-		std::runtime_error("Render Finished semaphore...");
-	}
+	this->drawPipeline = this->pipelines->request(this->drawDesc);
 }
 
-void VulkanTest::createFence()
+void IndirectRenderer::record(const RenderGraphContext& ctx)
 {
-	VkResult r;
-	VkFenceCreateInfo createInfo = {};
-	createInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-	createInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+	VkCommandBuffer cmd = ctx.cmd;
+	VkExtent2D extent = ctx.extent;
 
-	r = vkCreateFence(
-		this->device,
-		&createInfo,
-		nullptr,
-		&this->inFlight
-	);
+	// Cached by the manager, only a new kind of pass compiles
+	this->requestPipelines(ctx.compatiblePass, ctx.subpass);
 
-	if (r != VK_SUCCESS)
+	// Still compiling on a worker, skip rather than stall the frame
+	VkPipeline pipeline = this->pipelines->get(this->drawPipeline);
+
+	if (pipeline == VK_NULL_HANDLE)
 	{
-		std::runtime_error("In Flight Fence...");
+		return;
 	}
-}
-
-VkCommandBuffer VulkanTest::allocCommandBuffer()
-{
-	VkCommandBufferAllocateInfo allocInfo = {};
-	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	allocInfo.commandPool = this->commandPool;
-	allocInfo.commandBufferCount = 1;
 
-	VkCommandBuffer temp;
-	vkAllocateCommandBuffers(device, &allocInfo, &temp);
+	auto start = std::chrono::steady_clock::now();
 
-	return temp;
-}
+	IndirectFrame& frame = this->frames[this->frame];
 
-VkCommandBuffer VulkanTest::clearCommand(glm::vec3 color)
-{
-	VkResult r;
-	VkCommandBuffer temp = this->allocCommandBuffer();
+	VkViewport viewport = {};
+	viewport.width = (float)extent.width;
+	viewport.height = (float)extent.height;
+	viewport.maxDepth = 1.0f;
 
-	VkClearValue value = {};
-	value.color = {
-		color.r,
-		color.g,
-		color.b,
-		1.0f
-	};
+	VkRect2D scissor = {};
+	scissor.extent = extent;
 
-	VkCommandBufferBeginInfo beginInfo = {};
-	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	vkCmdSetViewport(cmd, 0, 1, &viewport);
+	vkCmdSetScissor(cmd, 0, 1, &scissor);
 
-	VkRenderPassBeginInfo rp = {};
-	rp.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-	rp.renderPass = this->clearRenderPass;
-	rp.renderArea.offset = { 0, 0 };
-	rp.renderArea.extent = this->swapChainExtent;
-	rp.clearValueCount = 1;
-	rp.pClearValues = &value;
-	rp.framebuffer = this->clearFramebuffers[this->swapChainIndex];
+	VkDeviceSize offset = 0;
 
-	vkBeginCommandBuffer(temp, &beginInfo);
-	vkCmdBeginRenderPass(temp, &rp, VK_SUBPASS_CONTENTS_INLINE);
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, this->drawLayout, 0, 1, &frame.set, 0, nullptr);
+	vkCmdPushConstants(cmd, this->drawLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(glm::mat4), &this->viewProjection);
+	vkCmdBindVertexBuffers(cmd, 0, 1, &this->vertexBuffer, &offset);
+	vkCmdBindIndexBuffer(cmd, this->indexBuffer, 0, VK_INDEX_TYPE_UINT32);
 
-	// Do nothing...
-	vkCmdEndRenderPass(temp);
-	r = vkEndCommandBuffer(temp);
+	uint32_t count = this->objects.size();
+	uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
 
-	if (r != VK_SUCCESS)
+	if (this->drawIndexedIndirectCount != nullptr)
+	{
+		this->drawIndexedIndirectCount(cmd, frame.draws, 0, frame.count, 0, count, stride);
+	}
+	else if (this->multiDraw)
+	{
+		vkCmdDrawIndexedIndirect(cmd, frame.draws, 0, count, stride);
+	}
+	else
 	{
-		std::runtime_error("Falied to kill command buffer...");
+		for (uint32_t i = 0; i < count; i++)
+		{
+			vkCmdDrawIndexedIndirect(cmd, frame.draws, i * stride, 1, stride);
+		}
 	}
 
-	return temp;
-}
\ No newline at end of file
+	this->cpuMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
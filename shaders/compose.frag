@@ -0,0 +1,11 @@
+#version 450
+
+// Same size as the target, read pixel for pixel
+layout(set = 0, binding = 0) uniform sampler2D layer;
+
+layout(location = 0) out vec4 outColor;
+
+void main()
+{
+	outColor = texelFetch(layer, ivec2(gl_FragCoord.xy), 0);
+}
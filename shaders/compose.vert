@@ -0,0 +1,15 @@
+#version 450
+
+layout(push_constant) uniform Push
+{
+	// Top and bottom of the band in clip space
+	vec2 band;
+} push;
+
+void main()
+{
+	// Triangle strip corner from the vertex index, no vertex buffer
+	vec2 corner = vec2(gl_VertexIndex & 1, (gl_VertexIndex >> 1) & 1);
+
+	gl_Position = vec4(corner.x * 2.0 - 1.0, mix(push.band.x, push.band.y, corner.y), 0.0, 1.0);
+}
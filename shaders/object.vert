@@ -0,0 +1,34 @@
+#version 450
+
+// Culled objects, one indirect draw each; gl_InstanceIndex is the object
+layout(location = 0) in vec3 inPosition;
+
+struct Object
+{
+	vec4 sphere;
+	vec4 color;
+	uint mesh;
+};
+
+layout(std430, set = 0, binding = 0) readonly buffer Objects
+{
+	Object objects[];
+};
+
+layout(push_constant) uniform Push
+{
+	mat4 viewProjection;
+} push;
+
+layout(location = 0) out vec4 outColor;
+
+void main()
+{
+	Object object = objects[gl_InstanceIndex];
+
+	// Meshes fit the unit sphere, scaled to the bounds
+	gl_Position = push.viewProjection * vec4(object.sphere.xyz + inPosition * object.sphere.w, 1.0);
+
+	// No normals, lighter towards the top is enough to tell faces apart
+	outColor = vec4(object.color.rgb * (0.7 + 0.3 * inPosition.y / length(inPosition)), object.color.a);
+}
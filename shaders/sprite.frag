@@ -0,0 +1,25 @@
+#version 450
+
+// Binding 0 of the bindless table, sized by the renderer; prebuilt SPIR-V
+// reaches the first 128 slots
+#ifndef BINDLESS_TEXTURES
+#define BINDLESS_TEXTURES 128
+#endif
+
+layout(set = 0, binding = 0) uniform sampler2D textures[BINDLESS_TEXTURES];
+
+layout(push_constant) uniform Push
+{
+	// After the vertex shader's scale; the same for the whole draw
+	layout(offset = 8) uint slot;
+} push;
+
+layout(location = 0) in vec2 inUV;
+layout(location = 1) in vec4 inColor;
+
+layout(location = 0) out vec4 outColor;
+
+void main()
+{
+	outColor = texture(textures[push.slot], inUV) * inColor;
+}
@@ -0,0 +1,33 @@
+#version 450
+
+// Per instance, see SpriteInstance
+layout(location = 0) in vec2 inPosition;
+layout(location = 1) in vec2 inSize;
+layout(location = 2) in vec4 inUV;
+layout(location = 3) in vec4 inColor;
+layout(location = 4) in float inRotation;
+
+layout(push_constant) uniform Push
+{
+	// 2 / framebuffer size, pixels to clip space
+	vec2 scale;
+} push;
+
+layout(location = 0) out vec2 outUV;
+layout(location = 1) out vec4 outColor;
+
+void main()
+{
+	// Triangle strip corner from the vertex index, no vertex buffer
+	vec2 corner = vec2(gl_VertexIndex & 1, (gl_VertexIndex >> 1) & 1);
+	vec2 local = (corner - 0.5) * inSize;
+
+	float s = sin(inRotation);
+	float c = cos(inRotation);
+	vec2 position = inPosition + vec2(c * local.x - s * local.y, s * local.x + c * local.y);
+
+	gl_Position = vec4(position * push.scale - 1.0, 0.0, 1.0);
+
+	outUV = mix(inUV.xy, inUV.zw, corner);
+	outColor = inColor;
+}